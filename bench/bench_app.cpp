@@ -0,0 +1,166 @@
+#include "wayward/app.hpp"
+#include "wayward/middleware.hpp"
+#include "wayward/response_cache.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+namespace w = wayward;
+
+namespace {
+    // A REST-ish application with a few dozen routes.
+    struct Routes {
+        w::App app;
+
+        Routes() {
+            auto handler = [](w::Request&, w::Response& res) {
+                res.status = w::Status::OK;
+            };
+            const char* resources[] = {"users", "posts", "comments", "tags", "teams", "projects", "issues", "files"};
+            for (auto resource: resources) {
+                std::string base = std::string("/api/v1/") + resource;
+                app.get(base.c_str(), handler);
+                app.post(base.c_str(), handler);
+                app.get((base + "/:id").c_str(), handler);
+                app.put((base + "/:id").c_str(), handler);
+                app.del((base + "/:id").c_str(), handler);
+                app.get((base + "/:id/history/:version").c_str(), handler);
+            }
+            app.get("/", handler);
+            app.get("/plaintext", handler);
+            app.mount("/assets", w::StaticFiles("."));
+        }
+    };
+
+    void respond(benchmark::State& state, w::Method method, const char* url) {
+        static Routes routes;
+        w::Request req;
+        req.method = method;
+        req.url = url;
+        w::Response res;
+        for (auto _: state) {
+            res.status = w::Status::OK;
+            routes.app.respond(req, res);
+            benchmark::DoNotOptimize(res.status);
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+}
+
+static void BM_RespondStatic(benchmark::State& state) {
+    respond(state, w::Method::Get, "/plaintext");
+}
+BENCHMARK(BM_RespondStatic);
+
+static void BM_RespondCaptures(benchmark::State& state) {
+    respond(state, w::Method::Get, "/api/v1/projects/1234/history/56?full=1");
+}
+BENCHMARK(BM_RespondCaptures);
+
+static void BM_RespondNotFound(benchmark::State& state) {
+    respond(state, w::Method::Get, "/api/v2/unknown");
+}
+BENCHMARK(BM_RespondNotFound);
+
+static void BM_RespondMethodNotAllowed(benchmark::State& state) {
+    respond(state, w::Method::Patch, "/api/v1/users/42");
+}
+BENCHMARK(BM_RespondMethodNotAllowed);
+
+namespace {
+    // A route that renders a 1 KiB document, with and without a cache in
+    // front. The response is reset like the server does between requests.
+    void render(benchmark::State& state, bool cached) {
+        w::App app;
+        app.get("/api/v1/report", [](w::Request&, w::Response& res) {
+            std::string body = "{\"rows\":[";
+            for (int i = 0; i < 64; ++i) {
+                body += "{\"id\":" + std::to_string(i) + "},";
+            }
+            body.back() = ']';
+            body += '}';
+            res.set_header(w::HeaderId::ContentType, "application/json");
+            res.set_header(w::HeaderId::CacheControl, "max-age=60");
+            res.body = std::move(body);
+        });
+        w::ResponseCache cache(app);
+        w::IRequestResponder& responder = cached ? static_cast<w::IRequestResponder&>(cache) : app;
+        w::Request req;
+        req.url = "/api/v1/report";
+        w::Response res;
+        for (auto _: state) {
+            responder.respond(req, res);
+            benchmark::DoNotOptimize(res.body.data());
+            res.headers.clear();
+            res.body.clear();
+            res.shared_owner.reset();
+            res.arena.reset();
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+}
+
+static void BM_RespondRendered(benchmark::State& state) {
+    render(state, false);
+}
+BENCHMARK(BM_RespondRendered);
+
+static void BM_RespondCacheHit(benchmark::State& state) {
+    render(state, true);
+}
+BENCHMARK(BM_RespondCacheHit);
+
+namespace {
+    // Eight trivial middlewares around a trivial handler: composed with
+    // chain(), or each wrapping the next through a std::function, as
+    // without it.
+    constexpr int num_middlewares = 8;
+
+    struct Step {
+        template <class Next>
+        void operator()(w::Request& req, w::Response& res, Next next) const {
+            if (req.method == w::Method::Other) {
+                res.status = w::Status::BadRequest;
+                return;
+            }
+            next();
+        }
+    };
+
+    void ok(w::Request&, w::Response& res) {
+        res.status = w::Status::OK;
+    }
+
+    void call(benchmark::State& state, const w::App::Handler& handler) {
+        w::Request req;
+        w::Response res;
+        for (auto _: state) {
+            handler(req, res);
+            benchmark::DoNotOptimize(res.status);
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+}
+
+static void BM_MiddlewareNone(benchmark::State& state) {
+    call(state, ok);
+}
+BENCHMARK(BM_MiddlewareNone);
+
+static void BM_MiddlewareChain(benchmark::State& state) {
+    Step s;
+    call(state, w::chain(s, s, s, s, s, s, s, s)(ok));
+}
+BENCHMARK(BM_MiddlewareChain);
+
+static void BM_MiddlewareFunctions(benchmark::State& state) {
+    w::App::Handler handler = ok;
+    for (int i = 0; i < num_middlewares; ++i) {
+        handler = [next = std::move(handler)](w::Request& req, w::Response& res) {
+            Step()(req, res, [&]() { next(req, res); });
+        };
+    }
+    call(state, handler);
+}
+BENCHMARK(BM_MiddlewareFunctions);
@@ -0,0 +1,69 @@
+#include "wayward/util/linklist.hpp"
+#include "wayward/util/timer_wheel.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+using namespace wayward::util;
+
+namespace {
+    struct Node {
+        IntrusiveListAnchor anchor;
+        Timer timer;
+        size_t value = 0;
+    };
+
+    using List = IntrusiveList<Node, &Node::anchor>;
+}
+
+// Moving a node to the front, as when a connection is recycled.
+static void BM_IntrusiveListRelink(benchmark::State& state) {
+    List list;
+    std::vector<Node> nodes(state.range(0));
+    for (auto& node: nodes) {
+        list.link_back(&node);
+    }
+    size_t i = 0;
+    for (auto _: state) {
+        Node& node = nodes[i];
+        list.unlink(&node);
+        list.link_front(&node);
+        i = (i + 7) % nodes.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IntrusiveListRelink)->Arg(16)->Arg(4096);
+
+static void BM_IntrusiveListIterate(benchmark::State& state) {
+    List list;
+    std::vector<Node> nodes(state.range(0));
+    for (auto& node: nodes) {
+        list.link_back(&node);
+    }
+    for (auto _: state) {
+        size_t sum = 0;
+        for (auto& node: list) {
+            sum += node.value;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * nodes.size());
+}
+BENCHMARK(BM_IntrusiveListIterate)->Arg(16)->Arg(4096);
+
+// Re-arming a connection timeout, as after every read and write.
+static void BM_TimerWheelReschedule(benchmark::State& state) {
+    TimerWheel<Node, &Node::timer> wheel;
+    std::vector<Node> nodes(state.range(0));
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        wheel.schedule(nodes[i], 1 + i % 600);
+    }
+    size_t i = 0;
+    for (auto _: state) {
+        wheel.schedule(nodes[i], 300);
+        i = (i + 7) % nodes.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_TimerWheelReschedule)->Arg(16)->Arg(100000);
@@ -0,0 +1,18 @@
+#include "wayward/metrics.hpp"
+
+#include <benchmark/benchmark.h>
+
+namespace w = wayward;
+
+// The histogram update the server adds per response. The clock is read
+// once per read and per write, not per request.
+static void BM_RecordLatency(benchmark::State& state) {
+    static w::LatencyHistogram histogram;
+    uint64_t ns = 0;
+    for (auto _: state) {
+        histogram.record(ns);
+        ns = (ns + 37813) % 100000000;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RecordLatency)->ThreadRange(1, 8);
@@ -0,0 +1,182 @@
+#include "wayward/http.hpp"
+
+#include <benchmark/benchmark.h>
+#include <http_parser.h>
+
+#include <string>
+#include <vector>
+
+namespace w = wayward;
+
+namespace {
+    // Collects the request fields as views into the input, like the server's
+    // callbacks do.
+    struct Collector {
+        http_parser parser;
+        w::Request request;
+        bool in_header_value = false;
+        size_t num_requests = 0;
+
+        Collector() {
+            http_parser_init(&parser, HTTP_REQUEST);
+            parser.data = this;
+        }
+
+        static Collector& of(http_parser* parser) {
+            return *static_cast<Collector*>(parser->data);
+        }
+
+        static void intern(w::HeaderField& field) {
+            field.id = w::header_id(field.name);
+        }
+
+        static void append(std::string_view& field, const char* data, size_t len) {
+            field = field.empty() ? std::string_view(data, len) : std::string_view(field.data(), field.size() + len);
+        }
+
+        static int on_message_begin(http_parser* parser) {
+            auto& c = of(parser);
+            c.request.url = std::string_view();
+            c.request.headers.clear();
+            c.request.body = std::string_view();
+            c.in_header_value = false;
+            return 0;
+        }
+        static int on_url(http_parser* parser, const char* data, size_t len) {
+            append(of(parser).request.url, data, len);
+            return 0;
+        }
+        static int on_header_field(http_parser* parser, const char* data, size_t len) {
+            auto& c = of(parser);
+            if (c.request.headers.empty() || c.in_header_value) {
+                if (!c.request.headers.empty()) {
+                    intern(c.request.headers.back());
+                }
+                c.request.headers.emplace_back();
+                c.in_header_value = false;
+            }
+            append(c.request.headers.back().name, data, len);
+            return 0;
+        }
+        static int on_header_value(http_parser* parser, const char* data, size_t len) {
+            auto& c = of(parser);
+            c.in_header_value = true;
+            append(c.request.headers.back().value, data, len);
+            return 0;
+        }
+        static int on_headers_complete(http_parser* parser) {
+            auto& c = of(parser);
+            if (!c.request.headers.empty()) {
+                intern(c.request.headers.back());
+            }
+            return 0;
+        }
+        static int on_body(http_parser* parser, const char* data, size_t len) {
+            append(of(parser).request.body, data, len);
+            return 0;
+        }
+        static int on_message_complete(http_parser* parser) {
+            ++of(parser).num_requests;
+            return 0;
+        }
+
+        static const http_parser_settings settings;
+    };
+
+    const http_parser_settings Collector::settings = {
+        /*.on_message_begin =*/ &Collector::on_message_begin,
+        /*.on_url =*/ &Collector::on_url,
+        /*.on_status =*/ nullptr,
+        /*.on_header_field =*/ &Collector::on_header_field,
+        /*.on_header_value =*/ &Collector::on_header_value,
+        /*.on_headers_complete =*/ &Collector::on_headers_complete,
+        /*.on_body =*/ &Collector::on_body,
+        /*.on_message_complete =*/ &Collector::on_message_complete,
+        /*.on_chunk_header =*/ nullptr,
+        /*.on_chunk_complete =*/ nullptr,
+    };
+
+    const char browser_request[] =
+        "GET /api/v1/users/12345/posts?limit=20&offset=40 HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Connection: keep-alive\r\n"
+        "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "\r\n";
+
+    const char small_request[] = "GET /plaintext HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+    const char chunked_request[] =
+        "POST /upload HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "\r\n"
+        "100\r\n" "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+        "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+        "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+        "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\r\n"
+        "0\r\n\r\n";
+
+    void parse(benchmark::State& state, const std::string& input, size_t requests_per_input) {
+        Collector collector;
+        for (auto _: state) {
+            size_t parsed = http_parser_execute(&collector.parser, &Collector::settings, input.data(), input.size());
+            if (parsed != input.size()) {
+                state.SkipWithError(http_errno_name(HTTP_PARSER_ERRNO(&collector.parser)));
+                break;
+            }
+            benchmark::DoNotOptimize(collector.request.headers.begin());
+        }
+        state.SetItemsProcessed(state.iterations() * requests_per_input);
+        state.SetBytesProcessed(state.iterations() * input.size());
+    }
+}
+
+static void BM_ParseBrowserRequest(benchmark::State& state) {
+    parse(state, browser_request, 1);
+}
+BENCHMARK(BM_ParseBrowserRequest);
+
+// A pipelined batch of small requests, as received in one read.
+static void BM_ParsePipelined(benchmark::State& state) {
+    std::string input;
+    for (int i = 0; i < 16; ++i) {
+        input += small_request;
+    }
+    parse(state, input, 16);
+}
+BENCHMARK(BM_ParsePipelined);
+
+static void BM_ParseChunkedBody(benchmark::State& state) {
+    parse(state, chunked_request, 1);
+}
+BENCHMARK(BM_ParseChunkedBody);
+
+// Looking up a field of the browser request, by name (as before header IDs)
+// and by ID.
+static void BM_HeaderLookupByName(benchmark::State& state) {
+    Collector collector;
+    http_parser_execute(&collector.parser, &Collector::settings, browser_request, sizeof(browser_request) - 1);
+    for (auto _: state) {
+        benchmark::DoNotOptimize(collector.request.header("Cache-Control"));
+        benchmark::DoNotOptimize(collector.request.header("X-Missing"));
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_HeaderLookupByName);
+
+static void BM_HeaderLookupById(benchmark::State& state) {
+    Collector collector;
+    http_parser_execute(&collector.parser, &Collector::settings, browser_request, sizeof(browser_request) - 1);
+    for (auto _: state) {
+        benchmark::DoNotOptimize(collector.request.header(w::HeaderId::CacheControl));
+        benchmark::DoNotOptimize(collector.request.header(w::HeaderId::Authorization));
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_HeaderLookupById);
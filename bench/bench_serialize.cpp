@@ -0,0 +1,56 @@
+#include "wayward/http.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <sstream>
+
+namespace w = wayward;
+
+namespace {
+    void make_response(w::Response& res, size_t body_size) {
+        res.status = w::Status::OK;
+        res.set_header("Content-Type", "text/plain");
+        res.set_header("Cache-Control", "no-cache");
+        res.set_header("X-Request-Id", "0123456789abcdef");
+        res.body = std::string(body_size, 'x');
+    }
+}
+
+// The serialization used before serialize_head(): stringstream formatting,
+// then the whole response (including the body) copied into a send buffer.
+static void BM_SerializeStringstream(benchmark::State& state) {
+    w::Response res;
+    make_response(res, state.range(0));
+    std::string send_buffer;
+    for (auto _: state) {
+        std::stringstream ss;
+        ss << "HTTP/1.1 " << int(res.status) << "\r\n";
+        for (auto& field: res.headers) {
+            ss << field.name << ": " << field.value << "\r\n";
+        }
+        ss << "Content-Length: " << res.body.size() << "\r\n";
+        ss << "\r\n";
+        ss << res.body;
+        send_buffer = ss.str();
+        benchmark::DoNotOptimize(send_buffer.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SerializeStringstream)->Arg(16)->Arg(4096)->Arg(65536);
+
+// Head into a reused buffer; the body is referenced by the second iovec.
+static void BM_SerializeHead(benchmark::State& state) {
+    w::Response res;
+    make_response(res, state.range(0));
+    std::string send_head;
+    for (auto _: state) {
+        send_head.clear();
+        w::serialize_head(res, send_head);
+        const void* buffers[2] = { send_head.data(), res.body.data() };
+        benchmark::DoNotOptimize(buffers);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SerializeHead)->Arg(16)->Arg(4096)->Arg(65536);
+
+BENCHMARK_MAIN();
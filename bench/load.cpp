@@ -0,0 +1,562 @@
+// wayward-load: HTTP/1.1 load generator, reporting throughput and latency
+// percentiles.
+//
+// Without --tcp or --unix, it starts a built-in "Hello, World!" server in a
+// child process, and measures it over loopback TCP and then over a UNIX
+// domain socket, so the numbers for a change to the server are one command
+// away:
+//
+//     wayward-load --connections 64 --duration 10
+//
+// Closed loop (the default): every connection sends its next request as
+// soon as the previous response has arrived, which measures the maximum
+// throughput. Open loop (--rate): requests are sent on a fixed schedule,
+// pipelined when responses fall behind, and latency counts from when a
+// request was due. A server that stalls then shows in the tail, instead of
+// slowing down the generator along with it (coordinated omission).
+//
+// With --requests-per-connection, connections close after that many
+// requests (the last with "Connection: close") and connect again, which
+// measures how fast the server takes new connections:
+//
+//     wayward-load --requests-per-connection 1 --server-accept-batch 1
+
+#include "wayward/app.hpp"
+#include "wayward/server.hpp"
+#include "config.h"
+
+#if defined(ASIO_FROM_BOOST)
+#include <boost/asio.hpp>
+namespace asio = boost::asio;
+using asio_error_code = boost::system::error_code;
+#else
+#include <asio.hpp>
+using asio_error_code = std::error_code;
+#endif
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace w = wayward;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+    struct Options {
+        std::string host = "127.0.0.1";
+        unsigned int port = 0;
+        std::string unix_path;
+        std::string path = "/";
+        unsigned int connections = 64;
+        unsigned int threads = 2;
+        unsigned int server_threads = 1;
+        bool server_io_uring = false;
+        double duration = 5;
+        double warmup = 1;
+        double rate = 0; // Requests per second over all connections; 0 for a closed loop.
+        unsigned int requests_per_connection = 0; // 0 to keep connections open.
+        unsigned int server_accept_batch = 16;
+    };
+
+    void usage() {
+        std::cerr <<
+            "usage: wayward-load [options]\n"
+            "  --tcp HOST:PORT        target server (default: built-in server, TCP and UNIX socket)\n"
+            "  --unix PATH            target server on a UNIX domain socket\n"
+            "  --path PATH            request path (default /)\n"
+            "  --connections N        concurrent connections (default 64)\n"
+            "  --threads N            client threads (default 2)\n"
+            "  --server-threads N     threads of the built-in server (default 1)\n"
+            "  --server-io BACKEND    asio or io_uring, for the built-in server (default asio)\n"
+            "  --duration SECONDS     measured time (default 5)\n"
+            "  --warmup SECONDS       unmeasured time before (default 1)\n"
+            "  --rate N               open loop at N requests per second (default: closed loop)\n"
+            "  --requests-per-connection N\n"
+            "                         reconnect after N requests, closed loop only (default: never)\n"
+            "  --server-accept-batch N\n"
+            "                         Server::accept_batch() of the built-in server (default 16)\n";
+    }
+
+    struct Results {
+        std::vector<uint64_t> latencies_ns;
+        std::vector<uint64_t> connect_ns; // Reconnections only.
+        uint64_t non_2xx = 0;
+        uint64_t errors = 0;
+        uint64_t unanswered = 0;
+    };
+
+    // Length of the first complete response in `data`, or 0.
+    size_t response_length(std::string_view data, int* status) {
+        size_t head_end = data.find("\r\n\r\n");
+        if (head_end == std::string_view::npos) {
+            return 0;
+        }
+        *status = data.size() > 12 ? std::atoi(data.data() + 9) : 0;
+        size_t body_start = head_end + 4;
+        size_t content_length = 0;
+        bool chunked = false;
+        size_t line_start = data.find("\r\n") + 2;
+        while (line_start < head_end) {
+            size_t line_end = data.find("\r\n", line_start);
+            auto line = data.substr(line_start, line_end - line_start);
+            size_t colon = line.find(':');
+            if (colon != std::string_view::npos) {
+                auto name = line.substr(0, colon);
+                auto value = line.substr(colon + 1);
+                while (!value.empty() && value.front() == ' ') {
+                    value.remove_prefix(1);
+                }
+                if (w::iequals(name, "Content-Length")) {
+                    content_length = std::strtoull(std::string(value).c_str(), nullptr, 10);
+                }
+                else if (w::iequals(name, "Transfer-Encoding") && w::iequals(value, "chunked")) {
+                    chunked = true;
+                }
+            }
+            line_start = line_end + 2;
+        }
+        if (!chunked) {
+            return data.size() - body_start >= content_length ? body_start + content_length : 0;
+        }
+        size_t pos = body_start;
+        while (true) {
+            size_t line_end = data.find("\r\n", pos);
+            if (line_end == std::string_view::npos) {
+                return 0;
+            }
+            size_t size = std::strtoull(std::string(data.substr(pos, line_end - pos)).c_str(), nullptr, 16);
+            pos = line_end + 2;
+            if (size == 0) {
+                return data.size() >= pos + 2 ? pos + 2 : 0;
+            }
+            pos += size + 2;
+            if (pos > data.size()) {
+                return 0;
+            }
+        }
+    }
+
+    struct Worker;
+
+    struct ConnectionBase {
+        virtual ~ConnectionBase() {}
+        virtual void start() = 0;
+        virtual void stop() = 0;
+    };
+
+    // Connections of one client thread, and what they measured.
+    struct Worker {
+        asio::io_service service;
+        std::vector<std::unique_ptr<ConnectionBase>> connections;
+        Results results;
+        Clock::time_point measure_from;
+        Clock::time_point deadline;
+        Clock::duration interval{0}; // Open loop: between requests of a connection.
+        unsigned int requests_per_connection = 0;
+    };
+
+    template <class Protocol>
+    struct Connection : ConnectionBase {
+        Worker& worker;
+        const std::string& request;
+        const std::string& last_request; // With "Connection: close".
+        const typename Protocol::endpoint endpoint;
+        asio::basic_stream_socket<Protocol> socket;
+        asio::steady_timer timer;
+        char buffer[64 * 1024];
+        std::string received;
+        std::string sending;
+        // When the requests still waiting for responses were sent, or due.
+        std::deque<Clock::time_point> outstanding;
+        size_t waiting_writes = 0;
+        bool writing = false;
+        bool stopped = false;
+        bool reconnecting = false;
+        Clock::time_point next_due;
+        // On the current connection, for --requests-per-connection.
+        unsigned int num_sent = 0;
+        unsigned int num_answered = 0;
+
+        Connection(Worker& worker, const std::string& request, const std::string& last_request, const typename Protocol::endpoint& endpoint)
+            : worker(worker), request(request), last_request(last_request), endpoint(endpoint), socket(worker.service), timer(worker.service)
+        {
+            socket.connect(endpoint);
+            connected();
+        }
+
+        void connected() {
+            if constexpr (std::is_same<Protocol, asio::ip::tcp>::value) {
+                asio_error_code ec;
+                socket.set_option(asio::ip::tcp::no_delay(true), ec);
+            }
+        }
+
+        void reconnect() {
+            reconnecting = true;
+            asio_error_code ec;
+            socket.close(ec);
+            received.clear();
+            num_sent = 0;
+            num_answered = 0;
+            auto started = Clock::now();
+            socket.async_connect(endpoint, [this, started](asio_error_code ec) {
+                reconnecting = false;
+                if (ec || stopped) {
+                    fail(ec);
+                    return;
+                }
+                auto now = Clock::now();
+                if (started >= worker.measure_from && started < worker.deadline) {
+                    worker.results.connect_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(now - started).count());
+                }
+                connected();
+                keep_reading();
+                send(now);
+            });
+        }
+
+        void start() override {
+            keep_reading();
+            if (worker.interval.count() == 0) {
+                send(Clock::now());
+            }
+            else {
+                // Spread the connections' schedules over one interval.
+                next_due = Clock::now() + Clock::duration(std::rand() % worker.interval.count());
+                schedule();
+            }
+        }
+
+        void stop() override {
+            stopped = true;
+            worker.results.unanswered += outstanding.size();
+            outstanding.clear();
+            asio_error_code ec;
+            socket.close(ec);
+            timer.cancel(ec);
+        }
+
+        void schedule() {
+            if (next_due >= worker.deadline) {
+                return;
+            }
+            timer.expires_at(next_due);
+            timer.async_wait([this](asio_error_code ec) {
+                if (ec || stopped) {
+                    return;
+                }
+                send(next_due);
+                next_due += worker.interval;
+                schedule();
+            });
+        }
+
+        void send(Clock::time_point due) {
+            outstanding.push_back(due);
+            if (writing) {
+                ++waiting_writes;
+                return;
+            }
+            write(1);
+        }
+
+        void write(size_t count) {
+            sending.clear();
+            for (size_t i = 0; i < count; ++i) {
+                sending += ++num_sent == worker.requests_per_connection ? last_request : request;
+            }
+            writing = true;
+            asio::async_write(socket, asio::buffer(sending), [this](asio_error_code ec, size_t) {
+                writing = false;
+                if (ec || stopped) {
+                    fail(ec);
+                    return;
+                }
+                if (waiting_writes > 0) {
+                    size_t count = waiting_writes;
+                    waiting_writes = 0;
+                    write(count);
+                }
+            });
+        }
+
+        void keep_reading() {
+            socket.async_read_some(asio::buffer(buffer), [this](asio_error_code ec, size_t len) {
+                if (ec || stopped) {
+                    fail(ec);
+                    return;
+                }
+                received.append(buffer, len);
+                received_responses();
+                if (!stopped && !reconnecting) {
+                    keep_reading();
+                }
+            });
+        }
+
+        void received_responses() {
+            auto now = Clock::now();
+            size_t consumed = 0;
+            int status = 0;
+            while (size_t len = response_length(std::string_view(received).substr(consumed), &status)) {
+                consumed += len;
+                if (outstanding.empty()) {
+                    ++worker.results.errors;
+                    continue;
+                }
+                auto sent = outstanding.front();
+                outstanding.pop_front();
+                if (sent >= worker.measure_from && sent < worker.deadline) {
+                    worker.results.latencies_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(now - sent).count());
+                    if (status < 200 || status >= 300) {
+                        ++worker.results.non_2xx;
+                    }
+                }
+                if (++num_answered == worker.requests_per_connection) {
+                    if (now < worker.deadline) {
+                        reconnect();
+                    }
+                    else {
+                        stop();
+                    }
+                    return;
+                }
+                if (worker.interval.count() == 0 && now < worker.deadline) {
+                    send(now);
+                }
+            }
+            received.erase(0, consumed);
+            if (now >= worker.deadline && outstanding.empty()) {
+                stop();
+            }
+        }
+
+        void fail(asio_error_code ec) {
+            if (stopped || ec == asio::error::operation_aborted) {
+                return;
+            }
+            ++worker.results.errors;
+            stop();
+        }
+    };
+
+    double percentile(const std::vector<uint64_t>& sorted, double q) {
+        if (sorted.empty()) {
+            return 0;
+        }
+        size_t i = std::min(sorted.size() - 1, size_t(q * sorted.size()));
+        return double(sorted[i]);
+    }
+
+    std::string format_latency(double ns) {
+        char buffer[32];
+        if (ns < 1e6) {
+            std::snprintf(buffer, sizeof(buffer), "%.0f us", ns / 1e3);
+        }
+        else {
+            std::snprintf(buffer, sizeof(buffer), "%.2f ms", ns / 1e6);
+        }
+        return buffer;
+    }
+
+    template <class Protocol>
+    void run_load(const Options& options, const typename Protocol::endpoint& endpoint, const std::string& target) {
+        std::string request = "GET " + options.path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        std::string last_request = "GET " + options.path + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+        unsigned int num_threads = std::max(1u, std::min(options.threads, options.connections));
+        std::vector<std::unique_ptr<Worker>> workers;
+        for (unsigned int i = 0; i < num_threads; ++i) {
+            workers.emplace_back(new Worker);
+        }
+        for (unsigned int i = 0; i < options.connections; ++i) {
+            auto& worker = *workers[i % num_threads];
+            worker.connections.emplace_back(new Connection<Protocol>(worker, request, last_request, endpoint));
+        }
+
+        auto started = Clock::now();
+        auto warmup = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.warmup));
+        auto duration = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+        std::vector<std::thread> threads;
+        for (auto& worker: workers) {
+            worker->measure_from = started + warmup;
+            worker->deadline = started + warmup + duration;
+            worker->requests_per_connection = options.requests_per_connection;
+            if (options.rate > 0) {
+                double per_connection = options.rate / options.connections;
+                worker->interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1 / per_connection));
+            }
+            Worker* w = worker.get();
+            threads.emplace_back([w]() {
+                for (auto& connection: w->connections) {
+                    connection->start();
+                }
+                // Give late responses a second, then give up on them.
+                w->service.run_until(w->deadline + std::chrono::seconds(1));
+                for (auto& connection: w->connections) {
+                    connection->stop();
+                }
+            });
+        }
+        for (auto& thread: threads) {
+            thread.join();
+        }
+
+        Results total;
+        for (auto& worker: workers) {
+            auto& results = worker->results;
+            total.latencies_ns.insert(total.latencies_ns.end(), results.latencies_ns.begin(), results.latencies_ns.end());
+            total.connect_ns.insert(total.connect_ns.end(), results.connect_ns.begin(), results.connect_ns.end());
+            total.non_2xx += results.non_2xx;
+            total.errors += results.errors;
+            total.unanswered += results.unanswered;
+        }
+        std::sort(total.latencies_ns.begin(), total.latencies_ns.end());
+        auto& latencies = total.latencies_ns;
+
+        std::printf("%s, %u connections, %s, %.0f s\n", target.c_str(), options.connections,
+            options.rate > 0 ? ("open loop at " + std::to_string(uint64_t(options.rate)) + " req/s").c_str() : "closed loop",
+            options.duration);
+        std::printf("  requests: %zu (%.0f/s), non-2xx: %llu, errors: %llu, unanswered: %llu\n",
+            latencies.size(), latencies.size() / options.duration,
+            (unsigned long long)total.non_2xx, (unsigned long long)total.errors, (unsigned long long)total.unanswered);
+        std::printf("  latency: p50 %s, p99 %s, p999 %s, max %s\n",
+            format_latency(percentile(latencies, 0.5)).c_str(),
+            format_latency(percentile(latencies, 0.99)).c_str(),
+            format_latency(percentile(latencies, 0.999)).c_str(),
+            format_latency(latencies.empty() ? 0 : double(latencies.back())).c_str());
+        if (options.requests_per_connection > 0) {
+            auto& connects = total.connect_ns;
+            std::sort(connects.begin(), connects.end());
+            std::printf("  connections: %zu (%.0f/s), %u requests each, connect: p50 %s, p99 %s, max %s\n",
+                connects.size(), connects.size() / options.duration, options.requests_per_connection,
+                format_latency(percentile(connects, 0.5)).c_str(),
+                format_latency(percentile(connects, 0.99)).c_str(),
+                format_latency(connects.empty() ? 0 : double(connects.back())).c_str());
+        }
+        std::fflush(stdout);
+    }
+
+    // Waits for the server to accept connections.
+    template <class Protocol>
+    bool wait_for(const typename Protocol::endpoint& endpoint) {
+        asio::io_service service;
+        for (int i = 0; i < 200; ++i) {
+            asio::basic_stream_socket<Protocol> socket(service);
+            asio_error_code ec;
+            socket.connect(endpoint, ec);
+            if (!ec) {
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    }
+
+    // The built-in server runs in its own process, so it does not share
+    // anything with the generator but the machine.
+    pid_t start_server(const Options& options) {
+        ::unlink(options.unix_path.c_str());
+        std::fflush(stdout);
+        pid_t pid = ::fork();
+        if (pid != 0) {
+            return pid;
+        }
+        w::App app;
+        app.get("/", [](w::Request&, w::Response& res) {
+            w::plain_text(res, "Hello, World!");
+        });
+        w::Server server;
+        server.threads(options.server_threads).io_uring(options.server_io_uring).accept_batch(options.server_accept_batch);
+        server.listen(options.host, options.port);
+        server.listen(options.unix_path);
+        std::_Exit(server.run(app));
+    }
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    bool tcp = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) {
+            usage();
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--tcp") {
+            size_t colon = value.rfind(':');
+            if (colon == std::string::npos) {
+                usage();
+                return 1;
+            }
+            options.host = value.substr(0, colon);
+            options.port = std::stoi(value.substr(colon + 1));
+            tcp = true;
+        }
+        else if (arg == "--unix") options.unix_path = value;
+        else if (arg == "--path") options.path = value;
+        else if (arg == "--connections") options.connections = std::max(1, std::stoi(value));
+        else if (arg == "--threads") options.threads = std::stoi(value);
+        else if (arg == "--server-threads") options.server_threads = std::stoi(value);
+        else if (arg == "--server-io" && (value == "asio" || value == "io_uring")) options.server_io_uring = value == "io_uring";
+        else if (arg == "--duration") options.duration = std::stod(value);
+        else if (arg == "--warmup") options.warmup = std::stod(value);
+        else if (arg == "--rate") options.rate = std::stod(value);
+        else if (arg == "--requests-per-connection") options.requests_per_connection = std::stoi(value);
+        else if (arg == "--server-accept-batch") options.server_accept_batch = std::stoi(value);
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (options.rate > 0 && options.requests_per_connection > 0) {
+        std::cerr << "wayward-load: --requests-per-connection needs a closed loop.\n";
+        return 1;
+    }
+
+    try {
+        if (tcp || !options.unix_path.empty()) {
+            if (tcp) {
+                asio::ip::tcp::endpoint endpoint(asio::ip::address::from_string(options.host), options.port);
+                run_load<asio::ip::tcp>(options, endpoint, "tcp " + options.host + ":" + std::to_string(options.port));
+            }
+            if (!options.unix_path.empty()) {
+                run_load<asio::local::stream_protocol>(options, options.unix_path, "unix " + options.unix_path);
+            }
+            return 0;
+        }
+
+        options.port = 3100;
+        options.unix_path = "/tmp/wayward-load.sock";
+        pid_t server = start_server(options);
+        asio::ip::tcp::endpoint tcp_endpoint(asio::ip::address::from_string(options.host), options.port);
+        asio::local::stream_protocol::endpoint unix_endpoint(options.unix_path);
+        if (!wait_for<asio::ip::tcp>(tcp_endpoint) || !wait_for<asio::local::stream_protocol>(unix_endpoint)) {
+            std::cerr << "The built-in server did not start.\n";
+            ::kill(server, SIGKILL);
+            return 1;
+        }
+        run_load<asio::ip::tcp>(options, tcp_endpoint, "built-in server, tcp " + options.host + ":" + std::to_string(options.port));
+        run_load<asio::local::stream_protocol>(options, unix_endpoint, "built-in server, unix " + options.unix_path);
+        ::kill(server, SIGTERM);
+        ::waitpid(server, nullptr, 0);
+        ::unlink(options.unix_path.c_str());
+    }
+    catch (const std::exception& e) {
+        std::cerr << "wayward-load: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include "wayward/util/arena.hpp"
+
+#include <gtest/gtest.h>
+
+using namespace wayward::util;
+
+TEST(Arena, LazyFirstChunk) {
+    Arena arena;
+    EXPECT_EQ(0u, arena.bytes_reserved());
+    arena.reset();
+    EXPECT_EQ(0u, arena.bytes_reserved());
+}
+
+TEST(Arena, Alignment) {
+    Arena arena;
+    arena.allocate_chars(1);
+    void* p = arena.allocate(sizeof(double), alignof(double));
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(p) % alignof(double));
+    arena.allocate_chars(3);
+    p = arena.allocate(64, 64);
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(p) % 64);
+}
+
+TEST(Arena, Copy) {
+    Arena arena;
+    std::string str = "Hello, Wayward!";
+    auto copy = arena.copy(str);
+    str = "Goodbye";
+    EXPECT_EQ("Hello, Wayward!", copy);
+    EXPECT_TRUE(arena.copy("").empty());
+}
+
+TEST(Arena, ResetReusesMemory) {
+    Arena arena(256);
+    char* first = arena.allocate_chars(100);
+    arena.allocate_chars(100);
+    arena.reset();
+    EXPECT_EQ(first, arena.allocate_chars(100));
+    EXPECT_EQ(256u, arena.bytes_reserved());
+}
+
+TEST(Arena, GrowsInChunks) {
+    Arena arena(256);
+    for (int i = 0; i < 10; ++i) {
+        arena.allocate_chars(200);
+    }
+    EXPECT_EQ(10 * 256u, arena.bytes_reserved());
+    char* big = arena.allocate_chars(1000);
+    big[999] = 'x';
+    EXPECT_EQ(10 * 256u + 1000u, arena.bytes_reserved());
+}
+
+TEST(Arena, ResetTrimsToMaxRetained) {
+    Arena arena(256, 1024);
+    for (int i = 0; i < 10; ++i) {
+        arena.allocate_chars(200);
+    }
+    arena.reset();
+    EXPECT_EQ(1024u, arena.bytes_reserved());
+
+    // Retained chunks are reused before new ones are allocated.
+    for (int i = 0; i < 4; ++i) {
+        arena.allocate_chars(200);
+    }
+    EXPECT_EQ(1024u, arena.bytes_reserved());
+}
+
+TEST(Arena, ResetDropsHugeFirstChunk) {
+    Arena arena(256, 1024);
+    arena.allocate_chars(1 << 20);
+    arena.reset();
+    EXPECT_EQ(0u, arena.bytes_reserved());
+    arena.allocate_chars(10);
+    EXPECT_EQ(256u, arena.bytes_reserved());
+}
+
+TEST(Arena, Move) {
+    Arena a;
+    auto str = a.copy("moved");
+    Arena b = std::move(a);
+    EXPECT_EQ(0u, a.bytes_reserved());
+    EXPECT_EQ("moved", str);
+    EXPECT_EQ(Arena::default_chunk_size, b.bytes_reserved());
+}
+
+TEST(Arena, ChunksFromPool) {
+    BufferPool pool(1024);
+    {
+        Arena arena(pool);
+        arena.allocate_chars(100);
+        EXPECT_EQ(1u, pool.num_acquired());
+        arena.allocate_chars(2000); // Too big for the pool.
+        EXPECT_EQ(1u, pool.num_acquired());
+        arena.release();
+        EXPECT_EQ(0u, arena.bytes_reserved());
+        EXPECT_EQ(0u, pool.num_acquired());
+        EXPECT_EQ(1u, pool.num_free());
+
+        arena.allocate_chars(100);
+        EXPECT_EQ(0u, pool.num_free());
+    }
+    EXPECT_EQ(0u, pool.num_acquired());
+}
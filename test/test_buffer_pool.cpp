@@ -0,0 +1,32 @@
+#include "wayward/util/buffer_pool.hpp"
+
+#include <gtest/gtest.h>
+
+using namespace wayward::util;
+
+TEST(BufferPool, ReusesReleasedBlocks) {
+    BufferPool pool(4096);
+    void* a = pool.acquire();
+    void* b = pool.acquire();
+    EXPECT_EQ(2u, pool.num_acquired());
+    pool.release(a);
+    EXPECT_EQ(1u, pool.num_free());
+    EXPECT_EQ(a, pool.acquire());
+    EXPECT_EQ(0u, pool.num_free());
+    pool.release(a);
+    pool.release(b);
+    EXPECT_EQ(0u, pool.num_acquired());
+    EXPECT_EQ(2u, pool.num_free());
+}
+
+TEST(BufferPool, MaxFree) {
+    BufferPool pool(64, 2);
+    void* blocks[4];
+    for (auto& block: blocks) {
+        block = pool.acquire();
+    }
+    for (auto& block: blocks) {
+        pool.release(block);
+    }
+    EXPECT_EQ(2u, pool.num_free());
+}
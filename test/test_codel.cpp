@@ -0,0 +1,42 @@
+#include "wayward/util/codel.hpp"
+
+#include <gtest/gtest.h>
+
+using namespace wayward::util;
+using std::chrono::milliseconds;
+
+TEST(Codel, ShedsOnlyWhenTheDelayStaysHigh) {
+    Codel codel(milliseconds(5), milliseconds(100));
+    auto now = Codel::Clock::now();
+    // Busy, but the queue drains within the interval.
+    EXPECT_FALSE(codel.overloaded(now, milliseconds(50)));
+    EXPECT_FALSE(codel.overloaded(now + milliseconds(50), milliseconds(1)));
+    EXPECT_FALSE(codel.overloaded(now + milliseconds(100), milliseconds(50)));
+    EXPECT_FALSE(codel.overloaded(now + milliseconds(150), milliseconds(50)));
+
+    // No request has waited less than the target for an interval.
+    EXPECT_TRUE(codel.overloaded(now + milliseconds(200), milliseconds(50)));
+    EXPECT_FALSE(codel.overloaded(now + milliseconds(210), milliseconds(10)));
+    EXPECT_TRUE(codel.overloaded(now + milliseconds(220), milliseconds(11)));
+
+    // Until one does.
+    EXPECT_FALSE(codel.overloaded(now + milliseconds(250), milliseconds(2)));
+    EXPECT_TRUE(codel.overloaded(now + milliseconds(260), milliseconds(50)));
+    EXPECT_FALSE(codel.overloaded(now + milliseconds(300), milliseconds(50)));
+}
+
+TEST(Codel, IdleIntervalsEndOverload) {
+    Codel codel(milliseconds(5), milliseconds(100));
+    auto now = Codel::Clock::now();
+    EXPECT_FALSE(codel.overloaded(now, milliseconds(50)));
+    EXPECT_TRUE(codel.overloaded(now + milliseconds(100), milliseconds(50)));
+    EXPECT_FALSE(codel.overloaded(now + milliseconds(500), milliseconds(50)));
+}
+
+TEST(Codel, DisabledByDefault) {
+    Codel codel;
+    auto now = Codel::Clock::now();
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_FALSE(codel.overloaded(now + milliseconds(i), milliseconds(1000)));
+    }
+}
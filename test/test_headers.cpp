@@ -0,0 +1,84 @@
+#include "wayward/http.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace w = wayward;
+
+TEST(Headers, InternsWellKnownNames) {
+    EXPECT_EQ(w::HeaderId::ContentLength, w::header_id("content-length"));
+    EXPECT_EQ(w::HeaderId::Host, w::header_id("HOST"));
+    EXPECT_EQ(w::HeaderId::Http2Settings, w::header_id("HTTP2-Settings"));
+    EXPECT_EQ(w::HeaderId::Other, w::header_id("X-Request-Id"));
+    EXPECT_EQ(w::HeaderId::Other, w::header_id("Content_Length"));
+    EXPECT_EQ(w::HeaderId::Other, w::header_id(""));
+    EXPECT_EQ("Content-Type", w::header_name(w::HeaderId::ContentType));
+    EXPECT_EQ("Content-Type: ", w::header_prefix(w::HeaderId::ContentType));
+    EXPECT_EQ("", w::header_name(w::HeaderId::Other));
+
+    for (size_t i = 1; i < w::num_header_ids; ++i) {
+        auto id = w::HeaderId(i);
+        EXPECT_EQ(id, w::header_id(w::header_name(id))) << w::header_name(id);
+    }
+}
+
+TEST(Headers, LookupIgnoresCase) {
+    w::Headers headers = {
+        {"host", "example.com"},
+        {"X-Trace", "abc"},
+        {"Cookie", "a=1"},
+        {"cookie", "b=2"},
+    };
+    EXPECT_EQ(w::HeaderId::Host, headers[0].id);
+    EXPECT_EQ("host", headers[0].name);
+    EXPECT_EQ("example.com", headers.get(w::HeaderId::Host));
+    EXPECT_EQ("example.com", headers.get("Host"));
+    EXPECT_EQ("abc", headers.get("x-trace"));
+    EXPECT_EQ("a=1", headers.get("COOKIE"));
+    EXPECT_EQ("", headers.get("X-Missing"));
+    EXPECT_EQ(nullptr, headers.find(w::HeaderId::ContentType));
+}
+
+TEST(Headers, SpillsBeyondInlineCapacity) {
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 3 * w::Headers::inline_capacity; ++i) {
+        names.push_back("X-Field-" + std::to_string(i));
+    }
+    w::Headers headers;
+    for (auto& name: names) {
+        headers.emplace_back(name, name);
+    }
+    EXPECT_EQ(names.size(), headers.size());
+    EXPECT_EQ("X-Field-30", headers.get("x-field-30"));
+
+    w::Headers copy = headers;
+    w::Headers moved = std::move(headers);
+    EXPECT_TRUE(headers.empty());
+    EXPECT_EQ(names.size(), copy.size());
+    EXPECT_EQ(names.size(), moved.size());
+    EXPECT_EQ("X-Field-0", moved[0].value);
+
+    // Clearing keeps the storage for the next message.
+    size_t capacity = moved.capacity();
+    moved.clear();
+    EXPECT_TRUE(moved.empty());
+    EXPECT_EQ(capacity, moved.capacity());
+}
+
+TEST(Headers, ResponseSetHeader) {
+    w::Response res;
+    res.set_header("content-type", "text/html");
+    res.set_header("Content-Type", "text/plain");
+    res.set_header("x-custom", "1");
+    res.set_header("X-Custom", "2");
+    ASSERT_EQ(2u, res.headers.size());
+    EXPECT_EQ("text/plain", res.header(w::HeaderId::ContentType));
+    EXPECT_EQ("2", res.header("x-custom"));
+
+    // Well-known names go out with their canonical spelling.
+    std::string head;
+    w::serialize_head(res, head);
+    EXPECT_EQ("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nx-custom: 2\r\nContent-Length: 0\r\n\r\n", head);
+}
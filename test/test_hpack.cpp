@@ -0,0 +1,169 @@
+#include "wayward/hpack.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace w = wayward;
+
+namespace {
+    std::string from_hex(std::string_view hex) {
+        std::string out;
+        int high = -1;
+        for (char c: hex) {
+            if (c == ' ') {
+                continue;
+            }
+            int digit = c <= '9' ? c - '0' : c - 'a' + 10;
+            if (high < 0) {
+                high = digit;
+            }
+            else {
+                out.push_back(char(high * 16 + digit));
+                high = -1;
+            }
+        }
+        return out;
+    }
+
+    using Fields = std::vector<std::pair<std::string, std::string>>;
+
+    Fields decode(w::HpackDecoder& decoder, const std::string& block) {
+        w::util::Arena arena;
+        w::Headers headers;
+        EXPECT_EQ(w::HpackDecoder::Result::Ok, decoder.decode(block, arena, headers, 64 * 1024));
+        Fields fields;
+        for (auto& field: headers) {
+            fields.emplace_back(std::string(field.name), std::string(field.value));
+        }
+        return fields;
+    }
+
+    bool malformed(const std::string& block) {
+        w::HpackDecoder decoder;
+        w::util::Arena arena;
+        w::Headers headers;
+        return decoder.decode(block, arena, headers, 64 * 1024) == w::HpackDecoder::Result::Malformed;
+    }
+
+    const Fields first_request = {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}};
+    const Fields second_request = {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}, {"cache-control", "no-cache"}};
+    const Fields third_request = {{":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"}, {":authority", "www.example.com"}, {"custom-key", "custom-value"}};
+}
+
+// RFC 7541, Appendix C.3: literals, and references to the fields they add.
+TEST(Hpack, DecodesRequests) {
+    w::HpackDecoder decoder;
+    EXPECT_EQ(first_request, decode(decoder, from_hex("8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d")));
+    EXPECT_EQ(second_request, decode(decoder, from_hex("8286 84be 5808 6e6f 2d63 6163 6865")));
+    EXPECT_EQ(third_request, decode(decoder, from_hex("8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65")));
+}
+
+// RFC 7541, Appendix C.4: the same, Huffman-coded.
+TEST(Hpack, DecodesHuffmanCodedRequests) {
+    w::HpackDecoder decoder;
+    EXPECT_EQ(first_request, decode(decoder, from_hex("8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff")));
+    EXPECT_EQ(second_request, decode(decoder, from_hex("8286 84be 5886 a8eb 1064 9cbf")));
+    EXPECT_EQ(third_request, decode(decoder, from_hex("8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf")));
+}
+
+TEST(Hpack, HuffmanCode) {
+    std::string encoded;
+    w::huffman_encode("www.example.com", encoded);
+    EXPECT_EQ(from_hex("f1e3 c2e5 f23a 6ba0 ab90 f4ff"), encoded);
+    EXPECT_EQ(encoded.size(), w::huffman_encoded_size("www.example.com"));
+
+    std::string all;
+    for (int c = 0; c < 256; ++c) {
+        all.push_back(char(c));
+    }
+    encoded.clear();
+    w::huffman_encode(all, encoded);
+    std::string decoded;
+    EXPECT_TRUE(w::huffman_decode(encoded, decoded));
+    EXPECT_EQ(all, decoded);
+
+    // Padding must be short, and all ones.
+    decoded.clear();
+    EXPECT_FALSE(w::huffman_decode(from_hex("f1e3 c2e5 f23a 6ba0 ab90 f4fe"), decoded));
+    decoded.clear();
+    EXPECT_FALSE(w::huffman_decode(from_hex("ffff ffff"), decoded));
+}
+
+TEST(Hpack, EncodesWhatItDecodes) {
+    w::HpackEncoder encoder;
+    w::HpackDecoder decoder;
+    const Fields fields = {
+        {":status", "200"},
+        {"content-type", "text/plain; charset=utf-8"},
+        {"Cache-Control", "max-age=60"},
+        {"content-length", "1234"},
+        {"set-cookie", "id=42"},
+        {"x-request-id", "abc"},
+    };
+    Fields expected = fields;
+    expected[2].first = "cache-control";
+
+    std::string first, second;
+    for (auto& field: fields) {
+        encoder.encode(field.first, field.second, first);
+    }
+    for (auto& field: fields) {
+        encoder.encode(field.first, field.second, second);
+    }
+    EXPECT_EQ(expected, decode(decoder, first));
+    EXPECT_EQ(expected, decode(decoder, second));
+    // Indexed the second time, but for the fields that are not indexed.
+    EXPECT_LT(second.size(), first.size() / 2);
+
+    // The peer shrinks the table: it is announced, and emptied.
+    encoder.set_max_table_size(0);
+    std::string third;
+    for (auto& field: fields) {
+        encoder.encode(field.first, field.second, third);
+    }
+    EXPECT_EQ(0x20, third[0]);
+    EXPECT_EQ(expected, decode(decoder, third));
+}
+
+TEST(Hpack, RejectsMalformedBlocks) {
+    EXPECT_TRUE(malformed(from_hex("80")));           // index 0
+    EXPECT_TRUE(malformed(from_hex("be")));           // index 62, with an empty table
+    EXPECT_TRUE(malformed(from_hex("ff")));           // truncated integer
+    EXPECT_TRUE(malformed(from_hex("4003 6162")));    // truncated name
+    EXPECT_TRUE(malformed(from_hex("82 20")));        // table size update after a field
+    EXPECT_TRUE(malformed(from_hex("3fe2 1f")));      // table size over 4096
+    EXPECT_TRUE(malformed(from_hex("4082 f1e2 00"))); // bad Huffman padding
+    EXPECT_FALSE(malformed(from_hex("20 82")));
+}
+
+// A block of references to a large table entry decodes to far more than
+// itself. Decoding stops at the limit, before the entry is copied again.
+TEST(Hpack, LimitsDecodedSize) {
+    const size_t limit = 64 * 1024;
+    // "a", with a 4000-byte value, added to the table.
+    const std::string literal = from_hex("4001 617f a11e") + std::string(4000, 'x');
+    const char reference = char(0xbe); // index 62, which is that field
+
+    std::string block = literal;
+    block.append(limit - block.size(), reference);
+    w::HpackDecoder decoder;
+    w::util::Arena arena;
+    w::Headers headers;
+    EXPECT_EQ(w::HpackDecoder::Result::TooLarge, decoder.decode(block, arena, headers, limit));
+    size_t decoded = 0;
+    for (auto& field: headers) {
+        decoded += field.name.size() + field.value.size() + 32;
+    }
+    EXPECT_LE(decoded, limit);
+    EXPECT_LT(arena.bytes_reserved(), 2 * limit);
+
+    // The same fields, fewer of them, fit.
+    std::string small = literal + std::string(14, reference);
+    w::HpackDecoder other;
+    w::util::Arena other_arena;
+    w::Headers fields;
+    EXPECT_EQ(w::HpackDecoder::Result::Ok, other.decode(small, other_arena, fields, limit));
+    EXPECT_EQ(15u, fields.size());
+}
@@ -0,0 +1,81 @@
+#include "wayward/http.hpp"
+
+#include <gtest/gtest.h>
+
+namespace w = wayward;
+
+namespace {
+    struct Pieces : w::IBodyProducer {
+        State produce(std::string& out) override {
+            out = "piece";
+            return Done;
+        }
+    };
+}
+
+TEST(Http, SerializeHead) {
+    w::Response res;
+    res.status = w::Status::NotFound;
+    res.set_header("Content-Type", "text/plain");
+    res.body = "missing";
+    std::string head;
+    w::serialize_head(res, head);
+    EXPECT_EQ("HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 7\r\n\r\n", head);
+    EXPECT_EQ(head.size(), w::head_size(res));
+
+    std::string raw(w::head_size(res), '\0');
+    EXPECT_EQ(&raw[0] + raw.size(), w::serialize_head(res, &raw[0]));
+    EXPECT_EQ(head, raw);
+}
+
+TEST(Http, SerializeStreamedHead) {
+    w::Response res;
+    res.set_header("Content-Type", "text/csv");
+    res.body_producer = std::make_shared<Pieces>();
+    std::string head;
+    w::serialize_head(res, head);
+    EXPECT_EQ("HTTP/1.1 200 OK\r\nContent-Type: text/csv\r\nTransfer-Encoding: chunked\r\n\r\n", head);
+    EXPECT_EQ(head.size(), w::head_size(res));
+}
+
+TEST(Http, SerializeHeadOwnsFraming) {
+    w::Response res;
+    res.set_header("Content-Length", "100");
+    res.set_header("Transfer-Encoding", "chunked");
+    res.set_header("X-Other", "1");
+    res.body = "short";
+    std::string head;
+    w::serialize_head(res, head);
+    EXPECT_EQ("HTTP/1.1 200 OK\r\nX-Other: 1\r\nContent-Length: 5\r\n\r\n", head);
+    EXPECT_EQ(head.size(), w::head_size(res));
+
+    res.body_producer = std::make_shared<Pieces>();
+    head.clear();
+    w::serialize_head(res, head);
+    EXPECT_EQ("HTTP/1.1 200 OK\r\nX-Other: 1\r\nTransfer-Encoding: chunked\r\n\r\n", head);
+}
+
+TEST(Http, SerializeDeclaredLength) {
+    w::Response res;
+    res.body_producer = std::make_shared<Pieces>();
+    res.content_length = 5;
+    std::string head;
+    w::serialize_head(res, head);
+    EXPECT_EQ("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n", head);
+
+    // A body left out, as from a HEAD request.
+    res.body_producer.reset();
+    res.content_length = 1234;
+    head.clear();
+    w::serialize_head(res, head);
+    EXPECT_EQ("HTTP/1.1 200 OK\r\nContent-Length: 1234\r\n\r\n", head);
+
+    res.status = w::Status::NotModified;
+    head.clear();
+    w::serialize_head(res, head);
+    EXPECT_EQ("HTTP/1.1 304 Not Modified\r\nContent-Length: 1234\r\n\r\n", head);
+    res.content_length = w::Response::unknown_length;
+    head.clear();
+    w::serialize_head(res, head);
+    EXPECT_EQ("HTTP/1.1 304 Not Modified\r\n\r\n", head);
+}
@@ -0,0 +1,78 @@
+#include "wayward/metrics.hpp"
+#include "wayward/app.hpp"
+#include "wayward/server.hpp"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace w = wayward;
+
+TEST(LatencyHistogram, Buckets) {
+    w::LatencyHistogram histogram;
+    histogram.record(50000);       // 50 us
+    histogram.record(100000);      // 100 us, the first bound is exclusive
+    histogram.record(3000000);     // 3 ms
+    histogram.record(60000000000); // 60 s
+    auto snapshot = histogram.snapshot();
+    EXPECT_EQ(4u, snapshot.count);
+    EXPECT_EQ(1u, snapshot.buckets[0]);
+    EXPECT_EQ(1u, snapshot.buckets[1]);
+    EXPECT_EQ(1u, snapshot.buckets[5]);
+    EXPECT_EQ(1u, snapshot.buckets[w::LatencyHistogram::num_buckets - 1]);
+    EXPECT_EQ(60003150000u, snapshot.sum_ns);
+}
+
+TEST(LatencyHistogram, ConcurrentRecording) {
+    w::LatencyHistogram histogram;
+    // A shard per hardware thread, so every event loop can have its own.
+    EXPECT_EQ(std::max(1u, std::thread::hardware_concurrency()), histogram.num_shards());
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&histogram, i]() {
+            if (i % 2 == 0) {
+                // Like the server's loops; the others take turns.
+                w::LatencyHistogram::use_shard(size_t(i));
+            }
+            for (int j = 0; j < 10000; ++j) {
+                histogram.record(1000);
+            }
+        });
+    }
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    auto snapshot = histogram.snapshot();
+    EXPECT_EQ(40000u, snapshot.count);
+    EXPECT_EQ(40000u, snapshot.buckets[0]);
+    EXPECT_EQ(40000000u, snapshot.sum_ns);
+}
+
+TEST(Metrics, Prometheus) {
+    w::Server server;
+    w::App app;
+    app.get("/users/:id", [](w::Request&, w::Response&) {});
+    app.get("/metrics", w::prometheus_metrics(server, app));
+
+    w::Request req;
+    req.method = w::Method::Get;
+    req.url = "/users/7";
+    w::Response res;
+    app.respond(req, res);
+    ASSERT_NE(nullptr, res.latency);
+    res.latency->record(2000000);
+
+    req.url = "/metrics";
+    w::Response metrics;
+    app.respond(req, metrics);
+    EXPECT_EQ("text/plain; version=0.0.4", metrics.header("Content-Type"));
+    auto& body = metrics.body;
+    EXPECT_NE(std::string::npos, body.find("# TYPE wayward_connections_active gauge\nwayward_connections_active 0\n"));
+    EXPECT_NE(std::string::npos, body.find("wayward_request_duration_seconds_bucket{method=\"GET\",route=\"/users/:id\",le=\"0.001\"} 0\n"));
+    EXPECT_NE(std::string::npos, body.find("wayward_request_duration_seconds_bucket{method=\"GET\",route=\"/users/:id\",le=\"0.0025\"} 1\n"));
+    EXPECT_NE(std::string::npos, body.find("wayward_request_duration_seconds_bucket{method=\"GET\",route=\"/users/:id\",le=\"+Inf\"} 1\n"));
+    EXPECT_NE(std::string::npos, body.find("wayward_request_duration_seconds_sum{method=\"GET\",route=\"/users/:id\"} 0.002\n"));
+    EXPECT_NE(std::string::npos, body.find("wayward_request_duration_seconds_count{method=\"GET\",route=\"/metrics\"} 0\n"));
+}
@@ -0,0 +1,93 @@
+#include "wayward/app.hpp"
+#include "wayward/middleware.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace w = wayward;
+
+namespace {
+    // Records its name before and after the rest of the chain.
+    struct Trace {
+        std::string* log;
+        char name;
+
+        template <class Next>
+        void operator()(w::Request&, w::Response&, Next next) const {
+            *log += name;
+            next();
+            *log += char(name - 'a' + 'A');
+        }
+    };
+}
+
+TEST(Middleware, RunsInOrderAroundTheHandler) {
+    std::string log;
+    auto handler = w::chain(Trace{&log, 'a'}, Trace{&log, 'b'}, Trace{&log, 'c'})([&](w::Request&, w::Response&) {
+        log += '-';
+    });
+    w::Request req;
+    w::Response res;
+    handler(req, res);
+    EXPECT_EQ("abc-CBA", log);
+}
+
+TEST(Middleware, ShortCircuits) {
+    std::string log;
+    auto require_token = [](w::Request& req, w::Response& res, auto next) {
+        if (req.header(w::HeaderId::Authorization).empty()) {
+            res.status = w::Status::Unauthorized;
+            return;
+        }
+        next();
+    };
+    auto handler = w::chain(Trace{&log, 'a'}, require_token, Trace{&log, 'b'})([&](w::Request&, w::Response& res) {
+        w::plain_text(res, "secret");
+    });
+
+    w::Request req;
+    w::Response res;
+    handler(req, res);
+    EXPECT_EQ(w::Status::Unauthorized, res.status);
+    EXPECT_EQ("", res.body);
+    EXPECT_EQ("aA", log);
+
+    log.clear();
+    req.headers = {{"Authorization", "Bearer x"}};
+    w::Response authorized;
+    handler(req, authorized);
+    EXPECT_EQ(w::Status::OK, authorized.status);
+    EXPECT_EQ("secret", authorized.body);
+    EXPECT_EQ("abBA", log);
+}
+
+TEST(Middleware, ChainsAreReusedAndExtended) {
+    auto tag = [](w::Request&, w::Response& res, auto next) {
+        next();
+        res.set_header("X-Tag", "api");
+    };
+    auto count = [](w::Request&, w::Response& res, auto next) {
+        next();
+        res.body += "!";
+    };
+    auto api = w::chain(tag);
+    auto loud = api.then(count);
+
+    w::App app;
+    app.get("/a", api([](w::Request&, w::Response& res) { w::plain_text(res, "a"); }));
+    app.get("/b", loud([](w::Request&, w::Response& res) { w::plain_text(res, "b"); }));
+
+    w::Request req;
+    req.url = "/b";
+    w::Response res;
+    app.respond(req, res);
+    EXPECT_EQ("b!", res.body);
+    EXPECT_EQ("api", res.header("X-Tag"));
+
+    req.url = "/a";
+    w::Response other;
+    app.respond(req, other);
+    EXPECT_EQ("a", other.body);
+    EXPECT_EQ("api", other.header("X-Tag"));
+}
@@ -0,0 +1,231 @@
+#include "wayward/response_cache.hpp"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace w = wayward;
+
+namespace {
+    // Answers with the number of requests it has seen, and the headers the
+    // test asks for.
+    struct Counter : w::IRequestResponder {
+        std::atomic<int> calls{0};
+        w::Headers headers;
+
+        void respond(w::Request& req, w::Response& res) override {
+            int n = ++calls;
+            for (auto& field: headers) {
+                res.set_header(field.name, field.value);
+            }
+            res.body = std::to_string(n);
+        }
+    };
+
+    w::Request get(std::string_view url, w::Headers headers = {}) {
+        w::Request req;
+        req.url = url;
+        req.headers = std::move(headers);
+        return req;
+    }
+
+    std::string_view body(const w::Response& res) {
+        return res.shared_owner ? res.shared_body : std::string_view(res.body);
+    }
+
+    std::string fetch(w::ResponseCache& cache, w::Request req) {
+        w::Response res;
+        cache.respond(req, res);
+        return std::string(body(res));
+    }
+}
+
+TEST(ResponseCache, ServesFreshResponsesFromMemory) {
+    Counter app;
+    app.headers = {{"Cache-Control", "public, max-age=60"}, {"Content-Type", "text/plain"}};
+    w::ResponseCache cache(app);
+
+    w::Response first, second;
+    auto req = get("/a");
+    cache.respond(req, first);
+    cache.respond(req, second);
+    EXPECT_EQ(1, app.calls.load());
+    EXPECT_EQ("1", body(second));
+    EXPECT_TRUE(second.shared_owner != nullptr);
+    EXPECT_EQ("text/plain", second.header(w::HeaderId::ContentType));
+    EXPECT_EQ("2", fetch(cache, get("/b")));
+    EXPECT_EQ("1", fetch(cache, get("/a")));
+
+    auto stats = cache.stats();
+    EXPECT_EQ(2u, stats.hits);
+    EXPECT_EQ(2u, stats.misses);
+    EXPECT_EQ(2u, stats.stored);
+}
+
+TEST(ResponseCache, HonoursCacheControl) {
+    Counter app;
+    w::ResponseCache cache(app);
+    // Neither max-age nor a default TTL.
+    EXPECT_EQ("1", fetch(cache, get("/")));
+    EXPECT_EQ("2", fetch(cache, get("/")));
+
+    for (auto value: {"no-store", "private, max-age=60", "no-cache", "max-age=0"}) {
+        app.headers = {{"Cache-Control", value}};
+        int calls = app.calls;
+        fetch(cache, get("/"));
+        fetch(cache, get("/"));
+        EXPECT_EQ(calls + 2, app.calls.load()) << value;
+    }
+
+    app.headers = {{"Cache-Control", "max-age=60"}, {"Set-Cookie", "id=1"}};
+    int calls = app.calls;
+    fetch(cache, get("/cookie"));
+    fetch(cache, get("/cookie"));
+    EXPECT_EQ(calls + 2, app.calls.load());
+
+    app.headers = {{"Cache-Control", "max-age=60"}};
+    EXPECT_EQ("13", fetch(cache, get("/fresh")));
+    EXPECT_EQ("13", fetch(cache, get("/fresh")));
+    // The request may ask for a new response, or to not use the cache.
+    EXPECT_EQ("14", fetch(cache, get("/fresh", {{"Cache-Control", "no-cache"}})));
+    EXPECT_EQ("14", fetch(cache, get("/fresh")));
+    EXPECT_EQ("15", fetch(cache, get("/fresh", {{"Cache-Control", "no-store"}})));
+    EXPECT_EQ("16", fetch(cache, get("/fresh", {{"Authorization", "Basic eDp5"}})));
+
+    auto post = get("/fresh");
+    post.method = w::Method::Post;
+    EXPECT_EQ("17", fetch(cache, post));
+}
+
+TEST(ResponseCache, DefaultTtlExpires) {
+    Counter app;
+    w::ResponseCache cache(app);
+    cache.default_ttl_ms(50);
+    EXPECT_EQ("1", fetch(cache, get("/")));
+    EXPECT_EQ("1", fetch(cache, get("/")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    EXPECT_EQ("2", fetch(cache, get("/")));
+}
+
+TEST(ResponseCache, KeyedByVaryHeaders) {
+    Counter app;
+    app.headers = {{"Cache-Control", "max-age=60"}, {"Vary", "Accept-Encoding, X-Tenant"}};
+    w::ResponseCache cache(app);
+    EXPECT_EQ("1", fetch(cache, get("/", {{"Accept-Encoding", "gzip"}})));
+    EXPECT_EQ("1", fetch(cache, get("/", {{"accept-encoding", "gzip"}})));
+    EXPECT_EQ("2", fetch(cache, get("/", {{"Accept-Encoding", "br"}})));
+    EXPECT_EQ("3", fetch(cache, get("/", {{"Accept-Encoding", "gzip"}, {"X-Tenant", "b"}})));
+    EXPECT_EQ("2", fetch(cache, get("/", {{"Accept-Encoding", "br"}})));
+    EXPECT_EQ("4", fetch(cache, get("/")));
+
+    app.headers = {{"Cache-Control", "max-age=60"}, {"Vary", "*"}};
+    EXPECT_EQ("5", fetch(cache, get("/star")));
+    EXPECT_EQ("6", fetch(cache, get("/star")));
+}
+
+TEST(ResponseCache, EvictsLeastRecentlyUsed) {
+    Counter app;
+    app.headers = {{"Cache-Control", "max-age=60"}};
+    w::ResponseCache cache(app);
+    cache.shards(1).cache_size(3 * 200);
+    fetch(cache, get("/1"));
+    fetch(cache, get("/2"));
+    fetch(cache, get("/3"));
+    fetch(cache, get("/1"));
+    fetch(cache, get("/4"));
+    EXPECT_EQ(1u, cache.stats().evicted);
+    EXPECT_EQ("1", fetch(cache, get("/1")));
+    EXPECT_EQ("5", fetch(cache, get("/2")));
+    EXPECT_LE(cache.stats().bytes, 3u * 200);
+}
+
+TEST(ResponseCache, CoalescesMisses) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool entered = false, release = false;
+    struct Slow : w::IRequestResponder {
+        std::function<void()> wait;
+        std::atomic<int> calls{0};
+        void respond(w::Request&, w::Response& res) override {
+            ++calls;
+            wait();
+            res.set_header("Cache-Control", "max-age=60");
+            res.body = "slow";
+        }
+    } app;
+    app.wait = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        entered = true;
+        cv.notify_all();
+        cv.wait(lock, [&]() { return release; });
+    };
+    w::ResponseCache cache(app);
+
+    std::thread leader([&]() {
+        EXPECT_EQ("slow", fetch(cache, get("/slow")));
+    });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return entered; });
+    }
+    // Waits for the leader's response, which the server would complete.
+    auto req = get("/slow");
+    w::Response res;
+    cache.respond(req, res);
+    EXPECT_TRUE(req.deferred);
+    EXPECT_EQ(1u, cache.stats().coalesced);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        release = true;
+    }
+    cv.notify_all();
+    leader.join();
+    EXPECT_EQ(1, app.calls.load());
+}
+
+TEST(ResponseCache, CachesDeferredResponses) {
+    struct Deferring : w::IRequestResponder {
+        int calls = 0;
+        void respond(w::Request& req, w::Response&) override {
+            ++calls;
+            req.defer();
+        }
+    } app;
+    w::ResponseCache cache(app);
+
+    auto leader = get("/deferred");
+    w::Response res;
+    cache.respond(leader, res);
+    EXPECT_TRUE(leader.deferred);
+    // Waits for the leader's response, as long as it takes.
+    auto waiter = get("/deferred");
+    cache.respond(waiter, res);
+    EXPECT_TRUE(waiter.deferred);
+    EXPECT_EQ(1u, cache.stats().coalesced);
+
+    // The server passes the completed response on before sending it.
+    w::Response completed;
+    completed.set_header("Cache-Control", "max-age=60");
+    completed.body = "late";
+    cache.completed(leader, completed);
+    EXPECT_EQ("late", fetch(cache, get("/deferred")));
+    EXPECT_EQ(1, app.calls);
+    EXPECT_EQ(1u, cache.stats().stored);
+
+    // Requests coalesce while a deferred response is pending, even one that
+    // then turns out not to be cacheable.
+    auto other = get("/other");
+    cache.respond(other, res);
+    auto second = get("/other");
+    cache.respond(second, res);
+    EXPECT_EQ(2u, cache.stats().coalesced);
+    w::Response uncacheable;
+    cache.completed(other, uncacheable);
+    fetch(cache, get("/other"));
+    EXPECT_EQ(3, app.calls);
+}
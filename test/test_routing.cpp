@@ -5,11 +5,18 @@
 namespace w = wayward;
 
 namespace {
-    w::Request make_request(std::string path, std::map<std::string, std::string> headers = {}, std::string body = "") {
+    // Request only holds views, so the arguments must outlive it (string literals).
+    w::Request make_request(std::string_view path, w::Headers headers = {}, std::string_view body = "") {
         w::Request req;
-        req.url = std::move(path);
+        req.url = path;
         req.headers = std::move(headers);
-        req.body = std::move(body);
+        req.body = body;
+        return req;
+    }
+
+    w::Request make_request(w::Method method, std::string_view path) {
+        w::Request req = make_request(path);
+        req.method = method;
         return req;
     }
 
@@ -47,4 +54,175 @@ TEST(Routing, Basic) {
     respond(app, make_request("/lol"));
     EXPECT_FALSE(get_root);
     EXPECT_FALSE(get_foo);
-}
\ No newline at end of file
+}
+TEST(Routing, NotFound) {
+    w::App app;
+    app.get("/foo", [&](auto& req, auto& res) {});
+    EXPECT_EQ(w::Status::NotFound, respond(app, make_request("/bar")).status);
+    EXPECT_EQ(w::Status::NotFound, respond(app, make_request("/foo/bar")).status);
+    EXPECT_EQ(w::Status::NotFound, respond(app, make_request("/fo")).status);
+}
+
+TEST(Routing, SharedPrefixes) {
+    w::App app;
+    std::string matched;
+    for (const char* path: {"/foobar", "/foo", "/fo", "/foobaz", "/f"}) {
+        app.get(path, [&matched, path](auto& req, auto& res) {
+            matched = path;
+        });
+    }
+    for (const char* path: {"/foobar", "/foo", "/fo", "/foobaz", "/f"}) {
+        respond(app, make_request(path));
+        EXPECT_EQ(path, matched);
+    }
+    EXPECT_EQ(w::Status::NotFound, respond(app, make_request("/fooba")).status);
+}
+
+TEST(Routing, Captures) {
+    w::App app;
+    std::string id, post;
+    app.get("/users/:id", [&](auto& req, auto& res) {
+        id = std::string(req.param("id"));
+    });
+    app.get("/users/:id/posts/:post", [&](auto& req, auto& res) {
+        id = std::string(req.param("id"));
+        post = std::string(req.param("post"));
+    });
+    respond(app, make_request("/users/123"));
+    EXPECT_EQ("123", id);
+    respond(app, make_request("/users/456/posts/hello"));
+    EXPECT_EQ("456", id);
+    EXPECT_EQ("hello", post);
+    EXPECT_EQ(w::Status::NotFound, respond(app, make_request("/users/")).status);
+}
+
+TEST(Routing, StaticBeforeCapture) {
+    w::App app;
+    bool me = false, other = false;
+    app.get("/users/:id", [&](auto& req, auto& res) {
+        other = true;
+    });
+    app.get("/users/me", [&](auto& req, auto& res) {
+        me = true;
+    });
+    respond(app, make_request("/users/me"));
+    EXPECT_TRUE(me);
+    EXPECT_FALSE(other);
+    me = false;
+    respond(app, make_request("/users/meh"));
+    EXPECT_FALSE(me);
+    EXPECT_TRUE(other);
+}
+
+TEST(Routing, Wildcard) {
+    w::App app;
+    std::string path;
+    bool index = false;
+    app.get("/static/*path", [&](auto& req, auto& res) {
+        path = std::string(req.param("path"));
+    });
+    app.get("/static/index.html", [&](auto& req, auto& res) {
+        index = true;
+    });
+    respond(app, make_request("/static/css/site.css"));
+    EXPECT_EQ("css/site.css", path);
+    respond(app, make_request("/static/"));
+    EXPECT_EQ("", path);
+    respond(app, make_request("/static/index.html"));
+    EXPECT_TRUE(index);
+}
+
+TEST(Routing, IgnoresQueryString) {
+    w::App app;
+    bool called = false;
+    app.get("/search", [&](auto& req, auto& res) {
+        called = true;
+    });
+    respond(app, make_request("/search?q=wayward"));
+    EXPECT_TRUE(called);
+}
+
+TEST(Routing, Methods) {
+    w::App app;
+    std::string called;
+    app.get("/items/:id", [&](auto& req, auto& res) { called = "get"; });
+    app.post("/items/:id", [&](auto& req, auto& res) { called = "post"; });
+    app.put("/items/:id", [&](auto& req, auto& res) { called = "put"; });
+    app.del("/items/:id", [&](auto& req, auto& res) { called = "delete"; });
+    respond(app, make_request(w::Method::Get, "/items/1"));
+    EXPECT_EQ("get", called);
+    respond(app, make_request(w::Method::Post, "/items/1"));
+    EXPECT_EQ("post", called);
+    respond(app, make_request(w::Method::Put, "/items/1"));
+    EXPECT_EQ("put", called);
+    respond(app, make_request(w::Method::Delete, "/items/1"));
+    EXPECT_EQ("delete", called);
+    auto refused = respond(app, make_request(w::Method::Patch, "/items/1"));
+    EXPECT_EQ(w::Status::MethodNotAllowed, refused.status);
+    EXPECT_EQ("DELETE, GET, HEAD, POST, PUT", refused.header("Allow"));
+
+    app.post("/form", [&](auto& req, auto& res) { called = "form"; });
+    refused = respond(app, make_request(w::Method::Get, "/form"));
+    EXPECT_EQ(w::Status::MethodNotAllowed, refused.status);
+    EXPECT_EQ("POST", refused.header("Allow"));
+
+    // Methods come from every route that fits the path, static or not.
+    app.get("/items/new", [&](auto& req, auto& res) { called = "new"; });
+    app.route(w::Method::Patch, "/items/*rest", [&](auto& req, auto& res) { called = "patch"; });
+    refused = respond(app, make_request(w::Method::Options, "/items/new"));
+    EXPECT_EQ(w::Status::MethodNotAllowed, refused.status);
+    EXPECT_EQ("DELETE, GET, HEAD, POST, PUT, PATCH", refused.header("Allow"));
+}
+
+TEST(Routing, HeadFallsBackToGet) {
+    w::App app;
+    std::string called;
+    app.get("/items/:id", [&](auto& req, auto& res) { called = "get " + std::string(req.param("id")); });
+    app.get("/files", [&](auto& req, auto& res) { called = "get"; });
+    app.route(w::Method::Head, "/files", [&](auto& req, auto& res) { called = "head"; });
+    EXPECT_EQ(w::Status::OK, respond(app, make_request(w::Method::Head, "/items/7")).status);
+    EXPECT_EQ("get 7", called);
+    respond(app, make_request(w::Method::Head, "/files"));
+    EXPECT_EQ("head", called);
+    EXPECT_EQ(w::Status::NotFound, respond(app, make_request(w::Method::Head, "/missing")).status);
+}
+
+TEST(Routing, Conflicts) {
+    w::App app;
+    app.get("/users/:id", [](auto& req, auto& res) {});
+    EXPECT_THROW(app.get("/users/:name/posts", [](auto& req, auto& res) {}), std::invalid_argument);
+    EXPECT_THROW(app.get("/users/:id", [](auto& req, auto& res) {}), std::invalid_argument);
+    EXPECT_THROW(app.get("/files/*path/more", [](auto& req, auto& res) {}), std::invalid_argument);
+}
+
+TEST(Routing, StreamingBody) {
+    struct Collect : w::IBodyConsumer {
+        std::string data;
+        bool consume(w::Request&, std::string_view piece) override {
+            data += piece;
+            return true;
+        }
+    };
+    w::App app;
+    std::string uploaded;
+    app.route(w::Method::Post, "/upload/:name", [](w::Request& req) {
+        EXPECT_EQ("a.txt", req.param("name"));
+        return std::make_shared<Collect>();
+    }, [&](w::Request& req, w::Response& res) {
+        uploaded = static_cast<Collect&>(*req.body_consumer).data;
+    });
+    app.post("/form", [](auto& req, auto& res) {});
+
+    w::Request req = make_request(w::Method::Post, "/upload/a.txt");
+    app.begin(req);
+    ASSERT_TRUE(req.body_consumer != nullptr);
+    req.body_consumer->consume(req, "hello ");
+    req.body_consumer->consume(req, "world");
+    respond(app, req);
+    EXPECT_EQ("hello world", uploaded);
+
+    // Routes without a consumer keep buffering.
+    w::Request form = make_request(w::Method::Post, "/form");
+    app.begin(form);
+    EXPECT_TRUE(form.body_consumer == nullptr);
+}
@@ -0,0 +1,1746 @@
+#include "wayward/app.hpp"
+#include "wayward/hpack.hpp"
+#include "wayward/proxy.hpp"
+#include "wayward/server.hpp"
+#include "wayward/sse.hpp"
+#include "wayward/websocket.hpp"
+#include "config.h"
+
+#if defined(ASIO_FROM_BOOST)
+#include <boost/asio.hpp>
+namespace asio = boost::asio;
+using asio_error_code = boost::system::error_code;
+#else
+#include <asio.hpp>
+using asio_error_code = std::error_code;
+#endif
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <sys/resource.h> // setrlimit
+#include <unistd.h> // getpid
+#endif
+
+namespace w = wayward;
+using asio::ip::tcp;
+
+namespace {
+    // A listening socket on a free port, for Server::listen_fd().
+    struct Listener {
+        asio::io_service service;
+        tcp::acceptor acceptor{service, tcp::endpoint(asio::ip::address_v4::loopback(), 0)};
+        tcp::endpoint endpoint = acceptor.local_endpoint();
+
+        int release() {
+            return int(acceptor.release());
+        }
+    };
+
+    struct Connection {
+        asio::io_service service;
+        tcp::socket socket{service};
+
+        explicit Connection(const tcp::endpoint& endpoint) {
+            socket.connect(endpoint);
+        }
+
+        // Received, and yet to be returned: responses may arrive together.
+        std::string input;
+
+        void send(const std::string& data) {
+            asio::write(socket, asio::buffer(data));
+        }
+
+        // Reads at least `size` bytes into `input`. Returns false at EOF.
+        bool fill(size_t size) {
+            while (input.size() < size) {
+                char more[16 * 1024];
+                asio_error_code ec;
+                size_t len = socket.read_some(asio::buffer(more), ec);
+                if (ec) {
+                    return false;
+                }
+                input.append(more, len);
+            }
+            return true;
+        }
+
+        // Reads `size` bytes, after what `input` holds.
+        void read(void* data, size_t size) {
+            if (!fill(size)) {
+                throw std::runtime_error("connection closed");
+            }
+            std::memcpy(data, input.data(), size);
+            input.erase(0, size);
+        }
+
+        std::string take(size_t size) {
+            std::string data(size, '\0');
+            if (size > 0) {
+                read(&data[0], size);
+            }
+            return data;
+        }
+
+        // Reads through the first occurrence of `delimiter`.
+        std::string take_until(const std::string& delimiter) {
+            size_t at;
+            while ((at = input.find(delimiter)) == std::string::npos) {
+                if (!fill(input.size() + 1)) {
+                    throw std::runtime_error("connection closed");
+                }
+            }
+            return take(at + delimiter.size());
+        }
+
+        // Reads one response, with a Content-Length.
+        std::string receive() {
+            std::string head = take_until("\r\n\r\n");
+            size_t at = head.find("Content-Length: ");
+            size_t length = at != std::string::npos ? std::stoul(head.substr(at + 16)) : 0;
+            return head + take(length);
+        }
+
+        // Reads one response, with a Content-Length or chunked, and returns
+        // its head followed by the body, without the chunk framing. Returns
+        // what it got if the connection closes before the last chunk.
+        std::string receive_any() {
+            std::string head = take_until("\r\n\r\n");
+            if (head.find("Transfer-Encoding: chunked\r\n") == std::string::npos) {
+                size_t at = head.find("Content-Length: ");
+                size_t length = at != std::string::npos ? std::stoul(head.substr(at + 16)) : 0;
+                return head + take(length);
+            }
+            std::string result = head;
+            for (;;) {
+                size_t line;
+                while ((line = input.find("\r\n")) == std::string::npos) {
+                    if (!fill(input.size() + 1)) {
+                        return result;
+                    }
+                }
+                size_t size = std::stoul(input, nullptr, 16);
+                if (!fill(line + 2 + size + 2)) {
+                    return result;
+                }
+                result.append(input, line + 2, size);
+                input.erase(0, line + 2 + size + 2);
+                if (size == 0) {
+                    return result;
+                }
+            }
+        }
+
+        bool closed() {
+            if (!input.empty()) {
+                return false;
+            }
+            char byte;
+            asio_error_code ec;
+            socket.read_some(asio::buffer(&byte, 1), ec);
+            return ec == asio::error::eof || ec == asio::error::connection_reset;
+        }
+    };
+
+    // A minimal HTTP/2 client, which leaves the frames it receives to the
+    // test, except for decoding header blocks.
+    struct Http2Connection : Connection {
+        enum FrameType : uint8_t { Data = 0, Headers = 1, Settings = 4, WindowUpdate = 8 };
+        static constexpr uint8_t end_stream = 0x1;
+        static constexpr uint8_t end_headers = 0x4;
+
+        struct Frame {
+            uint8_t type;
+            uint8_t flags;
+            uint32_t stream;
+            std::string payload;
+        };
+
+        w::HpackEncoder encoder;
+        w::HpackDecoder decoder;
+
+        using Connection::Connection;
+
+        static std::string u32(uint32_t n) {
+            return {char(n >> 24), char(n >> 16), char(n >> 8), char(n)};
+        }
+
+        void send_frame(uint8_t type, uint8_t flags, uint32_t stream, const std::string& payload) {
+            size_t size = payload.size();
+            std::string header = {char(size >> 16), char(size >> 8), char(size), char(type), char(flags)};
+            send(header + u32(stream) + payload);
+        }
+
+        // The connection preface, with (identifier, value) settings.
+        void start(const std::vector<std::pair<uint16_t, uint32_t>>& settings = {}) {
+            std::string payload;
+            for (auto& setting: settings) {
+                payload += std::string{char(setting.first >> 8), char(setting.first)} + u32(setting.second);
+            }
+            send("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+            send_frame(Settings, 0, 0, payload);
+        }
+
+        void get(uint32_t stream, const std::string& path) {
+            std::string block;
+            encoder.encode(":method", "GET", block);
+            encoder.encode(":scheme", "http", block);
+            encoder.encode(":path", path, block);
+            encoder.encode(":authority", "x", block);
+            send_frame(Headers, end_headers | end_stream, stream, block);
+        }
+
+        Frame receive_frame() {
+            unsigned char header[9];
+            read(header, sizeof(header));
+            Frame frame{header[3], header[4], uint32_t(header[5] & 0x7f) << 24 | uint32_t(header[6]) << 16 | uint32_t(header[7]) << 8 | header[8], std::string()};
+            frame.payload.resize(size_t(header[0]) << 16 | size_t(header[1]) << 8 | header[2]);
+            if (!frame.payload.empty()) {
+                read(&frame.payload[0], frame.payload.size());
+            }
+            return frame;
+        }
+
+        // Skips the frames for the connection, like SETTINGS.
+        Frame receive_stream_frame() {
+            for (;;) {
+                auto frame = receive_frame();
+                if (frame.stream != 0) {
+                    return frame;
+                }
+            }
+        }
+
+        std::string status(const Frame& headers) {
+            w::util::Arena arena;
+            w::Headers fields;
+            EXPECT_EQ(w::HpackDecoder::Result::Ok, decoder.decode(headers.payload, arena, fields, 64 * 1024));
+            return std::string(fields.get(":status"));
+        }
+    };
+
+    // A minimal WebSocket client, which masks its frames with a fixed key.
+    struct WebSocketConnection : Connection {
+        static constexpr unsigned char key[4] = {0x12, 0x34, 0x56, 0x78};
+
+        struct Frame {
+            uint8_t opcode;
+            bool fin;
+            bool compressed;
+            std::string payload;
+        };
+
+        // Returns the head of the response.
+        std::string handshake(const std::string& path, const std::string& extensions = std::string()) {
+            std::string request = "GET " + path + " HTTP/1.1\r\nHost: x\r\nConnection: Upgrade\r\nUpgrade: websocket\r\n"
+                "Sec-WebSocket-Version: 13\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n";
+            if (!extensions.empty()) {
+                request += "Sec-WebSocket-Extensions: " + extensions + "\r\n";
+            }
+            send(request + "\r\n");
+            return receive();
+        }
+
+        using Connection::Connection;
+
+        void send_frame(uint8_t opcode, const std::string& payload, bool fin = true, bool compressed = false, bool masked = true) {
+            std::string frame = {char((fin ? 0x80 : 0) | (compressed ? 0x40 : 0) | opcode)};
+            char mask_bit = masked ? char(0x80) : 0;
+            if (payload.size() < 126) {
+                frame.push_back(char(mask_bit | char(payload.size())));
+            }
+            else if (payload.size() <= 0xffff) {
+                frame += {char(mask_bit | 126), char(payload.size() >> 8), char(payload.size())};
+            }
+            else {
+                frame.push_back(char(mask_bit | 127));
+                for (int i = 7; i >= 0; --i) {
+                    frame.push_back(char(uint64_t(payload.size()) >> (8 * i)));
+                }
+            }
+            std::string masked_payload = payload;
+            if (masked) {
+                frame.append(reinterpret_cast<const char*>(key), 4);
+                for (size_t i = 0; i < masked_payload.size(); ++i) {
+                    masked_payload[i] ^= char(key[i % 4]);
+                }
+            }
+            send(frame + masked_payload);
+        }
+
+        Frame receive_frame() {
+            unsigned char header[2];
+            read(header, sizeof(header));
+            Frame frame{uint8_t(header[0] & 0x0f), (header[0] & 0x80) != 0, (header[0] & 0x40) != 0, std::string()};
+            EXPECT_FALSE(header[1] & 0x80); // Servers do not mask.
+            size_t length = header[1] & 0x7f;
+            if (length >= 126) {
+                unsigned char extended[8];
+                size_t size = length == 126 ? 2 : 8;
+                read(extended, size);
+                length = 0;
+                for (size_t i = 0; i < size; ++i) {
+                    length = length << 8 | extended[i];
+                }
+            }
+            frame.payload.resize(length);
+            if (length > 0) {
+                read(&frame.payload[0], length);
+            }
+            return frame;
+        }
+
+        static uint16_t code(const Frame& close) {
+            return uint16_t(uint8_t(close.payload[0]) << 8 | uint8_t(close.payload[1]));
+        }
+    };
+    constexpr unsigned char WebSocketConnection::key[4];
+
+    // Echoes messages, and keeps the sockets it opens and the codes they
+    // close with for the test.
+    struct Echo : w::IWebSocketHandler {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<w::WebSocket> sockets;
+        std::vector<uint16_t> codes;
+
+        void opened(const w::WebSocket& socket) override {
+            std::lock_guard<std::mutex> lock(mutex);
+            sockets.push_back(socket);
+            cv.notify_all();
+        }
+
+        void message(const w::WebSocket& socket, std::string_view data, bool binary) override {
+            socket.send(std::string(data), binary);
+        }
+
+        void closed(uint16_t code) override {
+            std::lock_guard<std::mutex> lock(mutex);
+            codes.push_back(code);
+            cv.notify_all();
+        }
+
+        w::WebSocket wait_opened() {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return !sockets.empty(); });
+            return sockets.back();
+        }
+
+        uint16_t wait_closed() {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return !codes.empty(); });
+            return codes.back();
+        }
+    };
+
+    // Deferred requests, for the test to complete.
+    struct Deferred {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<w::ConnectionHandle> handles;
+
+        w::ConnectionHandle wait() {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return !handles.empty(); });
+            auto handle = handles.back();
+            handles.pop_back();
+            return handle;
+        }
+    };
+
+    void add_routes(w::App& app, Deferred& deferred, std::string name) {
+        app.get("/", [name](w::Request&, w::Response& res) {
+            w::plain_text(res, name);
+        });
+        app.get("/slow", [&deferred](w::Request& req, w::Response&) {
+            std::lock_guard<std::mutex> lock(deferred.mutex);
+            deferred.handles.push_back(req.defer());
+            deferred.cv.notify_all();
+        });
+    }
+
+    bool ends_with(const std::string& s, const std::string& suffix) {
+        return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    const std::string get = "GET / HTTP/1.1\r\nHost: x\r\n\r\n";
+    const std::string get_slow = "GET /slow HTTP/1.1\r\nHost: x\r\n\r\n";
+
+    // Runs every test with asio, and with io_uring (which falls back to
+    // asio where it is not available).
+    struct Server : ::testing::TestWithParam<bool> {};
+}
+
+TEST_P(Server, ExchangesLargeMessages) {
+    w::App app;
+    app.post("/echo", [](w::Request& req, w::Response& res) {
+        w::plain_text(res, std::string(req.body));
+    });
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    std::string body(1 << 20, 'x');
+    for (size_t i = 0; i < body.size(); i += 4093) {
+        body[i] = char('a' + i % 26);
+    }
+    Connection connection(listener.endpoint);
+    std::string request = "POST /echo HTTP/1.1\r\nHost: x\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    // Pipelined, so the second waits while the first is answered.
+    std::thread sender([&]() {
+        connection.send(request + request);
+    });
+    EXPECT_TRUE(ends_with(connection.receive(), body));
+    EXPECT_TRUE(ends_with(connection.receive(), body));
+    sender.join();
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, AnswersPipelinedRequestsInOrder) {
+    struct Waits : w::IBodyProducer {
+        bool first = true;
+        State produce(std::string& out) override {
+            if (first) {
+                first = false;
+                return Waiting;
+            }
+            out = "streamed";
+            return Done;
+        }
+    };
+    Deferred deferred;
+    w::App app;
+    app.get("/n/:i", [](w::Request& req, w::Response& res) {
+        w::plain_text(res, "n" + std::string(req.param("i")));
+    });
+    app.get("/slow/:i", [&deferred](w::Request& req, w::Response&) {
+        std::lock_guard<std::mutex> lock(deferred.mutex);
+        deferred.handles.push_back(req.defer());
+        deferred.cv.notify_all();
+    });
+    app.get("/stream", [&deferred](w::Request& req, w::Response& res) {
+        res.body_producer = std::make_shared<Waits>();
+        std::lock_guard<std::mutex> lock(deferred.mutex);
+        deferred.handles.push_back(req.connection);
+        deferred.cv.notify_all();
+    });
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+    auto request = [](const std::string& path) {
+        return "GET " + path + " HTTP/1.1\r\nHost: x\r\n\r\n";
+    };
+
+    // A deferred response holds back the ones after it, immediate or not.
+    Connection connection(listener.endpoint);
+    connection.send(request("/n/0") + request("/slow/1") + request("/n/2") + request("/slow/3") + request("/n/4"));
+    EXPECT_TRUE(ends_with(connection.receive(), "\r\n\r\nn0"));
+    for (int i: {1, 3}) {
+        w::Response res;
+        w::plain_text(res, "s" + std::to_string(i));
+        deferred.wait().complete(std::move(res));
+        EXPECT_TRUE(ends_with(connection.receive(), "\r\n\r\ns" + std::to_string(i)));
+        EXPECT_TRUE(ends_with(connection.receive(), "\r\n\r\nn" + std::to_string(i + 1)));
+    }
+    EXPECT_EQ(5u, server.metrics().requests);
+
+    // While a body waits, the responses after it queue up, until reading
+    // pauses; they then go out together once the body is complete.
+    Connection pipelined(listener.endpoint);
+    std::string requests = request("/stream");
+    for (int i = 0; i < 40; ++i) {
+        requests += request("/n/" + std::to_string(i));
+    }
+    pipelined.send(requests);
+    auto stream = deferred.wait();
+    while (server.metrics().requests < 46) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    pipelined.send(request("/n/40"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_EQ(46u, server.metrics().requests);
+    stream.resume_response();
+    EXPECT_TRUE(ends_with(pipelined.receive_any(), "\r\n\r\nstreamed"));
+    for (int i = 0; i <= 40; ++i) {
+        EXPECT_TRUE(ends_with(pipelined.receive(), "\r\n\r\nn" + std::to_string(i)));
+    }
+    EXPECT_EQ(47u, server.metrics().requests);
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, WritesResponsesAsSerialized) {
+    // A head larger than an arena chunk, and a body large enough to take
+    // several writes.
+    std::string body(1 << 20, 'x');
+    for (size_t i = 0; i < body.size(); i += 4093) {
+        body[i] = char('a' + i % 26);
+    }
+    auto shared = std::make_shared<std::string>(256 * 1024, 's');
+    w::App app;
+    app.get("/large", [&body](w::Request&, w::Response& res) {
+        for (int i = 0; i < 200; ++i) {
+            res.set_header("X-Field-" + std::to_string(i), std::string(20, char('a' + i % 26)));
+        }
+        res.body = body;
+    });
+    app.get("/empty", [](w::Request&, w::Response& res) {
+        res.status = w::Status::NoContent;
+        res.set_header("X-Small", "1");
+    });
+    app.get("/shared", [&shared](w::Request&, w::Response& res) {
+        res.shared_owner = shared;
+        res.shared_body = *shared;
+    });
+    app.get("/odd", [](w::Request&, w::Response& res) {
+        res.status = w::Status(299);
+        res.body = "ok";
+    });
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    std::string fields;
+    for (int i = 0; i < 200; ++i) {
+        fields += "X-Field-" + std::to_string(i) + ": " + std::string(20, char('a' + i % 26)) + "\r\n";
+    }
+    std::string large_head = "HTTP/1.1 200 OK\r\n" + fields + "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+    std::string expected = large_head + body
+        + "HTTP/1.1 204 No Content\r\nX-Small: 1\r\n\r\n"
+        + "HTTP/1.1 200 OK\r\nContent-Length: 262144\r\n\r\n" + *shared
+        + "HTTP/1.1 299 \r\nContent-Length: 2\r\n\r\nok"
+        + large_head + body
+        + large_head;
+    Connection connection(listener.endpoint);
+    std::string requests;
+    for (auto path: {"/large", "/empty", "/shared", "/odd", "/large"}) {
+        requests += "GET " + std::string(path) + " HTTP/1.1\r\nHost: x\r\n\r\n";
+    }
+    connection.send(requests + "HEAD /large HTTP/1.1\r\nHost: x\r\n\r\n");
+    auto received = connection.take(expected.size());
+    // Not EXPECT_EQ, which would print megabytes.
+    EXPECT_TRUE(received == expected);
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, StreamsRequestBodies) {
+    // Pauses reading after the first piece, until the test resumes it.
+    struct Upload : w::IBodyConsumer {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::string data;
+        w::ConnectionHandle paused;
+        bool pause = true;
+
+        bool consume(w::Request& req, std::string_view piece) override {
+            std::lock_guard<std::mutex> lock(mutex);
+            data += piece;
+            if (pause) {
+                pause = false;
+                paused = req.connection;
+                cv.notify_all();
+                return false;
+            }
+            return true;
+        }
+    };
+    auto upload = std::make_shared<Upload>();
+    w::App app;
+    app.post("/echo", [](w::Request& req, w::Response& res) {
+        w::plain_text(res, std::string(req.body));
+    });
+    app.route(w::Method::Post, "/upload", [upload](w::Request&) {
+        return upload;
+    }, [](w::Request& req, w::Response& res) {
+        auto& upload = static_cast<Upload&>(*req.body_consumer);
+        std::lock_guard<std::mutex> lock(upload.mutex);
+        w::plain_text(res, upload.data);
+    });
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).max_body_size(16).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    // Chunks are put together into the buffered body.
+    Connection connection(listener.endpoint);
+    connection.send("POST /echo HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "4\r\nchun\r\n3;ext=1\r\nked\r\n0\r\nTrailer: x\r\n\r\n");
+    EXPECT_TRUE(ends_with(connection.receive(), "\r\n\r\nchunked"));
+
+    // Bodies beyond max_body_size are refused, whether their length is
+    // declared or not, and the connection closes.
+    for (auto request: {"Content-Length: 17\r\n\r\n", "Transfer-Encoding: chunked\r\n\r\n11\r\n"}) {
+        Connection refused(listener.endpoint);
+        refused.send(std::string("POST /echo HTTP/1.1\r\nHost: x\r\n") + request + std::string(17, 'x'));
+        EXPECT_EQ(0u, refused.receive().find("HTTP/1.1 413 Payload Too Large\r\n"));
+        EXPECT_TRUE(refused.closed());
+    }
+
+    // A consumer is not limited, and holds back the rest of the body while
+    // it is paused.
+    connection.send("POST /upload HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nfirst\r\n");
+    w::ConnectionHandle paused;
+    {
+        std::unique_lock<std::mutex> lock(upload->mutex);
+        upload->cv.wait(lock, [&]() { return !upload->pause; });
+        paused = upload->paused;
+    }
+    std::string rest(100, 'r');
+    connection.send("64\r\n" + rest + "\r\n0\r\n\r\n");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    {
+        std::lock_guard<std::mutex> lock(upload->mutex);
+        EXPECT_EQ("first", upload->data);
+    }
+    paused.resume_body();
+    EXPECT_TRUE(ends_with(connection.receive(), "\r\n\r\nfirst" + rest));
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, IgnoresFramingFieldsOfHandlers) {
+    w::App app;
+    app.get("/", [](w::Request&, w::Response& res) {
+        w::plain_text(res, "short");
+        res.set_header("Content-Length", "100");
+        res.set_header("Transfer-Encoding", "chunked");
+    });
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).http2(true).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    Connection connection(listener.endpoint);
+    connection.send(get + get);
+    for (int i = 0; i < 2; ++i) {
+        auto response = connection.receive();
+        EXPECT_EQ(std::string::npos, response.find("Transfer-Encoding"));
+        EXPECT_EQ(response.find("Content-Length: "), response.rfind("Content-Length: "));
+        EXPECT_TRUE(ends_with(response, "Content-Length: 5\r\n\r\nshort"));
+    }
+
+    Http2Connection http2(listener.endpoint);
+    http2.start();
+    http2.get(1, "/");
+    auto headers = http2.receive_stream_frame();
+    w::util::Arena arena;
+    w::Headers fields;
+    EXPECT_EQ(w::HpackDecoder::Result::Ok, http2.decoder.decode(headers.payload, arena, fields, 64 * 1024));
+    size_t lengths = 0;
+    for (auto& field: fields) {
+        if (field.name == "content-length") {
+            ++lengths;
+            EXPECT_EQ("5", field.value);
+        }
+        EXPECT_NE("transfer-encoding", field.name);
+    }
+    EXPECT_EQ(1u, lengths);
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, StreamsToHttp10ClientsUntilTheConnectionCloses) {
+    struct Pieces : w::IBodyProducer {
+        int left = 3;
+        State produce(std::string& out) override {
+            out = "piece";
+            return --left > 0 ? More : Done;
+        }
+    };
+    w::App app;
+    app.get("/stream", [](w::Request&, w::Response& res) {
+        res.body_producer = std::make_shared<Pieces>();
+    });
+    app.get("/", [](w::Request&, w::Response& res) {
+        w::plain_text(res, "one");
+    });
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    // Not chunked, so the request pipelined after it goes unanswered.
+    Connection connection(listener.endpoint);
+    connection.send("GET /stream HTTP/1.0\r\nConnection: keep-alive\r\n\r\nGET / HTTP/1.0\r\n\r\n");
+    while (connection.fill(connection.input.size() + 1)) {
+    }
+    auto& response = connection.input;
+    EXPECT_EQ(0u, response.find("HTTP/1.1 200 OK\r\n"));
+    EXPECT_EQ(std::string::npos, response.find("Transfer-Encoding"));
+    EXPECT_NE(std::string::npos, response.find("Connection: close\r\n"));
+    EXPECT_TRUE(ends_with(response, "\r\n\r\npiecepiecepiece")) << response;
+
+    // HTTP/1.1 clients still get chunks, and keep the connection.
+    Connection chunked(listener.endpoint);
+    chunked.send("GET /stream HTTP/1.1\r\nHost: x\r\n\r\n" + get);
+    auto streamed = chunked.receive_any();
+    EXPECT_NE(std::string::npos, streamed.find("Transfer-Encoding: chunked\r\n"));
+    EXPECT_TRUE(ends_with(streamed, "\r\n\r\npiecepiecepiece"));
+    EXPECT_TRUE(ends_with(chunked.receive(), "one"));
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, StreamsBodiesOfKnownLength) {
+    struct Pieces : w::IBodyProducer {
+        int left = 3;
+        State produce(std::string& out) override {
+            out = "piece";
+            return --left > 0 ? More : Done;
+        }
+    };
+    w::App app;
+    app.get("/stream", [](w::Request&, w::Response& res) {
+        res.body_producer = std::make_shared<Pieces>();
+        res.content_length = 15;
+    });
+    app.get("/short", [](w::Request&, w::Response& res) {
+        res.body_producer = std::make_shared<Pieces>();
+        res.content_length = 20;
+    });
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    Connection connection(listener.endpoint);
+    connection.send("GET /stream HTTP/1.1\r\nHost: x\r\n\r\n");
+    auto response = connection.receive();
+    EXPECT_EQ(std::string::npos, response.find("Transfer-Encoding"));
+    EXPECT_TRUE(ends_with(response, "Content-Length: 15\r\n\r\npiecepiecepiece"));
+
+    // A body that falls short of its length is cut off.
+    connection.send("GET /short HTTP/1.1\r\nHost: x\r\n\r\n");
+    connection.take_until("Content-Length: 20\r\n\r\n");
+    while (connection.fill(connection.input.size() + 1)) {
+    }
+    EXPECT_EQ("piecepiece", connection.input);
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, StopFinishesRequestsAndClosesIdleConnections) {
+    Deferred deferred;
+    w::App app;
+    add_routes(app, deferred, "one");
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).threads(2).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    Connection idle(listener.endpoint);
+    idle.send(get);
+    EXPECT_TRUE(ends_with(idle.receive(), "one"));
+    Connection busy(listener.endpoint);
+    busy.send(get_slow);
+    auto handle = deferred.wait();
+
+    server.stop();
+    EXPECT_TRUE(idle.closed());
+    w::Response res;
+    w::plain_text(res, "late");
+    handle.complete(std::move(res));
+    auto response = busy.receive();
+    EXPECT_NE(std::string::npos, response.find("Connection: close\r\n"));
+    EXPECT_TRUE(ends_with(response, "late"));
+    EXPECT_TRUE(busy.closed());
+    thread.join();
+
+    asio::io_service service;
+    tcp::socket refused(service);
+    asio_error_code ec;
+    refused.connect(listener.endpoint, ec);
+    EXPECT_TRUE(ec);
+}
+
+TEST_P(Server, DrainTimeoutClosesTheRest) {
+    Deferred deferred;
+    w::App app;
+    add_routes(app, deferred, "one");
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).drain_timeout(100).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    Connection busy(listener.endpoint);
+    busy.send(get_slow);
+    deferred.wait();
+    auto started = std::chrono::steady_clock::now();
+    server.stop();
+    EXPECT_TRUE(busy.closed());
+    thread.join();
+    EXPECT_GE(std::chrono::steady_clock::now() - started, std::chrono::milliseconds(100));
+}
+
+TEST_P(Server, ClosesStalledConnections) {
+    std::string large(32 << 20, 'x');
+    w::App app;
+    app.get("/", [](w::Request&, w::Response& res) {
+        w::plain_text(res, "one");
+    });
+    app.get("/large", [&large](w::Request&, w::Response& res) {
+        res.shared_owner = std::make_shared<int>();
+        res.shared_body = large;
+    });
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).header_timeout(200).body_timeout(200).idle_timeout(300).write_timeout(200)
+        .listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+    using clock = std::chrono::steady_clock;
+    auto ms_since = [](clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - start).count();
+    };
+
+    auto start = clock::now();
+    Connection header(listener.endpoint), body(listener.endpoint), idle(listener.endpoint), reader(listener.endpoint);
+    header.send("GET / HTTP/1.1\r\nHo");
+    body.send("POST / HTTP/1.1\r\nHost: x\r\nContent-Length: 10\r\n\r\nabc");
+    idle.send(get);
+    EXPECT_TRUE(ends_with(idle.receive(), "one"));
+    // Stops reading after the first bytes.
+    reader.send("GET /large HTTP/1.1\r\nHost: x\r\n\r\n");
+    reader.fill(1);
+    auto answered = clock::now();
+
+    // With the 100 ms resolution of the timers.
+    EXPECT_TRUE(header.closed());
+    EXPECT_TRUE(body.closed());
+    EXPECT_GE(ms_since(start), 100);
+    EXPECT_TRUE(idle.closed());
+    EXPECT_GE(ms_since(answered), 200);
+    EXPECT_LT(ms_since(start), 2000);
+
+    // The stalled write is given up on; the client then gets what was
+    // buffered, but not the rest.
+    while (server.metrics().connections_closed < 4) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        ASSERT_LT(ms_since(start), 5000);
+    }
+    while (reader.fill(reader.input.size() + 1)) {
+    }
+    EXPECT_LT(reader.input.size(), large.size());
+
+    // Connections that keep up are left alone.
+    Connection busy(listener.endpoint);
+    for (int i = 0; i < 5; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        busy.send(get);
+        EXPECT_TRUE(ends_with(busy.receive(), "one"));
+    }
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, MaxConnections) {
+    Deferred deferred;
+    w::App app;
+    add_routes(app, deferred, "one");
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).max_connections(1).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    Connection first(listener.endpoint);
+    first.send(get);
+    EXPECT_TRUE(ends_with(first.receive(), "one"));
+    // Waits in the backlog.
+    Connection second(listener.endpoint);
+    second.send(get);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(0u, second.socket.available());
+
+    first.socket.close();
+    EXPECT_TRUE(ends_with(second.receive(), "one"));
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, SpreadsConnectionsOverLoops) {
+    // Which loop answers, by its thread.
+    w::App app;
+    app.get("/", [](w::Request&, w::Response& res) {
+        w::plain_text(res, std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())));
+    });
+    auto loop_of = [](Connection& connection) {
+        connection.send(get);
+        auto response = connection.receive();
+        return response.substr(response.find("\r\n\r\n") + 4);
+    };
+#if defined(SO_REUSEPORT)
+    using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+    // One loop keeps its port to itself: no other socket can join it.
+    {
+        unsigned short port;
+        {
+            Listener unused;
+            port = unused.endpoint.port();
+        }
+        w::Server server;
+        server.io_uring(GetParam()).listen("127.0.0.1", port);
+        std::thread thread([&]() {
+            server.run(app);
+        });
+        Connection connection(tcp::endpoint(asio::ip::address_v4::loopback(), port));
+        loop_of(connection);
+        asio::io_service service;
+        tcp::acceptor intruder(service);
+        intruder.open(tcp::v4());
+        intruder.set_option(reuse_port(true));
+        asio_error_code ec;
+        intruder.bind(tcp::endpoint(asio::ip::address_v4::loopback(), port), ec);
+        EXPECT_EQ(asio::error::address_in_use, ec);
+        server.stop();
+        thread.join();
+    }
+#endif
+
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).threads(4).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+    std::vector<std::unique_ptr<Connection>> connections;
+    std::set<std::string> loops;
+    for (int i = 0; i < 64; ++i) {
+        connections.emplace_back(new Connection(listener.endpoint));
+        loops.insert(loop_of(*connections.back()));
+    }
+    EXPECT_GT(loops.size(), 1u);
+    EXPECT_LE(loops.size(), 4u);
+    // A connection stays on the loop that accepted it.
+    for (auto& connection: connections) {
+        auto loop = loop_of(*connection);
+        EXPECT_EQ(loop, loop_of(*connection));
+    }
+    EXPECT_EQ(64u, server.metrics().connections_accepted);
+    EXPECT_EQ(64u * 3, server.metrics().requests);
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, AcceptsBursts) {
+    Deferred deferred;
+    w::App app;
+    add_routes(app, deferred, "one");
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).accept_batch(4).listen_fd(listener.release());
+    // Waiting in the backlog when the server starts.
+    std::vector<std::unique_ptr<Connection>> connections;
+    for (int i = 0; i < 10; ++i) {
+        connections.emplace_back(new Connection(listener.endpoint));
+        connections.back()->send(get);
+    }
+    std::thread thread([&]() {
+        server.run(app);
+    });
+    for (auto& connection: connections) {
+        EXPECT_TRUE(ends_with(connection->receive(), "one"));
+    }
+    EXPECT_EQ(10u, server.metrics().connections_accepted);
+    server.stop();
+    thread.join();
+}
+
+#if defined(__linux__)
+TEST_P(Server, DeferAccept) {
+    Deferred deferred;
+    w::App app;
+    add_routes(app, deferred, "one");
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).defer_accept(10).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+    Connection busy(listener.endpoint);
+    busy.send(get);
+    EXPECT_TRUE(ends_with(busy.receive(), "one"));
+    // Not accepted before it sends something.
+    Connection silent(listener.endpoint);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    busy.send(get);
+    EXPECT_TRUE(ends_with(busy.receive(), "one"));
+    EXPECT_EQ(1u, server.metrics().connections_accepted);
+    silent.send(get);
+    EXPECT_TRUE(ends_with(silent.receive(), "one"));
+    server.stop();
+    thread.join();
+}
+#endif
+
+TEST_P(Server, MaxRequestsInFlight) {
+    Deferred deferred;
+    w::App app;
+    add_routes(app, deferred, "one");
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).max_requests_in_flight(1).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    Connection busy(listener.endpoint), refused(listener.endpoint);
+    busy.send(get_slow);
+    auto handle = deferred.wait();
+    for (auto& request: {get_slow, get}) {
+        // Answered without the responder.
+        refused.send(request);
+        auto response = refused.receive();
+        EXPECT_EQ(0u, response.find("HTTP/1.1 503 Service Unavailable\r\n"));
+        EXPECT_NE(std::string::npos, response.find("Retry-After: 1\r\n"));
+    }
+    EXPECT_EQ(2u, server.metrics().requests_shed);
+
+    w::Response res;
+    w::plain_text(res, "late");
+    handle.complete(std::move(res));
+    EXPECT_TRUE(ends_with(busy.receive(), "late"));
+    refused.send(get);
+    EXPECT_TRUE(ends_with(refused.receive(), "one"));
+    server.stop();
+    thread.join();
+}
+
+#if defined(__linux__)
+TEST_P(Server, PausesAcceptingWithoutFileDescriptors) {
+    if (GetParam()) {
+        // A multishot accept goes by the limit as it was when submitted.
+        return;
+    }
+    Deferred deferred;
+    w::App app;
+    add_routes(app, deferred, "one");
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+    Connection first(listener.endpoint);
+    first.send(get);
+    EXPECT_TRUE(ends_with(first.receive(), "one"));
+
+    // Room for one more of the server's sockets. The clients' are opened
+    // before.
+    asio::io_service service;
+    tcp::socket second(service), third(service);
+    second.open(tcp::v4());
+    third.open(tcp::v4());
+    size_t open = 0;
+    for (const auto& entry: std::filesystem::directory_iterator("/proc/self/fd")) {
+        (void)entry;
+        ++open;
+    }
+    rlimit old_limit;
+    ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &old_limit));
+    rlimit limit = old_limit;
+    limit.rlim_cur = open; // Counting the directory's own descriptor.
+    ASSERT_EQ(0, setrlimit(RLIMIT_NOFILE, &limit));
+    auto receive = [](tcp::socket& socket) {
+        std::string response;
+        asio::read_until(socket, asio::dynamic_buffer(response), "one");
+        return response;
+    };
+    second.connect(listener.endpoint);
+    asio::write(second, asio::buffer(get));
+    EXPECT_TRUE(ends_with(receive(second), "one"));
+    third.connect(listener.endpoint);
+    asio::write(third, asio::buffer(get));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_EQ(0u, third.available());
+
+    // Once a connection closes, the next is accepted.
+    second.close();
+    EXPECT_TRUE(ends_with(receive(third), "one"));
+    setrlimit(RLIMIT_NOFILE, &old_limit);
+    server.stop();
+    thread.join();
+}
+#endif
+
+#if !defined(_WIN32)
+TEST_P(Server, TakeOver) {
+    std::string path = "/tmp/wayward-test-takeover-" + std::to_string(::getpid());
+    Deferred deferred;
+    w::App old_app, new_app;
+    add_routes(old_app, deferred, "old");
+    add_routes(new_app, deferred, "new");
+
+    w::Server successor;
+    EXPECT_FALSE(successor.take_over(path));
+
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).threads(2).listen_fd(listener.release()).allow_takeover(path);
+    std::thread old_thread([&]() {
+        server.run(old_app);
+    });
+    Connection before(listener.endpoint);
+    before.send(get);
+    EXPECT_TRUE(ends_with(before.receive(), "old"));
+
+    ASSERT_TRUE(successor.take_over(path));
+    successor.io_uring(GetParam()).threads(1).allow_takeover(path);
+    EXPECT_TRUE(before.closed());
+    old_thread.join();
+
+    std::thread new_thread([&]() {
+        successor.run(new_app);
+    });
+    Connection after(listener.endpoint);
+    after.send(get);
+    EXPECT_TRUE(ends_with(after.receive(), "new"));
+    successor.stop();
+    new_thread.join();
+    std::remove(path.c_str());
+}
+#endif
+
+TEST_P(Server, Http2StreamsAreAnsweredAsTheyAreReady) {
+    Deferred deferred;
+    w::App app;
+    add_routes(app, deferred, "one");
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).http2(true).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    Http2Connection connection(listener.endpoint);
+    connection.start();
+    connection.get(1, "/slow");
+    auto handle = deferred.wait();
+    connection.get(3, "/");
+    auto headers = connection.receive_stream_frame();
+    EXPECT_EQ(3u, headers.stream);
+    EXPECT_EQ("200", connection.status(headers));
+    auto data = connection.receive_stream_frame();
+    EXPECT_EQ(3u, data.stream);
+    EXPECT_EQ("one", data.payload);
+    EXPECT_TRUE(data.flags & Http2Connection::end_stream);
+
+    w::Response res;
+    w::plain_text(res, "late");
+    handle.complete(std::move(res));
+    headers = connection.receive_stream_frame();
+    EXPECT_EQ(1u, headers.stream);
+    EXPECT_EQ("200", connection.status(headers));
+    data = connection.receive_stream_frame();
+    EXPECT_EQ(1u, data.stream);
+    EXPECT_EQ("late", data.payload);
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, Http2Upgrade) {
+    Deferred deferred;
+    w::App app;
+    add_routes(app, deferred, "one");
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).http2(true).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    Http2Connection connection(listener.endpoint);
+    connection.send("GET / HTTP/1.1\r\nHost: x\r\nConnection: Upgrade, HTTP2-Settings\r\nUpgrade: h2c\r\nHTTP2-Settings: AAMAAABkAAQCAAAAAAIAAAAA\r\n\r\n");
+    const std::string switching = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    std::string head(switching.size(), '\0');
+    connection.read(&head[0], head.size());
+    EXPECT_EQ(switching, head);
+    // The request continues as stream 1.
+    connection.start();
+    auto headers = connection.receive_stream_frame();
+    EXPECT_EQ(1u, headers.stream);
+    EXPECT_EQ("200", connection.status(headers));
+    auto data = connection.receive_stream_frame();
+    EXPECT_EQ("one", data.payload);
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, Http2IsOptIn) {
+    w::App app;
+    app.get("/", [](w::Request&, w::Response& res) {
+        w::plain_text(res, "one");
+    });
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    // The upgrade is ignored, and the request answered over HTTP/1.1.
+    Connection connection(listener.endpoint);
+    connection.send("GET / HTTP/1.1\r\nHost: x\r\nConnection: Upgrade, HTTP2-Settings\r\nUpgrade: h2c\r\nHTTP2-Settings: AAMAAABkAAQCAAAAAAIAAAAA\r\n\r\n");
+    std::string response = connection.receive();
+    EXPECT_EQ(0u, response.find("HTTP/1.1 200 OK\r\n"));
+    EXPECT_EQ("one", response.substr(response.size() - 3));
+    // A connection preface is taken for an HTTP/1.1 request, which fails.
+    Connection prior_knowledge(listener.endpoint);
+    prior_knowledge.send("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+    EXPECT_EQ(0u, prior_knowledge.receive().find("HTTP/1.1 4"));
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, Http2FlowControl) {
+    w::App app;
+    app.get("/big", [](w::Request&, w::Response& res) {
+        w::plain_text(res, std::string(1000, 'x'));
+    });
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).http2(true).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    Http2Connection connection(listener.endpoint);
+    connection.start({{4, 100}}); // SETTINGS_INITIAL_WINDOW_SIZE
+    connection.get(1, "/big");
+    auto headers = connection.receive_stream_frame();
+    EXPECT_EQ("200", connection.status(headers));
+    auto data = connection.receive_stream_frame();
+    EXPECT_EQ(100u, data.payload.size());
+    EXPECT_FALSE(data.flags & Http2Connection::end_stream);
+
+    connection.send_frame(Http2Connection::WindowUpdate, 0, 1, Http2Connection::u32(900));
+    size_t rest = 0;
+    do {
+        data = connection.receive_stream_frame();
+        rest += data.payload.size();
+    } while (!(data.flags & Http2Connection::end_stream));
+    EXPECT_EQ(900u, rest);
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, EventStreamFanOut) {
+    w::EventChannels channels;
+    w::App app;
+    app.get("/events", [&channels](w::Request& req, w::Response& res) {
+        channels.subscribe(req, res, "news");
+    });
+    Listener listener;
+    w::Server server;
+    // Event streams never finish, so stop() closes them at the timeout.
+    server.io_uring(GetParam()).http2(true).drain_timeout(100).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    Connection first(listener.endpoint), second(listener.endpoint);
+    first.send("GET /events HTTP/1.1\r\nHost: x\r\n\r\n");
+    second.send("GET /events HTTP/1.1\r\nHost: x\r\n\r\n");
+    Http2Connection third(listener.endpoint);
+    third.start();
+    third.get(1, "/events");
+    while (channels.num_subscribers("news") < 3) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(3u, channels.publish("news", "one\ntwo", "update"));
+    const std::string event = "event: update\ndata: one\ndata: two\n\n";
+    for (auto connection: {&first, &second}) {
+        std::string received = connection->take_until("\n\n\r\n");
+        EXPECT_NE(std::string::npos, received.find("Content-Type: text/event-stream\r\n"));
+        EXPECT_TRUE(ends_with(received, "\r\n\r\n23\r\n" + event + "\r\n")) << received;
+    }
+    auto headers = third.receive_stream_frame();
+    EXPECT_EQ("200", third.status(headers));
+    std::string data;
+    while (data.size() < event.size()) {
+        auto frame = third.receive_stream_frame();
+        EXPECT_FALSE(frame.flags & Http2Connection::end_stream);
+        data += frame.payload;
+    }
+    EXPECT_EQ(event, data);
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, WebSocketEchoes) {
+    auto echo = std::make_shared<Echo>();
+    w::App app;
+    app.websocket("/ws", [echo](w::Request&) {
+        return echo;
+    });
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    WebSocketConnection connection(listener.endpoint);
+    auto head = connection.handshake("/ws");
+    EXPECT_EQ(0u, head.find("HTTP/1.1 101 Switching Protocols\r\n"));
+    EXPECT_NE(std::string::npos, head.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"));
+
+    connection.send_frame(1, "hello");
+    auto frame = connection.receive_frame();
+    EXPECT_EQ(1, frame.opcode);
+    EXPECT_TRUE(frame.fin);
+    EXPECT_EQ("hello", frame.payload);
+
+    // Fragments, with a ping in between, which is answered at once.
+    std::string large(70000, 'x');
+    connection.send_frame(2, large.substr(0, 100), false);
+    connection.send_frame(9, "ping");
+    connection.send_frame(0, large.substr(100), true);
+    frame = connection.receive_frame();
+    EXPECT_EQ(10, frame.opcode);
+    EXPECT_EQ("ping", frame.payload);
+    frame = connection.receive_frame();
+    EXPECT_EQ(2, frame.opcode);
+    EXPECT_EQ(large, frame.payload);
+
+    connection.send_frame(8, std::string{char(1000 >> 8), char(1000 & 0xff)} + "bye");
+    frame = connection.receive_frame();
+    EXPECT_EQ(8, frame.opcode);
+    EXPECT_EQ(1000, WebSocketConnection::code(frame));
+    EXPECT_TRUE(connection.closed());
+    EXPECT_EQ(1000, echo->wait_closed());
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, WebSocketSendsFromAnyThread) {
+    auto echo = std::make_shared<Echo>();
+    w::App app;
+    app.websocket("/ws", [echo](w::Request&) {
+        return echo;
+    });
+    app.websocket("/refused", [](w::Request&) {
+        return nullptr;
+    });
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    WebSocketConnection refused(listener.endpoint);
+    EXPECT_EQ(0u, refused.handshake("/refused").find("HTTP/1.1 403 Forbidden\r\n"));
+
+    WebSocketConnection connection(listener.endpoint);
+    connection.handshake("/ws");
+    auto socket = echo->wait_opened();
+    for (int i = 0; i < 100; ++i) {
+        socket.send(std::to_string(i));
+    }
+    socket.close(w::WebSocket::GoingAway, "done");
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(std::to_string(i), connection.receive_frame().payload);
+    }
+    auto frame = connection.receive_frame();
+    EXPECT_EQ(8, frame.opcode);
+    EXPECT_EQ(w::WebSocket::GoingAway, WebSocketConnection::code(frame));
+    EXPECT_EQ("done", frame.payload.substr(2));
+    // The server waits for the answer before closing.
+    connection.send_frame(8, frame.payload.substr(0, 2));
+    EXPECT_TRUE(connection.closed());
+    EXPECT_EQ(w::WebSocket::GoingAway, echo->wait_closed());
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, WebSocketProtocolErrors) {
+    auto echo = std::make_shared<Echo>();
+    w::App app;
+    app.websocket("/ws", [echo](w::Request&) {
+        return echo;
+    });
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    // Clients must mask their frames.
+    WebSocketConnection unmasked(listener.endpoint);
+    unmasked.handshake("/ws");
+    unmasked.send_frame(1, "hello", true, false, false);
+    auto frame = unmasked.receive_frame();
+    EXPECT_EQ(8, frame.opcode);
+    EXPECT_EQ(w::WebSocket::ProtocolError, WebSocketConnection::code(frame));
+    EXPECT_TRUE(unmasked.closed());
+
+    WebSocketConnection invalid(listener.endpoint);
+    invalid.handshake("/ws");
+    invalid.send_frame(1, "\xc3\x28");
+    frame = invalid.receive_frame();
+    EXPECT_EQ(w::WebSocket::InvalidPayload, WebSocketConnection::code(frame));
+    EXPECT_TRUE(invalid.closed());
+    server.stop();
+    thread.join();
+}
+
+TEST_P(Server, WebSocketDeflate) {
+    if (!w::MessageDeflate::available()) {
+        return;
+    }
+    auto echo = std::make_shared<Echo>();
+    w::App app;
+    app.websocket("/ws", [echo](w::Request&) {
+        return echo;
+    }, true);
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    WebSocketConnection connection(listener.endpoint);
+    auto head = connection.handshake("/ws", "permessage-deflate; client_max_window_bits");
+    EXPECT_NE(std::string::npos, head.find("Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; client_no_context_takeover\r\n"));
+
+    w::MessageDeflate deflate;
+    std::string text;
+    for (int i = 0; i < 100; ++i) {
+        text += "{\"id\": " + std::to_string(i) + ", \"status\": \"ok\"}\n";
+    }
+    std::string compressed;
+    deflate.compress(text, compressed);
+    connection.send_frame(1, compressed, true, true);
+    auto frame = connection.receive_frame();
+    EXPECT_TRUE(frame.compressed);
+    EXPECT_LT(frame.payload.size(), text.size() / 4);
+    std::string echoed;
+    EXPECT_TRUE(deflate.decompress(frame.payload, text.size(), echoed));
+    EXPECT_EQ(text, echoed);
+
+    // Too small to be worth compressing.
+    connection.send_frame(1, "short");
+    frame = connection.receive_frame();
+    EXPECT_FALSE(frame.compressed);
+    EXPECT_EQ("short", frame.payload);
+
+    // Stopping closes WebSocket connections too, once they have answered.
+    server.stop();
+    frame = connection.receive_frame();
+    EXPECT_EQ(8, frame.opcode);
+    EXPECT_EQ(w::WebSocket::GoingAway, WebSocketConnection::code(frame));
+    connection.send_frame(8, frame.payload);
+    EXPECT_TRUE(connection.closed());
+    thread.join();
+}
+
+TEST_P(Server, ProxiesToUpstreams) {
+    std::string large(1 << 20, 'x');
+    for (size_t i = 0; i < large.size(); i += 4093) {
+        large[i] = char('a' + i % 26);
+    }
+    w::App backend_app;
+    backend_app.get("/hello", [](w::Request& req, w::Response& res) {
+        w::plain_text(res, "hello from " + std::string(req.header(w::HeaderId::Host)));
+        res.set_header("X-Backend", "1");
+    });
+    backend_app.get("/headers", [](w::Request& req, w::Response& res) {
+        w::plain_text(res, std::string(req.header("X-Kept")) + "," + std::string(req.header("X-Hop")));
+    });
+    backend_app.post("/echo", [](w::Request& req, w::Response& res) {
+        w::plain_text(res, std::string(req.body));
+    });
+    backend_app.get("/large", [&large](w::Request&, w::Response& res) {
+        w::plain_text(res, large);
+    });
+    backend_app.get("/cached", [](w::Request&, w::Response& res) {
+        res.status = w::Status::NotModified;
+        res.content_length = 15;
+    });
+    Listener backend_listener;
+    w::Server backend;
+    backend.listen_fd(backend_listener.release());
+    std::thread backend_thread([&]() {
+        backend.run(backend_app);
+    });
+
+    w::Proxy proxy;
+    proxy.upstream("127.0.0.1", backend_listener.endpoint.port());
+    w::App app;
+    app.proxy("/", proxy);
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).http2(true).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    Connection connection(listener.endpoint);
+    connection.send("GET /hello HTTP/1.1\r\nHost: example.com\r\n\r\n");
+    auto response = connection.receive_any();
+    EXPECT_EQ(0u, response.find("HTTP/1.1 200 OK\r\n"));
+    EXPECT_NE(std::string::npos, response.find("X-Backend: 1\r\n"));
+    EXPECT_TRUE(ends_with(response, "hello from example.com")) << response;
+
+    // The lengths of bodies left out are passed on.
+    connection.send("HEAD /hello HTTP/1.1\r\nHost: x\r\n\r\n");
+    response = connection.take_until("\r\n\r\n");
+    EXPECT_EQ(0u, response.find("HTTP/1.1 200 OK\r\n"));
+    EXPECT_TRUE(ends_with(response, "Content-Length: 12\r\n\r\n"));
+    connection.send("GET /cached HTTP/1.1\r\nHost: x\r\n\r\n");
+    response = connection.take_until("\r\n\r\n");
+    EXPECT_EQ(0u, response.find("HTTP/1.1 304 Not Modified\r\n"));
+    EXPECT_TRUE(ends_with(response, "Content-Length: 15\r\n\r\n"));
+
+    // Hop-by-hop fields stay behind.
+    connection.send("GET /headers HTTP/1.1\r\nHost: x\r\nConnection: keep-alive, X-Hop\r\nX-Hop: 1\r\nX-Kept: 2\r\n\r\n");
+    EXPECT_TRUE(ends_with(connection.receive_any(), "\r\n\r\n2,"));
+
+    std::string body = large.substr(0, 300 * 1024);
+    connection.send("POST /echo HTTP/1.1\r\nHost: x\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body);
+    EXPECT_TRUE(ends_with(connection.receive_any(), "\r\n\r\n" + body));
+
+    connection.send("POST /echo HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n");
+    EXPECT_TRUE(ends_with(connection.receive_any(), "\r\n\r\nhello world"));
+
+    // Streamed, as it is larger than the proxy buffers, with its length.
+    connection.send("GET /large HTTP/1.1\r\nHost: x\r\n\r\n");
+    response = connection.receive_any();
+    EXPECT_NE(std::string::npos, response.find("Content-Length: 1048576\r\n"));
+    EXPECT_EQ(std::string::npos, response.find("Transfer-Encoding"));
+    EXPECT_TRUE(ends_with(response, "\r\n\r\n" + large));
+
+    Http2Connection http2(listener.endpoint);
+    http2.start();
+    http2.get(1, "/hello");
+    auto headers = http2.receive_stream_frame();
+    EXPECT_EQ("200", http2.status(headers));
+    auto data = http2.receive_stream_frame();
+    EXPECT_EQ("hello from x", data.payload);
+
+    // One upstream connection carried all of them.
+    EXPECT_EQ(1u, backend.metrics().connections_accepted);
+    auto metrics = proxy.metrics();
+    EXPECT_EQ(1u, metrics.connections_opened);
+    EXPECT_EQ(metrics.requests - 1, metrics.connections_reused);
+    EXPECT_EQ(0u, proxy.num_outstanding(0));
+    server.stop();
+    thread.join();
+    backend.stop();
+    backend_thread.join();
+}
+
+TEST_P(Server, ProxyBalancesLeastOutstandingRequests) {
+    Deferred deferred[2];
+    w::App backend_apps[2];
+    add_routes(backend_apps[0], deferred[0], "first");
+    add_routes(backend_apps[1], deferred[1], "second");
+    Listener backend_listeners[2];
+    w::Server backends[2];
+    std::vector<std::thread> backend_threads;
+    w::Proxy proxy;
+    for (int i = 0; i < 2; ++i) {
+        proxy.upstream("127.0.0.1", backend_listeners[i].endpoint.port());
+        backends[i].listen_fd(backend_listeners[i].release());
+        backend_threads.emplace_back([&backends, &backend_apps, i]() {
+            backends[i].run(backend_apps[i]);
+        });
+    }
+
+    w::App app;
+    app.proxy("/", proxy);
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).threads(2).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    Connection slow(listener.endpoint);
+    slow.send(get_slow);
+    while (proxy.num_outstanding(0) + proxy.num_outstanding(1) == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    size_t busy = proxy.num_outstanding(0) == 1 ? 0 : 1;
+    EXPECT_EQ(1u, proxy.num_outstanding(busy));
+    auto handle = deferred[busy].wait();
+
+    // Everything else goes to the other upstream, from either loop.
+    std::string other = busy == 0 ? "second" : "first";
+    for (int i = 0; i < 4; ++i) {
+        Connection connection(listener.endpoint);
+        connection.send(get);
+        EXPECT_TRUE(ends_with(connection.receive_any(), other));
+    }
+
+    w::Response response;
+    w::plain_text(response, "done");
+    handle.complete(std::move(response));
+    EXPECT_TRUE(ends_with(slow.receive_any(), "done"));
+    while (proxy.num_outstanding(busy) != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    server.stop();
+    thread.join();
+    for (int i = 0; i < 2; ++i) {
+        backends[i].stop();
+        backend_threads[i].join();
+    }
+}
+
+#if !defined(_WIN32)
+// Streams the first piece, then fails.
+struct Broken : w::IBodyProducer {
+    bool first = true;
+
+    State produce(std::string& out) override {
+        if (!first) {
+            return Failed;
+        }
+        first = false;
+        out = "partial";
+        return More;
+    }
+};
+
+// Streams the first piece, then waits forever.
+struct Stalled : w::IBodyProducer {
+    bool first = true;
+
+    State produce(std::string& out) override {
+        if (!first) {
+            return Waiting;
+        }
+        first = false;
+        out = "partial";
+        return More;
+    }
+};
+
+TEST_P(Server, ProxyFailures) {
+    std::string path = "/tmp/wayward-test-proxy-" + std::to_string(::getpid());
+    std::remove(path.c_str());
+    Deferred deferred;
+    w::App backend_app;
+    add_routes(backend_app, deferred, "backend");
+    backend_app.get("/broken", [](w::Request&, w::Response& res) {
+        res.body_producer = std::make_shared<Broken>();
+    });
+    backend_app.get("/stalled", [](w::Request&, w::Response& res) {
+        res.body_producer = std::make_shared<Stalled>();
+    });
+    w::Server backend;
+    backend.drain_timeout(100).listen(path);
+    std::thread backend_thread([&]() {
+        backend.run(backend_app);
+    });
+
+    // Nothing listens on the first upstream.
+    tcp::endpoint refusing;
+    {
+        Listener closed;
+        refusing = closed.endpoint;
+    }
+    w::Proxy proxy, unreachable;
+    proxy.upstream("127.0.0.1", refusing.port()).upstream(path).response_timeout(100);
+    unreachable.upstream("127.0.0.1", refusing.port());
+
+    w::App app;
+    app.proxy("/", proxy);
+    app.proxy("/unreachable", unreachable);
+    Listener listener;
+    w::Server server;
+    server.io_uring(GetParam()).listen_fd(listener.release());
+    std::thread thread([&]() {
+        server.run(app);
+    });
+
+    Connection connection(listener.endpoint);
+    for (int i = 0; i < 3; ++i) {
+        connection.send(get);
+        EXPECT_TRUE(ends_with(connection.receive_any(), "backend"));
+    }
+
+    connection.send("GET /unreachable/x HTTP/1.1\r\nHost: x\r\n\r\n");
+    EXPECT_EQ(0u, connection.receive_any().find("HTTP/1.1 502 Bad Gateway\r\n"));
+
+    connection.send(get_slow);
+    EXPECT_EQ(0u, connection.receive_any().find("HTTP/1.1 504 Gateway Timeout\r\n"));
+
+    // A body cut off upstream is cut off here too.
+    connection.send("GET /broken HTTP/1.1\r\nHost: x\r\n\r\n");
+    auto response = connection.receive_any();
+    EXPECT_EQ(0u, response.find("HTTP/1.1 200 OK\r\n"));
+    EXPECT_TRUE(ends_with(response, "\r\n\r\npartial"));
+    EXPECT_TRUE(connection.closed());
+
+    // So is one that stalls.
+    Connection stalled(listener.endpoint);
+    stalled.send("GET /stalled HTTP/1.1\r\nHost: x\r\n\r\n");
+    auto started = std::chrono::steady_clock::now();
+    response = stalled.receive_any();
+    EXPECT_TRUE(ends_with(response, "\r\n\r\npartial"));
+    EXPECT_TRUE(stalled.closed());
+    EXPECT_GE(std::chrono::steady_clock::now() - started, std::chrono::milliseconds(100));
+
+    EXPECT_EQ(0u, proxy.num_outstanding(0));
+    EXPECT_EQ(0u, proxy.num_outstanding(1));
+    auto metrics = proxy.metrics();
+    EXPECT_EQ(1u, metrics.upstreams_down);
+    EXPECT_EQ(1u, metrics.gateway_timeout);
+    EXPECT_EQ(2u, metrics.responses_cut_off);
+    EXPECT_EQ(1u, unreachable.metrics().bad_gateway);
+    server.stop();
+    thread.join();
+    auto handle = deferred.wait();
+    handle.complete(w::Response());
+    backend.stop();
+    backend_thread.join();
+    std::remove(path.c_str());
+}
+#endif
+
+INSTANTIATE_TEST_CASE_P(Backends, Server, ::testing::Values(false, true));
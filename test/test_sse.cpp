@@ -0,0 +1,175 @@
+#include "wayward/sse.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace w = wayward;
+
+namespace {
+    using Pieces = std::vector<std::shared_ptr<const std::string>>;
+
+    // What the subscriber's stream writes next, and whether it ends there.
+    std::string next(w::Response& res, bool* done = nullptr) {
+        std::string out;
+        Pieces shared;
+        auto state = res.body_producer->produce_shared(out, shared);
+        for (auto& piece: shared) {
+            out += *piece;
+        }
+        if (done) {
+            *done = state == w::IBodyProducer::Done;
+        }
+        return out;
+    }
+}
+
+TEST(Sse, EncodesEvents) {
+    std::string out;
+    w::encode_event(out, "hello");
+    EXPECT_EQ("data: hello\n\n", out);
+    out.clear();
+    w::encode_event(out, "one\ntwo\r\nthree\rfour", "update", "42");
+    EXPECT_EQ("id: 42\nevent: update\ndata: one\ndata: two\ndata: three\ndata: four\n\n", out);
+    out.clear();
+    w::encode_event(out, "");
+    EXPECT_EQ("data: \n\n", out);
+}
+
+TEST(Sse, PublishesOneBufferToAllSubscribers) {
+    w::EventChannels channels;
+    w::Request req;
+    w::Response first, second, other;
+    channels.subscribe(req, first, "news");
+    channels.subscribe(req, second, "news");
+    channels.subscribe(req, other, "sports");
+    EXPECT_EQ("text/event-stream", first.header(w::HeaderId::ContentType));
+    EXPECT_EQ(2u, channels.num_subscribers("news"));
+    EXPECT_EQ("", next(first));
+
+    EXPECT_EQ(2u, channels.publish("news", "a"));
+    EXPECT_EQ(2u, channels.publish("news", "b"));
+    EXPECT_EQ(0u, channels.publish("weather", "c"));
+
+    std::string out;
+    Pieces shared_first, shared_second;
+    first.body_producer->produce_shared(out, shared_first);
+    second.body_producer->produce_shared(out, shared_second);
+    EXPECT_TRUE(out.empty());
+    ASSERT_EQ(2u, shared_first.size());
+    EXPECT_EQ(shared_first, shared_second); // The same buffers.
+    EXPECT_EQ("data: a\n\n", *shared_first[0]);
+    EXPECT_EQ("", next(other));
+
+    // Subscriptions end with their responses.
+    second.body_producer.reset();
+    EXPECT_EQ(1u, channels.num_subscribers("news"));
+    EXPECT_EQ(1u, channels.publish("news", "c"));
+}
+
+TEST(Sse, EvictsSlowSubscribers) {
+    w::EventChannels::Options options;
+    options.max_queued_events = 2;
+    w::EventChannels channels(options);
+    w::Request req;
+    w::Response slow, fast;
+    channels.subscribe(req, slow, "t");
+    channels.subscribe(req, fast, "t");
+    EXPECT_EQ(2u, channels.publish("t", "1"));
+    EXPECT_EQ(2u, channels.publish("t", "2"));
+    EXPECT_EQ("data: 1\n\ndata: 2\n\n", next(fast));
+    EXPECT_EQ(1u, channels.publish("t", "3"));
+    EXPECT_EQ(1u, channels.num_evicted());
+    // The slow subscriber's stream ends after what it has queued.
+    bool done = false;
+    EXPECT_EQ("data: 1\n\ndata: 2\n\n", next(slow, &done));
+    EXPECT_TRUE(done);
+    EXPECT_EQ("data: 3\n\n", next(fast, &done));
+    EXPECT_FALSE(done);
+}
+
+TEST(Sse, DropsOldestEvents) {
+    w::EventChannels::Options options;
+    options.max_queued_events = 2;
+    options.overflow = w::EventChannels::Overflow::DropOldest;
+    w::EventChannels channels(options);
+    w::Request req;
+    w::Response slow;
+    channels.subscribe(req, slow, "t");
+    for (auto data: {"1", "2", "3"}) {
+        EXPECT_EQ(1u, channels.publish("t", data));
+    }
+    EXPECT_EQ("data: 2\n\ndata: 3\n\n", next(slow));
+    EXPECT_EQ(0u, channels.num_evicted());
+}
+
+TEST(Sse, ReplaysHistoryAfterLastEventId) {
+    w::EventChannels::Options options;
+    options.history = 2;
+    options.retry_ms = 500;
+    w::EventChannels channels(options);
+    for (auto id: {"1", "2", "3"}) {
+        EXPECT_EQ(0u, channels.publish("t", id, "", id));
+    }
+    w::Request req;
+    req.headers.emplace_back(w::HeaderId::LastEventId, "2");
+    w::Response res;
+    channels.subscribe(req, res, "t");
+    EXPECT_EQ("retry: 500\n\nid: 3\ndata: 3\n\n", next(res));
+
+    // Too old to replay.
+    req.headers.back().value = "1";
+    w::Response late;
+    channels.subscribe(req, late, "t");
+    EXPECT_EQ("retry: 500\n\n", next(late));
+}
+
+TEST(Sse, ConcurrentPublishersKeepOneOrder) {
+    w::EventChannels::Options options;
+    options.max_queued_events = 10000;
+    w::EventChannels channels(options);
+    w::Request req;
+    w::Response first, second;
+    channels.subscribe(req, first, "shared");
+    channels.subscribe(req, second, "shared");
+
+    std::vector<std::thread> publishers;
+    for (int p = 0; p < 4; ++p) {
+        publishers.emplace_back([&channels, p]() {
+            for (int i = 0; i < 500; ++i) {
+                auto data = std::to_string(p) + "." + std::to_string(i);
+                EXPECT_LE(2u, channels.publish("shared", data));
+                channels.publish("own" + std::to_string(p), data);
+            }
+        });
+    }
+    // Subscribers come and go meanwhile, on the shared topic and on topics
+    // that are dropped as they empty.
+    std::thread churn([&]() {
+        for (int i = 0; i < 500; ++i) {
+            w::Response passing, own;
+            channels.subscribe(req, passing, "shared");
+            channels.subscribe(req, own, "own" + std::to_string(i % 4));
+        }
+    });
+    for (auto& publisher: publishers) {
+        publisher.join();
+    }
+    churn.join();
+
+    auto received = next(first);
+    EXPECT_EQ(received, next(second));
+    // Every publisher's events, in the order it published them.
+    for (int p = 0; p < 4; ++p) {
+        size_t at = 0;
+        for (int i = 0; i < 500; ++i) {
+            at = received.find("data: " + std::to_string(p) + "." + std::to_string(i) + "\n", at);
+            ASSERT_NE(std::string::npos, at);
+        }
+    }
+    EXPECT_EQ(2u, channels.num_subscribers("shared"));
+    EXPECT_EQ(0u, channels.publish("own0", "gone"));
+    EXPECT_EQ(0u, channels.num_subscribers("own0"));
+}
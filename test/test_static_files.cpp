@@ -0,0 +1,161 @@
+#include "wayward/static_files.hpp"
+
+#include <gtest/gtest.h>
+
+#if !defined(_MSC_VER)
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <utime.h>
+
+namespace w = wayward;
+
+namespace {
+    struct StaticFilesTest : ::testing::Test {
+        std::string root;
+
+        void SetUp() override {
+            char dir[] = "/tmp/wayward-static-XXXXXX";
+            ASSERT_NE(nullptr, ::mkdtemp(dir));
+            root = dir;
+            write("small.txt", "hello, world");
+            write("big.bin", std::string(100, 'x') + "tail");
+        }
+
+        void TearDown() override {
+            std::remove((root + "/small.txt").c_str());
+            std::remove((root + "/big.bin").c_str());
+            ::rmdir(root.c_str());
+        }
+
+        void write(const char* name, const std::string& content) {
+            FILE* file = std::fopen((root + "/" + name).c_str(), "wb");
+            std::fwrite(content.data(), 1, content.size(), file);
+            std::fclose(file);
+        }
+
+        w::StaticFiles files() {
+            return w::StaticFiles(root).max_cached_file_size(64);
+        }
+
+        // Views in the request must outlive it (string literals).
+        static w::Request get(std::string_view path, w::Headers headers = {}) {
+            w::Request req;
+            req.url = path;
+            req.params.emplace_back("path", path);
+            req.headers = std::move(headers);
+            return req;
+        }
+
+        static std::string body(const w::Response& res) {
+            return std::string(res.shared_body);
+        }
+    };
+}
+
+TEST_F(StaticFilesTest, ServesCachedFiles) {
+    auto handler = files();
+    w::Request req = get("small.txt");
+    w::Response res;
+    handler(req, res);
+    EXPECT_EQ(w::Status::OK, res.status);
+    EXPECT_EQ("hello, world", body(res));
+    EXPECT_EQ("text/plain; charset=utf-8", res.header("Content-Type"));
+    EXPECT_FALSE(res.header("ETag").empty());
+    EXPECT_FALSE(res.header("Last-Modified").empty());
+
+    // Served from the cache, even once the file is gone.
+    std::remove((root + "/small.txt").c_str());
+    w::Response again;
+    handler(req, again);
+    EXPECT_EQ("hello, world", body(again));
+    EXPECT_EQ(res.shared_owner, again.shared_owner);
+}
+
+TEST_F(StaticFilesTest, Revalidates) {
+    auto handler = files().revalidate_ms(0);
+    w::Request req = get("small.txt");
+    w::Response res;
+    handler(req, res);
+    write("small.txt", "changed");
+    ::utime((root + "/small.txt").c_str(), nullptr);
+    w::Response again;
+    handler(req, again);
+    EXPECT_EQ("changed", body(again));
+}
+
+TEST_F(StaticFilesTest, SendsLargeFiles) {
+    auto handler = files();
+    w::Request req = get("big.bin");
+    w::Response res;
+    handler(req, res);
+    EXPECT_EQ(w::Status::OK, res.status);
+    ASSERT_TRUE(res.file != nullptr);
+    EXPECT_EQ(0u, res.file_offset);
+    EXPECT_EQ(104u, res.file_length);
+    EXPECT_EQ("application/octet-stream", res.header("Content-Type"));
+}
+
+TEST_F(StaticFilesTest, NotModified) {
+    auto handler = files();
+    w::Request req = get("small.txt");
+    w::Response res;
+    handler(req, res);
+    std::string etag(res.header("ETag"));
+
+    w::Request conditional = get("small.txt", {{"if-none-match", etag}});
+    w::Response not_modified;
+    handler(conditional, not_modified);
+    EXPECT_EQ(w::Status::NotModified, not_modified.status);
+    EXPECT_EQ("", body(not_modified));
+
+    w::Request other = get("small.txt", {{"If-None-Match", "\"other\""}});
+    w::Response modified;
+    handler(other, modified);
+    EXPECT_EQ(w::Status::OK, modified.status);
+}
+
+TEST_F(StaticFilesTest, Ranges) {
+    auto handler = files();
+    w::Request req = get("small.txt", {{"Range", "bytes=7-"}});
+    w::Response res;
+    handler(req, res);
+    EXPECT_EQ(w::Status::PartialContent, res.status);
+    EXPECT_EQ("world", body(res));
+    EXPECT_EQ("bytes 7-11/12", res.header("Content-Range"));
+
+    w::Request suffix = get("big.bin", {{"Range", "bytes=-4"}});
+    w::Response tail;
+    handler(suffix, tail);
+    EXPECT_EQ(w::Status::PartialContent, tail.status);
+    EXPECT_EQ(100u, tail.file_offset);
+    EXPECT_EQ(4u, tail.file_length);
+
+    w::Request beyond = get("small.txt", {{"Range", "bytes=50-60"}});
+    w::Response unsatisfiable;
+    handler(beyond, unsatisfiable);
+    EXPECT_EQ(w::Status::RangeNotSatisfiable, unsatisfiable.status);
+    EXPECT_EQ("bytes */12", unsatisfiable.header("Content-Range"));
+
+    w::Request stale = get("small.txt", {{"Range", "bytes=0-1"}, {"If-Range", "\"old\""}});
+    w::Response full;
+    handler(stale, full);
+    EXPECT_EQ(w::Status::OK, full.status);
+    EXPECT_EQ("hello, world", body(full));
+}
+
+TEST_F(StaticFilesTest, StaysBelowRoot) {
+    auto handler = files();
+    for (auto path: {"../small.txt", "a/../../small.txt", "%2e%2e/small.txt", "missing.txt", "small.txt%00"}) {
+        w::Request req = get(path);
+        w::Response res;
+        handler(req, res);
+        EXPECT_EQ(w::Status::NotFound, res.status) << path;
+    }
+    w::Request encoded = get("sm%61ll.txt");
+    w::Response res;
+    handler(encoded, res);
+    EXPECT_EQ(w::Status::OK, res.status);
+}
+#endif
@@ -0,0 +1,79 @@
+#include "wayward/util/timer_wheel.hpp"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+using namespace wayward::util;
+
+namespace {
+    struct Connection {
+        int id = 0;
+        Timer timer;
+    };
+
+    using Wheel = TimerWheel<Connection, &Connection::timer>;
+
+    std::vector<int> advance(Wheel& wheel, uint64_t now) {
+        std::vector<int> expired;
+        wheel.advance(now, [&](Connection& c) {
+            expired.push_back(c.id);
+        });
+        return expired;
+    }
+}
+
+TEST(TimerWheel, ExpiresInOrderOfTicks) {
+    Wheel wheel(8);
+    Connection a, b, c;
+    a.id = 1; b.id = 2; c.id = 3;
+    wheel.schedule(a, 3);
+    wheel.schedule(b, 1);
+    wheel.schedule(c, 2);
+    EXPECT_EQ(3u, wheel.size());
+    EXPECT_EQ(std::vector<int>{2}, advance(wheel, 1));
+    EXPECT_FALSE(b.timer.armed());
+    EXPECT_EQ((std::vector<int>{3, 1}), advance(wheel, 3));
+    EXPECT_TRUE(wheel.empty());
+}
+
+TEST(TimerWheel, RescheduleAndCancel) {
+    Wheel wheel(8);
+    Connection a, b;
+    a.id = 1; b.id = 2;
+    wheel.schedule(a, 2);
+    wheel.schedule(b, 2);
+    wheel.schedule(a, 5);
+    wheel.cancel(b);
+    EXPECT_EQ(1u, wheel.size());
+    EXPECT_TRUE(advance(wheel, 4).empty());
+    EXPECT_EQ(std::vector<int>{1}, advance(wheel, 5));
+}
+
+TEST(TimerWheel, TimersBeyondOneTurn) {
+    Wheel wheel(8);
+    Connection a, b;
+    a.id = 1; b.id = 2;
+    wheel.schedule(a, 20);
+    wheel.schedule(b, 4);
+    EXPECT_EQ(std::vector<int>{2}, advance(wheel, 12));
+    EXPECT_TRUE(advance(wheel, 19).empty());
+    EXPECT_EQ(std::vector<int>{1}, advance(wheel, 100));
+}
+
+TEST(TimerWheel, CallbacksMayCancelDueTimers) {
+    Wheel wheel(8);
+    Connection a, b;
+    a.id = 1; b.id = 2;
+    wheel.schedule(a, 1);
+    wheel.schedule(b, 1);
+    std::vector<int> expired;
+    wheel.advance(1, [&](Connection& c) {
+        expired.push_back(c.id);
+        wheel.cancel(c.id == 1 ? b : a);
+        wheel.schedule(c, 1);
+    });
+    EXPECT_EQ(std::vector<int>{1}, expired);
+    EXPECT_EQ(1u, wheel.size());
+    EXPECT_EQ(2u, a.timer.expiry());
+}
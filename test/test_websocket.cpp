@@ -0,0 +1,149 @@
+#include "wayward/websocket.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace w = wayward;
+
+namespace {
+    w::Request handshake(w::util::Arena& arena, std::string_view extensions = std::string_view()) {
+        w::Request req;
+        req.method = w::Method::Get;
+        req.url = "/ws";
+        req.headers.emplace_back(w::HeaderId::Connection, "keep-alive, Upgrade");
+        req.headers.emplace_back(w::HeaderId::Upgrade, "websocket");
+        req.headers.emplace_back(w::HeaderId::SecWebSocketVersion, "13");
+        req.headers.emplace_back(w::HeaderId::SecWebSocketKey, "dGhlIHNhbXBsZSBub25jZQ==");
+        if (!extensions.empty()) {
+            req.headers.emplace_back(w::HeaderId::SecWebSocketExtensions, arena.copy(extensions));
+        }
+        return req;
+    }
+
+    struct Handler : w::IWebSocketHandler {
+        void message(const w::WebSocket&, std::string_view, bool) override {}
+    };
+}
+
+// RFC 6455, section 1.3.
+TEST(WebSocket, AcceptKey) {
+    EXPECT_EQ("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", w::websocket_accept_key("dGhlIHNhbXBsZSBub25jZQ=="));
+}
+
+TEST(WebSocket, AcceptsHandshakes) {
+    w::util::Arena arena;
+    auto handler = std::make_shared<Handler>();
+    auto req = handshake(arena);
+    w::Response res;
+    EXPECT_TRUE(w::accept_websocket(req, res, handler));
+    EXPECT_EQ(w::Status::SwitchingProtocols, res.status);
+    EXPECT_EQ("websocket", res.header(w::HeaderId::Upgrade));
+    EXPECT_EQ("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", res.header(w::HeaderId::SecWebSocketAccept));
+    EXPECT_EQ("", res.header(w::HeaderId::SecWebSocketExtensions));
+    EXPECT_EQ(handler, res.websocket);
+
+    w::Response other_version;
+    req.headers.find(w::HeaderId::SecWebSocketVersion)->value = "8";
+    EXPECT_FALSE(w::accept_websocket(req, other_version, handler));
+    EXPECT_EQ(w::Status::UpgradeRequired, other_version.status);
+    EXPECT_EQ("13", other_version.header(w::HeaderId::SecWebSocketVersion));
+    EXPECT_FALSE(other_version.websocket);
+
+    w::Response no_key;
+    req = handshake(arena);
+    req.headers.find(w::HeaderId::SecWebSocketKey)->value = "short";
+    EXPECT_FALSE(w::accept_websocket(req, no_key, handler));
+    EXPECT_EQ(w::Status::BadRequest, no_key.status);
+}
+
+TEST(WebSocket, NegotiatesDeflate) {
+    if (!w::MessageDeflate::available()) {
+        return;
+    }
+    auto handler = std::make_shared<Handler>();
+    auto accepted = [&](std::string_view extensions) {
+        w::util::Arena arena;
+        auto req = handshake(arena, extensions);
+        w::Response res;
+        w::accept_websocket(req, res, handler, true);
+        return !res.header(w::HeaderId::SecWebSocketExtensions).empty();
+    };
+    EXPECT_TRUE(accepted("permessage-deflate"));
+    EXPECT_TRUE(accepted("permessage-deflate; client_max_window_bits"));
+    EXPECT_TRUE(accepted("permessage-deflate; server_no_context_takeover; client_max_window_bits=10"));
+    // A smaller window than the loop's compressor uses.
+    EXPECT_FALSE(accepted("permessage-deflate; server_max_window_bits=10"));
+    EXPECT_TRUE(accepted("permessage-deflate; server_max_window_bits=10, permessage-deflate"));
+    EXPECT_FALSE(accepted("permessage-deflate; unknown"));
+    EXPECT_FALSE(accepted("x-webkit-deflate-frame"));
+
+    // Only if asked to.
+    w::util::Arena arena;
+    auto req = handshake(arena, "permessage-deflate");
+    w::Response res;
+    w::accept_websocket(req, res, handler);
+    EXPECT_EQ("", res.header(w::HeaderId::SecWebSocketExtensions));
+}
+
+TEST(WebSocket, Masks) {
+    const unsigned char key[4] = {0x37, 0xfa, 0x21, 0x3d};
+    std::string data;
+    for (int i = 0; i < 300; ++i) {
+        data.push_back(char(i * 7));
+    }
+    for (size_t offset: {0, 1, 2, 3, 6}) {
+        for (size_t len: {0, 1, 5, 8, 15, 16, 17, 63, 64, 65, 130, 300}) {
+            std::string masked = data.substr(0, len);
+            w::websocket_mask(&masked[0], len, key, offset);
+            for (size_t i = 0; i < len; ++i) {
+                ASSERT_EQ(char(data[i] ^ key[(offset + i) % 4]), masked[i]) << offset << " " << len << " " << i;
+            }
+        }
+    }
+    // RFC 6455, section 5.7: "Hello", masked.
+    const unsigned char rfc_key[4] = {0x37, 0xfa, 0x21, 0x3d};
+    std::string hello = "\x7f\x9f\x4d\x51\x58";
+    w::websocket_mask(&hello[0], hello.size(), rfc_key);
+    EXPECT_EQ("Hello", hello);
+}
+
+TEST(WebSocket, ValidatesUtf8) {
+    EXPECT_TRUE(w::valid_utf8(""));
+    EXPECT_TRUE(w::valid_utf8("plain ASCII, longer than eight bytes"));
+    EXPECT_TRUE(w::valid_utf8("\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5")); // κόσμε
+    EXPECT_TRUE(w::valid_utf8("\xf0\x9f\x98\x80 and \xef\xbf\xbf"));
+    EXPECT_FALSE(w::valid_utf8("\xc0\xaf"));         // overlong
+    EXPECT_FALSE(w::valid_utf8("\xe0\x80\xaf"));     // overlong
+    EXPECT_FALSE(w::valid_utf8("\xed\xa0\x80"));     // surrogate
+    EXPECT_FALSE(w::valid_utf8("\xf4\x90\x80\x80")); // above U+10FFFF
+    EXPECT_FALSE(w::valid_utf8("abcdefgh\xce"));     // truncated
+    EXPECT_FALSE(w::valid_utf8("\x80"));
+}
+
+// RFC 7692, section 7.2.3.1: "Hello" in one compressed message.
+TEST(WebSocket, DeflatesMessages) {
+    if (!w::MessageDeflate::available()) {
+        return;
+    }
+    w::MessageDeflate deflate;
+    std::string inflated;
+    EXPECT_TRUE(deflate.decompress(std::string("\xf2\x48\xcd\xc9\xc9\x07\x00", 7), 100, inflated));
+    EXPECT_EQ("Hello", inflated);
+
+    // No context is taken over, so the same message compresses the same.
+    std::string text(10000, 'a');
+    std::string first, second;
+    deflate.compress(text, first);
+    deflate.compress(text, second);
+    EXPECT_EQ(first, second);
+    EXPECT_LT(first.size(), 100u);
+    inflated.clear();
+    EXPECT_TRUE(deflate.decompress(first, text.size(), inflated));
+    EXPECT_EQ(text, inflated);
+
+    inflated.clear();
+    EXPECT_FALSE(deflate.decompress(first, text.size() - 1, inflated));
+    inflated.clear();
+    EXPECT_FALSE(deflate.decompress("\xff\xff\xff", 100, inflated));
+}
@@ -0,0 +1,99 @@
+#include "wayward/worker_pool.hpp"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace w = wayward;
+
+namespace {
+    // Holds up the pool's threads until released.
+    struct Gate {
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool open = false;
+
+        void wait() {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return open; });
+        }
+
+        void release() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                open = true;
+            }
+            cv.notify_all();
+        }
+    };
+}
+
+TEST(WorkerPool, RunsQueuedJobsBeforeJoining) {
+    std::atomic<int> done(0);
+    {
+        w::WorkerPool workers(2);
+        for (int i = 0; i < 100; ++i) {
+            EXPECT_TRUE(workers.try_post([&done]() { ++done; }));
+        }
+    }
+    EXPECT_EQ(100, done.load());
+}
+
+TEST(WorkerPool, BoundedQueue) {
+    Gate gate;
+    std::atomic<int> started(0);
+    w::WorkerPool workers(1, 2);
+    auto job = [&]() {
+        ++started;
+        gate.wait();
+    };
+    EXPECT_TRUE(workers.try_post(job));
+    while (started.load() == 0) {
+        std::this_thread::yield();
+    }
+    EXPECT_TRUE(workers.try_post(job));
+    EXPECT_TRUE(workers.try_post(job));
+    EXPECT_EQ(2u, workers.num_queued());
+    EXPECT_FALSE(workers.try_post(job));
+    gate.release();
+}
+
+TEST(WorkerPool, OffloadDefersTheResponse) {
+    Gate gate;
+    std::atomic<int> started(0);
+    std::atomic<int> handled(0);
+    w::WorkerPool workers(1, 1);
+    auto handler = w::offload(workers, [&](w::Request& req, w::Response& res) {
+        ++started;
+        gate.wait();
+        EXPECT_EQ("/slow", req.url);
+        ++handled;
+    });
+
+    w::Request first;
+    first.url = "/slow";
+    w::Request second = first;
+    w::Request third = first;
+    w::Response res;
+    handler(first, res);
+    EXPECT_TRUE(first.deferred);
+    while (started.load() == 0) {
+        std::this_thread::yield();
+    }
+
+    // One running, one queued, and the next one is refused.
+    handler(second, res);
+    EXPECT_TRUE(second.deferred);
+    handler(third, res);
+    EXPECT_FALSE(third.deferred);
+    EXPECT_EQ(w::Status::ServiceUnavailable, res.status);
+    EXPECT_EQ("1", res.header("Retry-After"));
+
+    gate.release();
+    while (handled.load() < 2) {
+        std::this_thread::yield();
+    }
+}
@@ -1,26 +1,162 @@
 #include "wayward/app.hpp"
+#include "wayward/metrics.hpp"
+#include "wayward/router.hpp"
+#include <string>
 #include <vector>
 
 namespace wayward {
     struct App::Impl {
-        std::vector<std::function<void(Request&, Response&)>> handlers;
+        Router router;
+        std::vector<Handler> handlers;
+        // Per route; empty for routes with buffered bodies.
+        std::vector<BodyConsumerFactory> consumers;
+        bool any_consumers = false;
+
+        struct RouteInfo {
+            Method method;
+            std::string path;
+            std::unique_ptr<LatencyHistogram> latency;
+        };
+        std::vector<RouteInfo> routes;
+
+        size_t match(Request& req, bool* path_matched) {
+            auto path = req.url.substr(0, req.url.find('?'));
+            req.params.clear();
+            size_t route = router.match(req.method, path, req.params, path_matched);
+            if (route == Router::npos && req.method == Method::Head) {
+                // HEAD is answered wherever GET is; the server leaves out
+                // the body.
+                req.params.clear();
+                route = router.match(Method::Get, path, req.params);
+            }
+            return route;
+        }
+
+        // "GET, HEAD, POST", for the Allow field.
+        std::string allowed(const Request& req) {
+            uint32_t methods = router.allowed_methods(req.url.substr(0, req.url.find('?')));
+            if (methods & (uint32_t(1) << size_t(Method::Get))) {
+                methods |= uint32_t(1) << size_t(Method::Head);
+            }
+            std::string allow;
+            for (size_t i = 0; i < num_methods; ++i) {
+                if (methods & (uint32_t(1) << i)) {
+                    if (!allow.empty()) {
+                        allow += ", ";
+                    }
+                    allow += method_name(Method(i));
+                }
+            }
+            return allow;
+        }
     };
 
     App::App() : impl_(new Impl) {}
     App::~App() {}
 
-    void App::get(const char* path, std::function<void(Request&, Response&)> handler) {
-        // TODO: Actually handle paths
+    void App::route(Method method, const char* path, Handler handler) {
+        route(method, path, BodyConsumerFactory(), std::move(handler));
+    }
+
+    void App::route(Method method, const char* path, BodyConsumerFactory consumer, Handler handler) {
+        impl_->router.insert(method, path, impl_->handlers.size());
         impl_->handlers.push_back(std::move(handler));
+        impl_->any_consumers = impl_->any_consumers || consumer;
+        impl_->consumers.push_back(std::move(consumer));
+        impl_->routes.push_back({method, path, std::make_unique<LatencyHistogram>()});
+    }
+
+    void App::get(const char* path, Handler handler) {
+        route(Method::Get, path, std::move(handler));
+    }
+
+    void App::post(const char* path, Handler handler) {
+        route(Method::Post, path, std::move(handler));
+    }
+
+    void App::put(const char* path, Handler handler) {
+        route(Method::Put, path, std::move(handler));
+    }
+
+    void App::del(const char* path, Handler handler) {
+        route(Method::Delete, path, std::move(handler));
+    }
+
+    namespace {
+        std::string wildcard_below(const char* prefix) {
+            std::string pattern = prefix;
+            while (!pattern.empty() && pattern.back() == '/') {
+                pattern.pop_back();
+            }
+            return pattern + "/*path";
+        }
+    }
+
+    void App::mount(const char* prefix, StaticFiles files) {
+        auto pattern = wildcard_below(prefix);
+        route(Method::Get, pattern.c_str(), files);
+        route(Method::Head, pattern.c_str(), std::move(files));
+    }
+
+    void App::proxy(const char* prefix, Proxy& proxy) {
+        auto pattern = wildcard_below(prefix);
+        BodyConsumerFactory consumer = [&proxy](Request& req) {
+            return proxy.begin(req);
+        };
+        Handler handler = [&proxy](Request& req, Response& res) {
+            proxy(req, res);
+        };
+        for (auto method: {Method::Get, Method::Head, Method::Post, Method::Put, Method::Delete, Method::Options, Method::Patch}) {
+            route(method, pattern.c_str(), consumer, handler);
+        }
+    }
+
+    void App::websocket(const char* path, WebSocketHandlerFactory handler, bool deflate) {
+        get(path, [handler, deflate](Request& req, Response& res) {
+            auto instance = handler(req);
+            if (!instance) {
+                res.status = Status::Forbidden;
+                return;
+            }
+            accept_websocket(req, res, std::move(instance), deflate);
+        });
+    }
+
+    void App::begin(Request& req) {
+        // Only streaming routes need the match this early.
+        if (!impl_->any_consumers) {
+            return;
+        }
+        size_t route = impl_->match(req, nullptr);
+        if (route != Router::npos && impl_->consumers[route]) {
+            req.body_consumer = impl_->consumers[route](req);
+        }
     }
 
     void App::respond(Request& req, Response& res) {
-        auto& handler = *impl_->handlers.begin();
-        handler(req, res);
+        bool path_matched = false;
+        size_t route = impl_->match(req, &path_matched);
+        if (route == Router::npos) {
+            if (!path_matched) {
+                res.status = Status::NotFound;
+                return;
+            }
+            res.status = Status::MethodNotAllowed;
+            res.set_header("Allow", impl_->allowed(req));
+            return;
+        }
+        res.latency = impl_->routes[route].latency.get();
+        impl_->handlers[route](req, res);
+    }
+
+    void App::visit_routes(const std::function<void(Method, std::string_view, const LatencyHistogram&)>& visit) const {
+        for (auto& route: impl_->routes) {
+            visit(route.method, route.path, *route.latency);
+        }
     }
 
     void plain_text(Response& res, std::string body) {
-        res.headers["Content-Type"] = "text/plain";
+        res.set_header(HeaderId::ContentType, "text/plain");
         res.status = Status::OK;
         res.body = std::move(body);
     }
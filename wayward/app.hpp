@@ -2,17 +2,64 @@
 
 #include <functional>
 #include <memory>
+#include <string_view>
 
 #include <wayward/http.hpp>
+#include <wayward/proxy.hpp>
+#include <wayward/static_files.hpp>
+#include <wayward/websocket.hpp>
 
 namespace wayward {
     struct WAYWARD_EXPORT App : IRequestResponder {
+        using Handler = std::function<void(Request&, Response&)>;
+        // Creates the consumer for the body of one request.
+        using BodyConsumerFactory = std::function<std::shared_ptr<IBodyConsumer>(Request&)>;
+        // Creates the handler of one WebSocket connection, or returns null
+        // to refuse it.
+        using WebSocketHandlerFactory = std::function<std::shared_ptr<IWebSocketHandler>(Request&)>;
+
         App();
         ~App();
 
-        void get(const char* path, std::function<void(Request&, Response&)> handler);
+        // Path patterns may contain ":name" captures and a trailing "*name"
+        // wildcard, see Router. Captures end up in Request::params. HEAD
+        // requests without a route of their own go to the GET route.
+        // Requests to a path without a route for their method are answered
+        // with 405 Method Not Allowed, and an Allow field.
+        void route(Method method, const char* path, Handler handler);
+        void get(const char* path, Handler handler);
+        void post(const char* path, Handler handler);
+        void put(const char* path, Handler handler);
+        void del(const char* path, Handler handler);
+
+        // Like route(), but the body is streamed to a consumer made for each
+        // request, instead of being buffered into Request::body. The handler
+        // runs once the whole body has been consumed, and finds the consumer
+        // in Request::body_consumer.
+        void route(Method method, const char* path, BodyConsumerFactory consumer, Handler handler);
+
+        // Serves `files` below `prefix` for GET and HEAD requests, e.g.
+        // mount("/assets", StaticFiles("public")) answers "/assets/app.js"
+        // with "public/app.js".
+        void mount(const char* prefix, StaticFiles files);
+
+        // Forwards the requests below `prefix`, with any method but CONNECT
+        // and TRACE, to the upstreams of `proxy`, with their URLs unchanged.
+        // The proxy must outlive the Server.
+        void proxy(const char* prefix, Proxy& proxy);
+
+        // Accepts WebSocket connections at `path` (see accept_websocket()),
+        // each with a handler made by `handler` for its request. Refused
+        // connections are answered with 403 Forbidden.
+        void websocket(const char* path, WebSocketHandlerFactory handler, bool deflate = false);
+
+        // Calls `visit` with every route, in the order they were added, and
+        // the latency of its requests (see Response::latency). Thread-safe
+        // once the routes have been set up.
+        void visit_routes(const std::function<void(Method, std::string_view path, const LatencyHistogram&)>& visit) const;
 
         // IRequestResponder
+        void begin(Request&) override;
         void respond(Request&, Response&) override;
 
     private:
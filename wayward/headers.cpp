@@ -0,0 +1,144 @@
+#include "wayward/headers.hpp"
+
+namespace wayward {
+    namespace {
+        // Indexed by HeaderId; the names are the prefix without ": ".
+        const std::string_view prefixes[num_header_ids] = {
+            std::string_view(),
+            "Accept: ",
+            "Accept-Encoding: ",
+            "Accept-Language: ",
+            "Accept-Ranges: ",
+            "Age: ",
+            "Authorization: ",
+            "Cache-Control: ",
+            "Connection: ",
+            "Content-Encoding: ",
+            "Content-Length: ",
+            "Content-Range: ",
+            "Content-Type: ",
+            "Cookie: ",
+            "Date: ",
+            "ETag: ",
+            "Expect: ",
+            "Host: ",
+            "HTTP2-Settings: ",
+            "If-Modified-Since: ",
+            "If-None-Match: ",
+            "If-Range: ",
+            "Keep-Alive: ",
+            "Last-Event-ID: ",
+            "Last-Modified: ",
+            "Location: ",
+            "Origin: ",
+            "Range: ",
+            "Referer: ",
+            "Retry-After: ",
+            "Sec-WebSocket-Accept: ",
+            "Sec-WebSocket-Extensions: ",
+            "Sec-WebSocket-Key: ",
+            "Sec-WebSocket-Protocol: ",
+            "Sec-WebSocket-Version: ",
+            "Server: ",
+            "Set-Cookie: ",
+            "Transfer-Encoding: ",
+            "Upgrade: ",
+            "User-Agent: ",
+            "Vary: ",
+            "X-Forwarded-For: ",
+        };
+    }
+
+    HeaderId header_id(std::string_view name) {
+        // Only names of the same length can match.
+        switch (name.size()) {
+            case 3:
+                if (iequals(name, "Age")) return HeaderId::Age;
+                break;
+            case 4:
+                if (iequals(name, "Date")) return HeaderId::Date;
+                if (iequals(name, "ETag")) return HeaderId::ETag;
+                if (iequals(name, "Host")) return HeaderId::Host;
+                if (iequals(name, "Vary")) return HeaderId::Vary;
+                break;
+            case 5:
+                if (iequals(name, "Range")) return HeaderId::Range;
+                break;
+            case 6:
+                if (iequals(name, "Accept")) return HeaderId::Accept;
+                if (iequals(name, "Cookie")) return HeaderId::Cookie;
+                if (iequals(name, "Expect")) return HeaderId::Expect;
+                if (iequals(name, "Origin")) return HeaderId::Origin;
+                if (iequals(name, "Server")) return HeaderId::Server;
+                break;
+            case 7:
+                if (iequals(name, "Referer")) return HeaderId::Referer;
+                if (iequals(name, "Upgrade")) return HeaderId::Upgrade;
+                break;
+            case 8:
+                if (iequals(name, "If-Range")) return HeaderId::IfRange;
+                if (iequals(name, "Location")) return HeaderId::Location;
+                break;
+            case 10:
+                if (iequals(name, "Connection")) return HeaderId::Connection;
+                if (iequals(name, "Keep-Alive")) return HeaderId::KeepAlive;
+                if (iequals(name, "Set-Cookie")) return HeaderId::SetCookie;
+                if (iequals(name, "User-Agent")) return HeaderId::UserAgent;
+                break;
+            case 11:
+                if (iequals(name, "Retry-After")) return HeaderId::RetryAfter;
+                break;
+            case 12:
+                if (iequals(name, "Content-Type")) return HeaderId::ContentType;
+                break;
+            case 13:
+                if (iequals(name, "Accept-Ranges")) return HeaderId::AcceptRanges;
+                if (iequals(name, "Authorization")) return HeaderId::Authorization;
+                if (iequals(name, "Cache-Control")) return HeaderId::CacheControl;
+                if (iequals(name, "Content-Range")) return HeaderId::ContentRange;
+                if (iequals(name, "If-None-Match")) return HeaderId::IfNoneMatch;
+                if (iequals(name, "Last-Event-ID")) return HeaderId::LastEventId;
+                if (iequals(name, "Last-Modified")) return HeaderId::LastModified;
+                break;
+            case 14:
+                if (iequals(name, "Content-Length")) return HeaderId::ContentLength;
+                if (iequals(name, "HTTP2-Settings")) return HeaderId::Http2Settings;
+                break;
+            case 15:
+                if (iequals(name, "Accept-Encoding")) return HeaderId::AcceptEncoding;
+                if (iequals(name, "Accept-Language")) return HeaderId::AcceptLanguage;
+                if (iequals(name, "X-Forwarded-For")) return HeaderId::XForwardedFor;
+                break;
+            case 16:
+                if (iequals(name, "Content-Encoding")) return HeaderId::ContentEncoding;
+                break;
+            case 17:
+                if (iequals(name, "If-Modified-Since")) return HeaderId::IfModifiedSince;
+                if (iequals(name, "Sec-WebSocket-Key")) return HeaderId::SecWebSocketKey;
+                if (iequals(name, "Transfer-Encoding")) return HeaderId::TransferEncoding;
+                break;
+            case 20:
+                if (iequals(name, "Sec-WebSocket-Accept")) return HeaderId::SecWebSocketAccept;
+                break;
+            case 21:
+                if (iequals(name, "Sec-WebSocket-Version")) return HeaderId::SecWebSocketVersion;
+                break;
+            case 22:
+                if (iequals(name, "Sec-WebSocket-Protocol")) return HeaderId::SecWebSocketProtocol;
+                break;
+            case 24:
+                if (iequals(name, "Sec-WebSocket-Extensions")) return HeaderId::SecWebSocketExtensions;
+                break;
+        }
+        return HeaderId::Other;
+    }
+
+    std::string_view header_name(HeaderId id) {
+        auto prefix = header_prefix(id);
+        return prefix.empty() ? prefix : prefix.substr(0, prefix.size() - 2);
+    }
+
+    std::string_view header_prefix(HeaderId id) {
+        return size_t(id) < num_header_ids ? prefixes[size_t(id)] : std::string_view();
+    }
+}
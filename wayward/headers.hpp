@@ -0,0 +1,277 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring> // std::memcpy
+#include <initializer_list>
+#include <memory>
+#include <stddef.h>
+#include <string_view>
+#include <utility> // std::move
+
+#include <wayward/def.hpp>
+
+namespace wayward {
+    // ASCII case-insensitive equality, as for header field names.
+    inline bool iequals(std::string_view a, std::string_view b) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); ++i) {
+            char x = a[i], y = b[i];
+            if (x != y && ((x | 0x20) != (y | 0x20) || (x | 0x20) < 'a' || (x | 0x20) > 'z')) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Whether a comma-separated list, like Upgrade or Connection, contains
+    // `token`, ignoring case.
+    inline bool has_token(std::string_view list, std::string_view token) {
+        while (!list.empty()) {
+            size_t comma = list.find(',');
+            auto item = list.substr(0, comma);
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+            while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) {
+                item.remove_prefix(1);
+            }
+            while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) {
+                item.remove_suffix(1);
+            }
+            if (iequals(item, token)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Header fields known by name. Fields are tagged with their ID when they
+    // are added, so looking up a well-known field compares integers, and
+    // serializing one writes a pre-encoded name.
+    enum class HeaderId : uint8_t {
+        Other,
+        Accept,
+        AcceptEncoding,
+        AcceptLanguage,
+        AcceptRanges,
+        Age,
+        Authorization,
+        CacheControl,
+        Connection,
+        ContentEncoding,
+        ContentLength,
+        ContentRange,
+        ContentType,
+        Cookie,
+        Date,
+        ETag,
+        Expect,
+        Host,
+        Http2Settings,
+        IfModifiedSince,
+        IfNoneMatch,
+        IfRange,
+        KeepAlive,
+        LastEventId,
+        LastModified,
+        Location,
+        Origin,
+        Range,
+        Referer,
+        RetryAfter,
+        SecWebSocketAccept,
+        SecWebSocketExtensions,
+        SecWebSocketKey,
+        SecWebSocketProtocol,
+        SecWebSocketVersion,
+        Server,
+        SetCookie,
+        TransferEncoding,
+        Upgrade,
+        UserAgent,
+        Vary,
+        XForwardedFor,
+    };
+    static constexpr size_t num_header_ids = size_t(HeaderId::XForwardedFor) + 1;
+
+    // The ID of a field name, ignoring case, or HeaderId::Other.
+    HeaderId WAYWARD_EXPORT header_id(std::string_view name);
+    // The canonical spelling, e.g. "Content-Type", or empty for Other.
+    std::string_view WAYWARD_EXPORT header_name(HeaderId);
+    // The canonical spelling followed by ": ", or empty for Other.
+    std::string_view WAYWARD_EXPORT header_prefix(HeaderId);
+
+    struct HeaderField {
+        HeaderField() = default;
+        HeaderField(std::string_view name, std::string_view value)
+            : name(name), value(value), id(header_id(name)) {}
+        HeaderField(HeaderId id, std::string_view value)
+            : name(header_name(id)), value(value), id(id) {}
+
+        std::string_view name;
+        std::string_view value;
+        // Always header_id(name), once the name is complete.
+        HeaderId id = HeaderId::Other;
+    };
+
+    // Header fields in the order they were added. The first
+    // `inline_capacity` fields are stored in the object itself, which is
+    // enough for most requests and responses, so filling in a reused Headers
+    // does not allocate; more spill to the heap. Lookups ignore case.
+    struct Headers {
+        static constexpr size_t inline_capacity = 12;
+
+        using iterator = HeaderField*;
+        using const_iterator = const HeaderField*;
+
+        Headers() = default;
+
+        Headers(std::initializer_list<HeaderField> fields) {
+            for (auto& field: fields) {
+                push_back(field);
+            }
+        }
+
+        Headers(const Headers& other) {
+            *this = other;
+        }
+
+        Headers& operator=(const Headers& other) {
+            if (this != &other) {
+                size_ = 0;
+                reserve(other.size_);
+                std::memcpy(data_, other.data_, other.size_ * sizeof(HeaderField));
+                size_ = other.size_;
+            }
+            return *this;
+        }
+
+        // Takes over the other's heap storage, if any, so views into fields
+        // stay valid as long as the field memory does.
+        Headers(Headers&& other) noexcept {
+            *this = std::move(other);
+        }
+
+        Headers& operator=(Headers&& other) noexcept {
+            if (this == &other) {
+                return *this;
+            }
+            if (other.heap_) {
+                heap_ = std::move(other.heap_);
+                data_ = heap_.get();
+                capacity_ = other.capacity_;
+                size_ = other.size_;
+                other.data_ = other.inline_;
+                other.capacity_ = inline_capacity;
+            }
+            else {
+                *this = static_cast<const Headers&>(other);
+            }
+            other.size_ = 0;
+            return *this;
+        }
+
+        iterator begin() { return data_; }
+        iterator end() { return data_ + size_; }
+        const_iterator begin() const { return data_; }
+        const_iterator end() const { return data_ + size_; }
+
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+        size_t capacity() const { return capacity_; }
+
+        HeaderField& operator[](size_t i) { return data_[i]; }
+        const HeaderField& operator[](size_t i) const { return data_[i]; }
+        HeaderField& back() { return data_[size_ - 1]; }
+        const HeaderField& back() const { return data_[size_ - 1]; }
+
+        // Keeps the capacity.
+        void clear() {
+            size_ = 0;
+        }
+
+        void reserve(size_t capacity) {
+            if (capacity <= capacity_) {
+                return;
+            }
+            size_t grown = capacity_ * 2 > capacity ? capacity_ * 2 : capacity;
+            std::unique_ptr<HeaderField[]> heap(new HeaderField[grown]);
+            std::memcpy(heap.get(), data_, size_ * sizeof(HeaderField));
+            heap_ = std::move(heap);
+            data_ = heap_.get();
+            capacity_ = grown;
+        }
+
+        void push_back(const HeaderField& field) {
+            if (size_ == capacity_) {
+                reserve(size_ + 1);
+            }
+            data_[size_++] = field;
+        }
+
+        // An empty field, for the parser to fill in.
+        HeaderField& emplace_back() {
+            push_back(HeaderField());
+            return back();
+        }
+
+        HeaderField& emplace_back(std::string_view name, std::string_view value) {
+            push_back(HeaderField(name, value));
+            return back();
+        }
+
+        HeaderField& emplace_back(HeaderId id, std::string_view value) {
+            push_back(HeaderField(id, value));
+            return back();
+        }
+
+        // The first field with the ID or name, or null.
+        const HeaderField* find(HeaderId id) const {
+            for (auto& field: *this) {
+                if (field.id == id) {
+                    return &field;
+                }
+            }
+            return nullptr;
+        }
+
+        const HeaderField* find(std::string_view name) const {
+            HeaderId id = header_id(name);
+            if (id != HeaderId::Other) {
+                return find(id);
+            }
+            for (auto& field: *this) {
+                if (field.id == HeaderId::Other && iequals(field.name, name)) {
+                    return &field;
+                }
+            }
+            return nullptr;
+        }
+
+        HeaderField* find(HeaderId id) {
+            return const_cast<HeaderField*>(static_cast<const Headers&>(*this).find(id));
+        }
+
+        HeaderField* find(std::string_view name) {
+            return const_cast<HeaderField*>(static_cast<const Headers&>(*this).find(name));
+        }
+
+        // The value of the first field with the ID or name, or empty.
+        std::string_view get(HeaderId id) const {
+            auto field = find(id);
+            return field ? field->value : std::string_view();
+        }
+
+        std::string_view get(std::string_view name) const {
+            auto field = find(name);
+            return field ? field->value : std::string_view();
+        }
+
+    private:
+        HeaderField* data_ = inline_;
+        size_t size_ = 0;
+        size_t capacity_ = inline_capacity;
+        std::unique_ptr<HeaderField[]> heap_;
+        HeaderField inline_[inline_capacity];
+    };
+}
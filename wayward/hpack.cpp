@@ -0,0 +1,483 @@
+#include "wayward/hpack.hpp"
+
+#include <algorithm>
+
+namespace wayward {
+    namespace {
+        struct StaticField {
+            std::string_view name;
+            std::string_view value;
+        };
+
+        // RFC 7541, Appendix A. Index 1 is the first.
+        const StaticField static_table[] = {
+            {":authority", ""},
+            {":method", "GET"},
+            {":method", "POST"},
+            {":path", "/"},
+            {":path", "/index.html"},
+            {":scheme", "http"},
+            {":scheme", "https"},
+            {":status", "200"},
+            {":status", "204"},
+            {":status", "206"},
+            {":status", "304"},
+            {":status", "400"},
+            {":status", "404"},
+            {":status", "500"},
+            {"accept-charset", ""},
+            {"accept-encoding", "gzip, deflate"},
+            {"accept-language", ""},
+            {"accept-ranges", ""},
+            {"accept", ""},
+            {"access-control-allow-origin", ""},
+            {"age", ""},
+            {"allow", ""},
+            {"authorization", ""},
+            {"cache-control", ""},
+            {"content-disposition", ""},
+            {"content-encoding", ""},
+            {"content-language", ""},
+            {"content-length", ""},
+            {"content-location", ""},
+            {"content-range", ""},
+            {"content-type", ""},
+            {"cookie", ""},
+            {"date", ""},
+            {"etag", ""},
+            {"expect", ""},
+            {"expires", ""},
+            {"from", ""},
+            {"host", ""},
+            {"if-match", ""},
+            {"if-modified-since", ""},
+            {"if-none-match", ""},
+            {"if-range", ""},
+            {"if-unmodified-since", ""},
+            {"last-modified", ""},
+            {"link", ""},
+            {"location", ""},
+            {"max-forwards", ""},
+            {"proxy-authenticate", ""},
+            {"proxy-authorization", ""},
+            {"range", ""},
+            {"referer", ""},
+            {"refresh", ""},
+            {"retry-after", ""},
+            {"server", ""},
+            {"set-cookie", ""},
+            {"strict-transport-security", ""},
+            {"transfer-encoding", ""},
+            {"user-agent", ""},
+            {"vary", ""},
+            {"via", ""},
+            {"www-authenticate", ""},
+        };
+        constexpr size_t num_static_fields = sizeof(static_table) / sizeof(static_table[0]);
+
+        // Bit lengths of the Huffman codes of the 256 octets and of EOS
+        // (RFC 7541, Appendix B).
+        const uint8_t huffman_lengths[257] = {
+            13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+            28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+            6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+            5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+            13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+            7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+            15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+            6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+            20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+            24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+            22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+            21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+            26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+            19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+            20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+            26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+            30,
+        };
+        constexpr unsigned int max_code_length = 30;
+        constexpr uint16_t eos = 256;
+
+        // The code is canonical: the codes of each length follow those of
+        // the shorter ones, and are consecutive in symbol order. So the
+        // lengths determine the codes, and a code of a given length is
+        // decoded by its distance from the first one.
+        struct HuffmanCode {
+            uint32_t codes[257];
+            // The symbols, ordered by code.
+            uint16_t symbols[257];
+            // By length: the first code, where its symbols start, and the
+            // end of its codes, left-aligned to max_code_length bits.
+            uint32_t firsts[max_code_length + 1];
+            uint16_t offsets[max_code_length + 1];
+            uint32_t limits[max_code_length + 1];
+
+            HuffmanCode() {
+                uint16_t counts[max_code_length + 1] = {};
+                for (unsigned int symbol = 0; symbol <= eos; ++symbol) {
+                    ++counts[huffman_lengths[symbol]];
+                }
+                uint32_t code = 0;
+                uint16_t offset = 0;
+                firsts[0] = 0;
+                offsets[0] = 0;
+                limits[0] = 0;
+                for (unsigned int length = 1; length <= max_code_length; ++length) {
+                    code <<= 1;
+                    firsts[length] = code;
+                    offsets[length] = offset;
+                    code += counts[length];
+                    offset += counts[length];
+                    limits[length] = code << (max_code_length - length);
+                }
+                uint32_t next[max_code_length + 1];
+                std::copy(firsts, firsts + max_code_length + 1, next);
+                for (unsigned int symbol = 0; symbol <= eos; ++symbol) {
+                    unsigned int length = huffman_lengths[symbol];
+                    codes[symbol] = next[length]++;
+                    symbols[offsets[length] + codes[symbol] - firsts[length]] = uint16_t(symbol);
+                }
+            }
+
+            // The symbol whose code starts `bits`, a left-aligned window of
+            // max_code_length bits, and the length of its code.
+            uint16_t decode(uint32_t bits, unsigned int& length) const {
+                for (length = 1; bits >= limits[length]; ++length) {}
+                return symbols[offsets[length] + (bits >> (max_code_length - length)) - firsts[length]];
+            }
+        };
+
+        const HuffmanCode& huffman_code() {
+            static const HuffmanCode code;
+            return code;
+        }
+
+        // Calls put(char) for every decoded octet.
+        template <class Put>
+        bool huffman_decode_to(std::string_view in, Put put) {
+            auto& code = huffman_code();
+            constexpr uint32_t window_mask = (uint32_t(1) << max_code_length) - 1;
+            uint64_t bits = 0;
+            unsigned int count = 0;
+            size_t i = 0;
+            for (;;) {
+                while (count < max_code_length && i < in.size()) {
+                    bits = (bits << 8) | uint8_t(in[i++]);
+                    count += 8;
+                }
+                if (count == 0) {
+                    return true;
+                }
+                uint32_t window;
+                if (count >= max_code_length) {
+                    window = uint32_t(bits >> (count - max_code_length)) & window_mask;
+                }
+                else {
+                    // Fill up with ones, like the padding.
+                    unsigned int missing = max_code_length - count;
+                    window = uint32_t((bits << missing) | ((uint64_t(1) << missing) - 1)) & window_mask;
+                }
+                unsigned int length;
+                uint16_t symbol = code.decode(window, length);
+                if (length > count) {
+                    // The end: at most 7 bits of padding, the start of EOS.
+                    uint64_t ones = (uint64_t(1) << count) - 1;
+                    return count < 8 && (bits & ones) == ones;
+                }
+                if (symbol == eos) {
+                    return false;
+                }
+                put(char(symbol));
+                count -= length;
+                bits &= (uint64_t(1) << count) - 1;
+            }
+        }
+
+        void encode_integer(uint64_t value, unsigned int prefix_bits, uint8_t flags, std::string& out) {
+            uint64_t max = (uint64_t(1) << prefix_bits) - 1;
+            if (value < max) {
+                out.push_back(char(flags | value));
+                return;
+            }
+            out.push_back(char(flags | max));
+            value -= max;
+            while (value >= 0x80) {
+                out.push_back(char(0x80 | (value & 0x7f)));
+                value >>= 7;
+            }
+            out.push_back(char(value));
+        }
+
+        bool decode_integer(const uint8_t*& p, const uint8_t* end, unsigned int prefix_bits, uint64_t& value) {
+            uint64_t max = (uint64_t(1) << prefix_bits) - 1;
+            value = *p++ & max;
+            if (value < max) {
+                return true;
+            }
+            // Nothing this end accepts needs more than 4 more octets.
+            for (unsigned int shift = 0; shift <= 28; shift += 7) {
+                if (p == end) {
+                    return false;
+                }
+                uint8_t octet = *p++;
+                value += uint64_t(octet & 0x7f) << shift;
+                if (!(octet & 0x80)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void encode_string(std::string_view str, std::string& out) {
+            size_t huffman_size = huffman_encoded_size(str);
+            if (huffman_size < str.size()) {
+                encode_integer(huffman_size, 7, 0x80, out);
+                huffman_encode(str, out);
+                return;
+            }
+            encode_integer(str.size(), 7, 0, out);
+            out.append(str.data(), str.size());
+        }
+
+        bool decode_string(const uint8_t*& p, const uint8_t* end, util::Arena& arena, std::string_view& str) {
+            if (p == end) {
+                return false;
+            }
+            bool huffman = *p & 0x80;
+            uint64_t len;
+            if (!decode_integer(p, end, 7, len) || len > uint64_t(end - p)) {
+                return false;
+            }
+            std::string_view raw(reinterpret_cast<const char*>(p), size_t(len));
+            p += len;
+            if (!huffman) {
+                str = arena.copy(raw);
+                return true;
+            }
+            // The shortest code has 5 bits.
+            char* decoded = arena.allocate_chars(raw.size() * 8 / 5 + 1);
+            char* q = decoded;
+            if (!huffman_decode_to(raw, [&q](char c) { *q++ = c; })) {
+                return false;
+            }
+            str = std::string_view(decoded, q - decoded);
+            return true;
+        }
+
+        enum class Indexing {
+            Incremental,
+            None,
+            Never,
+        };
+
+        Indexing indexing(std::string_view name, std::string_view value) {
+            // RFC 7541, section 7.1.3.
+            if (name == "authorization" || name == "proxy-authorization" || name == "cookie" || name == "set-cookie") {
+                return Indexing::Never;
+            }
+            // Values that seldom repeat would only push out those that do.
+            if (name == "content-length" || name == "date" || name == "etag" || name == "last-modified" ||
+                name == "age" || name == "content-range" || name == "location" || name == ":path" ||
+                value.size() > HpackEncoder::max_table_size / 4) {
+                return Indexing::None;
+            }
+            return Indexing::Incremental;
+        }
+    }
+
+    size_t huffman_encoded_size(std::string_view str) {
+        size_t bits = 0;
+        for (char c: str) {
+            bits += huffman_lengths[uint8_t(c)];
+        }
+        return (bits + 7) / 8;
+    }
+
+    void huffman_encode(std::string_view str, std::string& out) {
+        auto& code = huffman_code();
+        uint64_t bits = 0;
+        unsigned int count = 0;
+        for (char c: str) {
+            unsigned int length = huffman_lengths[uint8_t(c)];
+            bits = (bits << length) | code.codes[uint8_t(c)];
+            count += length;
+            while (count >= 8) {
+                count -= 8;
+                out.push_back(char(bits >> count));
+            }
+            bits &= (uint64_t(1) << count) - 1;
+        }
+        if (count > 0) {
+            // Padded with the start of EOS.
+            out.push_back(char((bits << (8 - count)) | (0xff >> count)));
+        }
+    }
+
+    bool huffman_decode(std::string_view str, std::string& out) {
+        return huffman_decode_to(str, [&out](char c) { out.push_back(c); });
+    }
+
+    HpackDecoder::Result HpackDecoder::decode(std::string_view block, util::Arena& arena, Headers& headers, size_t max_list_size) {
+        auto p = reinterpret_cast<const uint8_t*>(block.data());
+        auto end = p + block.size();
+        size_t list_size = 0;
+        auto fits = [&](size_t bytes) {
+            return bytes + HpackTable::entry_overhead <= max_list_size - list_size;
+        };
+        bool too_large = false;
+        // Entries are copied, as later fields of the block may evict them,
+        // but only if they fit.
+        auto lookup = [&](uint64_t index, std::string_view* name, std::string_view* value) {
+            if (index == 0) {
+                return false;
+            }
+            if (index <= num_static_fields) {
+                *name = static_table[index - 1].name;
+                if (value) {
+                    *value = static_table[index - 1].value;
+                }
+                return true;
+            }
+            index -= num_static_fields + 1;
+            if (index >= table_.entries.size()) {
+                return false;
+            }
+            auto& entry = table_.entries[size_t(index)];
+            if (!fits(entry.name.size() + (value ? entry.value.size() : 0))) {
+                too_large = true;
+                return false;
+            }
+            *name = arena.copy(entry.name);
+            if (value) {
+                *value = arena.copy(entry.value);
+            }
+            return true;
+        };
+
+        auto add = [&](std::string_view name, std::string_view value) {
+            if (!fits(name.size() + value.size())) {
+                return false;
+            }
+            list_size += name.size() + value.size() + HpackTable::entry_overhead;
+            headers.emplace_back(name, value);
+            return true;
+        };
+
+        bool in_fields = false;
+        while (p < end) {
+            uint8_t first = *p;
+            std::string_view name, value;
+            uint64_t index;
+            if (first & 0x80) {
+                // Indexed field.
+                if (!decode_integer(p, end, 7, index) || !lookup(index, &name, &value)) {
+                    return too_large ? Result::TooLarge : Result::Malformed;
+                }
+                if (!add(name, value)) {
+                    return Result::TooLarge;
+                }
+                in_fields = true;
+                continue;
+            }
+            if ((first & 0xe0) == 0x20) {
+                // Dynamic table size update, only at the start of a block.
+                if (in_fields || !decode_integer(p, end, 5, index) || index > max_table_size) {
+                    return Result::Malformed;
+                }
+                table_.resize(size_t(index));
+                continue;
+            }
+            // Literal field, with incremental indexing, or without (or
+            // never indexed, which makes no difference here).
+            bool incremental = first & 0x40;
+            if (!decode_integer(p, end, incremental ? 6 : 4, index)) {
+                return Result::Malformed;
+            }
+            if (index == 0) {
+                if (!decode_string(p, end, arena, name)) {
+                    return Result::Malformed;
+                }
+            }
+            else if (!lookup(index, &name, nullptr)) {
+                return too_large ? Result::TooLarge : Result::Malformed;
+            }
+            if (!decode_string(p, end, arena, value)) {
+                return Result::Malformed;
+            }
+            if (incremental) {
+                table_.add(name, value);
+            }
+            if (!add(name, value)) {
+                return Result::TooLarge;
+            }
+            in_fields = true;
+        }
+        return Result::Ok;
+    }
+
+    void HpackEncoder::set_max_table_size(size_t bytes) {
+        size_t size = std::min(bytes, max_table_size);
+        if (size != table_.max_size) {
+            table_.resize(size);
+            size_changed_ = true;
+        }
+    }
+
+    void HpackEncoder::encode(std::string_view name, std::string_view value, std::string& out) {
+        if (size_changed_) {
+            encode_integer(table_.max_size, 5, 0x20, out);
+            size_changed_ = false;
+        }
+        lower_name_.assign(name.data(), name.size());
+        for (auto& c: lower_name_) {
+            if (c >= 'A' && c <= 'Z') {
+                c = char(c - 'A' + 'a');
+            }
+        }
+        name = lower_name_;
+        auto mode = indexing(name, value);
+
+        size_t name_index = 0;
+        for (size_t i = 0; i < num_static_fields; ++i) {
+            if (static_table[i].name != name) {
+                continue;
+            }
+            if (static_table[i].value == value) {
+                encode_integer(i + 1, 7, 0x80, out);
+                return;
+            }
+            if (name_index == 0) {
+                name_index = i + 1;
+            }
+        }
+        if (mode != Indexing::Never) {
+            for (size_t i = 0; i < table_.entries.size(); ++i) {
+                auto& entry = table_.entries[i];
+                if (entry.name != name) {
+                    continue;
+                }
+                if (entry.value == value) {
+                    encode_integer(num_static_fields + 1 + i, 7, 0x80, out);
+                    return;
+                }
+                if (name_index == 0) {
+                    name_index = num_static_fields + 1 + i;
+                }
+            }
+        }
+
+        switch (mode) {
+            case Indexing::Incremental: encode_integer(name_index, 6, 0x40, out); break;
+            case Indexing::None:        encode_integer(name_index, 4, 0x00, out); break;
+            case Indexing::Never:       encode_integer(name_index, 4, 0x10, out); break;
+        }
+        if (name_index == 0) {
+            encode_string(name, out);
+        }
+        encode_string(value, out);
+        if (mode == Indexing::Incremental) {
+            table_.add(name, value);
+        }
+    }
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <stddef.h>
+#include <string>
+#include <string_view>
+
+#include <wayward/def.hpp>
+#include <wayward/headers.hpp>
+#include <wayward/util/arena.hpp>
+
+namespace wayward {
+    // HPACK (RFC 7541), the header compression of HTTP/2. A field goes out
+    // as an index into a static table of common fields, or into a dynamic
+    // table of recent ones that both ends keep in step, or as a literal,
+    // Huffman-coded where that is shorter. Every HTTP/2 connection has a
+    // decoder for the header blocks it receives and an encoder for those it
+    // sends. Neither is thread-safe.
+
+    // The dynamic table: the most recent field first, up to max_size bytes,
+    // counting 32 bytes of overhead per field (RFC 7541, section 4.1).
+    struct HpackTable {
+        struct Entry {
+            std::string name;
+            std::string value;
+        };
+        static constexpr size_t entry_overhead = 32;
+
+        std::deque<Entry> entries;
+        size_t size = 0;
+        size_t max_size = 4096;
+
+        // A field larger than the whole table empties it.
+        void add(std::string_view name, std::string_view value) {
+            size_t entry_size = name.size() + value.size() + entry_overhead;
+            if (entry_size > max_size) {
+                entries.clear();
+                size = 0;
+                return;
+            }
+            evict(max_size - entry_size);
+            entries.push_front({std::string(name), std::string(value)});
+            size += entry_size;
+        }
+
+        void resize(size_t bytes) {
+            max_size = bytes;
+            evict(bytes);
+        }
+
+    private:
+        void evict(size_t target) {
+            while (size > target) {
+                auto& last = entries.back();
+                size -= last.name.size() + last.value.size() + entry_overhead;
+                entries.pop_back();
+            }
+        }
+    };
+
+    struct WAYWARD_EXPORT HpackDecoder {
+        // The SETTINGS_HEADER_TABLE_SIZE this end announces, which is the
+        // HTTP/2 default.
+        static constexpr size_t max_table_size = 4096;
+
+        enum class Result {
+            Ok,
+            Malformed,
+            // The fields add up to more than the limit.
+            TooLarge,
+        };
+
+        // Decodes a complete header block, appending its fields to
+        // `headers`, in order, with their names and values in `arena`.
+        // Fields are counted as for SETTINGS_MAX_HEADER_LIST_SIZE, the
+        // length of name and value plus 32 bytes each, and decoding stops
+        // once they add up to more than `max_list_size`. A small block can
+        // otherwise refer to a large table entry over and over. Anything
+        // but Ok is a connection error: the dynamic table is out of step
+        // with the encoder's from then on.
+        Result decode(std::string_view block, util::Arena& arena, Headers& headers, size_t max_list_size);
+
+    private:
+        HpackTable table_;
+    };
+
+    struct WAYWARD_EXPORT HpackEncoder {
+        // The most this end keeps of the table size the peer allows.
+        static constexpr size_t max_table_size = 4096;
+
+        // Applies the peer's SETTINGS_HEADER_TABLE_SIZE. The change is
+        // signalled at the start of the next header block.
+        void set_max_table_size(size_t bytes);
+
+        // Appends a field to the header block in `out`. Names are sent in
+        // lower case, as HTTP/2 requires. Fields are added to the dynamic
+        // table, except those whose values seldom repeat, like
+        // Content-Length and Date; credentials and cookies are marked to
+        // never be indexed, by intermediaries either.
+        void encode(std::string_view name, std::string_view value, std::string& out);
+
+    private:
+        HpackTable table_;
+        bool size_changed_ = false;
+        std::string lower_name_;
+    };
+
+    // Huffman coding of HPACK string literals (RFC 7541, section 5.2).
+    // Exposed for testing.
+    size_t WAYWARD_EXPORT huffman_encoded_size(std::string_view);
+    void WAYWARD_EXPORT huffman_encode(std::string_view, std::string& out);
+    // Returns false for invalid codes or padding.
+    bool WAYWARD_EXPORT huffman_decode(std::string_view, std::string& out);
+}
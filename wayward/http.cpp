@@ -0,0 +1,155 @@
+#include "wayward/http.hpp"
+
+#include <charconv>
+#include <cstring>
+
+#if defined(_MSC_VER)
+#include <io.h> // _close
+#else
+#include <unistd.h> // close
+#endif
+
+namespace wayward {
+    std::string_view method_name(Method method) {
+        switch (method) {
+            case Method::Delete:  return "DELETE";
+            case Method::Get:     return "GET";
+            case Method::Head:    return "HEAD";
+            case Method::Post:    return "POST";
+            case Method::Put:     return "PUT";
+            case Method::Connect: return "CONNECT";
+            case Method::Options: return "OPTIONS";
+            case Method::Trace:   return "TRACE";
+            case Method::Patch:   return "PATCH";
+            case Method::Other:   break;
+        }
+        return "OTHER";
+    }
+
+    std::string_view status_line(Status status) {
+        switch (status) {
+            case Status::SwitchingProtocols:  return "HTTP/1.1 101 Switching Protocols\r\n";
+            case Status::OK:                  return "HTTP/1.1 200 OK\r\n";
+            case Status::Created:             return "HTTP/1.1 201 Created\r\n";
+            case Status::Accepted:            return "HTTP/1.1 202 Accepted\r\n";
+            case Status::NoContent:           return "HTTP/1.1 204 No Content\r\n";
+            case Status::PartialContent:      return "HTTP/1.1 206 Partial Content\r\n";
+            case Status::MovedPermanently:    return "HTTP/1.1 301 Moved Permanently\r\n";
+            case Status::Found:               return "HTTP/1.1 302 Found\r\n";
+            case Status::SeeOther:            return "HTTP/1.1 303 See Other\r\n";
+            case Status::NotModified:         return "HTTP/1.1 304 Not Modified\r\n";
+            case Status::TemporaryRedirect:   return "HTTP/1.1 307 Temporary Redirect\r\n";
+            case Status::PermanentRedirect:   return "HTTP/1.1 308 Permanent Redirect\r\n";
+            case Status::BadRequest:          return "HTTP/1.1 400 Bad Request\r\n";
+            case Status::Unauthorized:        return "HTTP/1.1 401 Unauthorized\r\n";
+            case Status::Forbidden:           return "HTTP/1.1 403 Forbidden\r\n";
+            case Status::NotFound:            return "HTTP/1.1 404 Not Found\r\n";
+            case Status::MethodNotAllowed:    return "HTTP/1.1 405 Method Not Allowed\r\n";
+            case Status::RequestTimeout:      return "HTTP/1.1 408 Request Timeout\r\n";
+            case Status::PayloadTooLarge:     return "HTTP/1.1 413 Payload Too Large\r\n";
+            case Status::RangeNotSatisfiable: return "HTTP/1.1 416 Range Not Satisfiable\r\n";
+            case Status::UpgradeRequired:     return "HTTP/1.1 426 Upgrade Required\r\n";
+            case Status::InternalServerError: return "HTTP/1.1 500 Internal Server Error\r\n";
+            case Status::NotImplemented:      return "HTTP/1.1 501 Not Implemented\r\n";
+            case Status::BadGateway:          return "HTTP/1.1 502 Bad Gateway\r\n";
+            case Status::ServiceUnavailable:  return "HTTP/1.1 503 Service Unavailable\r\n";
+            case Status::GatewayTimeout:      return "HTTP/1.1 504 Gateway Timeout\r\n";
+        }
+        return std::string_view();
+    }
+
+    File::~File() {
+#if defined(_MSC_VER)
+        ::_close(fd_);
+#else
+        ::close(fd_);
+#endif
+    }
+
+    namespace {
+        // The head is produced through a sink, so the same code measures it,
+        // writes it to preallocated memory, or appends it to a string.
+        struct CountSink {
+            size_t size = 0;
+            void append(std::string_view str) { size += str.size(); }
+        };
+
+        struct PointerSink {
+            char* p;
+            void append(std::string_view str) {
+                std::memcpy(p, str.data(), str.size());
+                p += str.size();
+            }
+        };
+
+        struct StringSink {
+            std::string& out;
+            void append(std::string_view str) { out += str; }
+        };
+
+        template <class Sink>
+        void append_number(Sink& sink, uint64_t n) {
+            char digits[20];
+            auto result = std::to_chars(digits, digits + sizeof(digits), n);
+            sink.append(std::string_view(digits, result.ptr - digits));
+        }
+
+        template <class Sink>
+        void write_head(const Response& res, Sink& sink, bool chunked) {
+            auto line = status_line(res.status);
+            if (!line.empty()) {
+                sink.append(line);
+            }
+            else {
+                sink.append("HTTP/1.1 ");
+                append_number(sink, size_t(res.status));
+                sink.append(" \r\n");
+            }
+            for (auto& field: res.headers) {
+                if (field.id == HeaderId::ContentLength || field.id == HeaderId::TransferEncoding) {
+                    // The framing is ours, so it cannot contradict the body.
+                    continue;
+                }
+                if (field.id != HeaderId::Other) {
+                    sink.append(header_prefix(field.id));
+                }
+                else {
+                    sink.append(field.name);
+                    sink.append(": ");
+                }
+                sink.append(field.value);
+                sink.append("\r\n");
+            }
+            bool known = res.content_length != Response::unknown_length;
+            if (!has_body(res.status) && !(known && res.status == Status::NotModified)) {
+                sink.append("\r\n");
+                return;
+            }
+            if (res.body_producer && !known) {
+                // Otherwise the body ends with the connection.
+                sink.append(chunked ? "Transfer-Encoding: chunked\r\n\r\n" : "\r\n");
+                return;
+            }
+            sink.append("Content-Length: ");
+            append_number(sink, known ? res.content_length : body_size(res));
+            sink.append("\r\n\r\n");
+        }
+    }
+
+    size_t head_size(const Response& res, bool chunked) {
+        CountSink sink;
+        write_head(res, sink, chunked);
+        return sink.size;
+    }
+
+    char* serialize_head(const Response& res, char* out, bool chunked) {
+        PointerSink sink{out};
+        write_head(res, sink, chunked);
+        return sink.p;
+    }
+
+    void serialize_head(const Response& res, std::string& out, bool chunked) {
+        StringSink sink{out};
+        write_head(res, sink, chunked);
+    }
+}
@@ -1,35 +1,370 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
-#include <map>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 #include <wayward/def.hpp>
+#include <wayward/headers.hpp>
+#include <wayward/util/arena.hpp>
 
 namespace wayward {
     enum class Status {
+        SwitchingProtocols = 101,
         OK = 200,
+        Created = 201,
+        Accepted = 202,
+        NoContent = 204,
+        PartialContent = 206,
+        MovedPermanently = 301,
+        Found = 302,
+        SeeOther = 303,
+        NotModified = 304,
+        TemporaryRedirect = 307,
+        PermanentRedirect = 308,
+        BadRequest = 400,
+        Unauthorized = 401,
+        Forbidden = 403,
+        NotFound = 404,
+        MethodNotAllowed = 405,
+        RequestTimeout = 408,
+        PayloadTooLarge = 413,
+        RangeNotSatisfiable = 416,
+        UpgradeRequired = 426,
         InternalServerError = 500,
+        NotImplemented = 501,
+        BadGateway = 502,
+        ServiceUnavailable = 503,
+        GatewayTimeout = 504,
     };
 
+    enum class Method {
+        Delete,
+        Get,
+        Head,
+        Post,
+        Put,
+        Connect,
+        Options,
+        Trace,
+        Patch,
+        Other,
+    };
+    static constexpr size_t num_methods = size_t(Method::Other) + 1;
+
+    // "GET", "POST", ..., or "OTHER".
+    std::string_view WAYWARD_EXPORT method_name(Method);
+
+    using Param = std::pair<std::string_view, std::string_view>;
+
+    struct Response;
+    struct LatencyHistogram;
+    struct IWebSocketHandler;
+
+    // Refers to the connection a request arrived on, and for HTTP/2, to its
+    // stream. Handles can be copied to, and used from, any thread, but must
+    // not outlive the Server. Once the connection has closed, operations on
+    // its handles do nothing.
+    struct WAYWARD_EXPORT ConnectionHandle {
+        ConnectionHandle() = default;
+
+        // Resumes reading a request body that a consumer paused (see
+        // IBodyConsumer::consume()).
+        void resume_body() const;
+        // Resumes a response body that its producer left waiting (see
+        // IBodyProducer::produce()).
+        void resume_response() const;
+        // Sends the response to a deferred request (see Request::defer()).
+        // Must be called exactly once per deferred request.
+        void complete(Response response) const;
+        // Runs `fn` on the connection's event loop, unless the connection has
+        // closed by then. A connection with a deferred response stays open
+        // for this until the response is completed.
+        void post(std::function<void()> fn) const;
+        // The asio::io_service of the connection's event loop (this header
+        // does not include asio), for responders that do their own I/O
+        // there, like Proxy. Null for an empty handle.
+        void* io_service() const;
+
+        explicit operator bool() const {
+            return host_ != nullptr;
+        }
+
+    private:
+        friend struct Server;
+        friend struct WebSocket;
+        struct Host;
+        ConnectionHandle(Host* host, uint32_t slot, uint32_t generation, uint32_t stream)
+            : host_(host), slot_(slot), generation_(generation), stream_(stream) {}
+
+        Host* host_ = nullptr;
+        uint32_t slot_ = 0;
+        uint32_t generation_ = 0;
+        uint32_t stream_ = 0; // 0 for HTTP/1.1
+    };
+
+    struct Request;
+
+    // Receives a request body piece by piece, as it arrives, instead of it
+    // being buffered into Request::body.
+    struct IBodyConsumer {
+        virtual ~IBodyConsumer() {}
+
+        // `data` is only valid during the call. Returning false pauses
+        // reading from the connection until ConnectionHandle::resume_body()
+        // is called, so a slow consumer holds back the client instead of
+        // piling up data in the server.
+        virtual bool consume(Request&, std::string_view data) = 0;
+    };
+
+    // All fields of a Request are views into memory owned by the connection
+    // that received it, and are only valid until the response has been sent.
+    //
+    // A responder that would hold up its event loop, waiting for I/O or
+    // doing heavy work, can defer() the response and complete it later, on
+    // any thread.
     struct Request {
-        // TODO: Use string_view for all of this
-        std::string url;
-        std::map<std::string, std::string> headers;
-        std::string body;
+        static constexpr size_t default_max_body_size = 1024 * 1024;
+
+        Method method = Method::Get;
+        std::string_view url;
+        Headers headers;
+        std::string_view body;
+
+        ConnectionHandle connection;
+
+        // Set by IRequestResponder::begin() to stream the body; `body` then
+        // stays empty. Released once the request has been responded to.
+        std::shared_ptr<IBodyConsumer> body_consumer;
+        // Buffered bodies larger than this are refused with 413 Payload Too
+        // Large. Defaults to Server::max_body_size(), and may be changed by
+        // IRequestResponder::begin().
+        size_t max_body_size = default_max_body_size;
+
+        // Captures from the matched route, e.g. {"id", "123"} for "/users/:id".
+        std::vector<Param> params;
+
+        // Set by defer().
+        bool deferred = false;
+
+        // Called by IRequestResponder::respond() instead of filling in its
+        // Response: the response is sent once it is passed to complete() on
+        // the returned handle, from any thread. Until then, the connection
+        // reads no further requests, and the Request stays valid (but must
+        // not be modified).
+        ConnectionHandle defer() {
+            deferred = true;
+            return connection;
+        }
+
+        // The value of the first field with the name, ignoring case.
+        std::string_view header(std::string_view name) const {
+            return headers.get(name);
+        }
+
+        std::string_view header(HeaderId id) const {
+            return headers.get(id);
+        }
+
+        std::string_view param(std::string_view name) const {
+            for (auto& pair: params) {
+                if (pair.first == name) {
+                    return pair.second;
+                }
+            }
+            return std::string_view();
+        }
+    };
+
+    // Produces a response body piece by piece. The head is sent as soon as
+    // the response is complete, with "Transfer-Encoding: chunked" instead of
+    // Content-Length, and every piece goes out as one chunk; unless the
+    // length is known in advance (see Response::content_length). HTTP/1.0
+    // clients get the pieces as they are, and the connection closes after
+    // the last.
+    struct IBodyProducer {
+        enum State {
+            More,    // Call again once this piece has been written.
+            Waiting, // Call again after ConnectionHandle::resume_response().
+            Done,    // This was the last piece.
+            Failed,  // The body cannot be completed. The connection is
+                     // closed (HTTP/1.1), or the stream reset (HTTP/2),
+                     // without ending the body, so the client does not
+                     // take what it got for all of it.
+        };
+
+        virtual ~IBodyProducer() {}
+
+        // Appends the next piece of the body to `out`, which is empty. Called
+        // on the connection's thread, whenever the previous piece has been
+        // written, so a producer never runs ahead of the client.
+        virtual State produce(std::string& out) = 0;
+
+        // Like produce(), but the piece may end with buffers shared with
+        // other responses, like an event published to many subscribers,
+        // which are appended to `shared`. Over HTTP/1.1 they are written
+        // where they are, after `out`, and released once written; over
+        // HTTP/2 they are copied into the piece's frames.
+        virtual State produce_shared(std::string& out, std::vector<std::shared_ptr<const std::string>>& shared) {
+            return produce(out);
+        }
+    };
+
+    // An open file descriptor, closed with the last reference.
+    struct WAYWARD_EXPORT File {
+        explicit File(int fd) : fd_(fd) {}
+        ~File();
+
+        File(const File&) = delete;
+        File& operator=(const File&) = delete;
+
+        int fd() const {
+            return fd_;
+        }
+
+    private:
+        int fd_;
     };
 
     struct Response {
-        Status status;
+        Status status = Status::OK;
 
-        // TODO: Use string_view for all of this
-        std::map<std::string, std::string> headers;
+        // Views, normally into `arena` (see set_header()).
+        Headers headers;
         std::string body;
+
+        // Alternatives to `body`, which are sent without copying them:
+        // - body_producer, if set, streams the body.
+        // - file, if set, sends `file_length` bytes from `file_offset`, with
+        //   sendfile(2) where available.
+        // - shared_owner, if set, sends `shared_body`, memory shared with
+        //   other responses (e.g. a cache). Header views may point into it,
+        //   too: the owner is kept alive until the response has been sent.
+        std::shared_ptr<IBodyProducer> body_producer;
+        std::shared_ptr<const File> file;
+        uint64_t file_offset = 0;
+        uint64_t file_length = 0;
+        std::shared_ptr<const void> shared_owner;
+        std::string_view shared_body;
+
+        // The length of a body that is not all there, if it is known: that
+        // of a body_producer, whose pieces then go out as they are, with
+        // this Content-Length, instead of chunked (a producer that ends
+        // short of it, or goes beyond, fails, see IBodyProducer::Failed);
+        // or that of the body a response to a HEAD request, or a 304 Not
+        // Modified, describes without it. Otherwise the length of the body
+        // that is sent is used.
+        static constexpr uint64_t unknown_length = uint64_t(-1);
+        uint64_t content_length = unknown_length;
+
+        // Set by accept_websocket() (see websocket.hpp) on a 101 response to
+        // an HTTP/1.1 request asking to upgrade: once the response has been
+        // written, the connection speaks WebSocket, and the handler gets its
+        // messages. Ignored on other responses.
+        std::shared_ptr<IWebSocketHandler> websocket;
+
+        // If set, the server records the time from the first byte of the
+        // request until the response has been written (see App, which sets
+        // one per route).
+        LatencyHistogram* latency = nullptr;
+
+        // Backs the header fields and the serialized head of this response.
+        // The server reuses Response objects, and resets the arena once the
+        // response has been written.
+        util::Arena arena;
+
+        // Copies the value into the arena, replacing the value of any
+        // existing field with the same name (ignoring case). Well-known names
+        // are not copied, but replaced with their canonical spelling.
+        void set_header(std::string_view name, std::string_view value) {
+            HeaderId id = header_id(name);
+            if (id != HeaderId::Other) {
+                set_header(id, value);
+                return;
+            }
+            value = arena.copy(value);
+            if (auto field = headers.find(name)) {
+                field->value = value;
+                return;
+            }
+            headers.emplace_back(arena.copy(name), value);
+        }
+
+        void set_header(HeaderId id, std::string_view value) {
+            value = arena.copy(value);
+            if (auto field = headers.find(id)) {
+                field->value = value;
+                return;
+            }
+            headers.emplace_back(id, value);
+        }
+
+        std::string_view header(std::string_view name) const {
+            return headers.get(name);
+        }
+
+        std::string_view header(HeaderId id) const {
+            return headers.get(id);
+        }
     };
 
+    // 1xx, 204 and 304 responses never have a body, nor (but 304) a
+    // Content-Length.
+    inline bool has_body(Status status) {
+        return int(status) >= 200 && status != Status::NoContent && status != Status::NotModified;
+    }
+
+    // Length of the body, from whichever source is set. Meaningless with a
+    // body_producer.
+    inline uint64_t body_size(const Response& res) {
+        if (res.file) {
+            return res.file_length;
+        }
+        if (res.shared_owner) {
+            return res.shared_body.size();
+        }
+        return res.body.size();
+    }
+
+    // Pre-encoded "HTTP/1.1 <code> <reason>\r\n", or empty for unknown codes.
+    std::string_view WAYWARD_EXPORT status_line(Status);
+
+    // Serializes the status line and headers of the response, including the
+    // empty line that ends them. The body is left out, so it can be written
+    // directly from the Response without copying. The framing fields are
+    // always the serializer's own: Content-Length and Transfer-Encoding
+    // fields among the headers are left out. The Content-Length is
+    // Response::content_length where it is known, and otherwise the body's.
+    // Without `chunked`, for HTTP/1.0 clients, which do not know chunked
+    // encoding, the body of a body_producer of unknown length goes out as
+    // it is, and ends when the connection closes.
+    size_t WAYWARD_EXPORT head_size(const Response&, bool chunked = true);
+    // Writes exactly head_size() bytes to `out`, and returns the end.
+    WAYWARD_EXPORT char* serialize_head(const Response&, char* out, bool chunked = true);
+    // Appends to `out`.
+    void WAYWARD_EXPORT serialize_head(const Response&, std::string& out, bool chunked = true);
+
     struct WAYWARD_EXPORT IRequestResponder {
         virtual ~IRequestResponder() {}
 
-        // Attention: This function must be thread-safe!
+        // Called once the headers of a request have been received, before
+        // its body. May set Request::body_consumer or max_body_size.
+        virtual void begin(Request&) {}
+
+        // Attention: This function must be thread-safe! Runs on the event
+        // loop of the connection, unless the response is deferred (see
+        // Request::defer()).
         virtual void respond(Request&, Response&) = 0;
+
+        // Called with the response to a deferred request once it has been
+        // completed, on the event loop of the connection, before it is sent
+        // (or dropped, if the connection has closed in the meantime). Lets a
+        // responder in front of another, like ResponseCache, see responses
+        // that respond() did not.
+        virtual void completed(Request&, Response&) {}
     };
 }
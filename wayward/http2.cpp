@@ -0,0 +1,1325 @@
+#include "wayward/server_impl.hpp"
+
+namespace wayward {
+    namespace {
+        // HTTP/2 framing (RFC 9113, section 4).
+        constexpr std::string_view http2_preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+        constexpr size_t frame_header_size = 9;
+        constexpr uint32_t default_max_frame_size = 16384;
+        constexpr int64_t default_window = 65535;
+        constexpr int64_t max_window = 0x7fffffff;
+        constexpr uint64_t no_length = uint64_t(-1);
+
+        enum class FrameType : uint8_t {
+            Data,
+            Headers,
+            Priority,
+            RstStream,
+            Settings,
+            PushPromise,
+            Ping,
+            GoAway,
+            WindowUpdate,
+            Continuation,
+        };
+
+        namespace frame_flag {
+            constexpr uint8_t EndStream = 0x1;
+            constexpr uint8_t Ack = 0x1;
+            constexpr uint8_t EndHeaders = 0x4;
+            constexpr uint8_t Padded = 0x8;
+            constexpr uint8_t Priority = 0x20;
+        }
+
+        enum class Setting : uint16_t {
+            HeaderTableSize = 1,
+            EnablePush,
+            MaxConcurrentStreams,
+            InitialWindowSize,
+            MaxFrameSize,
+            MaxHeaderListSize,
+        };
+
+        enum class Http2Error : uint32_t {
+            NoError,
+            ProtocolError,
+            InternalError,
+            FlowControlError,
+            SettingsTimeout,
+            StreamClosed,
+            FrameSizeError,
+            RefusedStream,
+            Cancel,
+            CompressionError,
+            ConnectError,
+            EnhanceYourCalm,
+            InadequateSecurity,
+            Http11Required,
+        };
+
+        uint32_t read_u32(const char* p) {
+            auto q = reinterpret_cast<const unsigned char*>(p);
+            return uint32_t(q[0]) << 24 | uint32_t(q[1]) << 16 | uint32_t(q[2]) << 8 | q[3];
+        }
+
+        void append_u16(std::string& out, uint32_t n) {
+            out.push_back(char(n >> 8));
+            out.push_back(char(n));
+        }
+
+        void append_u32(std::string& out, uint32_t n) {
+            append_u16(out, n >> 16);
+            append_u16(out, n);
+        }
+
+        void append_frame_header(std::string& out, size_t length, FrameType type, uint8_t flags, uint32_t stream) {
+            char header[frame_header_size] = {
+                char(length >> 16), char(length >> 8), char(length),
+                char(type), char(flags),
+                char(stream >> 24), char(stream >> 16), char(stream >> 8), char(stream),
+            };
+            out.append(header, sizeof(header));
+        }
+
+        // The payload of HTTP2-Settings: base64url, without padding (RFC
+        // 4648, section 5).
+        bool decode_base64url(std::string_view in, std::string& out) {
+            uint32_t bits = 0;
+            int num_bits = 0;
+            for (char c: in) {
+                int value;
+                if (c >= 'A' && c <= 'Z') value = c - 'A';
+                else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+                else if (c >= '0' && c <= '9') value = c - '0' + 52;
+                else if (c == '-') value = 62;
+                else if (c == '_') value = 63;
+                else if (c == '=') break;
+                else return false;
+                bits = bits << 6 | uint32_t(value);
+                num_bits += 6;
+                if (num_bits >= 8) {
+                    num_bits -= 8;
+                    out.push_back(char(bits >> num_bits));
+                }
+            }
+            return true;
+        }
+
+        Method method_from_name(std::string_view name) {
+            for (size_t i = 0; i < size_t(Method::Other); ++i) {
+                if (method_name(Method(i)) == name) {
+                    return Method(i);
+                }
+            }
+            return Method::Other;
+        }
+
+        // Fields that apply to a single HTTP/1.1 connection, which HTTP/2
+        // forbids (RFC 9113, section 8.2.2).
+        bool connection_specific(const HeaderField& field) {
+            switch (field.id) {
+                case HeaderId::Connection:
+                case HeaderId::KeepAlive:
+                case HeaderId::TransferEncoding:
+                case HeaderId::Upgrade:
+                case HeaderId::Http2Settings:
+                    return true;
+                default:
+                    return field.id == HeaderId::Other && iequals(field.name, "proxy-connection");
+            }
+        }
+    }
+
+    // An HTTP/2 connection over cleartext (h2c, RFC 9113). The client starts
+    // it with the connection preface, knowing that the server speaks HTTP/2
+    // (prior knowledge), or by upgrading its first HTTP/1.1 request. The
+    // session then takes over the client's input, parsing frames instead of
+    // HTTP/1.1, and its output, which it frames from the responses of the
+    // connection's streams.
+    //
+    // Every stream carries one request, which goes to the responder as soon
+    // as it is complete, so the requests of concurrent streams are answered
+    // in whatever order their responses are ready, deferred or not. Each
+    // stream has its own Request, arena and Outgoing, pooled like the
+    // client's. Request bodies are flow-controlled per stream: the window
+    // given to the client is only extended as data is consumed, so a body
+    // consumer that pauses holds back its own stream and no other. Response
+    // bodies go out as the client's windows allow, a frame per stream in
+    // turn, gathered into one write with the bodies referenced where they
+    // are.
+    struct Server::Http2Session::Impl {
+        using Outgoing = ClientBase::Outgoing;
+
+        static constexpr size_t max_streams = 128;
+        static constexpr int64_t stream_window = 256 * 1024;
+        static constexpr int64_t connection_window = 1024 * 1024;
+        static constexpr size_t max_header_block = 64 * 1024;
+        // Reading pauses while this much is waiting to be written, so a
+        // client that does not read cannot pile up control frames.
+        static constexpr size_t max_pending_frames = 64 * 1024;
+        static constexpr size_t max_pooled_streams = 16;
+
+        struct Stream {
+            uint32_t id = 0;
+            Request request;
+            util::Arena arena; // The request's fields.
+            std::string body;
+            uint64_t declared_length = no_length;
+            uint64_t received_length = 0;
+            int64_t recv_window = stream_window;
+            int64_t unacked = 0; // Consumed, but not yet given back.
+            bool remote_closed = false; // END_STREAM received.
+            bool body_paused = false;
+            std::string paused_data; // Arrived while the consumer was paused.
+            bool responded = false;
+            bool deferred = false;
+            bool refused = false; // Answered before its body arrived.
+            bool reset = false; // RST_STREAM sent or received.
+            bool done = false; // To be released (see sweep()).
+
+            Outgoing out;
+            int64_t send_window = default_window;
+            bool head_sent = false;
+            bool end_sent = false; // END_STREAM queued.
+            bool in_flight = false; // The write in flight refers to it.
+            std::string_view data; // What is left of the current piece.
+            bool more = false; // A producer or a file has more pieces.
+            bool producer_waiting = false;
+
+            explicit Stream(util::BufferPool& pool) : arena(pool) {
+                out.response.arena = util::Arena(pool);
+            }
+        };
+
+        ClientBase& client;
+        HpackDecoder decoder;
+        HpackEncoder encoder;
+        std::vector<std::unique_ptr<Stream>> streams;
+        std::vector<std::unique_ptr<Stream>> pooled_streams;
+        size_t next_stream = 0; // Goes first in the next flush().
+        uint32_t last_stream_id = 0;
+        size_t num_deferred = 0;
+
+        bool preface_received = false;
+        bool settings_received = false;
+        std::string input; // An incomplete frame.
+        uint32_t header_stream = 0; // Whose header block continues, if any.
+        bool header_end_stream = false;
+        std::string header_block;
+        Headers fields;
+        util::Arena scratch; // For header blocks that are decoded and dropped.
+        int64_t recv_window = default_window;
+        int64_t unacked = 0;
+
+        uint32_t peer_max_frame_size = default_max_frame_size;
+        int64_t peer_initial_window = default_window;
+        int64_t send_window = default_window;
+        // Frames to write next, and those being written. Bodies are not
+        // copied: `segments` interleaves ranges of `frames` with them.
+        std::string frames;
+        std::string frames_in_flight;
+        size_t frames_covered = 0;
+        struct Segment {
+            const char* data; // Null for a range of frames_in_flight.
+            size_t offset;
+            size_t size;
+        };
+        std::vector<Segment> segments;
+        std::string block; // Encoded headers.
+        bool going_away = false; // GOAWAY sent.
+        bool peer_going_away = false;
+        bool failed = false;
+
+        explicit Impl(ClientBase& client) : client(client), scratch(client.loop.buffer_pool) {
+            // Frames are batched into writes already, and a frame held back
+            // for the ACK of the previous one would stall a stream whose
+            // window the client only extends once it has the frame.
+            client.set_no_delay();
+            // The server's connection preface: its settings, and more room
+            // for request bodies.
+            append_frame_header(frames, 3 * 6, FrameType::Settings, 0, 0);
+            append_setting(Setting::MaxConcurrentStreams, max_streams);
+            append_setting(Setting::InitialWindowSize, stream_window);
+            append_setting(Setting::MaxHeaderListSize, max_header_block);
+            window_update(0, connection_window - default_window);
+            recv_window = connection_window;
+        }
+
+        // Continues the HTTP/1.1 request that asked for the upgrade as stream
+        // 1, whose response is the first to go out over HTTP/2.
+        void upgrade(Request& req) {
+            frames.insert(0, "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+            std::string settings;
+            decode_base64url(req.header(HeaderId::Http2Settings), settings);
+            if (!apply_settings(settings)) {
+                return;
+            }
+            last_stream_id = 1;
+            auto& stream = open_stream(1);
+            auto& upgraded = stream.request;
+            upgraded.method = req.method;
+            upgraded.url = stream.arena.copy(req.url);
+            for (auto& field: req.headers) {
+                if (!connection_specific(field)) {
+                    upgraded.headers.emplace_back(stream.arena.copy(field.name), stream.arena.copy(field.value));
+                }
+            }
+            stream.body.assign(req.body.data(), req.body.size());
+            stream.received_length = req.body.size();
+            upgraded.body_consumer = std::move(req.body_consumer);
+            upgraded.max_body_size = req.max_body_size;
+            upgraded.connection = client.handle(1);
+            stream.out.request_started = client.request_started;
+            stream.remote_closed = true;
+            finish_request(stream);
+        }
+
+        void received(const char* data, size_t len) {
+            if (input.empty()) {
+                size_t used = parse(data, len);
+                input.assign(data + used, len - used);
+            }
+            else {
+                input.append(data, len);
+                input.erase(0, parse(input.data(), input.size()));
+            }
+            give_back_windows();
+            sweep();
+            check_done();
+        }
+
+        // Handles the complete frames, and returns how much of `data` they
+        // took up.
+        size_t parse(const char* data, size_t len) {
+            if (failed) {
+                return len;
+            }
+            size_t used = 0;
+            if (!preface_received) {
+                size_t n = std::min(len, http2_preface.size());
+                if (std::memcmp(data, http2_preface.data(), n) != 0) {
+                    fail(Http2Error::ProtocolError);
+                    return len;
+                }
+                if (n < http2_preface.size()) {
+                    return 0;
+                }
+                preface_received = true;
+                used = n;
+            }
+            while (len - used >= frame_header_size) {
+                const char* header = data + used;
+                size_t length = read_u32(header) >> 8;
+                if (length > default_max_frame_size) {
+                    fail(Http2Error::FrameSizeError);
+                    return len;
+                }
+                if (len - used < frame_header_size + length) {
+                    break;
+                }
+                used += frame_header_size + length;
+                frame(FrameType(header[3]), uint8_t(header[4]), read_u32(header + 5) & 0x7fffffff, std::string_view(header + frame_header_size, length));
+                if (failed) {
+                    return len;
+                }
+            }
+            return used;
+        }
+
+        void frame(FrameType type, uint8_t flags, uint32_t id, std::string_view payload) {
+            // The client's preface ends with its SETTINGS, and nothing may
+            // interrupt a header block.
+            if ((!settings_received && type != FrameType::Settings) || (header_stream != 0 && type != FrameType::Continuation)) {
+                fail(Http2Error::ProtocolError);
+                return;
+            }
+            switch (type) {
+                case FrameType::Data:         on_data(flags, id, payload); return;
+                case FrameType::Headers:      on_headers(flags, id, payload); return;
+                case FrameType::Priority:     on_priority(id, payload); return;
+                case FrameType::RstStream:    on_rst_stream(id, payload); return;
+                case FrameType::Settings:     on_settings(flags, id, payload); return;
+                case FrameType::PushPromise:  fail(Http2Error::ProtocolError); return;
+                case FrameType::Ping:         on_ping(flags, id, payload); return;
+                case FrameType::GoAway:       on_goaway(id, payload); return;
+                case FrameType::WindowUpdate: on_window_update(id, payload); return;
+                case FrameType::Continuation: on_continuation(flags, id, payload); return;
+            }
+            // Unknown frame types are ignored.
+        }
+
+        // Removes the padding of DATA and HEADERS frames.
+        bool unpad(uint8_t flags, std::string_view& payload) {
+            if (!(flags & frame_flag::Padded)) {
+                return true;
+            }
+            if (payload.empty() || size_t(uint8_t(payload[0])) >= payload.size()) {
+                fail(Http2Error::ProtocolError);
+                return false;
+            }
+            size_t padding = uint8_t(payload[0]);
+            payload = payload.substr(1, payload.size() - 1 - padding);
+            return true;
+        }
+
+        void on_data(uint8_t flags, uint32_t id, std::string_view payload) {
+            if (id == 0) {
+                fail(Http2Error::ProtocolError);
+                return;
+            }
+            // Padding counts against the windows, too.
+            int64_t length = int64_t(payload.size());
+            if (!unpad(flags, payload)) {
+                return;
+            }
+            recv_window -= length;
+            if (recv_window < 0) {
+                fail(Http2Error::FlowControlError);
+                return;
+            }
+            unacked += length;
+            Stream* stream = find(id);
+            if (!stream) {
+                if (id > last_stream_id) {
+                    fail(Http2Error::ProtocolError);
+                }
+                return;
+            }
+            if (stream->remote_closed) {
+                reset_stream(*stream, Http2Error::StreamClosed);
+                return;
+            }
+            stream->recv_window -= length;
+            if (stream->recv_window < 0) {
+                reset_stream(*stream, Http2Error::FlowControlError);
+                return;
+            }
+            stream->unacked += length - int64_t(payload.size());
+            stream->received_length += payload.size();
+            if (!stream->reset && !stream->refused && !payload.empty()) {
+                consume(*stream, payload);
+            }
+            if (flags & frame_flag::EndStream) {
+                end_of_stream(*stream);
+            }
+        }
+
+        void consume(Stream& stream, std::string_view data) {
+            auto& req = stream.request;
+            if (req.body_consumer) {
+                if (stream.body_paused) {
+                    stream.paused_data.append(data.data(), data.size());
+                    return;
+                }
+                stream.unacked += int64_t(data.size());
+                if (!req.body_consumer->consume(req, data)) {
+                    stream.body_paused = true;
+                }
+                return;
+            }
+            if (stream.body.size() + data.size() > req.max_body_size) {
+                refuse(stream, Status::PayloadTooLarge);
+                return;
+            }
+            stream.unacked += int64_t(data.size());
+            stream.body.append(data.data(), data.size());
+        }
+
+        void on_headers(uint8_t flags, uint32_t id, std::string_view payload) {
+            if (id == 0 || !unpad(flags, payload)) {
+                fail(Http2Error::ProtocolError);
+                return;
+            }
+            if (flags & frame_flag::Priority) {
+                // Priorities are not used.
+                if (payload.size() < 5) {
+                    fail(Http2Error::ProtocolError);
+                    return;
+                }
+                payload.remove_prefix(5);
+            }
+            header_end_stream = flags & frame_flag::EndStream;
+            if (flags & frame_flag::EndHeaders) {
+                header_block_complete(id, payload);
+                return;
+            }
+            header_stream = id;
+            header_block.assign(payload.data(), payload.size());
+        }
+
+        void on_continuation(uint8_t flags, uint32_t id, std::string_view payload) {
+            if (header_stream == 0 || id != header_stream) {
+                fail(Http2Error::ProtocolError);
+                return;
+            }
+            header_block.append(payload.data(), payload.size());
+            if (header_block.size() > max_header_block) {
+                fail(Http2Error::EnhanceYourCalm);
+                return;
+            }
+            if (flags & frame_flag::EndHeaders) {
+                header_stream = 0;
+                header_block_complete(id, header_block);
+            }
+        }
+
+        // Every block must be decoded, even one that is dropped, to keep the
+        // dynamic table in step with the client's. One that decodes to more
+        // than the announced SETTINGS_MAX_HEADER_LIST_SIZE is given up
+        // part way, which leaves the table out of step just the same.
+        bool decode(std::string_view block, util::Arena& arena) {
+            fields.clear();
+            switch (decoder.decode(block, arena, fields, max_header_block)) {
+            case HpackDecoder::Result::Ok:
+                return true;
+            case HpackDecoder::Result::Malformed:
+                fail(Http2Error::CompressionError);
+                return false;
+            case HpackDecoder::Result::TooLarge:
+                fail(Http2Error::EnhanceYourCalm);
+                return false;
+            }
+            return false;
+        }
+
+        void drop(std::string_view block) {
+            decode(block, scratch);
+            scratch.reset();
+        }
+
+        void header_block_complete(uint32_t id, std::string_view block) {
+            if (Stream* stream = find(id)) {
+                // Trailers, which end the stream.
+                if (!decode(block, stream->arena)) {
+                    return;
+                }
+                if (stream->remote_closed) {
+                    reset_stream(*stream, Http2Error::StreamClosed);
+                    return;
+                }
+                if (!header_end_stream) {
+                    reset_stream(*stream, Http2Error::ProtocolError);
+                    return;
+                }
+                for (auto& field: fields) {
+                    if (field.name.empty() || field.name[0] == ':') {
+                        reset_stream(*stream, Http2Error::ProtocolError);
+                        return;
+                    }
+                    stream->request.headers.push_back(field);
+                }
+                end_of_stream(*stream);
+                return;
+            }
+            if (id <= last_stream_id || id % 2 == 0) {
+                // A stream that has closed, or one the server would have
+                // had to open.
+                drop(block);
+                if (!failed && id % 2 == 0) {
+                    fail(Http2Error::ProtocolError);
+                }
+                return;
+            }
+            last_stream_id = id;
+            if (going_away || peer_going_away || client.loop.draining) {
+                drop(block);
+                return;
+            }
+            if (streams.size() >= max_streams) {
+                drop(block);
+                rst(id, Http2Error::RefusedStream);
+                return;
+            }
+            auto& stream = open_stream(id);
+            if (!decode(block, stream.arena)) {
+                return;
+            }
+            if (!start_request(stream)) {
+                reset_stream(stream, Http2Error::ProtocolError);
+                return;
+            }
+            if (header_end_stream) {
+                end_of_stream(stream);
+            }
+        }
+
+        // Builds the request from the decoded fields, and begins it. Returns
+        // false if it is malformed (RFC 9113, section 8.1.1).
+        bool start_request(Stream& stream) {
+            auto& req = stream.request;
+            std::string_view method, scheme, authority;
+            bool regular = false;
+            HeaderField* cookie = nullptr;
+            for (auto& field: fields) {
+                if (!field.name.empty() && field.name[0] == ':') {
+                    if (regular) {
+                        return false;
+                    }
+                    if (field.name == ":method") method = field.value;
+                    else if (field.name == ":scheme") scheme = field.value;
+                    else if (field.name == ":authority") authority = field.value;
+                    else if (field.name == ":path") req.url = field.value;
+                    else return false;
+                    continue;
+                }
+                regular = true;
+                for (char c: field.name) {
+                    if (c >= 'A' && c <= 'Z') {
+                        return false;
+                    }
+                }
+                if (connection_specific(field) || (field.name == "te" && field.value != "trailers")) {
+                    return false;
+                }
+                if (field.id == HeaderId::ContentLength) {
+                    uint64_t length;
+                    auto end = field.value.data() + field.value.size();
+                    auto result = std::from_chars(field.value.data(), end, length);
+                    if (field.value.empty() || result.ec != std::errc() || result.ptr != end) {
+                        return false;
+                    }
+                    stream.declared_length = length;
+                }
+                if (field.id == HeaderId::Cookie && cookie) {
+                    // Cookies may arrive as separate fields, which compress
+                    // better (RFC 9113, section 8.2.3); they are joined as
+                    // HTTP/1.1 sends them.
+                    size_t size = cookie->value.size() + 2 + field.value.size();
+                    char* joined = stream.arena.allocate_chars(size);
+                    std::memcpy(joined, cookie->value.data(), cookie->value.size());
+                    std::memcpy(joined + cookie->value.size(), "; ", 2);
+                    std::memcpy(joined + cookie->value.size() + 2, field.value.data(), field.value.size());
+                    cookie->value = std::string_view(joined, size);
+                    continue;
+                }
+                req.headers.push_back(field);
+                if (field.id == HeaderId::Cookie) {
+                    cookie = &req.headers.back();
+                }
+            }
+            if (method.empty() || (method != "CONNECT" && (req.url.empty() || scheme.empty()))) {
+                return false;
+            }
+            if (!authority.empty() && !req.headers.find(HeaderId::Host)) {
+                req.headers.emplace_back(HeaderId::Host, authority);
+            }
+            req.method = method_from_name(method);
+            req.connection = client.handle(stream.id);
+            req.max_body_size = client.loop.server_impl.max_body_size;
+            stream.out.request_started = client.received_at;
+            if (client.loop.shed(client.received_at)) {
+                increment(client.loop.counters.requests);
+                refuse(stream, Status::ServiceUnavailable);
+                stream.out.response.set_header(HeaderId::RetryAfter, "1");
+                return true;
+            }
+            client.loop.server_impl.responder->begin(req);
+            if (!req.body_consumer && stream.declared_length != no_length && stream.declared_length > req.max_body_size) {
+                refuse(stream, Status::PayloadTooLarge);
+            }
+            return true;
+        }
+
+        void end_of_stream(Stream& stream) {
+            stream.remote_closed = true;
+            if (stream.reset || stream.refused) {
+                maybe_release(stream);
+                return;
+            }
+            if (!stream.body_paused) {
+                finish_request(stream);
+            }
+        }
+
+        void finish_request(Stream& stream) {
+            auto& req = stream.request;
+            if (stream.declared_length != no_length && stream.declared_length != stream.received_length) {
+                reset_stream(stream, Http2Error::ProtocolError);
+                return;
+            }
+            if (!req.body_consumer) {
+                req.body = stream.body;
+            }
+            increment(client.loop.counters.requests);
+            stream.responded = true;
+            auto& out = stream.out;
+            out.head_only = req.method == Method::Head;
+            client.loop.server_impl.responder->respond(req, out.response);
+            req.body_consumer.reset();
+            if (req.deferred) {
+                req.deferred = false;
+                stream.deferred = true;
+                ++num_deferred;
+                ++client.loop.num_deferred_requests;
+                client.deferred = true;
+            }
+        }
+
+        // Answers a request before its body has arrived; the rest of it is
+        // discarded, and the stream reset once the response has gone out.
+        void refuse(Stream& stream, Status status) {
+            stream.refused = true;
+            stream.responded = true;
+            stream.request.body_consumer.reset();
+            stream.out.response.status = status;
+        }
+
+        void on_priority(uint32_t id, std::string_view payload) {
+            if (id == 0 || payload.size() != 5) {
+                fail(id == 0 ? Http2Error::ProtocolError : Http2Error::FrameSizeError);
+            }
+        }
+
+        void on_rst_stream(uint32_t id, std::string_view payload) {
+            if (id == 0 || payload.size() != 4) {
+                fail(id == 0 ? Http2Error::ProtocolError : Http2Error::FrameSizeError);
+                return;
+            }
+            Stream* stream = find(id);
+            if (!stream) {
+                if (id > last_stream_id) {
+                    fail(Http2Error::ProtocolError);
+                }
+                return;
+            }
+            stream->reset = true;
+            stream->request.body_consumer.reset();
+            maybe_release(*stream);
+        }
+
+        void on_settings(uint8_t flags, uint32_t id, std::string_view payload) {
+            if (id != 0) {
+                fail(Http2Error::ProtocolError);
+                return;
+            }
+            if (flags & frame_flag::Ack) {
+                if (!payload.empty()) {
+                    fail(Http2Error::FrameSizeError);
+                }
+                return;
+            }
+            if (payload.size() % 6 != 0) {
+                fail(Http2Error::FrameSizeError);
+                return;
+            }
+            if (!apply_settings(payload)) {
+                return;
+            }
+            settings_received = true;
+            append_frame_header(frames, 0, FrameType::Settings, frame_flag::Ack, 0);
+        }
+
+        bool apply_settings(std::string_view payload) {
+            for (size_t i = 0; i + 6 <= payload.size(); i += 6) {
+                auto setting = Setting(read_u32(payload.data() + i) >> 16);
+                uint32_t value = read_u32(payload.data() + i + 2);
+                switch (setting) {
+                    case Setting::HeaderTableSize:
+                        encoder.set_max_table_size(value);
+                        break;
+                    case Setting::EnablePush:
+                        if (value > 1) {
+                            fail(Http2Error::ProtocolError);
+                            return false;
+                        }
+                        break;
+                    case Setting::InitialWindowSize: {
+                        if (value > max_window) {
+                            fail(Http2Error::FlowControlError);
+                            return false;
+                        }
+                        // Applies to the open streams, too.
+                        int64_t delta = int64_t(value) - peer_initial_window;
+                        peer_initial_window = value;
+                        for (auto& stream: streams) {
+                            stream->send_window += delta;
+                            if (stream->send_window > max_window) {
+                                fail(Http2Error::FlowControlError);
+                                return false;
+                            }
+                        }
+                        break;
+                    }
+                    case Setting::MaxFrameSize:
+                        if (value < default_max_frame_size || value > 0xffffff) {
+                            fail(Http2Error::ProtocolError);
+                            return false;
+                        }
+                        peer_max_frame_size = value;
+                        break;
+                    default:
+                        break;
+                }
+            }
+            return true;
+        }
+
+        void on_ping(uint8_t flags, uint32_t id, std::string_view payload) {
+            if (id != 0 || payload.size() != 8) {
+                fail(id != 0 ? Http2Error::ProtocolError : Http2Error::FrameSizeError);
+                return;
+            }
+            if (!(flags & frame_flag::Ack)) {
+                append_frame_header(frames, 8, FrameType::Ping, frame_flag::Ack, 0);
+                frames.append(payload.data(), payload.size());
+            }
+        }
+
+        // The client opens no more streams; those it has are finished.
+        void on_goaway(uint32_t id, std::string_view payload) {
+            if (id != 0 || payload.size() < 8) {
+                fail(id != 0 ? Http2Error::ProtocolError : Http2Error::FrameSizeError);
+                return;
+            }
+            peer_going_away = true;
+        }
+
+        void on_window_update(uint32_t id, std::string_view payload) {
+            if (payload.size() != 4) {
+                fail(Http2Error::FrameSizeError);
+                return;
+            }
+            int64_t increment = read_u32(payload.data()) & 0x7fffffff;
+            if (id == 0) {
+                send_window += increment;
+                if (increment == 0 || send_window > max_window) {
+                    fail(increment == 0 ? Http2Error::ProtocolError : Http2Error::FlowControlError);
+                }
+                return;
+            }
+            if (Stream* stream = find(id)) {
+                stream->send_window += increment;
+                if (increment == 0 || stream->send_window > max_window) {
+                    reset_stream(*stream, increment == 0 ? Http2Error::ProtocolError : Http2Error::FlowControlError);
+                }
+            }
+        }
+
+        void append_setting(Setting setting, uint32_t value) {
+            append_u16(frames, uint16_t(setting));
+            append_u32(frames, value);
+        }
+
+        void window_update(uint32_t id, int64_t increment) {
+            append_frame_header(frames, 4, FrameType::WindowUpdate, 0, id);
+            append_u32(frames, uint32_t(increment));
+        }
+
+        void rst(uint32_t id, Http2Error error) {
+            append_frame_header(frames, 4, FrameType::RstStream, 0, id);
+            append_u32(frames, uint32_t(error));
+        }
+
+        void go_away(Http2Error error) {
+            going_away = true;
+            append_frame_header(frames, 8, FrameType::GoAway, 0, 0);
+            append_u32(frames, last_stream_id);
+            append_u32(frames, uint32_t(error));
+        }
+
+        // A connection error: GOAWAY, then close once it has been written.
+        void fail(Http2Error error) {
+            if (failed) {
+                return;
+            }
+            failed = true;
+            go_away(error);
+            client.read_closed = true;
+        }
+
+        // Data is given back once half of a window has been consumed, so
+        // the client is not held up, and does not get an update per frame.
+        void give_back_windows() {
+            if (failed) {
+                return;
+            }
+            if (unacked >= connection_window / 2) {
+                window_update(0, unacked);
+                recv_window += unacked;
+                unacked = 0;
+            }
+            for (auto& stream: streams) {
+                if (!stream->remote_closed && !stream->reset && !stream->refused && stream->unacked >= stream_window / 2) {
+                    window_update(stream->id, stream->unacked);
+                    stream->recv_window += stream->unacked;
+                    stream->unacked = 0;
+                }
+            }
+        }
+
+        void resume_body(uint32_t id) {
+            Stream* stream = find(id);
+            if (!stream || !stream->body_paused) {
+                return;
+            }
+            stream->body_paused = false;
+            std::string data;
+            data.swap(stream->paused_data);
+            if (!data.empty() && stream->request.body_consumer) {
+                consume(*stream, data);
+            }
+            if (!stream->body_paused && stream->remote_closed && !stream->responded) {
+                finish_request(*stream);
+            }
+            give_back_windows();
+            sweep();
+        }
+
+        void resume_response(uint32_t id) {
+            Stream* stream = find(id);
+            if (stream && stream->producer_waiting) {
+                stream->producer_waiting = false;
+            }
+        }
+
+        void complete(uint32_t id, Response&& response) {
+            Stream* stream = find(id);
+            if (!stream || !stream->deferred) {
+                return;
+            }
+            stream->deferred = false;
+            --num_deferred;
+            --client.loop.num_deferred_requests;
+            client.deferred = num_deferred > 0;
+            client.loop.server_impl.responder->completed(stream->request, response);
+            if (client.closed) {
+                if (!client.deferred) {
+                    client.release();
+                }
+                return;
+            }
+            auto& out = stream->out;
+            if (!response.latency) {
+                response.latency = out.response.latency;
+            }
+            out.response = std::move(response);
+            out.adopted = true;
+            maybe_release(*stream);
+            sweep();
+            check_done();
+        }
+
+        // The server is stopping: the client is told to open no more
+        // streams, and the connection closes once those it has are done.
+        void drain() {
+            if (!going_away) {
+                go_away(Http2Error::NoError);
+            }
+            check_done();
+        }
+
+        void check_done() {
+            if ((going_away || peer_going_away) && streams.empty()) {
+                client.read_closed = true;
+            }
+        }
+
+        Stream* find(uint32_t id) {
+            for (auto& stream: streams) {
+                if (stream->id == id && !stream->done) {
+                    return stream.get();
+                }
+            }
+            return nullptr;
+        }
+
+        Stream& open_stream(uint32_t id) {
+            std::unique_ptr<Stream> stream;
+            if (pooled_streams.empty()) {
+                stream.reset(new Stream(client.loop.buffer_pool));
+            }
+            else {
+                stream = std::move(pooled_streams.back());
+                pooled_streams.pop_back();
+            }
+            stream->id = id;
+            stream->send_window = peer_initial_window;
+            streams.push_back(std::move(stream));
+            return *streams.back();
+        }
+
+        void reset_stream(Stream& stream, Http2Error error) {
+            if (!stream.reset) {
+                stream.reset = true;
+                rst(stream.id, error);
+            }
+            stream.request.body_consumer.reset();
+            maybe_release(stream);
+        }
+
+        // A stream is done once its response has been written and its
+        // request received, or it has been reset; but not while its memory
+        // is being written, or the application holds on to its request.
+        void maybe_release(Stream& stream) {
+            if (stream.done || stream.in_flight || stream.deferred) {
+                return;
+            }
+            if (stream.end_sent && !stream.remote_closed && !stream.reset) {
+                // Refused: the client need not send the rest.
+                reset_stream(stream, Http2Error::NoError);
+                return;
+            }
+            if (stream.reset || (stream.end_sent && stream.remote_closed)) {
+                stream.done = true;
+            }
+        }
+
+        void sweep() {
+            std::chrono::steady_clock::time_point now;
+            size_t kept = 0;
+            for (size_t i = 0; i < streams.size(); ++i) {
+                auto& stream = *streams[i];
+                if (!stream.done) {
+                    std::swap(streams[kept++], streams[i]);
+                    continue;
+                }
+                if (stream.end_sent && stream.out.response.latency) {
+                    if (now == std::chrono::steady_clock::time_point()) {
+                        now = std::chrono::steady_clock::now();
+                    }
+                    client.record_latency(stream.out, now);
+                }
+                release(stream);
+            }
+            while (streams.size() > kept) {
+                if (pooled_streams.size() < max_pooled_streams) {
+                    pooled_streams.push_back(std::move(streams.back()));
+                }
+                streams.pop_back();
+            }
+        }
+
+        void release(Stream& stream) {
+            auto& req = stream.request;
+            req.url = std::string_view();
+            req.headers.clear();
+            req.body = std::string_view();
+            req.params.clear();
+            req.body_consumer.reset();
+            req.deferred = false;
+            req.connection = ConnectionHandle();
+            stream.arena.reset();
+            if (stream.body.capacity() > ClientBase::max_retained_body) {
+                std::string().swap(stream.body);
+            }
+            else {
+                stream.body.clear();
+            }
+            std::string().swap(stream.paused_data);
+            client.recycle(stream.out);
+            stream.declared_length = no_length;
+            stream.received_length = 0;
+            stream.recv_window = stream_window;
+            stream.unacked = 0;
+            stream.remote_closed = false;
+            stream.body_paused = false;
+            stream.responded = false;
+            stream.deferred = false;
+            stream.refused = false;
+            stream.reset = false;
+            stream.done = false;
+            stream.head_sent = false;
+            stream.end_sent = false;
+            stream.in_flight = false;
+            stream.data = std::string_view();
+            stream.more = false;
+            stream.producer_waiting = false;
+        }
+
+        bool output_full() const {
+            return frames.size() >= max_pending_frames;
+        }
+
+        // Writes what is ready: control frames, and a frame per stream in
+        // turn, until the windows are used up, nothing is left, or the
+        // write has reached max_file_per_turn.
+        void flush() {
+            if (client.writing || client.closed) {
+                return;
+            }
+            segments.clear();
+            frames_covered = 0;
+            size_t n = streams.size();
+            size_t batch = 0;
+            for (bool progress = true; progress && batch < ClientBase::max_file_per_turn;) {
+                progress = false;
+                for (size_t i = 0; i < n; ++i) {
+                    progress |= send(*streams[(next_stream + i) % n], batch);
+                }
+            }
+            if (n > 0) {
+                next_stream = (next_stream + 1) % n;
+            }
+            cover_frames();
+            if (segments.empty()) {
+                return;
+            }
+            frames_in_flight.swap(frames);
+            frames.clear();
+            client.write_buffers.clear();
+            for (auto& segment: segments) {
+                const char* data = segment.data ? segment.data : frames_in_flight.data() + segment.offset;
+                client.write_buffers.push_back(asio::buffer(data, segment.size));
+            }
+            client.keep_writing();
+        }
+
+        void cover_frames() {
+            if (frames.size() > frames_covered) {
+                segments.push_back({nullptr, frames_covered, frames.size() - frames_covered});
+                frames_covered = frames.size();
+            }
+        }
+
+        // Adds the stream's next frame. Returns false if it has none ready.
+        bool send(Stream& stream, size_t& batch) {
+            // After an upgrade, the response to stream 1 waits for the
+            // client's preface: a client may not take much more than the
+            // 101 at once.
+            if (!settings_received || !stream.responded || stream.deferred || stream.reset || stream.end_sent || stream.done) {
+                return false;
+            }
+            if (!stream.head_sent) {
+                send_head(stream);
+                return true;
+            }
+            if (stream.data.empty() && stream.more) {
+                // Not while the previous piece is being written.
+                if (stream.in_flight || stream.producer_waiting) {
+                    return false;
+                }
+                next_piece(stream);
+                if (stream.reset) {
+                    return true;
+                }
+            }
+            if (stream.data.empty()) {
+                if (stream.more) {
+                    return false;
+                }
+                append_frame_header(frames, 0, FrameType::Data, frame_flag::EndStream, stream.id);
+                stream.end_sent = true;
+                stream.in_flight = true;
+                return true;
+            }
+            int64_t window = std::min(stream.send_window, send_window);
+            if (window <= 0) {
+                return false;
+            }
+            size_t size = std::min({stream.data.size(), size_t(window), size_t(peer_max_frame_size)});
+            bool last = size == stream.data.size() && !stream.more;
+            append_frame_header(frames, size, FrameType::Data, last ? frame_flag::EndStream : 0, stream.id);
+            cover_frames();
+            segments.push_back({stream.data.data(), 0, size});
+            stream.data.remove_prefix(size);
+            stream.send_window -= int64_t(size);
+            send_window -= int64_t(size);
+            batch += size;
+            stream.in_flight = true;
+            stream.end_sent = last;
+            return true;
+        }
+
+        void send_head(Stream& stream) {
+            auto& out = stream.out;
+            auto& res = out.response;
+            block.clear();
+            char status[3];
+            std::to_chars(status, status + sizeof(status), int(res.status));
+            encoder.encode(":status", std::string_view(status, sizeof(status)), block);
+            for (auto& field: res.headers) {
+                // The content-length, like HTTP/1.1 framing, is ours.
+                if (!connection_specific(field) && field.id != HeaderId::ContentLength) {
+                    encoder.encode(field.name, field.value, block);
+                }
+            }
+            bool body = has_body(res.status);
+            out.settle_length();
+            uint64_t length = res.content_length;
+            if (length == Response::unknown_length && body && !res.body_producer) {
+                length = body_size(res);
+            }
+            if (length != Response::unknown_length && (body || res.status == Status::NotModified)) {
+                char digits[20];
+                auto end = std::to_chars(digits, digits + sizeof(digits), length).ptr;
+                encoder.encode("content-length", std::string_view(digits, end - digits), block);
+            }
+            if (body && !out.head_only) {
+                if (res.body_producer) {
+                    stream.more = true;
+                }
+                else if (res.file) {
+                    out.file_offset = res.file_offset;
+                    out.file_left = res.file_length;
+                    stream.more = out.file_left > 0;
+                }
+                else {
+                    stream.data = res.shared_owner ? res.shared_body : std::string_view(res.body);
+                }
+            }
+            // Without a body, the stream ends with its headers.
+            bool ends = !stream.more && stream.data.empty();
+            size_t offset = 0;
+            do {
+                size_t size = std::min(block.size() - offset, size_t(peer_max_frame_size));
+                uint8_t flags = offset + size == block.size() ? frame_flag::EndHeaders : 0;
+                if (offset == 0 && ends) {
+                    flags |= frame_flag::EndStream;
+                }
+                append_frame_header(frames, size, offset == 0 ? FrameType::Headers : FrameType::Continuation, flags, stream.id);
+                frames.append(block, offset, size);
+                offset += size;
+            } while (offset < block.size());
+            stream.head_sent = true;
+            stream.end_sent = ends;
+            stream.in_flight = true;
+        }
+
+        // Produces the next piece of a streamed body, or reads it from the
+        // file: without sendfile(2), which cannot interleave with frames.
+        void next_piece(Stream& stream) {
+            auto& out = stream.out;
+            if (out.response.body_producer) {
+                auto& producer = *out.response.body_producer;
+                IBodyProducer::State state;
+                do {
+                    out.chunk.clear();
+                    out.shared_pieces.clear();
+                    state = producer.produce_shared(out.chunk, out.shared_pieces);
+                } while (out.chunk.empty() && out.shared_pieces.empty() && state == IBodyProducer::More);
+                // A piece goes out from one buffer.
+                for (auto& piece: out.shared_pieces) {
+                    out.chunk += *piece;
+                }
+                out.shared_pieces.clear();
+                if (state == IBodyProducer::Failed || !out.count_piece(out.chunk.size(), state == IBodyProducer::Done)) {
+                    reset_stream(stream, Http2Error::InternalError);
+                    return;
+                }
+                stream.data = out.chunk;
+                stream.more = state != IBodyProducer::Done;
+                stream.producer_waiting = state == IBodyProducer::Waiting;
+                return;
+            }
+#if defined(_MSC_VER)
+            reset_stream(stream, Http2Error::InternalError);
+#else
+            size_t count = size_t(std::min<uint64_t>(out.file_left, ClientBase::max_retained_body));
+            out.chunk.resize(count);
+            auto len = ::pread(out.response.file->fd(), &out.chunk[0], count, off_t(out.file_offset));
+            if (len <= 0) {
+                // The file shrank.
+                reset_stream(stream, Http2Error::InternalError);
+                return;
+            }
+            out.chunk.resize(len);
+            out.file_offset += len;
+            out.file_left -= len;
+            stream.data = out.chunk;
+            stream.more = out.file_left > 0;
+#endif
+        }
+
+        void written() {
+            frames_in_flight.clear();
+            for (auto& stream: streams) {
+                if (stream->in_flight) {
+                    stream->in_flight = false;
+                    maybe_release(*stream);
+                }
+            }
+            sweep();
+            check_done();
+        }
+
+        ClientBase::Timeout timeout() const {
+            using Timeout = ClientBase::Timeout;
+            if (client.writing) {
+                return Timeout::Write;
+            }
+            bool waiting = false;
+            bool receiving = false;
+            for (auto& stream: streams) {
+                if (stream->deferred || stream->producer_waiting || stream->body_paused) {
+                    waiting = true;
+                }
+                else if (!stream->remote_closed) {
+                    receiving = true;
+                }
+                else if (stream->responded && !stream->end_sent && !stream->reset) {
+                    // Not written, so held back by the client's window.
+                    return Timeout::Write;
+                }
+            }
+            if (waiting) {
+                return Timeout::None;
+            }
+            return receiving ? Timeout::Body : Timeout::Idle;
+        }
+    };
+
+    Server::Http2Session::Http2Session(ClientBase& client) : impl_(new Impl(client)) {}
+
+    Server::Http2Session::~Http2Session() = default;
+
+    void Server::Http2Session::upgrade(Request& req) { impl_->upgrade(req); }
+    void Server::Http2Session::received(const char* data, size_t len) { impl_->received(data, len); }
+    void Server::Http2Session::flush() { impl_->flush(); }
+    void Server::Http2Session::written() { impl_->written(); }
+    Server::ClientBase::Timeout Server::Http2Session::timeout() const { return impl_->timeout(); }
+    void Server::Http2Session::drain() { impl_->drain(); }
+    bool Server::Http2Session::output_full() const { return impl_->output_full(); }
+    void Server::Http2Session::resume_body(uint32_t id) { impl_->resume_body(id); }
+    void Server::Http2Session::resume_response(uint32_t id) { impl_->resume_response(id); }
+    void Server::Http2Session::complete(uint32_t id, Response&& response) { impl_->complete(id, std::move(response)); }
+
+    // A client that knows the server speaks HTTP/2 starts with its
+    // connection preface rather than a request. The first `len` bytes of
+    // recv_buffer are told apart here, and stay at its start while they
+    // could still be the beginning of a preface. Returns whether they were
+    // taken, in which case the client has moved on.
+    bool Server::ClientBase::received_preface(size_t len) {
+        size_t n = std::min(len, http2_preface.size());
+        if (std::memcmp(recv_buffer, http2_preface.data(), n) != 0) {
+            return false;
+        }
+        if (n < http2_preface.size()) {
+            may_be_http2 = true;
+            recv_used = len;
+            proceed();
+            return true;
+        }
+        http2.reset(new Http2Session(*this));
+        http2->received(recv_buffer, len);
+        release_recv_buffer();
+        proceed();
+        return true;
+    }
+
+    // The request in recv_buffer asked to switch to HTTP/2 (see
+    // wants_http2()). It is answered as stream 1, and what followed it is
+    // the client's HTTP/2 connection preface.
+    void Server::ClientBase::upgrade_to_http2(size_t parsed, size_t len) {
+        upgrading = false;
+        http_parser_pause(&parser, 0);
+        http2.reset(new Http2Session(*this));
+        http2->upgrade(current_request);
+        http2->received(recv_begin() + parsed, len - parsed);
+        recv_used = 0;
+        request_arena.release();
+        release_recv_buffer();
+        proceed();
+    }
+
+    // An upgrade to h2c (RFC 7540, section 3.2) is accepted for a request
+    // with its settings, with nothing else in progress on the connection.
+    bool Server::ClientBase::wants_http2() {
+        auto& req = current_request;
+        if (!loop.server_impl.http2 || loop.draining || read_closed || num_queued > 0 || num_in_flight > 0 || !has_token(req.header(HeaderId::Upgrade), "h2c")) {
+            return false;
+        }
+        auto settings = req.header(HeaderId::Http2Settings);
+        std::string decoded;
+        return !settings.empty() && decode_base64url(settings, decoded) && decoded.size() % 6 == 0;
+    }
+}
@@ -0,0 +1,168 @@
+#include "wayward/metrics.hpp"
+#include "wayward/app.hpp"
+#include "wayward/server.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <thread>
+
+namespace wayward {
+    const uint64_t LatencyHistogram::bucket_bounds_us[num_buckets - 1] = {
+        100, 250, 500,
+        1000, 2500, 5000,
+        10000, 25000, 50000,
+        100000, 250000, 500000,
+        1000000, 2500000, 5000000,
+    };
+
+    namespace {
+        std::atomic<size_t> next_shard(0);
+        constexpr size_t no_shard = size_t(-1);
+        thread_local size_t this_thread_shard = no_shard;
+
+        size_t shard_for_this_thread(size_t num_shards) {
+            if (this_thread_shard == no_shard) {
+                this_thread_shard = next_shard.fetch_add(1, std::memory_order_relaxed);
+            }
+            return this_thread_shard % num_shards;
+        }
+
+        void append_number(std::string& out, uint64_t n) {
+            char buffer[20];
+            out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), n).ptr);
+        }
+
+        void append_seconds(std::string& out, double seconds) {
+            char buffer[32];
+            int len = std::snprintf(buffer, sizeof(buffer), "%.9g", seconds);
+            out.append(buffer, len);
+        }
+
+        void append_label_value(std::string& out, std::string_view value) {
+            for (char c: value) {
+                switch (c) {
+                    case '\\': out += "\\\\"; break;
+                    case '"':  out += "\\\""; break;
+                    case '\n': out += "\\n"; break;
+                    default:   out += c; break;
+                }
+            }
+        }
+
+        void append_metric(std::string& out, const char* name, const char* type, const char* help, uint64_t value) {
+            out += "# HELP ";
+            out += name;
+            out += ' ';
+            out += help;
+            out += "\n# TYPE ";
+            out += name;
+            out += ' ';
+            out += type;
+            out += '\n';
+            out += name;
+            out += ' ';
+            append_number(out, value);
+            out += '\n';
+        }
+    }
+
+    LatencyHistogram::LatencyHistogram()
+        : num_shards_(std::max(1u, std::thread::hardware_concurrency()))
+        , shards_(new Shard[num_shards_])
+    {
+        for (size_t i = 0; i < num_shards_; ++i) {
+            for (auto& bucket: shards_[i].buckets) {
+                bucket.store(0, std::memory_order_relaxed);
+            }
+            shards_[i].sum_ns.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void LatencyHistogram::use_shard(size_t index) {
+        this_thread_shard = index;
+    }
+
+    void LatencyHistogram::record(uint64_t ns) {
+        uint64_t us = ns / 1000;
+        size_t bucket = 0;
+        while (bucket < num_buckets - 1 && us >= bucket_bounds_us[bucket]) {
+            ++bucket;
+        }
+        auto& shard = shards_[shard_for_this_thread(num_shards_)];
+        shard.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        shard.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    LatencyHistogram::Snapshot LatencyHistogram::snapshot() const {
+        Snapshot snapshot;
+        for (size_t s = 0; s < num_shards_; ++s) {
+            auto& shard = shards_[s];
+            for (size_t i = 0; i < num_buckets; ++i) {
+                uint64_t n = shard.buckets[i].load(std::memory_order_relaxed);
+                snapshot.buckets[i] += n;
+                snapshot.count += n;
+            }
+            snapshot.sum_ns += shard.sum_ns.load(std::memory_order_relaxed);
+        }
+        return snapshot;
+    }
+
+    void write_prometheus_metrics(const Server& server, const App& app, std::string& out) {
+        auto metrics = server.metrics();
+        append_metric(out, "wayward_connections_accepted_total", "counter", "Connections accepted.", metrics.connections_accepted);
+        append_metric(out, "wayward_connections_closed_total", "counter", "Connections closed.", metrics.connections_closed);
+        append_metric(out, "wayward_connections_active", "gauge", "Connections open.", metrics.active_connections);
+        append_metric(out, "wayward_requests_total", "counter", "Requests received.", metrics.requests);
+        append_metric(out, "wayward_parse_errors_total", "counter", "Malformed requests.", metrics.parse_errors);
+        append_metric(out, "wayward_requests_shed_total", "counter", "Requests answered with 503 by admission control.", metrics.requests_shed);
+        append_metric(out, "wayward_received_bytes_total", "counter", "Bytes received.", metrics.bytes_received);
+        append_metric(out, "wayward_sent_bytes_total", "counter", "Bytes sent.", metrics.bytes_sent);
+
+        const char* name = "wayward_request_duration_seconds";
+        out += "# HELP wayward_request_duration_seconds Time from the first byte of a request until its response has been written.\n";
+        out += "# TYPE wayward_request_duration_seconds histogram\n";
+        app.visit_routes([&](Method method, std::string_view path, const LatencyHistogram& latency) {
+            auto snapshot = latency.snapshot();
+            auto append_series = [&](const char* suffix) {
+                out += name;
+                out += suffix;
+                out += "{method=\"";
+                out += method_name(method);
+                out += "\",route=\"";
+                append_label_value(out, path);
+                out += '"';
+            };
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < LatencyHistogram::num_buckets; ++i) {
+                cumulative += snapshot.buckets[i];
+                append_series("_bucket");
+                out += ",le=\"";
+                if (i < LatencyHistogram::num_buckets - 1) {
+                    append_seconds(out, LatencyHistogram::bucket_bounds_us[i] / 1e6);
+                }
+                else {
+                    out += "+Inf";
+                }
+                out += "\"} ";
+                append_number(out, cumulative);
+                out += '\n';
+            }
+            append_series("_sum");
+            out += "} ";
+            append_seconds(out, snapshot.sum_ns / 1e9);
+            out += '\n';
+            append_series("_count");
+            out += "} ";
+            append_number(out, snapshot.count);
+            out += '\n';
+        });
+    }
+
+    std::function<void(Request&, Response&)> prometheus_metrics(const Server& server, const App& app) {
+        return [&server, &app](Request&, Response& res) {
+            write_prometheus_metrics(server, app, res.body);
+            res.set_header(HeaderId::ContentType, "text/plain; version=0.0.4");
+        };
+    }
+}
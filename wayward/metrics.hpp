@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <wayward/http.hpp>
+
+namespace wayward {
+    struct App;
+    struct Server;
+
+    // Latencies counted into fixed buckets. Recording is lock-free and
+    // cheap: every thread adds to one of cache-line sized shards, one per
+    // hardware thread, which are only summed up by snapshot(). The event
+    // loops of a Server each get a shard of their own (see use_shard());
+    // other threads take turns.
+    struct WAYWARD_EXPORT LatencyHistogram {
+        static constexpr size_t num_buckets = 16;
+        // Upper bounds of the buckets but the last, which is unbounded.
+        static const uint64_t bucket_bounds_us[num_buckets - 1];
+
+        struct Snapshot {
+            uint64_t buckets[num_buckets] = {}; // Not cumulative.
+            uint64_t count = 0;
+            uint64_t sum_ns = 0;
+        };
+
+        LatencyHistogram();
+        LatencyHistogram(const LatencyHistogram&) = delete;
+        LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+        void record(uint64_t ns);
+        Snapshot snapshot() const;
+
+        size_t num_shards() const {
+            return num_shards_;
+        }
+
+        // Makes the calling thread record into shard `index` of every
+        // histogram (modulo their number), instead of taking its turn.
+        static void use_shard(size_t index);
+
+    private:
+        struct alignas(64) Shard {
+            std::atomic<uint64_t> buckets[num_buckets];
+            std::atomic<uint64_t> sum_ns;
+        };
+        size_t num_shards_;
+        std::unique_ptr<Shard[]> shards_;
+    };
+
+    // Handler answering with the server's counters and the request latency
+    // of every route of `app`, in the Prometheus text format, e.g.
+    //
+    //     app.get("/metrics", prometheus_metrics(server, app));
+    std::function<void(Request&, Response&)> WAYWARD_EXPORT prometheus_metrics(const Server& server, const App& app);
+
+    // Appends the exposition text, as served by prometheus_metrics().
+    void WAYWARD_EXPORT write_prometheus_metrics(const Server& server, const App& app, std::string& out);
+}
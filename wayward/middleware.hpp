@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include <wayward/http.hpp>
+
+namespace wayward {
+    // Middlewares wrap a handler with cross-cutting behaviour. A middleware
+    // is any object callable as
+    //
+    //     void operator()(Request&, Response&, Next next) const
+    //
+    // that calls next() to run the rest of the chain (and the handler), or
+    // leaves it out to answer the request itself. It can change the request
+    // before, and the response after:
+    //
+    //     auto require_token = [](Request& req, Response& res, auto next) {
+    //         if (req.header(HeaderId::Authorization).empty()) {
+    //             res.status = Status::Unauthorized;
+    //             return;
+    //         }
+    //         next();
+    //     };
+    //     auto api = chain(cors, require_token, log_requests);
+    //     app.get("/users", api(list_users));
+    //
+    // Chains are composed with templates, so the middlewares and the handler
+    // inline into one function, which App type-erases once per route. Like
+    // handlers, middlewares run concurrently on all event loops.
+    template <class... Middlewares>
+    struct Chain {
+        std::tuple<Middlewares...> middlewares;
+
+        // The handler, wrapped by the middlewares, the first outermost.
+        template <class Handler>
+        struct Wrapped {
+            std::tuple<Middlewares...> middlewares;
+            Handler handler;
+
+            void operator()(Request& req, Response& res) const {
+                run<0>(req, res);
+            }
+
+        private:
+            template <size_t I>
+            void run(Request& req, Response& res) const {
+                if constexpr (I == sizeof...(Middlewares)) {
+                    handler(req, res);
+                }
+                else {
+                    std::get<I>(middlewares)(req, res, [this, &req, &res]() {
+                        run<I + 1>(req, res);
+                    });
+                }
+            }
+        };
+
+        template <class Handler>
+        Wrapped<std::decay_t<Handler>> operator()(Handler&& handler) const {
+            return {middlewares, std::forward<Handler>(handler)};
+        }
+
+        // This chain, followed by more middlewares.
+        template <class... More>
+        Chain<Middlewares..., std::decay_t<More>...> then(More&&... more) const {
+            return {std::tuple_cat(middlewares, std::make_tuple(std::forward<More>(more)...))};
+        }
+    };
+
+    template <class... Middlewares>
+    Chain<std::decay_t<Middlewares>...> chain(Middlewares&&... middlewares) {
+        return {std::make_tuple(std::forward<Middlewares>(middlewares)...)};
+    }
+}
@@ -0,0 +1,966 @@
+#include "wayward/proxy.hpp"
+#include "config.h"
+
+#if defined(ASIO_FROM_BOOST)
+#include <boost/asio.hpp>
+namespace asio = boost::asio;
+using asio_error_code = boost::system::error_code;
+#else
+#include <asio.hpp>
+using asio_error_code = std::error_code;
+#endif
+
+#include <http_parser.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+namespace wayward {
+    namespace {
+        using Clock = std::chrono::steady_clock;
+        using Socket = asio::generic::stream_protocol::socket;
+
+        // Per read from an upstream.
+        constexpr size_t read_size = 16 * 1024;
+        // How long an upstream that refused a connection is passed over.
+        constexpr auto down_time = std::chrono::seconds(1);
+
+        struct Upstream {
+            size_t index = 0;
+            asio::generic::stream_protocol::endpoint endpoint;
+            bool tcp = false;
+            std::string host; // For requests without a Host field.
+            std::atomic<size_t> outstanding{0};
+            std::atomic<Clock::rep> down_until{0};
+        };
+
+        // Used by one exchange at a time, or idle in its loop's pool.
+        struct UpstreamConnection {
+            Upstream& upstream;
+            Socket socket;
+            std::unique_ptr<char[]> buffer{new char[read_size]};
+            bool reused = false; // Has carried a request before.
+            bool idle = false;
+            uint64_t idle_epoch = 0; // Tells the waits of successive idle spells apart.
+            Clock::time_point idle_since;
+
+            UpstreamConnection(asio::io_service& service, Upstream& upstream) : upstream(upstream), socket(service) {}
+
+            void close() {
+                asio_error_code ec;
+                socket.close(ec);
+            }
+        };
+        using ConnectionPtr = std::shared_ptr<UpstreamConnection>;
+
+        // One proxy's idle connections on one loop, by upstream, the most
+        // recently used last.
+        struct Pool {
+            std::vector<std::vector<ConnectionPtr>> idle;
+        };
+
+        // The pools of the loop that runs an io_service, which live as long
+        // as it does. asio shuts down all of an io_service's services before
+        // it destroys any, so the pooled sockets are closed while the socket
+        // services are still there.
+        struct PoolService : asio::execution_context::service {
+            static asio::execution_context::id id;
+
+            std::map<const void*, Pool> pools; // By proxy
+
+            explicit PoolService(asio::execution_context& context) : asio::execution_context::service(context) {}
+
+            void shutdown() override {
+                pools.clear();
+            }
+        };
+        asio::execution_context::id PoolService::id;
+
+        // Fields that only apply to one connection (RFC 9110, section
+        // 7.6.1), including those named by `connection`, the value of the
+        // Connection field.
+        bool hop_by_hop(const HeaderField& field, std::string_view connection) {
+            switch (field.id) {
+                case HeaderId::Connection:
+                case HeaderId::KeepAlive:
+                case HeaderId::TransferEncoding:
+                case HeaderId::Upgrade:
+                case HeaderId::Http2Settings:
+                    return true;
+                case HeaderId::Other:
+                    if (iequals(field.name, "proxy-connection") || iequals(field.name, "te") || iequals(field.name, "trailer")) {
+                        return true;
+                    }
+                    break;
+                default:
+                    break;
+            }
+            return !connection.empty() && has_token(connection, field.name);
+        }
+
+        bool idempotent(Method method) {
+            return method != Method::Post && method != Method::Patch && method != Method::Connect && method != Method::Other;
+        }
+
+        // What the exchanges of a proxy share, on all loops.
+        struct Upstreams {
+            std::vector<std::unique_ptr<Upstream>> upstreams;
+            std::atomic<size_t> next{0};
+            size_t max_idle = 32;
+            std::chrono::milliseconds idle_timeout{60000};
+            std::chrono::milliseconds connect_timeout{5000};
+            std::chrono::milliseconds response_timeout{60000};
+
+            struct Counters {
+                std::atomic<uint64_t> requests{0};
+                std::atomic<uint64_t> connections_opened{0};
+                std::atomic<uint64_t> connections_reused{0};
+                std::atomic<uint64_t> connect_failures{0};
+                std::atomic<uint64_t> upstreams_down{0};
+                std::atomic<uint64_t> bad_gateway{0};
+                std::atomic<uint64_t> gateway_timeout{0};
+                std::atomic<uint64_t> responses_cut_off{0};
+            };
+            Counters counters;
+
+            static void increment(std::atomic<uint64_t>& counter) {
+                counter.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // The upstream with the fewest requests in progress, other than
+            // `except`, preferring those that are not down. The search
+            // starts one further each time, so that ties take turns. Counts
+            // the request against the upstream.
+            Upstream* pick(const Upstream* except) {
+                auto now = Clock::now().time_since_epoch().count();
+                size_t start = next.fetch_add(1, std::memory_order_relaxed);
+                Upstream* best = nullptr;
+                bool best_down = false;
+                size_t best_outstanding = 0;
+                for (size_t i = 0; i < upstreams.size(); ++i) {
+                    auto& upstream = *upstreams[(start + i) % upstreams.size()];
+                    if (&upstream == except) {
+                        continue;
+                    }
+                    bool down = upstream.down_until.load(std::memory_order_relaxed) > now;
+                    size_t outstanding = upstream.outstanding.load(std::memory_order_relaxed);
+                    if (!best || (best_down && !down) || (down == best_down && outstanding < best_outstanding)) {
+                        best = &upstream;
+                        best_down = down;
+                        best_outstanding = outstanding;
+                    }
+                }
+                if (best) {
+                    best->outstanding.fetch_add(1, std::memory_order_relaxed);
+                }
+                return best;
+            }
+
+            // Only on the loop that runs `service`.
+            Pool& pool(asio::io_service& service) {
+                auto& pools = asio::use_service<PoolService>(service).pools;
+                auto it = pools.find(this);
+                if (it == pools.end()) {
+                    it = pools.emplace(this, Pool()).first;
+                    it->second.idle.resize(upstreams.size());
+                }
+                return it->second;
+            }
+
+            // Keeps a connection for the next request to its upstream,
+            // closing the longest idle beyond max_idle. If the upstream
+            // closes it in the meantime, the wait for it to become readable
+            // takes it out of the pool.
+            void put(Pool& pool, ConnectionPtr connection) {
+                auto& idle = pool.idle[connection->upstream.index];
+                if (max_idle == 0) {
+                    connection->close();
+                    return;
+                }
+                if (idle.size() >= max_idle) {
+                    idle.front()->idle = false;
+                    idle.front()->close();
+                    idle.erase(idle.begin());
+                }
+                connection->reused = true;
+                connection->idle = true;
+                connection->idle_since = Clock::now();
+                uint64_t epoch = ++connection->idle_epoch;
+                idle.push_back(connection);
+                Pool* in_pool = &pool;
+                connection->socket.async_wait(asio::socket_base::wait_read, [connection, epoch, in_pool](asio_error_code) {
+                    if (!connection->idle || connection->idle_epoch != epoch) {
+                        return;
+                    }
+                    // Closed by the upstream, or it sent something unasked.
+                    connection->idle = false;
+                    connection->close();
+                    auto& idle = in_pool->idle[connection->upstream.index];
+                    idle.erase(std::find(idle.begin(), idle.end(), connection));
+                });
+            }
+
+            // The most recently used connection to the upstream, unless it
+            // has been idle for too long.
+            ConnectionPtr take(Pool& pool, Upstream& upstream) {
+                auto& idle = pool.idle[upstream.index];
+                if (idle.empty()) {
+                    return nullptr;
+                }
+                auto connection = std::move(idle.back());
+                idle.pop_back();
+                connection->idle = false;
+                if (Clock::now() - connection->idle_since < idle_timeout) {
+                    asio_error_code ec;
+                    connection->socket.cancel(ec);
+                    return connection;
+                }
+                // The rest have been idle for longer still.
+                connection->close();
+                for (auto& old: idle) {
+                    old->idle = false;
+                    old->close();
+                }
+                idle.clear();
+                return nullptr;
+            }
+        };
+
+        struct Exchange;
+
+        struct Upload : IBodyConsumer {
+            std::shared_ptr<Exchange> exchange;
+
+            explicit Upload(std::shared_ptr<Exchange> exchange) : exchange(std::move(exchange)) {}
+            ~Upload();
+
+            bool consume(Request&, std::string_view data) override;
+        };
+
+        struct Download : IBodyProducer {
+            std::shared_ptr<Exchange> exchange;
+
+            explicit Download(std::shared_ptr<Exchange> exchange) : exchange(std::move(exchange)) {}
+            ~Download();
+
+            State produce(std::string& out) override;
+        };
+
+        // One request on its way to an upstream, and its response on the
+        // way back. Runs on the loop of the client's connection, as do the
+        // handlers of its upstream connection, which keep it alive along
+        // with the consumer of the request body and the producer of the
+        // response body. Handlers that find their connection let go of
+        // since they started return right away.
+        struct Exchange : std::enable_shared_from_this<Exchange> {
+            enum class Framing {
+                Unknown, // Until the body begins, or the request ends.
+                None,
+                Length,
+                Chunked,
+            };
+
+            Upstreams& proxy;
+            asio::io_service& service;
+            Pool& pool;
+            const ConnectionHandle client;
+            const bool replayable;
+            const bool head_request;
+
+            Upstream* upstream = nullptr;
+            ConnectionPtr connection;
+            size_t attempts = 0;
+            bool connected = false;
+            bool received = false; // Anything, on this connection.
+            bool replayed = false;
+            bool finished = false; // The upstream no longer counts this request.
+
+            asio::steady_timer timer;
+            uint64_t timer_epoch = 0;
+            bool timed_out = false;
+
+            // The request. Its head is kept to send it again.
+            std::string head;
+            std::string_view content_length;
+            Framing framing = Framing::Unknown;
+            bool head_queued = false;
+            bool body_queued = false;
+            std::string outgoing; // Queued behind `writing_data`.
+            std::string writing_data;
+            bool writing = false;
+            bool body_paused = false;
+            bool request_ended = false; // The handler has run.
+            bool request_sent = false;
+            bool request_dropped = false; // Answered before it was all sent.
+
+            // The response.
+            http_parser parser;
+            std::string field;
+            std::string value;
+            bool in_value = false;
+            Response response;
+            bool keep_alive = false;
+            bool response_begun = false; // Its head has arrived.
+            bool response_ended = false;
+            std::string body; // Received, and yet to be produced.
+            bool reading = false;
+            bool producer_waiting = false;
+            bool responding = false; // The handler has deferred it.
+            bool delivered = false;
+            bool failed = false;
+            Status error = Status::BadGateway;
+
+            Exchange(Upstreams& proxy, asio::io_service& service, const Request& req)
+                : proxy(proxy), service(service), pool(proxy.pool(service)), client(req.connection),
+                  replayable(idempotent(req.method)), head_request(req.method == Method::Head), timer(service) {
+                parser.data = this;
+            }
+
+            ~Exchange() {
+                if (connection) {
+                    connection->close();
+                }
+                finish();
+            }
+
+            void start(const Request& req) {
+                proxy.increment(proxy.counters.requests);
+                upstream = proxy.pick(nullptr);
+                auto connection_field = req.header(HeaderId::Connection);
+                head += method_name(req.method);
+                head += ' ';
+                head += req.url;
+                head += " HTTP/1.1\r\n";
+                bool has_host = false;
+                for (auto& field: req.headers) {
+                    if (hop_by_hop(field, connection_field)) {
+                        continue;
+                    }
+                    if (field.id == HeaderId::ContentLength) {
+                        content_length = field.value;
+                        continue;
+                    }
+                    has_host = has_host || field.id == HeaderId::Host;
+                    head += field.name;
+                    head += ": ";
+                    head += field.value;
+                    head += "\r\n";
+                }
+                if (!has_host) {
+                    head += "Host: ";
+                    head += upstream->host;
+                    head += "\r\n";
+                }
+                // Otherwise, as HTTP/2 requests may, the body is announced
+                // by its arrival.
+                if (!req.header(HeaderId::TransferEncoding).empty()) {
+                    framing = Framing::Chunked;
+                    queue_head();
+                }
+                else if (!content_length.empty()) {
+                    framing = Framing::Length;
+                    queue_head();
+                }
+                connect(true);
+            }
+
+            void queue_head() {
+                if (framing == Framing::Length) {
+                    head += "Content-Length: ";
+                    head += content_length;
+                    head += "\r\n";
+                }
+                else if (framing == Framing::Chunked) {
+                    head += "Transfer-Encoding: chunked\r\n";
+                }
+                head += "\r\n";
+                outgoing += head;
+                head_queued = true;
+            }
+
+            bool consume(std::string_view data) {
+                if (failed || request_dropped || data.empty()) {
+                    return true;
+                }
+                if (framing == Framing::Unknown) {
+                    framing = Framing::Chunked;
+                    queue_head();
+                }
+                if (framing == Framing::Chunked) {
+                    char size[18];
+                    char* end = std::to_chars(size, size + 16, data.size(), 16).ptr;
+                    *end++ = '\r';
+                    *end++ = '\n';
+                    outgoing.append(size, end - size);
+                    outgoing += data;
+                    outgoing += "\r\n";
+                }
+                else {
+                    outgoing += data;
+                }
+                body_queued = true;
+                flush();
+                if (outgoing.size() < Proxy::max_buffered) {
+                    return true;
+                }
+                body_paused = true;
+                return false;
+            }
+
+            void respond(Request& req, Response& res) {
+                request_ended = true;
+                responding = true;
+                if (!failed && !request_dropped) {
+                    if (framing == Framing::Unknown) {
+                        framing = Framing::None;
+                        queue_head();
+                    }
+                    else if (framing == Framing::Chunked) {
+                        outgoing += "0\r\n\r\n";
+                    }
+                    flush();
+                    check_sent();
+                }
+                if (failed) {
+                    delivered = true;
+                    res.status = error;
+                    return;
+                }
+                req.defer();
+                if (response_begun) {
+                    deliver();
+                }
+            }
+
+            // Takes a pooled connection to the upstream, or opens one.
+            void connect(bool pooled) {
+                ++attempts;
+                connection = pooled ? proxy.take(pool, *upstream) : nullptr;
+                if (connection) {
+                    proxy.increment(proxy.counters.connections_reused);
+                    connected = true;
+                    flush();
+                    check_sent();
+                    read();
+                    return;
+                }
+                connection = std::make_shared<UpstreamConnection>(service, *upstream);
+                proxy.increment(proxy.counters.connections_opened);
+                arm(proxy.connect_timeout);
+                auto self = shared_from_this();
+                auto conn = connection;
+                connection->socket.async_connect(upstream->endpoint, [self, conn](asio_error_code ec) {
+                    if (conn != self->connection) {
+                        return;
+                    }
+                    self->disarm();
+                    if (ec) {
+                        self->connect_failed();
+                        return;
+                    }
+                    if (conn->upstream.tcp) {
+                        asio_error_code ignored;
+                        conn->socket.set_option(asio::ip::tcp::no_delay(true), ignored);
+                    }
+                    self->connected = true;
+                    self->flush();
+                    self->check_sent();
+                    self->read();
+                });
+            }
+
+            // Passes the upstream over for a while, and tries another one.
+            void connect_failed() {
+                auto now = Clock::now();
+                auto was_down_until = upstream->down_until.exchange((now + down_time).time_since_epoch().count());
+                proxy.increment(proxy.counters.connect_failures);
+                if (was_down_until < now.time_since_epoch().count()) {
+                    proxy.increment(proxy.counters.upstreams_down);
+                }
+                close_connection();
+                if (attempts < proxy.upstreams.size()) {
+                    if (auto next = proxy.pick(upstream)) {
+                        upstream->outstanding.fetch_sub(1, std::memory_order_relaxed);
+                        upstream = next;
+                        timed_out = false;
+                        connect(true);
+                        return;
+                    }
+                }
+                fail(timed_out ? Status::GatewayTimeout : Status::BadGateway);
+            }
+
+            // An established connection failed.
+            void connection_failed() {
+                // The upstream closed a pooled connection just as the
+                // request went out, so it did not get there.
+                bool stale = connection->reused && !received;
+                close_connection();
+                if (response_ended) {
+                    // Only the end of the request was still being written.
+                    finish();
+                    return;
+                }
+                if (stale && replayable && !body_queued && !replayed && !timed_out) {
+                    replayed = true;
+                    outgoing.clear();
+                    if (head_queued) {
+                        outgoing = head;
+                        if (request_ended && framing == Framing::Chunked) {
+                            outgoing += "0\r\n\r\n";
+                        }
+                    }
+                    request_sent = false;
+                    connect(false);
+                    return;
+                }
+                fail(timed_out ? Status::GatewayTimeout : Status::BadGateway);
+            }
+
+            void close_connection() {
+                if (connection) {
+                    connection->close();
+                    connection.reset();
+                }
+                connected = false;
+                received = false;
+                writing = false;
+                reading = false;
+                writing_data.clear();
+                disarm();
+            }
+
+            void arm(std::chrono::milliseconds timeout) {
+                if (timeout.count() == 0) {
+                    return;
+                }
+                uint64_t epoch = ++timer_epoch;
+                timer.expires_after(timeout);
+                auto self = shared_from_this();
+                timer.async_wait([self, epoch](asio_error_code ec) {
+                    if (ec || epoch != self->timer_epoch || !self->connection) {
+                        return;
+                    }
+                    // The handler of the connect or read fails.
+                    self->timed_out = true;
+                    self->connection->close();
+                });
+            }
+
+            void disarm() {
+                ++timer_epoch;
+                timer.cancel();
+            }
+
+            void flush() {
+                if (!connected || writing || outgoing.empty()) {
+                    return;
+                }
+                writing = true;
+                writing_data.clear();
+                writing_data.swap(outgoing);
+                auto self = shared_from_this();
+                auto conn = connection;
+                asio::async_write(conn->socket, asio::buffer(writing_data), [self, conn](asio_error_code ec, size_t) {
+                    if (conn != self->connection) {
+                        return;
+                    }
+                    self->writing = false;
+                    if (ec) {
+                        self->connection_failed();
+                        return;
+                    }
+                    if (self->body_paused && self->outgoing.size() < Proxy::max_buffered) {
+                        self->body_paused = false;
+                        self->client.resume_body();
+                    }
+                    self->flush();
+                    self->check_sent();
+                });
+            }
+
+            void check_sent() {
+                if (!request_ended || request_sent || !connected || writing || !outgoing.empty()) {
+                    return;
+                }
+                request_sent = true;
+                if (response_ended) {
+                    release();
+                }
+                else if (!response_begun) {
+                    arm(proxy.response_timeout);
+                }
+            }
+
+            void read() {
+                if (reading || !connected || response_ended) {
+                    return;
+                }
+                if (body.size() >= Proxy::max_buffered) {
+                    // Waiting for the client, whose writes the server times.
+                    disarm();
+                    return;
+                }
+                reading = true;
+                if (response_begun) {
+                    // The body must keep coming, or the response fails.
+                    arm(proxy.response_timeout);
+                }
+                auto self = shared_from_this();
+                auto conn = connection;
+                conn->socket.async_read_some(asio::buffer(conn->buffer.get(), read_size), [self, conn](asio_error_code ec, size_t len) {
+                    if (conn != self->connection) {
+                        return;
+                    }
+                    self->reading = false;
+                    self->parse(ec, len);
+                });
+            }
+
+            void parse(const asio_error_code& ec, size_t len) {
+                static const http_parser_settings settings = make_settings();
+                if (ec && (ec != asio::error::eof || !received)) {
+                    connection_failed();
+                    return;
+                }
+                if (!received) {
+                    received = true;
+                    http_parser_init(&parser, HTTP_RESPONSE);
+                }
+                // At EOF, a body without a length ends.
+                size_t parsed = http_parser_execute(&parser, &settings, ec ? nullptr : connection->buffer.get(), ec ? 0 : len);
+                auto status = HTTP_PARSER_ERRNO(&parser);
+                if (status == HPE_PAUSED) {
+                    // At the end of the response; anything after it was not asked for.
+                    http_parser_pause(&parser, 0);
+                    keep_alive = keep_alive && parsed == len;
+                }
+                else if (status != HPE_OK || (ec && !response_ended)) {
+                    connection_failed();
+                    return;
+                }
+                if (response_begun && responding && !delivered) {
+                    deliver();
+                }
+                if (producer_waiting && (!body.empty() || response_ended)) {
+                    producer_waiting = false;
+                    client.resume_response();
+                }
+                if (response_ended) {
+                    ended();
+                    return;
+                }
+                read();
+            }
+
+            void ended() {
+                disarm();
+                if (request_sent) {
+                    release();
+                    return;
+                }
+                if (request_ended && outgoing.empty()) {
+                    // The rest of the request is still being written; see check_sent().
+                    return;
+                }
+                // The upstream did not wait for the rest of the request,
+                // which is dropped along with the connection.
+                request_dropped = true;
+                outgoing.clear();
+                close_connection();
+                if (body_paused) {
+                    body_paused = false;
+                    client.resume_body();
+                }
+                finish();
+            }
+
+            // Pools the connection, if it can carry another request.
+            void release() {
+                if (keep_alive) {
+                    proxy.put(pool, std::move(connection));
+                    connection.reset();
+                }
+                close_connection();
+                finish();
+            }
+
+            void fail(Status status) {
+                if (delivered) {
+                    proxy.increment(proxy.counters.responses_cut_off);
+                }
+                else {
+                    proxy.increment(status == Status::GatewayTimeout ? proxy.counters.gateway_timeout : proxy.counters.bad_gateway);
+                }
+                failed = true;
+                error = status;
+                outgoing.clear();
+                close_connection();
+                if (body_paused) {
+                    body_paused = false;
+                    client.resume_body();
+                }
+                if (producer_waiting) {
+                    producer_waiting = false;
+                    client.resume_response();
+                }
+                if (responding && !delivered) {
+                    deliver();
+                }
+                finish();
+            }
+
+            // The client is gone, or will never be answered.
+            void abandon() {
+                failed = true;
+                close_connection();
+                finish();
+            }
+
+            void finish() {
+                if (finished || !upstream) {
+                    return;
+                }
+                finished = true;
+                upstream->outstanding.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+            // Completes the deferred response, with the head of the
+            // upstream's, and with its body if that has arrived in full.
+            void deliver() {
+                delivered = true;
+                if (failed) {
+                    Response res;
+                    res.status = error;
+                    client.complete(std::move(res));
+                    return;
+                }
+                if (response_ended || head_request || !has_body(response.status)) {
+                    response.body.swap(body);
+                }
+                else {
+                    response.body_producer = std::make_shared<Download>(shared_from_this());
+                }
+                client.complete(std::move(response));
+            }
+
+            IBodyProducer::State produce(std::string& out) {
+                if (!body.empty()) {
+                    out.swap(body);
+                    read();
+                    return response_ended ? IBodyProducer::Done : IBodyProducer::More;
+                }
+                if (response_ended) {
+                    return IBodyProducer::Done;
+                }
+                if (failed) {
+                    return IBodyProducer::Failed;
+                }
+                producer_waiting = true;
+                read();
+                return IBodyProducer::Waiting;
+            }
+
+            void end_field() {
+                if (!in_value) {
+                    return;
+                }
+                response.headers.push_back(HeaderField(response.arena.copy(field), response.arena.copy(value)));
+                field.clear();
+                value.clear();
+                in_value = false;
+            }
+
+            static Exchange& of(http_parser* parser) {
+                return *static_cast<Exchange*>(parser->data);
+            }
+
+            static http_parser_settings make_settings() {
+                http_parser_settings settings;
+                http_parser_settings_init(&settings);
+                settings.on_message_begin = [](http_parser* parser) {
+                    auto& self = of(parser);
+                    self.response.headers.clear();
+                    self.response.content_length = Response::unknown_length;
+                    self.field.clear();
+                    self.value.clear();
+                    self.in_value = false;
+                    return 0;
+                };
+                settings.on_header_field = [](http_parser* parser, const char* at, size_t len) {
+                    auto& self = of(parser);
+                    self.end_field();
+                    self.field.append(at, len);
+                    return 0;
+                };
+                settings.on_header_value = [](http_parser* parser, const char* at, size_t len) {
+                    auto& self = of(parser);
+                    self.in_value = true;
+                    self.value.append(at, len);
+                    return 0;
+                };
+                settings.on_headers_complete = [](http_parser* parser) {
+                    auto& self = of(parser);
+                    self.end_field();
+                    if (parser->status_code / 100 == 1) {
+                        // Interim responses, like 100 Continue, are not passed on.
+                        return 0;
+                    }
+                    auto& res = self.response;
+                    res.status = Status(parser->status_code);
+                    auto connection_field = res.header(HeaderId::Connection);
+                    Headers kept;
+                    for (auto& field: res.headers) {
+                        // The server frames the body itself, with the
+                        // upstream's length where it has one.
+                        if (field.id == HeaderId::ContentLength) {
+                            uint64_t length;
+                            auto end = field.value.data() + field.value.size();
+                            auto result = std::from_chars(field.value.data(), end, length);
+                            if (!(parser->flags & F_CHUNKED) && result.ec == std::errc() && result.ptr == end) {
+                                res.content_length = length;
+                            }
+                        }
+                        else if (!hop_by_hop(field, connection_field)) {
+                            kept.push_back(field);
+                        }
+                    }
+                    res.headers = kept;
+                    self.keep_alive = http_should_keep_alive(parser) != 0;
+                    self.response_begun = true;
+                    self.disarm();
+                    // Responses to HEAD requests describe a body they lack.
+                    return self.head_request ? 1 : 0;
+                };
+                settings.on_body = [](http_parser* parser, const char* at, size_t len) {
+                    of(parser).body.append(at, len);
+                    return 0;
+                };
+                settings.on_message_complete = [](http_parser* parser) {
+                    auto& self = of(parser);
+                    if (!self.response_begun) {
+                        return 0;
+                    }
+                    self.response_ended = true;
+                    self.keep_alive = self.keep_alive && http_should_keep_alive(parser) != 0;
+                    http_parser_pause(parser, 1);
+                    return 0;
+                };
+                return settings;
+            }
+        };
+
+        Upload::~Upload() {
+            if (!exchange->responding) {
+                exchange->abandon();
+            }
+        }
+
+        bool Upload::consume(Request&, std::string_view data) {
+            return exchange->consume(data);
+        }
+
+        Download::~Download() {
+            if (!exchange->response_ended) {
+                exchange->abandon();
+            }
+        }
+
+        IBodyProducer::State Download::produce(std::string& out) {
+            return exchange->produce(out);
+        }
+    }
+
+    struct Proxy::Impl : Upstreams {};
+
+    Proxy::Proxy() : impl_(new Impl) {}
+    Proxy::~Proxy() {}
+
+    Proxy& Proxy::upstream(std::string host, unsigned int port) {
+        asio::io_service service;
+        asio::ip::tcp::resolver resolver(service);
+        auto endpoint = resolver.resolve(host, std::to_string(port)).begin()->endpoint();
+        auto upstream = std::make_unique<Upstream>();
+        upstream->index = impl_->upstreams.size();
+        upstream->endpoint = asio::generic::stream_protocol::endpoint(endpoint);
+        upstream->tcp = true;
+        upstream->host = (host.find(':') != std::string::npos ? "[" + host + "]" : host) + ":" + std::to_string(port);
+        impl_->upstreams.push_back(std::move(upstream));
+        return *this;
+    }
+
+    Proxy& Proxy::upstream(std::string unix_socket_path) {
+#if defined(_MSC_VER)
+        throw std::runtime_error("UNIX domain sockets not supported on Win32.");
+#else
+        auto upstream = std::make_unique<Upstream>();
+        upstream->index = impl_->upstreams.size();
+        upstream->endpoint = asio::generic::stream_protocol::endpoint(asio::local::stream_protocol::endpoint(unix_socket_path));
+        upstream->host = "localhost";
+        impl_->upstreams.push_back(std::move(upstream));
+        return *this;
+#endif
+    }
+
+    Proxy& Proxy::max_idle_connections(size_t max) {
+        impl_->max_idle = max;
+        return *this;
+    }
+
+    Proxy& Proxy::idle_timeout(unsigned int ms) {
+        impl_->idle_timeout = std::chrono::milliseconds(ms);
+        return *this;
+    }
+
+    Proxy& Proxy::connect_timeout(unsigned int ms) {
+        impl_->connect_timeout = std::chrono::milliseconds(ms);
+        return *this;
+    }
+
+    Proxy& Proxy::response_timeout(unsigned int ms) {
+        impl_->response_timeout = std::chrono::milliseconds(ms);
+        return *this;
+    }
+
+    size_t Proxy::num_outstanding(size_t upstream) const {
+        return impl_->upstreams.at(upstream)->outstanding.load(std::memory_order_relaxed);
+    }
+
+    Proxy::Metrics Proxy::metrics() const {
+        auto& counters = impl_->counters;
+        Metrics metrics;
+        metrics.requests = counters.requests.load(std::memory_order_relaxed);
+        metrics.connections_opened = counters.connections_opened.load(std::memory_order_relaxed);
+        metrics.connections_reused = counters.connections_reused.load(std::memory_order_relaxed);
+        metrics.connect_failures = counters.connect_failures.load(std::memory_order_relaxed);
+        metrics.upstreams_down = counters.upstreams_down.load(std::memory_order_relaxed);
+        metrics.bad_gateway = counters.bad_gateway.load(std::memory_order_relaxed);
+        metrics.gateway_timeout = counters.gateway_timeout.load(std::memory_order_relaxed);
+        metrics.responses_cut_off = counters.responses_cut_off.load(std::memory_order_relaxed);
+        return metrics;
+    }
+
+    std::shared_ptr<IBodyConsumer> Proxy::begin(Request& req) {
+        auto service = static_cast<asio::io_service*>(req.connection.io_service());
+        if (!service || impl_->upstreams.empty()) {
+            return nullptr;
+        }
+        auto exchange = std::make_shared<Exchange>(*impl_, *service, req);
+        exchange->start(req);
+        return std::make_shared<Upload>(std::move(exchange));
+    }
+
+    void Proxy::operator()(Request& req, Response& res) {
+        auto upload = std::dynamic_pointer_cast<Upload>(req.body_consumer);
+        if (!upload) {
+            res.status = Status::BadGateway;
+            return;
+        }
+        upload->exchange->respond(req, res);
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <wayward/http.hpp>
+
+namespace wayward {
+    // Forwards requests to a set of upstream HTTP/1.1 servers, as a handler
+    // for App::proxy(), and streams their responses back.
+    //
+    // The proxy does its I/O on the event loop of each request's
+    // connection, and keeps the connections to the upstreams it has finished
+    // with open, in a pool per loop, for the loop's next requests. Every
+    // request goes to the upstream with the fewest requests in progress
+    // (over all loops); an upstream that refuses a connection is passed over
+    // for a second, and the request goes to the next one.
+    //
+    // Bodies stream in both directions, each with at most max_buffered bytes
+    // held by the proxy: the request body as it arrives, with its
+    // Content-Length, or chunked; the response body through a producer
+    // (see IBodyProducer), which stops reading from the upstream while the
+    // client falls behind, with the upstream's Content-Length if it sent
+    // one. HEAD and 304 responses keep the upstream's Content-Length too.
+    // The request goes out with its own header fields, except for
+    // hop-by-hop ones (Connection, Keep-Alive, Transfer-Encoding, Upgrade,
+    // ..., and the fields Connection names), and so does the response.
+    //
+    // Requests that fail before their response has begun are answered with
+    // 502 Bad Gateway, or 504 Gateway Timeout. A request without a body that
+    // finds a pooled connection closed by its upstream is sent again on a
+    // new one, if its method is idempotent. A response that fails, or
+    // stalls (see response_timeout()), while its body is streaming is cut
+    // off (see IBodyProducer::Failed).
+    //
+    // Set up before the server runs; the proxy must outlive the Server.
+    struct WAYWARD_EXPORT Proxy {
+        static constexpr size_t max_buffered = 64 * 1024;
+
+        Proxy();
+        ~Proxy();
+
+        Proxy(const Proxy&) = delete;
+        Proxy& operator=(const Proxy&) = delete;
+
+        // Adds an upstream at a TCP address, which is resolved now, or at a
+        // UNIX domain socket.
+        Proxy& upstream(std::string host, unsigned int port);
+        Proxy& upstream(std::string unix_socket_path);
+
+        // Pooled connections per upstream and event loop; beyond that, the
+        // longest idle are closed. Default is 32.
+        Proxy& max_idle_connections(size_t max);
+        // Pooled connections unused for this long are closed, in
+        // milliseconds. Default is 60 s.
+        Proxy& idle_timeout(unsigned int ms);
+        // How long to wait for an upstream to accept a connection, and for
+        // the head of its response once the request has been sent, then
+        // for each piece of its body (while the client keeps up), in
+        // milliseconds; 0 waits forever. Defaults are 5 s and 60 s.
+        Proxy& connect_timeout(unsigned int ms);
+        Proxy& response_timeout(unsigned int ms);
+
+        // Requests in progress at each upstream, in the order they were
+        // added. Thread-safe.
+        size_t num_outstanding(size_t upstream) const;
+
+        // Counters over all upstreams and loops. Thread-safe.
+        struct Metrics {
+            uint64_t requests = 0;
+            uint64_t connections_opened = 0;
+            uint64_t connections_reused = 0; // Taken from a pool.
+            uint64_t connect_failures = 0;
+            uint64_t upstreams_down = 0; // Times one was passed over.
+            uint64_t bad_gateway = 0; // Answered with 502.
+            uint64_t gateway_timeout = 0; // Answered with 504.
+            uint64_t responses_cut_off = 0; // Failed while streaming.
+        };
+        Metrics metrics() const;
+
+        // Starts forwarding a request once its headers have arrived, and
+        // returns the consumer its body streams through (see App::proxy()).
+        std::shared_ptr<IBodyConsumer> begin(Request&);
+        // Defers the response until the upstream's has begun.
+        void operator()(Request&, Response&);
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
+}
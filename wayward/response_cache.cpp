@@ -0,0 +1,507 @@
+#include "wayward/response_cache.hpp"
+
+#include <charconv>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace wayward {
+    namespace {
+        using Clock = std::chrono::steady_clock;
+
+        // How long a response that could not be cached keeps requests for
+        // it from waiting for each other.
+        constexpr auto pass_duration = std::chrono::seconds(1);
+
+        // Rough bookkeeping cost of a cached key, besides its data.
+        constexpr size_t slot_overhead = 128;
+
+        std::string_view trim(std::string_view str) {
+            while (!str.empty() && (str.front() == ' ' || str.front() == '\t')) {
+                str.remove_prefix(1);
+            }
+            while (!str.empty() && (str.back() == ' ' || str.back() == '\t')) {
+                str.remove_suffix(1);
+            }
+            return str;
+        }
+
+        // Calls `fn(item)` for every non-empty item of a comma-separated
+        // list.
+        template <class Function>
+        void for_each_item(std::string_view list, Function fn) {
+            while (!list.empty()) {
+                auto comma = list.find(',');
+                auto item = trim(list.substr(0, comma));
+                if (!item.empty()) {
+                    fn(item);
+                }
+                list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+            }
+        }
+
+        // Calls `fn(name, argument)` for every Cache-Control directive.
+        template <class Function>
+        void for_each_directive(std::string_view list, Function fn) {
+            for_each_item(list, [&](std::string_view item) {
+                auto equals = item.find('=');
+                if (equals == std::string_view::npos) {
+                    fn(item, std::string_view());
+                    return;
+                }
+                auto argument = trim(item.substr(equals + 1));
+                if (argument.size() >= 2 && argument.front() == '"' && argument.back() == '"') {
+                    argument = argument.substr(1, argument.size() - 2);
+                }
+                fn(trim(item.substr(0, equals)), argument);
+            });
+        }
+
+        bool parse_seconds(std::string_view str, uint64_t& seconds) {
+            auto result = std::from_chars(str.data(), str.data() + str.size(), seconds);
+            return result.ec == std::errc() && result.ptr == str.data() + str.size();
+        }
+
+        // Statuses cacheable by default (RFC 7231, section 6.1).
+        bool cacheable_status(Status status) {
+            switch (status) {
+                case Status::OK:
+                case Status::NoContent:
+                case Status::MovedPermanently:
+                case Status::PermanentRedirect:
+                case Status::NotFound:
+                case Status::MethodNotAllowed:
+                case Status::NotImplemented:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+    }
+
+    struct ResponseCache::Impl {
+        IRequestResponder& next;
+        size_t cache_size = 64 * 1024 * 1024;
+        Clock::duration default_ttl = Clock::duration::zero();
+
+        // Immutable once cached. Responses sent from it keep it alive.
+        struct Entry {
+            Status status = Status::OK;
+            Headers headers; // Views into `data`, or static names.
+            std::string_view body; // Into `data`.
+            std::string data;
+            LatencyHistogram* latency = nullptr;
+            Clock::time_point stored;
+        };
+
+        // What is known about a key: a response, or else the request headers
+        // that select one (by Vary), or else neither, for a response that
+        // could not be cached.
+        struct Slot {
+            std::string key;
+            Clock::time_point expires;
+            std::shared_ptr<const Entry> entry;
+            std::vector<std::string> vary;
+            size_t size = 0;
+        };
+        using Lru = std::list<Slot>;
+
+        // A request deferred until another one's response is ready. The
+        // Request stays valid, and untouched by its connection, until then.
+        struct Waiter {
+            ConnectionHandle connection;
+            Request* request;
+        };
+
+        struct alignas(64) Shard {
+            std::mutex mutex;
+            Lru lru; // Most recently used first.
+            std::unordered_map<std::string_view, Lru::iterator> index; // By Slot::key.
+            // Keys whose response is being produced, and who waits for it.
+            std::unordered_map<std::string, std::vector<Waiter>> filling;
+            // The fills whose handler deferred its response, by request,
+            // until completed().
+            std::unordered_map<const Request*, std::string> deferred;
+            size_t bytes = 0;
+            Stats stats;
+        };
+        std::vector<std::unique_ptr<Shard>> shards;
+
+        explicit Impl(IRequestResponder& next) : next(next) {
+            reset_shards(16);
+        }
+
+        void reset_shards(size_t num_shards) {
+            shards.clear();
+            for (size_t i = 0; i < (num_shards > 0 ? num_shards : 1); ++i) {
+                shards.push_back(std::make_unique<Shard>());
+            }
+        }
+
+        Shard& shard_for(std::string_view key) {
+            return *shards[std::hash<std::string_view>()(key) % shards.size()];
+        }
+
+        // Appends the values of the request headers a response varies by.
+        static void append_vary_values(std::string& key, const std::vector<std::string>& vary, const Request& req) {
+            for (auto& name: vary) {
+                key += '\n';
+                key += req.header(name);
+            }
+        }
+
+        // Fresh slot for the key, if any; drops an expired one.
+        Slot* find(Shard& shard, std::string_view key, Clock::time_point now) {
+            auto it = shard.index.find(key);
+            if (it == shard.index.end()) {
+                return nullptr;
+            }
+            if (it->second->expires <= now) {
+                erase(shard, it->second);
+                return nullptr;
+            }
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            return &*it->second;
+        }
+
+        void store(Shard& shard, Slot slot) {
+            slot.size = slot_overhead + 2 * slot.key.size() + (slot.entry ? slot.entry->data.size() : 0);
+            for (auto& name: slot.vary) {
+                slot.size += name.size();
+            }
+            auto it = shard.index.find(slot.key);
+            if (it != shard.index.end()) {
+                erase(shard, it->second);
+            }
+            size_t limit = cache_size / shards.size();
+            if (slot.size > limit) {
+                return;
+            }
+            while (shard.bytes + slot.size > limit) {
+                erase(shard, std::prev(shard.lru.end()));
+                ++shard.stats.evicted;
+            }
+            if (slot.entry) {
+                ++shard.stats.stored;
+            }
+            shard.bytes += slot.size;
+            shard.lru.push_front(std::move(slot));
+            shard.index.emplace(shard.lru.front().key, shard.lru.begin());
+        }
+
+        void erase(Shard& shard, Lru::iterator it) {
+            shard.bytes -= it->size;
+            shard.index.erase(it->key);
+            shard.lru.erase(it);
+        }
+
+        // How long the response may be cached, or zero.
+        Clock::duration freshness(const Response& res, std::vector<std::string>& vary) const {
+            if (!cacheable_status(res.status) || res.body_producer || res.file) {
+                return Clock::duration::zero();
+            }
+            bool storable = true;
+            bool has_max_age = false;
+            bool has_s_maxage = false;
+            uint64_t max_age = 0;
+            for (auto& field: res.headers) {
+                switch (field.id) {
+                    case HeaderId::SetCookie:
+                        storable = false;
+                        break;
+                    case HeaderId::CacheControl:
+                        for_each_directive(field.value, [&](std::string_view name, std::string_view argument) {
+                            uint64_t seconds = 0;
+                            if (iequals(name, "no-store") || iequals(name, "no-cache") || iequals(name, "private")) {
+                                storable = false;
+                            }
+                            else if (iequals(name, "s-maxage") && parse_seconds(argument, seconds)) {
+                                has_s_maxage = true;
+                                max_age = seconds;
+                            }
+                            else if (iequals(name, "max-age") && !has_s_maxage && parse_seconds(argument, seconds)) {
+                                has_max_age = true;
+                                max_age = seconds;
+                            }
+                        });
+                        break;
+                    case HeaderId::Vary:
+                        for_each_item(field.value, [&](std::string_view name) {
+                            if (name == "*") {
+                                storable = false;
+                            }
+                            vary.emplace_back(name);
+                        });
+                        break;
+                    default:
+                        break;
+                }
+            }
+            if (!storable) {
+                return Clock::duration::zero();
+            }
+            if (has_max_age || has_s_maxage) {
+                return std::chrono::seconds(max_age);
+            }
+            return default_ttl;
+        }
+
+        // Copies the response into one buffer.
+        static std::shared_ptr<Entry> snapshot(const Response& res, Clock::time_point now) {
+            auto entry = std::make_shared<Entry>();
+            auto body = res.shared_owner ? res.shared_body : std::string_view(res.body);
+            size_t size = body.size();
+            for (auto& field: res.headers) {
+                size += (field.id == HeaderId::Other ? field.name.size() : 0) + field.value.size();
+            }
+            entry->data.reserve(size);
+            for (auto& field: res.headers) {
+                auto name = field.id == HeaderId::Other ? copy(entry->data, field.name) : header_name(field.id);
+                auto& copied = entry->headers.emplace_back();
+                copied.name = name;
+                copied.id = field.id;
+                copied.value = copy(entry->data, field.value);
+            }
+            entry->body = copy(entry->data, body);
+            entry->status = res.status;
+            entry->latency = res.latency;
+            entry->stored = now;
+            return entry;
+        }
+
+        // Appends to `data`, which has been reserved for it.
+        static std::string_view copy(std::string& data, std::string_view str) {
+            size_t offset = data.size();
+            data += str;
+            return std::string_view(data).substr(offset);
+        }
+
+        static void send(Response& res, std::shared_ptr<const Entry> entry, Clock::time_point now) {
+            res.status = entry->status;
+            res.headers = entry->headers;
+            res.shared_body = entry->body;
+            if (!res.latency) {
+                res.latency = entry->latency;
+            }
+            auto age = std::chrono::duration_cast<std::chrono::seconds>(now - entry->stored).count();
+            res.shared_owner = std::move(entry);
+            if (age > 0) {
+                char digits[20];
+                auto end = std::to_chars(digits, digits + sizeof(digits), age).ptr;
+                res.set_header(HeaderId::Age, std::string_view(digits, end - digits));
+            }
+        }
+
+        // Stores what the leader of a fill found out, and answers the
+        // requests that waited for it.
+        void finish(Shard& shard, const std::string& primary, const std::string& key,
+                    const Request& req, std::shared_ptr<Entry> entry, std::vector<std::string> vary,
+                    Clock::duration ttl, Clock::time_point now) {
+            std::string entry_key = primary;
+            append_vary_values(entry_key, vary, req);
+            std::vector<Waiter> waiters;
+            {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                auto fill = shard.filling.find(key);
+                if (fill != shard.filling.end()) {
+                    waiters = std::move(fill->second);
+                    shard.filling.erase(fill);
+                }
+                if (entry) {
+                    if (!vary.empty()) {
+                        store(shard, Slot{primary, now + ttl, nullptr, vary});
+                    }
+                    store(shard, Slot{entry_key, now + ttl, entry, {}});
+                }
+                else {
+                    store(shard, Slot{key, now + pass_duration, nullptr, {}});
+                }
+            }
+            for (auto& waiter: waiters) {
+                std::string waiter_key = primary;
+                append_vary_values(waiter_key, vary, *waiter.request);
+                if (entry && waiter_key == entry_key) {
+                    Response res;
+                    send(res, entry, now);
+                    waiter.connection.complete(std::move(res));
+                }
+                else {
+                    pass(waiter);
+                }
+            }
+        }
+
+        // The key by which a request is stored (before Vary), which also
+        // picks its shard.
+        static std::string primary_key(const Request& req) {
+            std::string primary;
+            primary.reserve(8 + req.url.size());
+            primary += method_name(req.method);
+            primary += ' ';
+            primary += req.url;
+            return primary;
+        }
+
+        // Stores the response if it may be cached, and finishes the fill.
+        void fill(Shard& shard, const std::string& primary, const std::string& key,
+                  const Request& req, const Response& res, Clock::time_point now) {
+            std::vector<std::string> vary;
+            auto ttl = freshness(res, vary);
+            std::shared_ptr<Entry> entry;
+            if (ttl > Clock::duration::zero()) {
+                entry = snapshot(res, now);
+            }
+            else {
+                vary.clear();
+            }
+            finish(shard, primary, key, req, std::move(entry), std::move(vary), ttl, now);
+        }
+
+        // Lets a waiting request run the handler itself, on its own thread.
+        void pass(const Waiter& waiter) {
+            auto connection = waiter.connection;
+            auto req = waiter.request;
+            connection.post([this, connection, req]() {
+                Response res;
+                next.respond(*req, res);
+                if (req->deferred) {
+                    // The handler completes it; the server no longer looks.
+                    req->deferred = false;
+                    return;
+                }
+                connection.complete(std::move(res));
+            });
+        }
+    };
+
+    ResponseCache::ResponseCache(IRequestResponder& next) : impl_(new Impl(next)) {}
+    ResponseCache::~ResponseCache() {}
+
+    ResponseCache& ResponseCache::cache_size(size_t bytes) {
+        impl_->cache_size = bytes;
+        return *this;
+    }
+
+    ResponseCache& ResponseCache::default_ttl_ms(unsigned int ms) {
+        impl_->default_ttl = std::chrono::milliseconds(ms);
+        return *this;
+    }
+
+    ResponseCache& ResponseCache::shards(size_t num_shards) {
+        impl_->reset_shards(num_shards);
+        return *this;
+    }
+
+    ResponseCache::Stats ResponseCache::stats() const {
+        Stats total;
+        for (auto& shard: impl_->shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            total.hits += shard->stats.hits;
+            total.misses += shard->stats.misses;
+            total.coalesced += shard->stats.coalesced;
+            total.stored += shard->stats.stored;
+            total.evicted += shard->stats.evicted;
+            total.bytes += shard->bytes;
+        }
+        return total;
+    }
+
+    void ResponseCache::begin(Request& req) {
+        impl_->next.begin(req);
+    }
+
+    void ResponseCache::completed(Request& req, Response& res) {
+        auto& impl = *impl_;
+        auto primary = Impl::primary_key(req);
+        auto& shard = impl.shard_for(primary);
+        std::string key;
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.deferred.find(&req);
+            if (it != shard.deferred.end()) {
+                key = std::move(it->second);
+                shard.deferred.erase(it);
+            }
+        }
+        if (!key.empty()) {
+            impl.fill(shard, primary, key, req, res, Clock::now());
+        }
+        impl.next.completed(req, res);
+    }
+
+    void ResponseCache::respond(Request& req, Response& res) {
+        auto& impl = *impl_;
+        bool bypass = (req.method != Method::Get && req.method != Method::Head) || !req.header(HeaderId::Authorization).empty();
+        bool refresh = false;
+        for_each_directive(req.header(HeaderId::CacheControl), [&](std::string_view name, std::string_view) {
+            bypass = bypass || iequals(name, "no-store");
+            refresh = refresh || iequals(name, "no-cache");
+        });
+        if (bypass) {
+            impl.next.respond(req, res);
+            return;
+        }
+
+        std::string primary = Impl::primary_key(req);
+        std::string key = primary;
+        auto& shard = impl.shard_for(primary);
+        auto now = Clock::now();
+        std::shared_ptr<const Impl::Entry> hit;
+        bool pass = false;
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto slot = impl.find(shard, key, now);
+            if (slot && !slot->vary.empty()) {
+                Impl::append_vary_values(key, slot->vary, req);
+                slot = impl.find(shard, key, now);
+            }
+            if (slot && slot->entry && !refresh) {
+                ++shard.stats.hits;
+                hit = slot->entry;
+            }
+            else if (slot && !slot->entry) {
+                // Not cacheable lately; do not wait for others.
+                ++shard.stats.misses;
+                pass = true;
+            }
+            else {
+                ++shard.stats.misses;
+                auto fill = shard.filling.find(key);
+                if (fill != shard.filling.end()) {
+                    ++shard.stats.coalesced;
+                    fill->second.push_back({req.defer(), &req});
+                    return;
+                }
+                shard.filling.emplace(key, std::vector<Impl::Waiter>());
+            }
+        }
+        if (hit) {
+            Impl::send(res, std::move(hit), now);
+            return;
+        }
+        if (pass) {
+            impl.next.respond(req, res);
+            return;
+        }
+
+        try {
+            impl.next.respond(req, res);
+        }
+        catch (...) {
+            impl.finish(shard, primary, key, req, nullptr, {}, Clock::duration::zero(), now);
+            throw;
+        }
+        if (req.deferred) {
+            // The fill goes on until completed(); the server keeps the
+            // Request as it is until then.
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.deferred.emplace(&req, std::move(key));
+            return;
+        }
+        impl.fill(shard, primary, key, req, res, now);
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include <wayward/http.hpp>
+
+namespace wayward {
+    // Answers repeated GET and HEAD requests from memory, in front of
+    // another responder (usually an App):
+    //
+    //     App app;
+    //     ...
+    //     ResponseCache cache(app);
+    //     server.run(cache);
+    //
+    // Responses are keyed by method and URL, and the values of the request
+    // headers listed in their Vary field. They are cached for the max-age
+    // (or s-maxage) of their Cache-Control field, or default_ttl_ms if they
+    // have none, unless they are marked no-store, no-cache or private, set
+    // cookies, or their body is streamed or sent from a file. Requests with
+    // an Authorization field, or "Cache-Control: no-store", bypass the cache;
+    // "Cache-Control: no-cache" refreshes the entry.
+    //
+    // A cached response is stored once, with its header fields and body in
+    // one immutable buffer, which hits send without copying. While a
+    // response is being produced, further requests for it wait (deferred)
+    // and get the same response, so a cold key runs its handler once; that
+    // includes responses the handler defers, which are taken up when they
+    // are completed (see IRequestResponder::completed()). Responses that
+    // turn out not to be cacheable are not waited for again for a second;
+    // waiting requests then run the handler themselves.
+    //
+    // The cache is split into shards, each with its own lock and least
+    // recently used order, and cache_size / shards bytes.
+    struct WAYWARD_EXPORT ResponseCache : IRequestResponder {
+        explicit ResponseCache(IRequestResponder& next);
+        ~ResponseCache();
+
+        // Not thread-safe; shards() drops what has been cached.
+        ResponseCache& cache_size(size_t bytes);         // Default 64 MiB.
+        ResponseCache& default_ttl_ms(unsigned int ms);  // Default 0: not cached.
+        ResponseCache& shards(size_t num_shards);        // Default 16.
+
+        struct Stats {
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t coalesced = 0; // Misses that waited for another.
+            uint64_t stored = 0;
+            uint64_t evicted = 0;
+            uint64_t bytes = 0;
+        };
+        Stats stats() const;
+
+        // IRequestResponder
+        void begin(Request&) override;
+        void respond(Request&, Response&) override;
+        void completed(Request&, Response&) override;
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
+}
@@ -0,0 +1,222 @@
+#include "wayward/router.hpp"
+
+#include <array>
+#include <stdexcept>
+#include <string>
+
+namespace wayward {
+    struct Router::Node {
+        // Static text consumed by this node. Empty for captures and wildcards.
+        std::string prefix;
+
+        // Static children, and the first byte of each of their prefixes.
+        std::string indices;
+        std::vector<std::unique_ptr<Node>> children;
+
+        std::unique_ptr<Node> capture;
+        std::unique_ptr<Node> wildcard;
+
+        // Name of the capture or wildcard this node represents.
+        std::string name;
+
+        std::array<size_t, num_methods> routes;
+
+        Node() {
+            routes.fill(npos);
+        }
+
+        bool has_routes() const {
+            for (size_t route: routes) {
+                if (route != npos) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        Node* static_child(char c) const {
+            size_t idx = indices.find(c);
+            return idx == std::string::npos ? nullptr : children[idx].get();
+        }
+
+        static Node* named_child(std::unique_ptr<Node>& child, std::string_view name) {
+            if (!child) {
+                child.reset(new Node);
+                child->name = std::string(name);
+            }
+            else if (child->name != name) {
+                throw std::invalid_argument("Route captures '" + std::string(name) + "' where another route captures '" + child->name + "'.");
+            }
+            return child.get();
+        }
+
+        size_t match(Method method, std::string_view path, std::vector<Param>& params, bool& path_matched) const;
+        size_t match_children(Method method, std::string_view path, std::vector<Param>& params, bool& path_matched) const;
+
+        uint32_t allowed(std::string_view path) const;
+
+        uint32_t methods() const {
+            uint32_t mask = 0;
+            for (size_t i = 0; i < num_methods; ++i) {
+                if (routes[i] != npos) {
+                    mask |= uint32_t(1) << i;
+                }
+            }
+            return mask;
+        }
+
+        size_t match_leaf(Method method, bool& path_matched) const {
+            if (has_routes()) {
+                path_matched = true;
+            }
+            return routes[size_t(method)];
+        }
+    };
+
+    Router::Router() : root_(new Node) {}
+    Router::~Router() {}
+
+    void Router::insert(Method method, std::string_view pattern, size_t route) {
+        const std::string_view full_pattern = pattern;
+        Node* node = root_.get();
+
+        while (!pattern.empty()) {
+            if (pattern[0] == ':') {
+                size_t end = pattern.find('/');
+                auto name = pattern.substr(1, end == std::string_view::npos ? end : end - 1);
+                if (name.empty()) {
+                    throw std::invalid_argument("Unnamed capture in route '" + std::string(full_pattern) + "'.");
+                }
+                node = Node::named_child(node->capture, name);
+                pattern.remove_prefix(1 + name.size());
+                continue;
+            }
+
+            if (pattern[0] == '*') {
+                auto name = pattern.substr(1);
+                if (name.find_first_of("/:*") != std::string_view::npos) {
+                    throw std::invalid_argument("Wildcard must be last in route '" + std::string(full_pattern) + "'.");
+                }
+                node = Node::named_child(node->wildcard, name.empty() ? "*" : name);
+                break;
+            }
+
+            auto text = pattern.substr(0, pattern.find_first_of(":*"));
+            Node* child = node->static_child(text[0]);
+            if (!child) {
+                size_t idx = node->children.size();
+                node->children.emplace_back(new Node);
+                node->indices.push_back(text[0]);
+                child = node->children[idx].get();
+                child->prefix = std::string(text);
+                node = child;
+                pattern.remove_prefix(text.size());
+                continue;
+            }
+
+            size_t common = 0;
+            while (common < text.size() && common < child->prefix.size() && text[common] == child->prefix[common]) {
+                ++common;
+            }
+            if (common < child->prefix.size()) {
+                // Split the edge: the shared part becomes a new node between
+                // `node` and `child`.
+                std::unique_ptr<Node> middle(new Node);
+                middle->prefix = child->prefix.substr(0, common);
+                child->prefix.erase(0, common);
+                size_t idx = node->indices.find(text[0]);
+                middle->indices.push_back(child->prefix[0]);
+                middle->children.push_back(std::move(node->children[idx]));
+                node->children[idx] = std::move(middle);
+                child = node->children[idx].get();
+            }
+            node = child;
+            pattern.remove_prefix(common);
+        }
+
+        size_t& slot = node->routes[size_t(method)];
+        if (slot != npos) {
+            throw std::invalid_argument("Route '" + std::string(full_pattern) + "' is already registered for this method.");
+        }
+        slot = route;
+    }
+
+    size_t Router::Node::match(Method method, std::string_view path, std::vector<Param>& params, bool& path_matched) const {
+        if (path.empty()) {
+            size_t route = match_leaf(method, path_matched);
+            if (route != npos) {
+                return route;
+            }
+        }
+        return match_children(method, path, params, path_matched);
+    }
+
+    size_t Router::Node::match_children(Method method, std::string_view path, std::vector<Param>& params, bool& path_matched) const {
+        if (!path.empty()) {
+            if (const Node* child = static_child(path[0])) {
+                auto& prefix = child->prefix;
+                if (path.compare(0, prefix.size(), prefix) == 0) {
+                    size_t route = child->match(method, path.substr(prefix.size()), params, path_matched);
+                    if (route != npos) {
+                        return route;
+                    }
+                }
+            }
+
+            if (capture && path[0] != '/') {
+                auto segment = path.substr(0, path.find('/'));
+                params.emplace_back(capture->name, segment);
+                size_t route = capture->match(method, path.substr(segment.size()), params, path_matched);
+                if (route != npos) {
+                    return route;
+                }
+                params.pop_back();
+            }
+        }
+
+        if (wildcard) {
+            size_t route = wildcard->match_leaf(method, path_matched);
+            if (route != npos) {
+                params.emplace_back(wildcard->name, path);
+                return route;
+            }
+        }
+        return npos;
+    }
+
+    size_t Router::match(Method method, std::string_view path, std::vector<Param>& params, bool* path_matched) const {
+        bool matched = false;
+        size_t route = root_->match(method, path, params, matched);
+        if (path_matched) {
+            *path_matched = matched;
+        }
+        return route;
+    }
+
+    // Like match(), but follows every branch that fits the path instead of
+    // stopping at the first route, so one walk finds the routes of all
+    // methods.
+    uint32_t Router::Node::allowed(std::string_view path) const {
+        uint32_t mask = path.empty() ? methods() : 0;
+        if (!path.empty()) {
+            if (const Node* child = static_child(path[0])) {
+                auto& prefix = child->prefix;
+                if (path.compare(0, prefix.size(), prefix) == 0) {
+                    mask |= child->allowed(path.substr(prefix.size()));
+                }
+            }
+            if (capture && path[0] != '/') {
+                auto segment = path.substr(0, path.find('/'));
+                mask |= capture->allowed(path.substr(segment.size()));
+            }
+        }
+        if (wildcard) {
+            mask |= wildcard->methods();
+        }
+        return mask;
+    }
+
+    uint32_t Router::allowed_methods(std::string_view path) const {
+        return root_->allowed(path);
+    }
+}
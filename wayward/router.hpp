@@ -0,0 +1,51 @@
+#pragma once
+
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include <wayward/http.hpp>
+
+namespace wayward {
+    // Compressed radix tree mapping (method, path pattern) to route indices.
+    //
+    // Patterns are static text mixed with ":name" captures, which match one
+    // non-empty path segment, and an optional trailing "*name" (or "*")
+    // wildcard, which matches the rest of the path. Static text takes
+    // precedence over captures, and captures over wildcards.
+    //
+    // Matching follows the path down the tree, and does not allocate beyond
+    // growing `params`. Where static text and a capture both fit a segment
+    // but the static branch leads to no route for the method, it backs up
+    // and tries the capture, then the wildcard. So patterns that overlap
+    // over several segments, like "/a/b/c" and "/:x/:y/:z", can make it
+    // visit more nodes than the path is long. It still visits each node at
+    // most once, as a node's remaining path is fixed by the way down, so
+    // the cost is bounded by the size of the route table, which the
+    // application chooses, whatever path a client sends.
+    struct WAYWARD_EXPORT Router {
+        static constexpr size_t npos = size_t(-1);
+
+        Router();
+        ~Router();
+
+        // Throws std::invalid_argument if the pattern is malformed, conflicts
+        // with the capture names of another route, or is already registered
+        // for the method.
+        void insert(Method method, std::string_view pattern, size_t route);
+
+        // Returns the route for the method and path, or npos. On success, the
+        // captures are appended to `params`. If no route matched only because
+        // of the method, `*path_matched` is set to true.
+        size_t match(Method method, std::string_view path, std::vector<Param>& params, bool* path_matched = nullptr) const;
+
+        // The methods with a route for the path, as a mask of
+        // 1 << size_t(Method), e.g. for the Allow field of a 405. One walk
+        // covers all methods.
+        uint32_t allowed_methods(std::string_view path) const;
+
+    private:
+        struct Node;
+        std::unique_ptr<Node> root_;
+    };
+}
@@ -1,129 +1,286 @@
-#include "wayward/server.hpp"
-#include "wayward/util/linklist.hpp"
-#include "config.h"
-
-#if defined(ASIO_FROM_BOOST)
-#include <boost/asio.hpp>
-namespace asio = boost::asio;
-using asio_error_code = boost::system::error_code;
-#else
-#include <asio.hpp>
-using asio_error_code = std::error_code;
-#endif
-
-#include <http_parser.h>
-
-#include <iostream>
-#include <sstream>
+#include "wayward/server_impl.hpp"
 
 namespace wayward {
-    struct Server::ClientBase {
-        Server::Impl& server_impl;
-        util::IntrusiveListAnchor anchor;
-        asio::ip::tcp::socket socket;
-        http_parser parser;
-
-        static constexpr size_t recv_buffer_size = 1024;
-        std::unique_ptr<char[]> recv_buffer;
-        std::string send_buffer; // TODO
-
-        std::string current_header_field;
-        Request current_request;
-
-        ClientBase(Impl& server_impl);
-        virtual ~ClientBase() {}
-
-        void send_response(Response);
-        virtual void close() = 0;
-
-        virtual void keep_reading() = 0;
-        virtual void keep_writing() = 0;
-
-        static int on_message_begin(http_parser*);
-        static int on_headers_complete(http_parser*);
-        static int on_message_complete(http_parser*);
-        static int on_chunk_header(http_parser*);
-        static int on_chunk_complete(http_parser*);
+    namespace {
+        // Without SO_REUSEPORT (and always for UNIX domain sockets, which
+        // cannot be bound twice), the loops share a duplicate of the same
+        // listening socket and race to accept from it.
+        template <class Protocol>
+        void share_sibling(asio::basic_socket_acceptor<Protocol>& acceptor, const asio::basic_socket_acceptor<Protocol>& sibling) {
+#if defined(_MSC_VER)
+            throw std::runtime_error("Multiple threads require SO_REUSEPORT, which is not supported on Win32.");
+#else
+            int fd = ::dup(const_cast<asio::basic_socket_acceptor<Protocol>&>(sibling).native_handle());
+            if (fd < 0) {
+                throw std::system_error(errno, std::system_category(), "dup()");
+            }
+            acceptor.assign(sibling.local_endpoint().protocol(), fd);
+#endif
+        }
 
-        static int on_url(http_parser*, const char*, size_t);
-        static int on_status(http_parser*, const char*, size_t);
-        static int on_header_field(http_parser*, const char*, size_t);
-        static int on_header_value(http_parser*, const char*, size_t);
-        static int on_body(http_parser*, const char*, size_t);
+        template <class Protocol>
+        void open_sibling(asio::basic_socket_acceptor<Protocol>& acceptor, const asio::basic_socket_acceptor<Protocol>& sibling) {
+            share_sibling(acceptor, sibling);
+        }
 
-        static const http_parser_settings parser_settings;
-    };
+#if defined(SO_REUSEPORT)
+        using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
 
-    struct Server::AcceptorBase {
-        Server::Impl& server_impl;
-        util::IntrusiveListAnchor anchor;
+        // With SO_REUSEPORT, every loop binds its own socket, and the kernel
+        // balances incoming connections between them. The first socket only
+        // gets the option once it has siblings, so that with one loop, no
+        // other process can bind the port alongside. Sockets that refuse to
+        // be joined, like inherited ones bound by another user, are shared.
+        void open_sibling(asio::ip::tcp::acceptor& acceptor, const asio::ip::tcp::acceptor& sibling) {
+            auto endpoint = sibling.local_endpoint();
+            asio_error_code ec;
+            const_cast<asio::ip::tcp::acceptor&>(sibling).set_option(reuse_port(true), ec);
+            acceptor.open(endpoint.protocol());
+            acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+            acceptor.set_option(reuse_port(true));
+            acceptor.bind(endpoint, ec);
+            if (ec == asio::error::address_in_use) {
+                acceptor.close();
+                share_sibling(acceptor, sibling);
+                return;
+            }
+            if (ec) {
+                throw std::system_error(ec.value(), std::system_category(), "bind()");
+            }
+            acceptor.listen();
+        }
+#endif
 
-        AcceptorBase(Server::Impl& impl) : server_impl(impl) {}
-        virtual ~AcceptorBase() {}
+        // The local address of a socket, as raw bytes, to tell which
+        // listening sockets are bound to the same endpoint.
+        std::string socket_name(int fd) {
+#if defined(_MSC_VER)
+            return std::string();
+#else
+            sockaddr_storage addr;
+            socklen_t len = sizeof(addr);
+            if (::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+                return std::string();
+            }
+            return std::string(reinterpret_cast<const char*>(&addr), len);
+#endif
+        }
 
-        virtual void keep_accepting() = 0;
-        virtual void close() = 0;
-    };
+        template <class Protocol>
+        std::string socket_name(asio::basic_socket_acceptor<Protocol>& acceptor) {
+            return socket_name(int(acceptor.native_handle()));
+        }
 
-    struct Server::Impl {
-        asio::io_service service;
-        util::IntrusiveList<ClientBase, &ClientBase::anchor> clients;
-        util::IntrusiveList<AcceptorBase, &AcceptorBase::anchor> acceptors;
+#if !defined(_MSC_VER)
+        // SCM_RIGHTS carries at most this many descriptors per message.
+        constexpr size_t max_fds_per_message = 253;
 
-        IRequestResponder* responder = nullptr;
+        // Sends descriptors over a UNIX domain socket, attached to one byte
+        // per message.
+        void send_fds(int socket, const std::vector<int>& fds) {
+            for (size_t first = 0; first < fds.size(); first += max_fds_per_message) {
+                size_t n = std::min(max_fds_per_message, fds.size() - first);
+                std::vector<cmsghdr> control(CMSG_SPACE(n * sizeof(int)) / sizeof(cmsghdr) + 1);
+                char byte = 0;
+                iovec iov = {&byte, 1};
+                msghdr msg = {};
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control.data();
+                msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+                cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+                std::memcpy(CMSG_DATA(cmsg), fds.data() + first, n * sizeof(int));
+#if defined(MSG_NOSIGNAL)
+                int flags = MSG_NOSIGNAL;
+#else
+                int flags = 0;
+#endif
+                while (::sendmsg(socket, &msg, flags) < 0) {
+                    if (errno != EINTR) {
+                        throw std::system_error(errno, std::system_category(), "sendmsg()");
+                    }
+                }
+            }
+        }
 
-        ~Impl();
+        // Receives what send_fds() sent, until the sender closes the socket.
+        std::vector<int> receive_fds(int socket) {
+            std::vector<int> fds;
+            std::vector<cmsghdr> control(CMSG_SPACE(max_fds_per_message * sizeof(int)) / sizeof(cmsghdr) + 1);
+#if defined(MSG_CMSG_CLOEXEC)
+            int flags = MSG_CMSG_CLOEXEC;
+#else
+            int flags = 0;
+#endif
+            for (;;) {
+                char byte;
+                iovec iov = {&byte, 1};
+                msghdr msg = {};
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control.data();
+                msg.msg_controllen = control.size() * sizeof(cmsghdr);
+                ssize_t len = ::recvmsg(socket, &msg, flags);
+                if (len < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (len < 0) {
+                    int error = errno;
+                    for (int fd: fds) {
+                        ::close(fd);
+                    }
+                    throw std::system_error(error, std::system_category(), "recvmsg()");
+                }
+                for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                        continue;
+                    }
+                    size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    size_t old_size = fds.size();
+                    fds.resize(old_size + n);
+                    std::memcpy(fds.data() + old_size, CMSG_DATA(cmsg), n * sizeof(int));
+                }
+                if (len == 0) {
+                    break;
+                }
+            }
+#if !defined(MSG_CMSG_CLOEXEC)
+            for (int fd: fds) {
+                ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+#endif
+            return fds;
+        }
+#endif
+    }
 
-        void keep_accepting(AcceptorBase*);
-    };
 
     template <class Protocol>
     struct Server::Client : Server::ClientBase {
+        Acceptor<Protocol>& acceptor;
         asio::basic_stream_socket<Protocol> socket;
 
-        Client(Server::Impl& impl) : ClientBase(impl), socket(impl.service) {}
+        Client(Server::Loop& loop, Acceptor<Protocol>& acceptor) : ClientBase(loop), acceptor(acceptor), socket(loop.service) {}
 
         void close() final {
-            ClientBase* dead_client = this;
-            socket.cancel();
+            if (closed) {
+                return;
+            }
+            closed = true;
+            increment(loop.counters.connections_closed);
+            loop.timers.cancel(*this);
+            timeout = Timeout::None;
+            asio_error_code ec;
+            socket.close(ec);
+            websocket_closed();
+            if (!deferred) {
+                release();
+            }
+        }
+
+        void drop() final {
+            asio_error_code ec;
+            socket.set_option(asio::socket_base::linger(true, 0), ec);
+            close();
+        }
+
+        void set_no_delay() final {
+            asio_error_code ec;
+            socket.set_option(asio::ip::tcp::no_delay(true), ec);
+        }
+
+        void release() final {
+            loop.close_slot(*this);
+            Client* dead_client = this;
             auto handler = [dead_client]() {
-                delete dead_client;
+                dead_client->acceptor.recycle(dead_client);
             };
-            server_impl.service.post(std::move(handler));
+            loop.service.post(std::move(handler));
         }
 
-        void keep_reading() final {
-            auto handler = [this](asio_error_code ec, size_t len) {
-                if (ec == asio::error::operation_aborted) {
+        void linger() final {
+            asio_error_code ec;
+            socket.shutdown(asio::socket_base::shutdown_send, ec);
+            if (ec) {
+                close();
+                return;
+            }
+            discard_input(0);
+        }
+
+        void discard_input(size_t discarded) {
+            socket.async_wait(asio::socket_base::wait_read, [this, discarded](asio_error_code ec) mutable {
+                if (ec == asio::error::operation_aborted || closed) {
                     return;
                 }
-                if (ec == asio::error::connection_reset) {
-                    close();
-                    return;
+                char buffer[buffer_size];
+                while (!ec && discarded < max_lingering_bytes) {
+                    discarded += socket.read_some(asio::buffer(buffer), ec);
                 }
-                if (ec == asio::error::eof) {
-                    http_parser_execute(&parser, &parser_settings, nullptr, 0);
-                    if (http_should_keep_alive(&parser))
-                        keep_reading();
-                    else
-                        close();
+                if (ec == asio::error::would_block || ec == asio::error::try_again) {
+                    discard_input(discarded);
                     return;
                 }
+                close();
+            });
+        }
 
-                if (ec) {
-                    std::cerr << "socket error: " << ec.message() << "\n";
-                    close();
-                }
-                else {
-                    http_parser_execute(&parser, &parser_settings, recv_buffer.get(), len);
+        // Waits for readability without holding a receive buffer (a "null
+        // buffers" read), and only then takes one from the pool.
+        void keep_reading() final {
+            reading = true;
+            if (may_have_more) {
+                may_have_more = false;
+                loop.service.post([this]() {
+                    read_available(asio_error_code());
+                });
+            }
+            else {
+                socket.async_wait(asio::socket_base::wait_read, [this](asio_error_code ec) {
+                    read_available(ec);
+                });
+            }
+        }
+
+        void read_available(asio_error_code ec) {
+            reading = false;
+            if (ec == asio::error::operation_aborted || closed) {
+                return;
+            }
+            if (!ec) {
+                acquire_recv_buffer();
+                size_t capacity = recv_capacity();
+                size_t len = socket.read_some(asio::buffer(recv_begin(), capacity), ec);
+                if (!ec) {
+                    increment(loop.counters.bytes_received, len);
+                    received_at = std::chrono::steady_clock::now();
+                    may_have_more = len == capacity;
+                    received(len);
+                    return;
                 }
-            };
-            socket.async_read_some(asio::buffer(recv_buffer.get(), recv_buffer_size), std::move(handler));
+            }
+            if (ec == asio::error::would_block || ec == asio::error::try_again) {
+                release_recv_buffer();
+                keep_reading();
+                return;
+            }
+            if (ec == asio::error::eof) {
+                received_eof();
+                return;
+            }
+            if (ec != asio::error::connection_reset) {
+                std::cerr << "socket error: " << ec.message() << "\n";
+            }
+            close();
         }
 
         void keep_writing() final {
             auto handler = [this](asio_error_code ec, size_t len) {
-                if (ec == asio::error::operation_aborted) {
+                increment(loop.counters.bytes_sent, len);
+                if (ec == asio::error::operation_aborted || closed) {
                     return;
                 }
                 if (ec == asio::error::connection_reset) {
@@ -139,9 +296,68 @@ namespace wayward {
                     close();
                     return;
                 }
-                keep_reading();
+                written();
             };
-            asio::async_write(socket, asio::buffer(send_buffer.data(), send_buffer.size()), std::move(handler));
+            writing = true;
+            BufferRange buffers = { write_buffers.data(), write_buffers.data() + write_buffers.size() };
+            asio::async_write(socket, buffers, std::move(handler));
+        }
+
+        void send_file() final {
+#if defined(HAVE_SYS_SENDFILE_H)
+            switch (send_file_to(socket.native_handle())) {
+                case FileProgress::Sent:
+                    streaming = false;
+                    return;
+                case FileProgress::Yielded:
+                    writing = true;
+                    loop.service.post([this]() {
+                        if (!closed) {
+                            written();
+                        }
+                    });
+                    return;
+                case FileProgress::WouldBlock:
+                    writing = true;
+                    socket.async_wait(asio::socket_base::wait_write, [this](asio_error_code ec) {
+                        if (ec == asio::error::operation_aborted || closed) {
+                            return;
+                        }
+                        if (ec) {
+                            close();
+                            return;
+                        }
+                        written();
+                    });
+                    return;
+                case FileProgress::Failed:
+                    close();
+                    return;
+            }
+#elif defined(_MSC_VER)
+            std::cerr << "File bodies are not supported on Win32.\n";
+            close();
+#else
+            // Without sendfile(2), the file goes through a buffer after all.
+            auto& out = in_flight[0];
+            if (out.file_left == 0) {
+                streaming = false;
+                return;
+            }
+            size_t count = size_t(std::min<uint64_t>(out.file_left, max_retained_body));
+            out.chunk.resize(count);
+            auto len = ::pread(out.response.file->fd(), &out.chunk[0], count, off_t(out.file_offset));
+            if (len <= 0) {
+                close();
+                return;
+            }
+            out.chunk.resize(len);
+            out.file_offset += len;
+            out.file_left -= len;
+            write_buffers.clear();
+            write_buffers.push_back(asio::buffer(out.chunk));
+            keep_writing();
+#endif
         }
     };
 
@@ -149,38 +365,572 @@ namespace wayward {
     struct Server::Acceptor : Server::AcceptorBase {
         asio::basic_socket_acceptor<Protocol> acceptor;
         Client<Protocol>* next_client = nullptr;
+        static constexpr bool is_tcp = std::is_same<Protocol, asio::ip::tcp>::value;
+
+        util::IntrusiveList<ClientBase, &ClientBase::anchor> pooled_clients;
+        size_t num_pooled_clients = 0;
 
         template <class Endpoint>
-        Acceptor(Server::Impl& impl, Endpoint endpoint) : AcceptorBase(impl), acceptor(impl.service) {
+        Acceptor(Server::Loop& loop, Endpoint endpoint) : AcceptorBase(loop, is_tcp), acceptor(loop.service) {
             acceptor.open(endpoint.protocol());
             acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
             acceptor.bind(endpoint);
             acceptor.listen();
+            name = socket_name(acceptor);
+        }
+
+        Acceptor(Server::Loop& loop, const Acceptor& sibling) : AcceptorBase(loop, is_tcp), acceptor(loop.service) {
+            open_sibling(acceptor, sibling.acceptor);
+            name = sibling.name;
+        }
+
+        // Takes over a socket that is already listening.
+        Acceptor(Server::Loop& loop, const Protocol& protocol, int fd) : AcceptorBase(loop, is_tcp), acceptor(loop.service) {
+            acceptor.assign(protocol, fd);
+            name = socket_name(acceptor);
+        }
+
+        ~Acceptor() {
+            while (!pooled_clients.empty()) {
+                delete &*pooled_clients.begin();
+            }
+        }
+
+        Client<Protocol>* make_client() {
+            if (pooled_clients.empty()) {
+                return new Client<Protocol>(loop, *this);
+            }
+            auto client = static_cast<Client<Protocol>*>(&*pooled_clients.begin());
+            pooled_clients.unlink(client);
+            --num_pooled_clients;
+            return client;
+        }
+
+        void recycle(Client<Protocol>* client) {
+            if (num_pooled_clients == max_pooled_clients) {
+                delete client;
+                return;
+            }
+            loop.clients.unlink(client);
+            client->reset();
+            pooled_clients.link_front(client);
+            ++num_pooled_clients;
+        }
+
+        void pause() final {
+#if defined(WAYWARD_WITH_IO_URING)
+            if (loop.ring) {
+                loop.cancel(static_cast<AcceptorBase*>(this), Loop::Op::Accept);
+                return;
+            }
+#endif
+            asio_error_code ec;
+            acceptor.cancel(ec);
         }
 
         void close() final {
-            acceptor.close();
+            closed = true;
+#if defined(WAYWARD_WITH_IO_URING)
+            if (loop.ring) {
+                loop.cancel(static_cast<AcceptorBase*>(this), Loop::Op::Accept);
+            }
+#endif
+            asio_error_code ec;
+            acceptor.close(ec);
+        }
+
+        AcceptorBase* clone(Server::Loop& other_loop) final {
+            return new Acceptor<Protocol>(other_loop, *this);
+        }
+
+        AcceptorBase* adopt(Server::Loop& other_loop, int fd) final {
+            return new Acceptor<Protocol>(other_loop, acceptor.local_endpoint().protocol(), fd);
+        }
+
+        int native_handle() final {
+            return int(acceptor.native_handle());
         }
 
         void keep_accepting() final {
-            assert(next_client == nullptr);
-            next_client = new Client<Protocol>(server_impl);
-            server_impl.clients.link_front(next_client);
+            if (loop.accepting_paused) {
+                return;
+            }
+            accepting = true;
+#if defined(WAYWARD_WITH_IO_URING)
+            if (loop.ring) {
+                loop.accept(*this);
+                return;
+            }
+#endif
+            // Kept when the last accept failed or was cancelled.
+            if (!next_client) {
+                next_client = make_client();
+                loop.clients.link_front(next_client);
+            }
             acceptor.async_accept(next_client->socket, [this](asio_error_code ec) {
+                accepting = false;
                 if (ec == asio::error::operation_aborted) {
+                    // Closed, or paused, and maybe resumed since.
+                    if (!closed) {
+                        keep_accepting();
+                    }
                     return;
                 }
                 if (ec) {
-                    std::cerr << "accept(): " << ec.message() << "\n";
-                    std::abort();
+                    if (accept_error_is_transient(ec)) {
+                        keep_accepting();
+                    }
+                    else {
+                        loop.accept_failed(ec);
+                    }
+                    return;
                 }
-                next_client->keep_reading();
+                next_client->socket.non_blocking(true, ec);
+                auto client = next_client;
                 next_client = nullptr;
+                loop.open(*this, *client);
+                accept_backlog();
                 keep_accepting();
             });
         }
+
+        // Takes the connections waiting in the backlog, up to accept_batch
+        // in all, rather than waiting for readiness and a turn of the loop
+        // for each of them.
+        void accept_backlog() {
+            asio_error_code ec;
+            if (!acceptor.non_blocking()) {
+                acceptor.non_blocking(true, ec);
+            }
+            for (unsigned int i = 1; i < loop.server_impl.accept_batch && !loop.accepting_paused && !closed; ++i) {
+                if (!next_client) {
+                    next_client = make_client();
+                    loop.clients.link_front(next_client);
+                }
+                acceptor.accept(next_client->socket, ec);
+                if (ec == asio::error::would_block || ec == asio::error::try_again) {
+                    return;
+                }
+                if (ec) {
+                    if (!accept_error_is_transient(ec)) {
+                        loop.accept_failed(ec);
+                        return;
+                    }
+                    continue;
+                }
+                next_client->socket.non_blocking(true, ec);
+                auto client = next_client;
+                next_client = nullptr;
+                loop.open(*this, *client);
+            }
+        }
+    };
+
+    // A WebSocket connection (RFC 6455), which an HTTP/1.1 request was
+    // upgraded to (see accept_websocket()). Once the 101 response has been
+    // written, the session takes over the client's input, parsing frames
+    // instead of HTTP/1.1, and its output, which it frames from the messages
+    // sent through the connection's WebSocket handles.
+    //
+    // Frames are unmasked where they were received. A message that arrives
+    // in one frame, within one read, goes to the handler from recv_buffer;
+    // only fragmented messages and frames split across reads are copied,
+    // into `message`. Messages sent in the meantime are framed into one
+    // buffer, so a burst of them goes out in one write.
+    struct Server::WebSocketSession {
+        enum Opcode : uint8_t {
+            Continuation = 0x0,
+            Text = 0x1,
+            Binary = 0x2,
+            Close = 0x8,
+            Ping = 0x9,
+            Pong = 0xa,
+        };
+        static constexpr unsigned char fin_bit = 0x80;
+        static constexpr unsigned char rsv1_bit = 0x40; // Compressed (permessage-deflate).
+        static constexpr unsigned char mask_bit = 0x80;
+        static constexpr size_t max_header_size = 14;
+        static constexpr size_t max_control_payload = 125;
+        // Reading pauses while this much is waiting to be written, so a
+        // client that does not read cannot pile up pongs.
+        static constexpr size_t max_pending_frames = 64 * 1024;
+        // Smaller messages seldom get smaller when compressed.
+        static constexpr size_t min_deflate_size = 128;
+
+        ClientBase& client;
+        std::shared_ptr<IWebSocketHandler> handler;
+        WebSocket socket;
+        bool deflate;
+        bool started = false; // The handshake has been written.
+
+        // The frame being received.
+        unsigned char header[max_header_size];
+        size_t header_used = 0; // Of a header split across reads.
+        bool in_payload = false;
+        uint8_t opcode = 0;
+        bool fin = false;
+        unsigned char mask[4];
+        uint64_t payload_offset = 0;
+        uint64_t payload_left = 0;
+        std::string control; // A control frame split across reads.
+
+        // The message being received: its first frame's opcode, or 0
+        // between messages.
+        uint8_t message_opcode = 0;
+        bool message_compressed = false;
+        std::string message;
+        std::string inflated;
+
+        std::string frames;
+        std::string frames_in_flight;
+        std::string deflated;
+        bool close_sent = false;
+        bool close_received = false;
+        uint16_t close_code = WebSocket::AbnormalClosure;
+        bool notified = false;
+
+        WebSocketSession(ClientBase& client, std::shared_ptr<IWebSocketHandler> handler, bool deflate)
+            : client(client), handler(std::move(handler)), socket(client.handle()), deflate(deflate) {}
+
+        size_t max_message_size() const {
+            return client.loop.server_impl.max_body_size;
+        }
+
+        void start() {
+            started = true;
+            // Messages are pushed as they happen, and one held back for the
+            // ACK of the previous one would arrive late.
+            client.set_no_delay();
+            handler->opened(socket);
+        }
+
+        // The size of the frame header starting at `h`, once its first
+        // two bytes are there.
+        static size_t header_size(const unsigned char* h, size_t available) {
+            if (available < 2) {
+                return 2;
+            }
+            size_t length = h[1] & 0x7f;
+            size_t size = 2 + (length == 126 ? 2 : length == 127 ? 8 : 0);
+            return (h[1] & mask_bit) ? size + 4 : size;
+        }
+
+        void received(char* data, size_t len) {
+            while (len > 0 && !client.read_closed) {
+                if (!in_payload) {
+                    auto h = reinterpret_cast<const unsigned char*>(data);
+                    size_t size = header_size(h, len);
+                    if (header_used == 0 && size <= len) {
+                        data += size;
+                        len -= size;
+                    }
+                    else {
+                        while (len > 0 && header_used < header_size(header, header_used)) {
+                            header[header_used++] = static_cast<unsigned char>(*data++);
+                            --len;
+                        }
+                        if (header_used < header_size(header, header_used)) {
+                            return;
+                        }
+                        h = header;
+                        header_used = 0;
+                    }
+                    if (!begin_frame(h)) {
+                        return;
+                    }
+                    if (payload_left == 0) {
+                        end_frame(std::string_view());
+                    }
+                    continue;
+                }
+                size_t n = size_t(std::min<uint64_t>(len, payload_left));
+                websocket_mask(data, n, mask, payload_offset);
+                bool whole = payload_offset == 0 && n == payload_left;
+                payload_offset += n;
+                payload_left -= n;
+                auto piece = std::string_view(data, n);
+                data += n;
+                len -= n;
+                if (opcode >= Close) {
+                    if (!whole) {
+                        control.append(piece);
+                        piece = control;
+                    }
+                }
+                else if (!(whole && fin && opcode != Continuation)) {
+                    message.append(piece);
+                    piece = message;
+                }
+                if (payload_left == 0) {
+                    end_frame(piece);
+                }
+            }
+        }
+
+        bool begin_frame(const unsigned char* h) {
+            fin = (h[0] & fin_bit) != 0;
+            opcode = h[0] & 0x0f;
+            bool compressed = (h[0] & rsv1_bit) != 0;
+            if (!(h[1] & mask_bit) || (h[0] & 0x30) != 0) {
+                return fail(WebSocket::ProtocolError);
+            }
+            uint64_t length = h[1] & 0x7f;
+            const unsigned char* p = h + 2;
+            if (length == 126) {
+                length = uint64_t(p[0]) << 8 | p[1];
+                p += 2;
+            }
+            else if (length == 127) {
+                length = 0;
+                for (int i = 0; i < 8; ++i) {
+                    length = length << 8 | p[i];
+                }
+                p += 8;
+            }
+            std::memcpy(mask, p, 4);
+
+            if (opcode >= Close) {
+                if ((opcode != Close && opcode != Ping && opcode != Pong) || !fin || compressed || length > max_control_payload) {
+                    return fail(WebSocket::ProtocolError);
+                }
+            }
+            else if (opcode == Continuation) {
+                if (message_opcode == 0 || compressed) {
+                    return fail(WebSocket::ProtocolError);
+                }
+            }
+            else if (opcode == Text || opcode == Binary) {
+                if (message_opcode != 0 || (compressed && !deflate)) {
+                    return fail(WebSocket::ProtocolError);
+                }
+                message_opcode = opcode;
+                message_compressed = compressed;
+            }
+            else {
+                return fail(WebSocket::ProtocolError);
+            }
+            if (opcode < Close && length > max_message_size() - message.size()) {
+                return fail(WebSocket::MessageTooBig);
+            }
+            in_payload = true;
+            payload_offset = 0;
+            payload_left = length;
+            return true;
+        }
+
+        void end_frame(std::string_view payload) {
+            in_payload = false;
+            if (opcode >= Close) {
+                control_frame(payload);
+                control.clear();
+                return;
+            }
+            if (!fin) {
+                return;
+            }
+            if (opcode == Continuation) {
+                payload = message;
+            }
+            bool binary = message_opcode == Binary;
+            if (message_compressed) {
+                inflated.clear();
+                if (!client.loop.message_deflate().decompress(payload, max_message_size(), inflated)) {
+                    fail(inflated.size() > max_message_size() ? WebSocket::MessageTooBig : WebSocket::InvalidPayload);
+                    return;
+                }
+                payload = inflated;
+            }
+            message_opcode = 0;
+            if (!binary && !valid_utf8(payload)) {
+                fail(WebSocket::InvalidPayload);
+                return;
+            }
+            // After our Close frame, messages are discarded.
+            if (!close_sent) {
+                handler->message(socket, payload, binary);
+            }
+            clear(message);
+            clear(inflated);
+        }
+
+        static void clear(std::string& buffer) {
+            if (buffer.capacity() > ClientBase::max_retained_body) {
+                std::string().swap(buffer);
+            }
+            else {
+                buffer.clear();
+            }
+        }
+
+        void control_frame(std::string_view payload) {
+            if (opcode == Ping) {
+                if (!close_sent) {
+                    append_frame(Pong, false, payload);
+                }
+                return;
+            }
+            if (opcode == Pong) {
+                return;
+            }
+            // Close: the status code, if any, and a reason in UTF-8.
+            uint16_t code = WebSocket::NoStatus;
+            if (payload.size() == 1) {
+                fail(WebSocket::ProtocolError);
+                return;
+            }
+            if (payload.size() >= 2) {
+                code = uint16_t(uint8_t(payload[0]) << 8 | uint8_t(payload[1]));
+                if (!valid_close_code(code)) {
+                    fail(WebSocket::ProtocolError);
+                    return;
+                }
+                if (!valid_utf8(payload.substr(2))) {
+                    fail(WebSocket::InvalidPayload);
+                    return;
+                }
+            }
+            close_received = true;
+            if (!close_sent) {
+                // Echo the code, and close once the reply has been written.
+                close_code = code;
+                close_sent = true;
+                append_frame(Close, false, payload.substr(0, 2));
+            }
+            client.read_closed = true;
+        }
+
+        // RFC 6455, section 7.4: those that may be sent in a Close frame.
+        static bool valid_close_code(uint16_t code) {
+            if (code >= 3000 && code <= 4999) {
+                return true;
+            }
+            return code >= 1000 && code <= 1011 && code != 1004 && code != WebSocket::NoStatus && code != WebSocket::AbnormalClosure;
+        }
+
+        // A protocol error: Close with the code, and close the connection
+        // once it has been written, without waiting for the answer.
+        bool fail(uint16_t code) {
+            close(code, std::string_view());
+            client.read_closed = true;
+            return false;
+        }
+
+        void append_frame(uint8_t frame_opcode, bool compressed, std::string_view payload) {
+            unsigned char head[10];
+            size_t size = 2;
+            head[0] = fin_bit | (compressed ? rsv1_bit : 0) | frame_opcode;
+            if (payload.size() < 126) {
+                head[1] = static_cast<unsigned char>(payload.size());
+            }
+            else if (payload.size() <= 0xffff) {
+                head[1] = 126;
+                head[2] = static_cast<unsigned char>(payload.size() >> 8);
+                head[3] = static_cast<unsigned char>(payload.size());
+                size = 4;
+            }
+            else {
+                head[1] = 127;
+                for (int i = 0; i < 8; ++i) {
+                    head[2 + i] = static_cast<unsigned char>(uint64_t(payload.size()) >> (56 - 8 * i));
+                }
+                size = 10;
+            }
+            frames.append(reinterpret_cast<const char*>(head), size);
+            frames.append(payload);
+        }
+
+        // Queues a message. A peer that has fallen too far behind is dropped.
+        void send(std::string_view payload, bool binary) {
+            if (close_sent) {
+                return;
+            }
+            bool compressed = false;
+            if (deflate && payload.size() >= min_deflate_size) {
+                deflated.clear();
+                client.loop.message_deflate().compress(payload, deflated);
+                if (deflated.size() < payload.size()) {
+                    payload = deflated;
+                    compressed = true;
+                }
+            }
+            append_frame(binary ? Binary : Text, compressed, payload);
+            clear(deflated);
+            if (frames.size() + frames_in_flight.size() > WebSocket::max_queued_bytes) {
+                client.drop();
+            }
+        }
+
+        // Starts the closing handshake, unless it has been started.
+        void close(uint16_t code, std::string_view reason) {
+            if (close_sent) {
+                return;
+            }
+            close_sent = true;
+            close_code = code;
+            char payload[max_control_payload];
+            payload[0] = char(code >> 8);
+            payload[1] = char(code & 0xff);
+            size_t size = reason.copy(payload + 2, max_control_payload - 2);
+            append_frame(Close, false, std::string_view(payload, size + 2));
+        }
+
+        bool output_full() const {
+            return frames.size() >= max_pending_frames;
+        }
+
+        void flush() {
+            if (client.writing || client.closed || frames.empty()) {
+                return;
+            }
+            frames_in_flight.swap(frames);
+            frames.clear();
+            client.write_buffers.clear();
+            client.write_buffers.push_back(asio::buffer(frames_in_flight));
+            client.keep_writing();
+        }
+
+        void written() {
+            clear(frames_in_flight);
+        }
+
+        // Quiet connections stay open: closing them is up to the
+        // application. Only a peer that does not answer our Close frame, or
+        // does not read, times out.
+        ClientBase::Timeout timeout() const {
+            using Timeout = ClientBase::Timeout;
+            if (client.writing) {
+                return Timeout::Write;
+            }
+            return close_sent && !close_received ? Timeout::Body : Timeout::None;
+        }
+
+        // Tells the handler, once.
+        void closed() {
+            if (notified) {
+                return;
+            }
+            notified = true;
+            handler->closed(close_received || close_sent ? close_code : uint16_t(WebSocket::AbnormalClosure));
+        }
     };
 
+    namespace {
+        Method method_from_parser(unsigned int method) {
+            switch (method) {
+                case HTTP_DELETE:  return Method::Delete;
+                case HTTP_GET:     return Method::Get;
+                case HTTP_HEAD:    return Method::Head;
+                case HTTP_POST:    return Method::Post;
+                case HTTP_PUT:     return Method::Put;
+                case HTTP_CONNECT: return Method::Connect;
+                case HTTP_OPTIONS: return Method::Options;
+                case HTTP_TRACE:   return Method::Trace;
+                case HTTP_PATCH:   return Method::Patch;
+                default:           return Method::Other;
+            }
+        }
+    }
+
     const http_parser_settings Server::ClientBase::parser_settings = {
         /*.on_message_begin =*/ &Server::ClientBase::on_message_begin,
         /*.on_url =*/ &Server::ClientBase::on_url,
@@ -198,7 +948,186 @@ namespace wayward {
 
     Server::~Server() {}
 
+    Server::Impl::Impl() {
+        loops.emplace_back(new Loop(*this));
+    }
+
     Server::Impl::~Impl() {
+#if !defined(_MSC_VER)
+        for (int fd: spare_fds) {
+            ::close(fd);
+        }
+#endif
+    }
+
+    // Stops all loops once their connections have closed. Loops run() has
+    // yet to create are drained as they start.
+    void Server::Impl::stop() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping) {
+            return;
+        }
+        stopping = true;
+        for (auto& loop: loops) {
+            Loop* target = loop.get();
+            target->service.post([target]() {
+                target->drain();
+            });
+        }
+    }
+
+    void Server::Loop::drain() {
+        if (draining) {
+            return;
+        }
+        draining = true;
+        for (auto& acceptor: acceptors) {
+            acceptor.close();
+        }
+#if !defined(_MSC_VER)
+        if (this == server_impl.loops.front().get() && server_impl.takeover) {
+            asio_error_code ec;
+            server_impl.takeover->close(ec);
+        }
+#endif
+        // Closed clients stay in the list until they are recycled.
+        for (auto& client: clients) {
+            client.drain();
+        }
+        if (num_open_clients() == 0) {
+            stop();
+            return;
+        }
+        drain_timer.expires_after(std::chrono::milliseconds(server_impl.drain_timeout_ms));
+        drain_timer.async_wait([this](asio_error_code ec) {
+            if (ec) {
+                return;
+            }
+            for (auto& client: clients) {
+                if (client.slot != ClientBase::no_slot) {
+                    client.close();
+                }
+            }
+            stop();
+        });
+    }
+
+    void Server::Loop::stop() {
+        asio_error_code ec;
+        drain_timer.cancel(ec);
+        ticker.cancel(ec);
+        accept_timer.cancel(ec);
+        probe_timer.cancel(ec);
+#if defined(WAYWARD_WITH_IO_URING)
+        if (ring) {
+            ring->submit();
+        }
+#endif
+        service.stop();
+    }
+
+    void Server::Loop::open(AcceptorBase& acceptor, ClientBase& client) {
+        increment(counters.connections_accepted);
+        accept_failing = false;
+        if (acceptor.tcp && server_impl.no_delay) {
+            client.set_no_delay();
+        }
+        open_slot(client);
+        client.keep_reading();
+        client.update_timeout();
+        if (probe_interval.count() > 0 && !probing) {
+            probing = true;
+            keep_probing();
+        }
+        if (max_clients > 0 && num_open_clients() >= max_clients) {
+            pause_accepting();
+        }
+    }
+
+    // accept() failed for a lack of resources, like file descriptors, and
+    // would fail again if retried at once. Accepting pauses until a
+    // connection closes, or for accept_retry_ms.
+    void Server::Loop::accept_failed(const asio_error_code& ec) {
+        if (!accept_failing) {
+            std::cerr << "accept(): " << ec.message() << ", pausing.\n";
+            accept_failing = true;
+        }
+        pause_accepting();
+        accept_timer.expires_after(std::chrono::milliseconds(accept_retry_ms));
+        accept_timer.async_wait([this](asio_error_code ec) {
+            if (!ec) {
+                resume_accepting();
+            }
+        });
+    }
+
+    void Server::Loop::pause_accepting() {
+        if (accepting_paused) {
+            return;
+        }
+        accepting_paused = true;
+        for (auto& acceptor: acceptors) {
+            if (acceptor.accepting) {
+                acceptor.pause();
+            }
+        }
+    }
+
+    void Server::Loop::resume_accepting() {
+        if (!accepting_paused || draining || (max_clients > 0 && num_open_clients() >= max_clients)) {
+            return;
+        }
+        accepting_paused = false;
+        asio_error_code ec;
+        accept_timer.cancel(ec);
+        for (auto& acceptor: acceptors) {
+            // Those paused have yet to complete their cancelled accepts.
+            if (!acceptor.closed && !acceptor.accepting) {
+                acceptor.keep_accepting();
+            }
+        }
+    }
+
+    void Server::Loop::keep_probing() {
+        probe_timer.expires_after(probe_interval);
+        probe_timer.async_wait([this](asio_error_code ec) {
+            if (ec) {
+                return;
+            }
+            lag = std::chrono::steady_clock::now() - probe_timer.expiry();
+            if (num_open_clients() == 0) {
+                probing = false;
+                lag = std::chrono::steady_clock::duration(0);
+                return;
+            }
+            keep_probing();
+        });
+    }
+
+    // Whether to answer a request with 503 rather than pass it to the
+    // responder (see Server::max_requests_in_flight() and shed_load()).
+    bool Server::Loop::shed(std::chrono::steady_clock::time_point request_started) {
+        size_t max_deferred = server_impl.max_requests_in_flight;
+        bool overloaded = max_deferred > 0 && num_deferred_requests >= max_deferred;
+        if (!overloaded && probe_interval.count() > 0) {
+            auto now = std::chrono::steady_clock::now();
+            overloaded = codel.overloaded(now, now - request_started + lag);
+        }
+        if (overloaded) {
+            increment(counters.requests_shed);
+        }
+        return overloaded;
+    }
+
+    Server::Loop::~Loop() {
+#if defined(WAYWARD_WITH_IO_URING)
+        // Cancels what is in flight before the clients go.
+        ring_events.reset();
+        ring.reset();
+        while (!pooled_uring_clients.empty()) {
+            delete &*pooled_uring_clients.begin();
+        }
+#endif
         while (!acceptors.empty()) {
             auto it = acceptors.begin();
             AcceptorBase* acceptor = &*it;
@@ -211,76 +1140,1405 @@ namespace wayward {
         }
     }
 
-    Server& Server::listen(std::string addr, unsigned int port) {
-        auto ip_addr = asio::ip::address::from_string(addr.c_str());
-        asio::ip::tcp::endpoint endpoint(ip_addr, port);
-        auto acceptor = new Acceptor<asio::ip::tcp>(*impl_, endpoint);
-        impl_->acceptors.link_front(acceptor);
-        acceptor->keep_accepting();
+    Server& Server::threads(unsigned int num_threads) {
+        impl_->num_threads = num_threads;
+        return *this;
+    }
 
-        std::cout << "Wayward Server listening on " << acceptor->acceptor.local_endpoint().address() << ":" << acceptor->acceptor.local_endpoint().port() << ".\n";
+    Server& Server::max_body_size(size_t bytes) {
+        impl_->max_body_size = bytes;
         return *this;
     }
 
-    Server& Server::listen(std::string unix_socket_path) {
-#if defined(_MSC_VER)
-		throw std::runtime_error("UNIX domain sockets not supported on Win32.");
-#else
-        asio::local::stream_protocol::endpoint endpoint(unix_socket_path);
-        auto acceptor = new Acceptor<asio::local::stream_protocol>(*impl_, endpoint);
-        impl_->acceptors.link_front(acceptor);
-        acceptor->keep_accepting();
+    Server& Server::header_timeout(unsigned int ms) {
+        impl_->header_timeout_ms = ms;
+        return *this;
+    }
 
-        std::cout << "Wayward Server listening on " << endpoint.path() <<".\n";
+    Server& Server::body_timeout(unsigned int ms) {
+        impl_->body_timeout_ms = ms;
         return *this;
-#endif
     }
 
-    int Server::run(IRequestResponder& responder) {
-        impl_->responder = &responder;
-        impl_->service.run();
-        return 0;
+    Server& Server::idle_timeout(unsigned int ms) {
+        impl_->idle_timeout_ms = ms;
+        return *this;
     }
 
-    Server::ClientBase::ClientBase(Server::Impl& impl)
-        : server_impl(impl)
-        , socket(impl.service)
-        , recv_buffer(new char[recv_buffer_size])
-    {
-        http_parser_init(&parser, HTTP_REQUEST);
-        parser.data = this;
+    Server& Server::write_timeout(unsigned int ms) {
+        impl_->write_timeout_ms = ms;
+        return *this;
     }
 
-    void Server::ClientBase::send_response(Response res) {
-        std::stringstream ss;
-        ss << "HTTP/1.1 " << int(res.status) << "\r\n";
-        for (auto& pair: res.headers) {
-            ss << pair.first << ": " << pair.second << "\r\n";
-        }
-        ss << "Content-Length: " << res.body.size() << "\r\n";
-        ss << "\r\n";
-        ss << res.body;
-        send_buffer = ss.str();
-        keep_writing();
+    Server& Server::io_uring(bool enable) {
+        impl_->use_io_uring = enable;
+        return *this;
     }
 
-    int Server::ClientBase::on_message_begin(http_parser* parser) {
-        ClientBase& client = *static_cast<ClientBase*>(parser->data);
-        return 0;
+    Server& Server::http2(bool enable) {
+        impl_->http2 = enable;
+        return *this;
     }
-    int Server::ClientBase::on_headers_complete(http_parser* parser) {
-        ClientBase& client = *static_cast<ClientBase*>(parser->data);
+
+    Server& Server::drain_timeout(unsigned int ms) {
+        impl_->drain_timeout_ms = ms;
+        return *this;
+    }
+
+    Server& Server::accept_batch(unsigned int max) {
+        impl_->accept_batch = max;
+        return *this;
+    }
+
+    Server& Server::no_delay(bool enable) {
+        impl_->no_delay = enable;
+        return *this;
+    }
+
+    Server& Server::defer_accept(unsigned int seconds) {
+        impl_->defer_accept_s = seconds;
+        return *this;
+    }
+
+    Server& Server::max_connections(size_t max) {
+        impl_->max_connections = max;
+        return *this;
+    }
+
+    Server& Server::max_requests_in_flight(size_t max) {
+        impl_->max_requests_in_flight = max;
+        return *this;
+    }
+
+    Server& Server::shed_load(unsigned int target_ms, unsigned int interval_ms) {
+        impl_->shed_target_ms = target_ms;
+        impl_->shed_interval_ms = interval_ms;
+        return *this;
+    }
+
+    Server::Metrics Server::metrics() const {
+        Metrics metrics;
+        // run() may still be adding loops.
+        std::lock_guard<std::mutex> lock(impl_->mutex);
+        for (auto& loop: impl_->loops) {
+            auto& counters = loop->counters;
+            metrics.connections_accepted += counters.connections_accepted.load(std::memory_order_relaxed);
+            metrics.connections_closed += counters.connections_closed.load(std::memory_order_relaxed);
+            metrics.requests += counters.requests.load(std::memory_order_relaxed);
+            metrics.parse_errors += counters.parse_errors.load(std::memory_order_relaxed);
+            metrics.requests_shed += counters.requests_shed.load(std::memory_order_relaxed);
+            metrics.bytes_received += counters.bytes_received.load(std::memory_order_relaxed);
+            metrics.bytes_sent += counters.bytes_sent.load(std::memory_order_relaxed);
+        }
+        // Closes may be counted before their accepts are.
+        if (metrics.connections_accepted > metrics.connections_closed) {
+            metrics.active_connections = metrics.connections_accepted - metrics.connections_closed;
+        }
+        return metrics;
+    }
+
+    Server& Server::listen(std::string addr, unsigned int port) {
+        auto ip_addr = asio::ip::address::from_string(addr.c_str());
+        asio::ip::tcp::endpoint endpoint(ip_addr, port);
+        auto& loop = *impl_->loops.front();
+        auto acceptor = new Acceptor<asio::ip::tcp>(loop, endpoint);
+        loop.acceptors.link_front(acceptor);
+
+        std::cout << "Wayward Server listening on " << acceptor->acceptor.local_endpoint().address() << ":" << acceptor->acceptor.local_endpoint().port() << ".\n";
+        return *this;
+    }
+
+    Server& Server::listen(std::string unix_socket_path) {
+#if defined(_MSC_VER)
+		throw std::runtime_error("UNIX domain sockets not supported on Win32.");
+#else
+        asio::local::stream_protocol::endpoint endpoint(unix_socket_path);
+        auto& loop = *impl_->loops.front();
+        auto acceptor = new Acceptor<asio::local::stream_protocol>(loop, endpoint);
+        loop.acceptors.link_front(acceptor);
+
+        std::cout << "Wayward Server listening on " << endpoint.path() <<".\n";
+        return *this;
+#endif
+    }
+
+    Server& Server::listen_fd(int fd) {
+#if defined(_MSC_VER)
+        throw std::runtime_error("Inheriting sockets is not supported on Win32.");
+#else
+        sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        if (::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+            throw std::system_error(errno, std::system_category(), "getsockname()");
+        }
+        int listening = 0;
+        len = sizeof(listening);
+        if (::getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 || !listening) {
+            throw std::runtime_error("Not a listening socket: " + std::to_string(fd));
+        }
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        auto& impl = *impl_;
+        auto& loop = *impl.loops.front();
+        auto name = socket_name(fd);
+        for (auto& acceptor: loop.acceptors) {
+            if (acceptor.name == name) {
+                impl.spare_fds.push_back(fd);
+                return *this;
+            }
+        }
+        AcceptorBase* acceptor;
+        switch (addr.ss_family) {
+            case AF_UNIX:
+                acceptor = new Acceptor<asio::local::stream_protocol>(loop, asio::local::stream_protocol(), fd);
+                break;
+            case AF_INET:
+                acceptor = new Acceptor<asio::ip::tcp>(loop, asio::ip::tcp::v4(), fd);
+                break;
+            case AF_INET6:
+                acceptor = new Acceptor<asio::ip::tcp>(loop, asio::ip::tcp::v6(), fd);
+                break;
+            default:
+                throw std::runtime_error("Not a TCP or UNIX domain socket: " + std::to_string(fd));
+        }
+        loop.acceptors.link_front(acceptor);
+
+        std::cout << "Wayward Server listening on inherited socket " << fd << ".\n";
+        return *this;
+#endif
+    }
+
+    size_t Server::listen_inherited() {
+#if defined(_MSC_VER)
+        return 0;
+#else
+        // See sd_listen_fds(3).
+        const char* pid = std::getenv("LISTEN_PID");
+        const char* count = std::getenv("LISTEN_FDS");
+        if (!pid || !count || std::strtol(pid, nullptr, 10) != long(::getpid())) {
+            return 0;
+        }
+        long num_fds = std::strtol(count, nullptr, 10);
+        // Not for child processes.
+        ::unsetenv("LISTEN_PID");
+        ::unsetenv("LISTEN_FDS");
+        ::unsetenv("LISTEN_FDNAMES");
+        for (long i = 0; i < num_fds; ++i) {
+            listen_fd(3 + int(i));
+        }
+        return num_fds > 0 ? size_t(num_fds) : 0;
+#endif
+    }
+
+    Server& Server::allow_takeover(std::string unix_socket_path) {
+#if defined(_MSC_VER)
+        throw std::runtime_error("UNIX domain sockets not supported on Win32.");
+#else
+        auto& loop = *impl_->loops.front();
+        // Left behind by the server this one took over from, if any.
+        ::unlink(unix_socket_path.c_str());
+        asio::local::stream_protocol::endpoint endpoint(unix_socket_path);
+        impl_->takeover.reset(new asio::local::stream_protocol::acceptor(loop.service, endpoint));
+        impl_->wait_for_successor();
+        return *this;
+#endif
+    }
+
+    bool Server::take_over(std::string unix_socket_path) {
+#if defined(_MSC_VER)
+        throw std::runtime_error("UNIX domain sockets not supported on Win32.");
+#else
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (unix_socket_path.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("UNIX domain socket path too long: " + unix_socket_path);
+        }
+        std::memcpy(addr.sun_path, unix_socket_path.data(), unix_socket_path.size());
+        int socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (socket < 0) {
+            throw std::system_error(errno, std::system_category(), "socket()");
+        }
+        if (::connect(socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            // No server to take over from.
+            ::close(socket);
+            return false;
+        }
+        std::vector<int> fds;
+        try {
+            fds = receive_fds(socket);
+        }
+        catch (...) {
+            ::close(socket);
+            throw;
+        }
+        ::close(socket);
+        for (int fd: fds) {
+            listen_fd(fd);
+        }
+        return !fds.empty();
+#endif
+    }
+
+#if !defined(_MSC_VER)
+    void Server::Impl::wait_for_successor() {
+        successor.reset(new asio::local::stream_protocol::socket(loops.front()->service));
+        takeover->async_accept(*successor, [this](asio_error_code ec) {
+            if (ec == asio::error::operation_aborted) {
+                return;
+            }
+            if (ec) {
+                std::cerr << "Takeover: accept(): " << ec.message() << "\n";
+                return;
+            }
+            hand_over();
+        });
+    }
+
+    // Sends the listening sockets of all loops to the successor, which
+    // accepts from them from now on, and stops.
+    void Server::Impl::hand_over() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            // Once stopping, the loops may be closing their sockets.
+            if (stopping) {
+                successor.reset();
+                return;
+            }
+            std::vector<int> fds;
+            for (auto& loop: loops) {
+                for (auto& acceptor: loop->acceptors) {
+                    fds.push_back(acceptor.native_handle());
+                }
+            }
+            try {
+                asio_error_code ec;
+                successor->native_non_blocking(false, ec);
+                send_fds(successor->native_handle(), fds);
+            }
+            catch (std::exception& e) {
+                std::cerr << "Takeover: " << e.what() << "\n";
+                wait_for_successor();
+                return;
+            }
+            successor.reset();
+        }
+        std::cout << "Wayward Server handed over its listening sockets.\n";
+        stop();
+    }
+#endif
+
+    void Server::stop() {
+        impl_->stop();
+    }
+
+    int Server::run(IRequestResponder& responder) {
+        impl_->responder = &responder;
+
+#if defined(HAVE_SYS_SENDFILE_H)
+        // Unlike asio's writes, sendfile(2) cannot suppress SIGPIPE, and a
+        // client going away must not kill the process.
+        std::signal(SIGPIPE, SIG_IGN);
+#endif
+
+        size_t num_loops = impl_->num_threads;
+        if (num_loops == 0) {
+            num_loops = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        auto& impl = *impl_;
+        auto& first_loop = *impl.loops.front();
+        {
+            std::lock_guard<std::mutex> lock(impl.mutex);
+            // Sockets from listen_fd() for the same endpoint as one of the
+            // first loop's acceptors.
+            auto take_spare = [&](AcceptorBase& acceptor) {
+                for (auto it = impl.spare_fds.begin(); it != impl.spare_fds.end(); ++it) {
+                    int fd = *it;
+                    if (socket_name(fd) == acceptor.name) {
+                        impl.spare_fds.erase(it);
+                        return fd;
+                    }
+                }
+                return -1;
+            };
+            while (impl.loops.size() < num_loops) {
+                auto loop = new Loop(impl);
+                impl.loops.emplace_back(loop);
+                for (auto& acceptor: first_loop.acceptors) {
+                    int fd = take_spare(acceptor);
+                    auto sibling = fd < 0 ? acceptor.clone(*loop) : acceptor.adopt(*loop, fd);
+                    loop->acceptors.link_back(sibling);
+                }
+                if (impl.stopping) {
+                    loop->service.post([loop]() {
+                        loop->drain();
+                    });
+                }
+            }
+            // Left over when the server taken over had more loops than this
+            // one: the loops share them.
+            for (size_t i = 1; !impl.spare_fds.empty(); ++i) {
+                auto& loop = *impl.loops[i % impl.loops.size()];
+                bool adopted = false;
+                for (auto& acceptor: first_loop.acceptors) {
+                    int fd = take_spare(acceptor);
+                    if (fd >= 0) {
+                        auto sibling = acceptor.adopt(loop, fd);
+                        loop.acceptors.link_back(sibling);
+                        adopted = true;
+                        break;
+                    }
+                }
+                if (!adopted) {
+                    break;
+                }
+            }
+        }
+
+#if defined(WAYWARD_WITH_IO_URING)
+        if (impl.use_io_uring) {
+            try {
+                for (auto& loop: impl.loops) {
+                    loop->start_uring();
+                }
+            }
+            catch (std::exception& e) {
+                std::cerr << "io_uring is not available (" << e.what() << "), using asio.\n";
+                for (auto& loop: impl.loops) {
+                    loop->ring_events.reset();
+                    loop->ring.reset();
+                }
+            }
+        }
+#else
+        if (impl.use_io_uring) {
+            std::cerr << "Built without io_uring, using asio.\n";
+        }
+#endif
+        for (auto& loop: impl.loops) {
+            if (impl.max_connections > 0) {
+                loop->max_clients = (impl.max_connections + impl.loops.size() - 1) / impl.loops.size();
+            }
+            if (impl.shed_target_ms > 0) {
+                loop->codel = util::Codel(std::chrono::milliseconds(impl.shed_target_ms), std::chrono::milliseconds(impl.shed_interval_ms));
+                loop->probe_interval = std::chrono::milliseconds(impl.shed_target_ms);
+            }
+            for (auto& acceptor: loop->acceptors) {
+                if (acceptor.tcp && impl.defer_accept_s > 0) {
+                    acceptor.defer_accept(impl.defer_accept_s);
+                }
+                acceptor.keep_accepting();
+            }
+        }
+
+        std::vector<std::thread> threads;
+        threads.reserve(impl_->loops.size() - 1);
+        for (size_t i = 1; i < impl_->loops.size(); ++i) {
+            Loop* loop = impl_->loops[i].get();
+            threads.emplace_back([loop, i]() {
+                LatencyHistogram::use_shard(i);
+                loop->service.run();
+            });
+        }
+        LatencyHistogram::use_shard(0);
+        first_loop.service.run();
+        for (auto& thread: threads) {
+            thread.join();
+        }
+        return 0;
+    }
+
+    Server::ClientBase::ClientBase(Server::Loop& loop)
+        : loop(loop)
+        , request_arena(loop.buffer_pool)
+    {
+        http_parser_init(&parser, HTTP_REQUEST);
+        parser.data = this;
+    }
+
+    Server::ClientBase::~ClientBase() {
+        if (recv_buffer) {
+            loop.buffer_pool.release(recv_buffer);
+        }
+    }
+
+    void Server::ClientBase::reset() {
+        http_parser_init(&parser, HTTP_REQUEST);
+        parser.data = this;
+        recv_used = 0;
+        recv_pending = 0;
+        body_paused = false;
+        deferred = false;
+        http2.reset();
+        may_be_http2 = true;
+        upgrading = false;
+        websocket.reset();
+        upgrade_requested = false;
+        release_recv_buffer();
+        request_arena.release();
+        in_message = false;
+        in_body = false;
+        error_status = Status::BadRequest;
+        shedding = false;
+        current_request.body_consumer.reset();
+        current_request.deferred = false;
+        for (size_t i = 0; i < num_queued; ++i) {
+            recycle(queued[i]);
+        }
+        for (size_t i = 0; i < num_in_flight; ++i) {
+            recycle(in_flight[i]);
+        }
+        num_queued = 0;
+        num_in_flight = 0;
+        write_buffers.clear();
+        streaming = false;
+        stream_waiting = false;
+        reading = false;
+        writing = false;
+        read_closed = false;
+        refused = false;
+        closed = false;
+        may_have_more = false;
+        timeout = Timeout::None;
+    }
+
+    void Server::ClientBase::acquire_recv_buffer() {
+        if (!recv_buffer) {
+            recv_buffer = static_cast<char*>(loop.buffer_pool.acquire());
+        }
+    }
+
+    void Server::ClientBase::release_recv_buffer() {
+        if (recv_buffer && recv_used == 0 && recv_pending == 0) {
+            loop.buffer_pool.release(recv_buffer);
+            recv_buffer = nullptr;
+        }
+    }
+
+    void Server::ClientBase::received(size_t len) {
+        if (http2) {
+            http2->received(recv_begin(), len);
+            release_recv_buffer();
+            proceed();
+            return;
+        }
+        if (websocket) {
+            websocket->received(recv_begin(), len);
+            release_recv_buffer();
+            proceed();
+            return;
+        }
+        if (may_be_http2) {
+            may_be_http2 = false;
+            len += recv_used;
+            recv_used = 0;
+            if (loop.server_impl.http2 && received_preface(len)) {
+                return;
+            }
+        }
+        size_t parsed = http_parser_execute(&parser, &parser_settings, recv_begin(), len);
+        if (upgrading) {
+            upgrade_to_http2(parsed, len);
+            return;
+        }
+        auto error = HTTP_PARSER_ERRNO(&parser);
+        if (error == HPE_PAUSED) {
+            recv_pending = len - parsed;
+            len = parsed;
+        }
+        else if (error != HPE_OK && !read_closed) {
+            // Answer the malformed (or refused) request, and read no further.
+            if (error_status == Status::BadRequest) {
+                increment(loop.counters.parse_errors);
+            }
+            auto& out = queue_response();
+            out.response.status = error_status;
+            out.response.set_header(HeaderId::Connection, "close");
+            serialize(out);
+            read_closed = true;
+            refused = true;
+        }
+
+        if (deferred) {
+            // The responder may still be reading the request.
+            recv_used += len;
+        }
+        else if (websocket) {
+            // What followed the handshake waits for start_websocket().
+            recv_used += len;
+        }
+        else if (read_closed) {
+            recv_used = 0;
+            recv_pending = 0;
+        }
+        else if (in_message) {
+            // Keep the partial request around, and receive the rest after it.
+            recv_used += len;
+            if (recv_used == buffer_size) {
+                spill_request();
+            }
+        }
+        else {
+            recv_used = 0;
+        }
+        if (!in_message && !deferred) {
+            request_arena.release();
+        }
+        release_recv_buffer();
+        proceed();
+    }
+
+    // A 101 response from accept_websocket() switches a connection whose
+    // request asked to upgrade, once it has been written. Until then,
+    // parsing stays paused, and whatever followed the request waits in
+    // recv_buffer.
+    bool Server::ClientBase::upgrade_to_websocket(Outgoing& out) {
+        auto& res = out.response;
+        if (!res.websocket) {
+            return false;
+        }
+        auto handler = std::move(res.websocket);
+        if (!upgrade_requested || res.status != Status::SwitchingProtocols) {
+            return false;
+        }
+        if (read_closed) {
+            // The server is stopping, or the request asked to close.
+            res.status = Status::ServiceUnavailable;
+            res.headers.clear();
+            return false;
+        }
+        bool deflate = res.header(HeaderId::SecWebSocketExtensions).substr(0, 18) == "permessage-deflate";
+        websocket.reset(new WebSocketSession(*this, std::move(handler), deflate));
+        return true;
+    }
+
+    void Server::ClientBase::start_websocket() {
+        size_t pending = recv_pending;
+        recv_pending = 0;
+        websocket->start();
+        if (pending > 0 && !closed) {
+            websocket->received(recv_begin(), pending);
+        }
+        recv_used = 0;
+        request_arena.release();
+        release_recv_buffer();
+        if (closed) {
+            return;
+        }
+        // Reading was paused, and more may have arrived in the meantime.
+        may_have_more = true;
+        if (loop.draining) {
+            websocket->close(WebSocket::GoingAway, std::string_view());
+        }
+        proceed();
+    }
+
+    void Server::ClientBase::websocket_closed() {
+        if (websocket && websocket->started) {
+            websocket->closed();
+        }
+    }
+
+    void Server::ClientBase::received_eof() {
+        if (!http2 && !websocket) {
+            http_parser_execute(&parser, &parser_settings, nullptr, 0);
+        }
+        read_closed = true;
+        if (done_writing()) {
+            close();
+        }
+    }
+
+    Server::ClientBase::Outgoing& Server::ClientBase::queue_response() {
+        if (num_queued == queued.size()) {
+            queued.emplace_back();
+            queued.back().response.arena = util::Arena(loop.buffer_pool);
+        }
+        auto& out = queued[num_queued++];
+        out.request_started = request_started;
+        return out;
+    }
+
+    void Server::ClientBase::recycle(Outgoing& out) {
+        auto& res = out.response;
+        res.status = Status::OK;
+        res.headers.clear();
+        if (res.body.capacity() > max_retained_body) {
+            std::string().swap(res.body);
+        }
+        else {
+            res.body.clear();
+        }
+        res.body_producer.reset();
+        res.file.reset();
+        res.file_offset = 0;
+        res.file_length = 0;
+        res.shared_owner.reset();
+        res.shared_body = std::string_view();
+        res.content_length = Response::unknown_length;
+        res.websocket.reset();
+        res.latency = nullptr;
+        res.arena.release();
+        if (out.adopted) {
+            res.arena = util::Arena(loop.buffer_pool);
+            out.adopted = false;
+        }
+        out.head_only = false;
+        out.pending = false;
+        out.closing = false;
+        out.http10 = false;
+        out.chunked = false;
+        out.body_left = 0;
+        if (out.chunk.capacity() > max_retained_body) {
+            std::string().swap(out.chunk);
+        }
+        out.shared_pieces.clear();
+    }
+
+    void Server::ClientBase::record_latency(Outgoing& out, std::chrono::steady_clock::time_point now) {
+        if (out.response.latency) {
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - out.request_started);
+            out.response.latency->record(uint64_t(elapsed.count()));
+        }
+    }
+
+    void Server::ClientBase::serialize(Outgoing& out) {
+        auto& res = out.response;
+        out.settle_length();
+        bool known = res.content_length != Response::unknown_length;
+        out.chunked = res.body_producer && !known && !out.http10;
+        if (res.body_producer && !known && out.http10 && has_body(res.status)) {
+            // Without chunked encoding, the end of the connection ends the
+            // body, so nothing pipelined after the request is answered.
+            read_closed = true;
+            out.closing = true;
+        }
+        if (out.closing) {
+            res.set_header(HeaderId::Connection, "close");
+        }
+        size_t size = head_size(res, out.chunked);
+        char* head = res.arena.allocate_chars(size);
+        serialize_head(res, head, out.chunked);
+        out.head = std::string_view(head, size);
+    }
+
+    void Server::ClientBase::flush() {
+        if (http2) {
+            http2->flush();
+            return;
+        }
+        if (websocket && websocket->started) {
+            websocket->flush();
+            return;
+        }
+        if (writing || streaming || num_queued == 0) {
+            return;
+        }
+        size_t count = 0;
+        while (count < num_queued && !queued[count].pending && !queued[count].continued()) {
+            ++count;
+        }
+        if (count < num_queued && !queued[count].pending) {
+            // The continued response goes out up to its head.
+            ++count;
+        }
+        if (count == 0) {
+            return;
+        }
+        if (count == num_queued) {
+            queued.swap(in_flight);
+        }
+        else {
+            // Send up to the continued or deferred response, and keep the
+            // rest queued.
+            while (in_flight.size() < count) {
+                in_flight.emplace_back();
+                in_flight.back().response.arena = util::Arena(loop.buffer_pool);
+            }
+            for (size_t i = 0; i < count; ++i) {
+                std::swap(in_flight[i], queued[i]);
+            }
+            std::rotate(queued.begin(), queued.begin() + count, queued.begin() + num_queued);
+        }
+        num_in_flight = count;
+        num_queued -= count;
+
+        write_buffers.clear();
+        for (size_t i = 0; i < num_in_flight; ++i) {
+            auto& out = in_flight[i];
+            write_buffers.push_back(asio::buffer(out.head.data(), out.head.size()));
+            auto& res = out.response;
+            if (out.head_only) {
+                continue;
+            }
+            if (res.body_producer) {
+                streaming = true;
+                produce(out);
+            }
+            else if (res.file) {
+                // Follows the head once it has been written.
+                streaming = true;
+                out.file_offset = res.file_offset;
+                out.file_left = res.file_length;
+            }
+            else {
+                auto body = res.shared_owner ? res.shared_body : std::string_view(res.body);
+                if (!body.empty()) {
+                    write_buffers.push_back(asio::buffer(body.data(), body.size()));
+                }
+            }
+        }
+        keep_writing();
+    }
+
+    // Adds the next piece of a streamed body to write_buffers, in chunked
+    // framing, followed by the last-chunk once the producer is done; or
+    // unframed, for HTTP/1.0.
+    void Server::ClientBase::produce(Outgoing& out) {
+        auto& producer = *out.response.body_producer;
+        IBodyProducer::State state;
+        do {
+            out.chunk.clear();
+            out.shared_pieces.clear();
+            state = producer.produce_shared(out.chunk, out.shared_pieces);
+        } while (out.chunk.empty() && out.shared_pieces.empty() && state == IBodyProducer::More);
+
+        size_t size = out.chunk.size();
+        for (auto& piece: out.shared_pieces) {
+            size += piece->size();
+        }
+        if (state != IBodyProducer::Failed && !out.count_piece(size, state == IBodyProducer::Done)) {
+            state = IBodyProducer::Failed;
+        }
+        if (state == IBodyProducer::Failed) {
+            size = 0;
+        }
+        if (size > 0 && !out.chunked) {
+            if (!out.chunk.empty()) {
+                write_buffers.push_back(asio::buffer(out.chunk));
+            }
+            for (auto& piece: out.shared_pieces) {
+                if (!piece->empty()) {
+                    write_buffers.push_back(asio::buffer(piece->data(), piece->size()));
+                }
+            }
+        }
+        else if (size > 0) {
+            // The shared pieces go into the same chunk, without copying.
+            char* end = std::to_chars(out.chunk_size, out.chunk_size + 16, size, 16).ptr;
+            *end++ = '\r';
+            *end++ = '\n';
+            write_buffers.push_back(asio::buffer(out.chunk_size, end - out.chunk_size));
+            if (!out.chunk.empty()) {
+                write_buffers.push_back(asio::buffer(out.chunk));
+            }
+            for (auto& piece: out.shared_pieces) {
+                if (!piece->empty()) {
+                    write_buffers.push_back(asio::buffer(piece->data(), piece->size()));
+                }
+            }
+            write_buffers.push_back(asio::buffer("\r\n", 2));
+        }
+        if (state == IBodyProducer::Done) {
+            if (out.chunked) {
+                write_buffers.push_back(asio::buffer("0\r\n\r\n", 5));
+            }
+            streaming = false;
+        }
+        if (state == IBodyProducer::Failed) {
+            // The body never ends: the connection closes once the loop is
+            // done with it, and waits until then.
+            loop.post_to_client(slot, loop.client_slots[slot].generation, [](ClientBase& client) {
+                client.close();
+            });
+            stream_waiting = true;
+            return;
+        }
+        stream_waiting = state == IBodyProducer::Waiting;
+    }
+
+    void Server::ClientBase::continue_body() {
+        if (in_flight[0].response.body_producer) {
+            if (!stream_waiting) {
+                continue_stream();
+            }
+        }
+        else {
+            send_file();
+        }
+    }
+
+    void Server::ClientBase::continue_stream() {
+        write_buffers.clear();
+        produce(in_flight[0]);
+        if (!write_buffers.empty()) {
+            keep_writing();
+        }
+    }
+
+    void Server::ClientBase::resume_response(uint32_t stream) {
+        if (http2 && !closed) {
+            http2->resume_response(stream);
+            proceed();
+            return;
+        }
+        if (!streaming || !stream_waiting || closed) {
+            return;
+        }
+        stream_waiting = false;
+        if (!writing) {
+            continue_stream();
+            if (read_closed && done_writing()) {
+                close_written();
+                return;
+            }
+            update_timeout();
+        }
+    }
+
+    void Server::ClientBase::written() {
+        if (http2) {
+            writing = false;
+            http2->written();
+            proceed();
+            return;
+        }
+        if (websocket && websocket->started) {
+            writing = false;
+            websocket->written();
+            proceed();
+            return;
+        }
+        // A streamed response stays in flight until its body is complete.
+        size_t done = streaming ? num_in_flight - 1 : num_in_flight;
+        std::chrono::steady_clock::time_point now;
+        for (size_t i = 0; i < done; ++i) {
+            if (in_flight[i].response.latency && now == std::chrono::steady_clock::time_point()) {
+                now = std::chrono::steady_clock::now();
+            }
+            record_latency(in_flight[i], now);
+            recycle(in_flight[i]);
+        }
+        if (streaming) {
+            std::swap(in_flight[0], in_flight[done]);
+            num_in_flight = 1;
+        }
+        else {
+            num_in_flight = 0;
+        }
+        writing = false;
+
+        if (streaming) {
+            continue_body();
+            if (closed) {
+                return;
+            }
+            if (!streaming && !writing) {
+                // The rest of the file went out without blocking.
+                record_latency(in_flight[0], std::chrono::steady_clock::now());
+                recycle(in_flight[0]);
+                num_in_flight = 0;
+            }
+        }
+        if (websocket && num_in_flight == 0 && num_queued == 0) {
+            start_websocket();
+            return;
+        }
+        proceed();
+    }
+
+    // Writes what is ready, then reads on, or closes once everything has
+    // been written after the last request.
+    void Server::ClientBase::proceed() {
+        flush();
+        if (read_closed && done_writing()) {
+            close_written();
+            return;
+        }
+        resume_reading();
+        update_timeout();
+    }
+
+    void Server::ClientBase::update_timeout() {
+        Timeout next;
+        if (http2) {
+            next = http2->timeout();
+        }
+        else if (websocket && websocket->started) {
+            next = websocket->timeout();
+        }
+        else if (writing || (streaming && !stream_waiting)) {
+            next = Timeout::Write;
+        }
+        else if (streaming || deferred) {
+            next = Timeout::None;
+        }
+        else if (in_message) {
+            next = in_body ? Timeout::Body : Timeout::Header;
+        }
+        else {
+            next = Timeout::Idle;
+        }
+        if (next == timeout && next != Timeout::Body && next != Timeout::Write) {
+            return;
+        }
+        set_timeout(next);
+    }
+
+    void Server::ClientBase::timed_out() {
+        if (timeout == Timeout::Write) {
+            drop();
+        }
+        else {
+            close();
+        }
+    }
+
+    void Server::ClientBase::set_timeout(Timeout next) {
+        auto& impl = loop.server_impl;
+        unsigned int ms = 0;
+        switch (next) {
+            case Timeout::None:   break;
+            case Timeout::Idle:   ms = impl.idle_timeout_ms; break;
+            case Timeout::Header: ms = impl.header_timeout_ms; break;
+            case Timeout::Body:   ms = impl.body_timeout_ms; break;
+            case Timeout::Write:  ms = impl.write_timeout_ms; break;
+            case Timeout::Linger: ms = impl.write_timeout_ms; break;
+        }
+        timeout = next;
+        if (ms == 0) {
+            loop.timers.cancel(*this);
+        }
+        else {
+            loop.arm(*this, ms);
+        }
+    }
+
+    // The server is stopping. Idle connections close now; the others once
+    // their current request has been answered (see on_message_complete()).
+    void Server::ClientBase::drain() {
+        if (closed || slot == no_slot) {
+            return;
+        }
+        if (http2) {
+            http2->drain();
+            proceed();
+            return;
+        }
+        if (websocket && websocket->started) {
+            websocket->close(WebSocket::GoingAway, std::string_view());
+            proceed();
+            return;
+        }
+        if (timeout == Timeout::Idle) {
+            close();
+        }
+        else if (!in_message) {
+            read_closed = true;
+            // A deferred response has yet to be serialized; it will be the last.
+            if (num_queued > 0 && queued[num_queued - 1].pending) {
+                queued[num_queued - 1].closing = true;
+            }
+        }
+    }
+
+#if defined(HAVE_SYS_SENDFILE_H)
+    Server::ClientBase::FileProgress Server::ClientBase::send_file_to(int socket) {
+        auto& out = in_flight[0];
+        int fd = out.response.file->fd();
+        size_t sent = 0;
+        while (out.file_left > 0) {
+            if (sent >= max_file_per_turn) {
+                return FileProgress::Yielded;
+            }
+            off_t offset = off_t(out.file_offset);
+            size_t count = size_t(std::min<uint64_t>(out.file_left, max_file_per_turn - sent));
+            ssize_t len = ::sendfile(socket, fd, &offset, count);
+            if (len > 0) {
+                increment(loop.counters.bytes_sent, len);
+                out.file_offset += len;
+                out.file_left -= len;
+                sent += len;
+                continue;
+            }
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return FileProgress::WouldBlock;
+            }
+            if (len < 0 && errno != EPIPE && errno != ECONNRESET) {
+                std::cerr << "sendfile(): " << std::strerror(errno) << "\n";
+            }
+            return FileProgress::Failed;
+        }
+        return FileProgress::Sent;
+    }
+#endif
+
+    // After a refused request, the client may still be sending its body.
+    void Server::ClientBase::close_written() {
+        if (refused) {
+            set_timeout(Timeout::Linger);
+            linger();
+        }
+        else {
+            close();
+        }
+    }
+
+    void Server::ClientBase::resume_reading() {
+        if (http2) {
+            if (!reading && !read_closed && !http2->output_full()) {
+                keep_reading();
+            }
+            return;
+        }
+        if (websocket) {
+            if (websocket->started && !reading && !read_closed && !websocket->output_full()) {
+                keep_reading();
+            }
+            return;
+        }
+        if (!reading && !read_closed && !body_paused && !deferred && num_queued < max_queued_responses) {
+            keep_reading();
+        }
+    }
+
+    void Server::ClientBase::resume_body(uint32_t stream) {
+        if (http2 && !closed) {
+            http2->resume_body(stream);
+            proceed();
+            return;
+        }
+        if (!body_paused || closed) {
+            return;
+        }
+        body_paused = false;
+        resume_parsing();
+    }
+
+    void Server::ClientBase::resume_parsing() {
+        http_parser_pause(&parser, 0);
+        // More may have arrived in the meantime.
+        may_have_more = true;
+        if (recv_pending > 0) {
+            size_t len = recv_pending;
+            recv_pending = 0;
+            received(len);
+            return;
+        }
+        if (!in_message) {
+            recv_used = 0;
+            request_arena.release();
+        }
+        release_recv_buffer();
+        proceed();
+    }
+
+    void Server::ClientBase::complete(Response&& response, uint32_t stream) {
+        if (http2) {
+            http2->complete(stream, std::move(response));
+            if (!closed) {
+                proceed();
+            }
+            return;
+        }
+        if (!deferred) {
+            return;
+        }
+        deferred = false;
+        --loop.num_deferred_requests;
+        loop.server_impl.responder->completed(current_request, response);
+        if (closed) {
+            release();
+            return;
+        }
+        // Deferring paused parsing, so nothing has been queued after it.
+        auto& out = queued[num_queued - 1];
+        assert(out.pending);
+        out.pending = false;
+        if (!response.latency) {
+            response.latency = out.response.latency;
+        }
+        out.response = std::move(response);
+        out.adopted = true;
+        if (upgrade_to_websocket(out)) {
+            // Parsing stays paused.
+            serialize(out);
+            proceed();
+            return;
+        }
+        serialize(out);
+        resume_parsing();
+    }
+
+    ConnectionHandle Server::ClientBase::handle(uint32_t stream) {
+        assert(slot != no_slot);
+        return ConnectionHandle(&loop, slot, loop.client_slots[slot].generation, stream);
+    }
+
+    void ConnectionHandle::resume_body() const {
+        if (!host_) {
+            return;
+        }
+        auto loop = static_cast<Server::Loop*>(host_);
+        uint32_t stream = stream_;
+        loop->post_to_client(slot_, generation_, [stream](Server::ClientBase& client) {
+            client.resume_body(stream);
+        });
+    }
+
+    void ConnectionHandle::resume_response() const {
+        if (!host_) {
+            return;
+        }
+        auto loop = static_cast<Server::Loop*>(host_);
+        uint32_t stream = stream_;
+        loop->post_to_client(slot_, generation_, [stream](Server::ClientBase& client) {
+            client.resume_response(stream);
+        });
+    }
+
+    void ConnectionHandle::complete(Response response) const {
+        if (!host_) {
+            return;
+        }
+        auto loop = static_cast<Server::Loop*>(host_);
+        // asio copies handlers, and Responses cannot be copied.
+        auto moved = std::make_shared<Response>(std::move(response));
+        uint32_t stream = stream_;
+        loop->post_to_client(slot_, generation_, [moved, stream](Server::ClientBase& client) {
+            client.complete(std::move(*moved), stream);
+        });
+    }
+
+    void ConnectionHandle::post(std::function<void()> fn) const {
+        if (!host_) {
+            return;
+        }
+        auto loop = static_cast<Server::Loop*>(host_);
+        loop->post_to_client(slot_, generation_, [fn](Server::ClientBase&) {
+            fn();
+        });
+    }
+
+    void* ConnectionHandle::io_service() const {
+        if (!host_) {
+            return nullptr;
+        }
+        return &static_cast<Server::Loop*>(host_)->service;
+    }
+
+    void WebSocket::send(std::string message, bool binary) const {
+        if (!connection_.host_) {
+            return;
+        }
+        auto loop = static_cast<Server::Loop*>(connection_.host_);
+        auto moved = std::make_shared<std::string>(std::move(message));
+        loop->post_to_client(connection_.slot_, connection_.generation_, [moved, binary](Server::ClientBase& client) {
+            if (client.websocket && client.websocket->started) {
+                client.websocket->send(*moved, binary);
+                if (!client.closed) {
+                    client.proceed();
+                }
+            }
+        });
+    }
+
+    void WebSocket::close(uint16_t code, std::string reason) const {
+        if (!connection_.host_) {
+            return;
+        }
+        auto loop = static_cast<Server::Loop*>(connection_.host_);
+        auto moved = std::make_shared<std::string>(std::move(reason));
+        loop->post_to_client(connection_.slot_, connection_.generation_, [code, moved](Server::ClientBase& client) {
+            if (client.websocket && client.websocket->started) {
+                client.websocket->close(code, *moved);
+                client.proceed();
+            }
+        });
+    }
+
+    void Server::ClientBase::append(std::string_view& field, const char* data, size_t len) {
+        if (field.empty()) {
+            field = std::string_view(data, len);
+        }
+        else if (field.data() + field.size() == data) {
+            field = std::string_view(field.data(), field.size() + len);
+        }
+        else {
+            // The field crossed a read boundary after its beginning was spilled.
+            char* joined = request_arena.allocate_chars(field.size() + len);
+            std::copy(field.begin(), field.end(), joined);
+            std::copy(data, data + len, joined + field.size());
+            field = std::string_view(joined, field.size() + len);
+        }
+    }
+
+    // Bodies grow in place while they are contiguous in recv_buffer. Chunked
+    // bodies are compacted over their chunk framing, which has already been
+    // parsed. Once spilled, a body grows in request_arena, doubling, so
+    // buffering it is linear in its size.
+    void Server::ClientBase::append_body(const char* data, size_t len) {
+        auto& body = current_request.body;
+        if (body.empty()) {
+            body = std::string_view(data, len);
+            return;
+        }
+        char* end = const_cast<char*>(body.data()) + body.size();
+        if (end == data) {
+            body = std::string_view(body.data(), body.size() + len);
+            return;
+        }
+        if (in_recv_buffer(body.data())) {
+            std::memmove(end, data, len);
+            body = std::string_view(body.data(), body.size() + len);
+            return;
+        }
+        if (body.size() + len > body_capacity) {
+            size_t capacity = std::max(body.size() + len, 2 * body_capacity);
+            char* grown = request_arena.allocate_chars(capacity);
+            std::memcpy(grown, body.data(), body.size());
+            body = std::string_view(grown, body.size());
+            body_capacity = capacity;
+            end = grown + body.size();
+        }
+        std::memcpy(end, data, len);
+        body = std::string_view(body.data(), body.size() + len);
+    }
+
+    // Copies the fields still in recv_buffer; those spilled before stay put.
+    void Server::ClientBase::spill_request() {
+        auto& req = current_request;
+        auto spill_size = [&](std::string_view field) {
+            return in_recv_buffer(field.data()) ? field.size() : 0;
+        };
+        size_t size = spill_size(req.url) + spill_size(req.body);
+        for (auto& field: req.headers) {
+            size += spill_size(field.name) + spill_size(field.value);
+        }
+        char* p = request_arena.allocate_chars(size);
+        auto move_field = [&](std::string_view& field) {
+            if (in_recv_buffer(field.data())) {
+                std::copy(field.begin(), field.end(), p);
+                field = std::string_view(p, field.size());
+                p += field.size();
+            }
+        };
+        move_field(req.url);
+        for (auto& field: req.headers) {
+            move_field(field.name);
+            move_field(field.value);
+        }
+        if (in_recv_buffer(req.body.data())) {
+            move_field(req.body);
+            body_capacity = req.body.size();
+        }
+        recv_used = 0;
+    }
+
+    int Server::ClientBase::on_message_begin(http_parser* parser) {
+        ClientBase& client = *static_cast<ClientBase*>(parser->data);
+        if (client.read_closed) {
+            // Pipelined after "Connection: close"; ignore the rest.
+            return -1;
+        }
+        auto& req = client.current_request;
+        req.url = std::string_view();
+        req.headers.clear();
+        req.body = std::string_view();
+        client.body_capacity = 0;
+        client.request_arena.reset();
+        client.in_message = true;
+        client.in_header_value = false;
+        client.in_body = false;
+        client.shedding = false;
+        client.request_started = client.received_at;
+        return 0;
+    }
+    int Server::ClientBase::on_headers_complete(http_parser* parser) {
+        ClientBase& client = *static_cast<ClientBase*>(parser->data);
+        auto& req = client.current_request;
+        if (!req.headers.empty()) {
+            intern(req.headers.back());
+        }
+        req.method = method_from_parser(parser->method);
+        req.connection = client.handle();
+        client.in_body = true;
+        req.max_body_size = client.loop.server_impl.max_body_size;
+        if (client.loop.shed(client.request_started)) {
+            // Answered by on_message_complete().
+            client.shedding = true;
+            return 0;
+        }
+        client.loop.server_impl.responder->begin(req);
+        // Without Content-Length, the parser reports ULLONG_MAX.
+        if (!req.body_consumer && parser->content_length != ULLONG_MAX && parser->content_length > req.max_body_size) {
+            client.error_status = Status::PayloadTooLarge;
+            return -1;
+        }
         return 0;
     }
     int Server::ClientBase::on_message_complete(http_parser* parser) {
         ClientBase& client = *static_cast<ClientBase*>(parser->data);
-        Response response;
-        client.server_impl.responder->respond(client.current_request, response);
-        client.send_response(std::move(response));
+        client.in_message = false;
+        if (parser->upgrade && !client.shedding && client.wants_http2()) {
+            // Answered over HTTP/2, once parsing stops (see received()).
+            client.upgrading = true;
+            http_parser_pause(parser, 1);
+            return 0;
+        }
+        increment(client.loop.counters.requests);
+        auto& headers = client.current_request.headers;
+        if ((parser->flags & F_TRAILING) && !headers.empty()) {
+            intern(headers.back());
+        }
+        if (!http_should_keep_alive(parser)) {
+            client.read_closed = true;
+        }
+        auto& out = client.queue_response();
+        if (client.loop.draining && !client.read_closed) {
+            // The server is stopping: no more requests on this connection.
+            client.read_closed = true;
+            out.closing = true;
+        }
+        out.head_only = client.current_request.method == Method::Head;
+        out.http10 = parser->http_major == 1 && parser->http_minor == 0;
+        auto& req = client.current_request;
+        client.upgrade_requested = parser->upgrade;
+        if (client.shedding) {
+            out.response.status = Status::ServiceUnavailable;
+            out.response.set_header(HeaderId::RetryAfter, "1");
+            client.serialize(out);
+            return 0;
+        }
+        client.loop.server_impl.responder->respond(req, out.response);
+        req.body_consumer.reset();
+        if (req.deferred) {
+            req.deferred = false;
+            ++client.loop.num_deferred_requests;
+            out.pending = true;
+            client.deferred = true;
+            http_parser_pause(parser, 1);
+            return 0;
+        }
+        if (client.upgrade_to_websocket(out)) {
+            // Nothing after the request is HTTP.
+            http_parser_pause(parser, 1);
+        }
+        client.serialize(out);
         return 0;
     }
     int Server::ClientBase::on_chunk_header(http_parser* parser) {
         ClientBase& client = *static_cast<ClientBase*>(parser->data);
+        auto& req = client.current_request;
+        // The parser has decoded the chunk size into content_length, so an
+        // oversized chunked body is refused before any of it is buffered.
+        if (!client.shedding && !req.body_consumer && req.body.size() + parser->content_length > req.max_body_size) {
+            client.error_status = Status::PayloadTooLarge;
+            return -1;
+        }
         return 0;
     }
     int Server::ClientBase::on_chunk_complete(http_parser* parser) {
@@ -290,7 +2548,7 @@ namespace wayward {
 
     int Server::ClientBase::on_url(http_parser* parser, const char* url, size_t len) {
         ClientBase& client = *static_cast<ClientBase*>(parser->data);
-        client.current_request.url = std::string(url, len);
+        client.append(client.current_request.url, url, len);
         return 0;
     }
     int Server::ClientBase::on_status(http_parser* parser, const char*, size_t) {
@@ -299,17 +2557,41 @@ namespace wayward {
     }
     int Server::ClientBase::on_header_field(http_parser* parser, const char* field, size_t len) {
         ClientBase& client = *static_cast<ClientBase*>(parser->data);
-        client.current_header_field = std::string(field, len);
+        auto& headers = client.current_request.headers;
+        if (headers.empty() || client.in_header_value) {
+            if (!headers.empty()) {
+                intern(headers.back());
+            }
+            headers.emplace_back();
+            client.in_header_value = false;
+        }
+        client.append(headers.back().name, field, len);
         return 0;
     }
     int Server::ClientBase::on_header_value(http_parser* parser, const char* value, size_t len) {
         ClientBase& client = *static_cast<ClientBase*>(parser->data);
-        client.current_request.headers[std::move(client.current_header_field)] = std::string(value, len);
+        client.in_header_value = true;
+        client.append(client.current_request.headers.back().value, value, len);
         return 0;
     }
     int Server::ClientBase::on_body(http_parser* parser, const char* body, size_t len) {
         ClientBase& client = *static_cast<ClientBase*>(parser->data);
-        client.current_request.body = std::string(body, len);
+        auto& req = client.current_request;
+        if (client.shedding) {
+            return 0;
+        }
+        if (req.body_consumer) {
+            if (!req.body_consumer->consume(req, std::string_view(body, len))) {
+                client.body_paused = true;
+                http_parser_pause(parser, 1);
+            }
+            return 0;
+        }
+        if (req.body.size() + len > req.max_body_size) {
+            client.error_status = Status::PayloadTooLarge;
+            return -1;
+        }
+        client.append_body(body, len);
         return 0;
     }
 }
@@ -9,14 +9,162 @@ namespace wayward {
         Server();
         ~Server();
 
+        // Number of event loops, each running on its own thread. Every loop
+        // gets its own listening socket per listen() call (SO_REUSEPORT where
+        // available), so a connection stays on the thread that accepted it.
+        // 0 means one loop per hardware thread. Default is 1.
+        Server& threads(unsigned int num_threads);
+
+        // Limit for request bodies buffered into Request::body. Requests
+        // whose body streams to a consumer are not limited. Default is
+        // Request::default_max_body_size.
+        Server& max_body_size(size_t bytes);
+
+        // Connections that stall are closed: when the headers of a request
+        // take longer than header_timeout to arrive, counted from its first
+        // byte; when no body data arrives for body_timeout, even while a
+        // consumer has paused reading; when no request arrives for
+        // idle_timeout after the last response; and when writing makes no
+        // progress for write_timeout (which also bounds discarding input
+        // after a refused request). Responses deferred by the application,
+        // and body producers waiting for it, are not timed. In milliseconds,
+        // with a resolution of 100 ms; 0 disables a timeout. Defaults are
+        // 10 s, 30 s, 60 s and 30 s.
+        Server& header_timeout(unsigned int ms);
+        Server& body_timeout(unsigned int ms);
+        Server& idle_timeout(unsigned int ms);
+        Server& write_timeout(unsigned int ms);
+
+        // Use io_uring for socket I/O instead of asio's reactor: listening
+        // sockets accept continuously (multishot accept), connections
+        // receive into buffers the kernel picks from a ring shared by the
+        // loop, and each loop submits all of its writes (and receives) at
+        // once, with one system call per turn. Requires Linux 6.0 and a
+        // build with WAYWARD_IO_URING; otherwise, or when the kernel refuses
+        // (e.g. in containers with a seccomp policy), asio is used, with a
+        // warning. Default is false.
+        Server& io_uring(bool enable);
+
+        // Serve HTTP/2 over cleartext (h2c) as well as HTTP/1.1, to clients
+        // that start with the HTTP/2 connection preface (prior knowledge),
+        // or that ask to upgrade a request with "Upgrade: h2c". The requests
+        // of a connection's concurrent streams (up to 128) go to the same
+        // responder and are answered in whatever order their responses are
+        // ready, deferred or not. Default is false.
+        Server& http2(bool enable);
+
+        // With asio's reactor, an acceptor that is woken up by a connection
+        // takes up to accept_batch connections from its listening socket's
+        // backlog before the loop goes on, so a burst of connections does
+        // not cost a turn of the loop each. io_uring's multishot accept
+        // takes them as they come anyway. Default is 16.
+        Server& accept_batch(unsigned int max);
+
+        // Accepted TCP connections get TCP_NODELAY, so that small writes,
+        // like pieces of a streamed body or pipelined responses, are not
+        // held back until the previous one has been acknowledged. Default is
+        // true.
+        Server& no_delay(bool enable);
+
+        // Sets TCP_DEFER_ACCEPT on TCP listening sockets, where there is
+        // one (Linux): connections are only accepted once their first
+        // request has started to arrive, or after `seconds` without it, so
+        // connections that stay silent cost nothing. 0 (the default)
+        // leaves the sockets as they are.
+        Server& defer_accept(unsigned int seconds);
+
+        // How long stop() waits for requests in progress, in milliseconds.
+        // Connections still open then are closed. Default is 30 s.
+        Server& drain_timeout(unsigned int ms);
+
+        // Admission control, to keep the latency of the requests the server
+        // does take bounded when more arrive than it can handle.
+        //
+        // max_connections: while this many connections are open, no more
+        // are accepted; they wait in the listening sockets' backlogs. Split
+        // evenly over the loops (see threads()), which accept on their own.
+        // Accepting also pauses when the process runs out of file
+        // descriptors, until a connection closes or half a second has
+        // passed.
+        //
+        // max_requests_in_flight: requests that each loop has deferred (see
+        // Request::defer()) and that have yet to be completed. Beyond that,
+        // requests are answered with 503 Service Unavailable and
+        // "Retry-After: 1", without passing them to the responder.
+        //
+        // shed_load: answers requests the same way while the loop is
+        // overloaded, after CoDel: when, for interval_ms, no request has
+        // been taken up less than target_ms after its first byte arrived,
+        // requests that have waited more than twice target_ms are refused.
+        // How long a request has waited includes how far the loop runs
+        // behind, which it measures every target_ms while connections are
+        // open.
+        //
+        // 0 disables each; all are disabled by default.
+        Server& max_connections(size_t max);
+        Server& max_requests_in_flight(size_t max);
+        Server& shed_load(unsigned int target_ms, unsigned int interval_ms = 100);
+
+        // Counters summed over all event loops, which keep their own without
+        // synchronizing. Thread-safe at any time, including while run()
+        // starts the loops.
+        struct Metrics {
+            uint64_t connections_accepted = 0;
+            uint64_t connections_closed = 0;
+            uint64_t active_connections = 0;
+            uint64_t requests = 0;
+            uint64_t parse_errors = 0;
+            uint64_t requests_shed = 0; // By admission control.
+            uint64_t bytes_received = 0;
+            uint64_t bytes_sent = 0;
+        };
+        Metrics metrics() const;
+
         Server& listen(std::string listen_address, unsigned int port);
         Server& listen(std::string unix_socket_path);
+        // Accepts from a TCP or UNIX domain socket that is already listening,
+        // e.g. one inherited from the parent process, and takes ownership of
+        // it. Several sockets bound to the same endpoint are spread over the
+        // loops (see threads()).
+        Server& listen_fd(int fd);
+        // listen_fd() for each socket passed by systemd socket activation
+        // ($LISTEN_FDS, see sd_listen_fds(3)). Returns how many there were.
+        size_t listen_inherited();
+
+        // Restarts without refusing connections. The running server calls
+        // allow_takeover(path) before run(), and its successor calls
+        // take_over(path) instead of listen():
+        //
+        //     if (!server.take_over("/run/app.takeover")) {
+        //         server.listen("0.0.0.0", 8080);
+        //     }
+        //     server.allow_takeover("/run/app.takeover");
+        //     server.run(app);
+        //
+        // The old server passes its listening sockets over the UNIX domain
+        // socket at `path` (SCM_RIGHTS), then stops as if by stop(). Its
+        // successor accepts from the same sockets, so connections waiting in
+        // their backlogs are not lost. take_over() returns false if no
+        // server is listening at `path`.
+        Server& allow_takeover(std::string unix_socket_path);
+        bool take_over(std::string unix_socket_path);
+
         int run(IRequestResponder&);
+        // Shuts down gracefully, from any thread: stops accepting
+        // connections, closes idle ones, and closes the rest after their
+        // current request has been answered, with "Connection: close", or
+        // at drain_timeout. run() returns once all connections are closed.
         void stop();
 
     private:
+        friend struct ConnectionHandle;
+        friend struct WebSocket;
+        struct Loop;
         struct ClientBase;
         template <class> struct Client;
+        struct UringClient;
+        struct Http2Session;
+        struct WebSocketSession;
         struct AcceptorBase;
         template <class> struct Acceptor;
         struct Impl;
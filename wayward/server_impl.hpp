@@ -0,0 +1,662 @@
+// Internal to the server: the types shared by server.cpp, http2.cpp and
+// uring.cpp. Not part of the public API.
+#pragma once
+
+#include "wayward/server.hpp"
+#include "wayward/hpack.hpp"
+#include "wayward/metrics.hpp"
+#include "wayward/util/linklist.hpp"
+#include "wayward/util/buffer_pool.hpp"
+#include "wayward/util/codel.hpp"
+#include "wayward/util/timer_wheel.hpp"
+#include "wayward/websocket.hpp"
+#include "config.h"
+
+#if defined(ASIO_FROM_BOOST)
+#include <boost/asio.hpp>
+namespace asio = boost::asio;
+using asio_error_code = boost::system::error_code;
+#else
+#include <asio.hpp>
+using asio_error_code = std::error_code;
+#endif
+
+#include <http_parser.h>
+
+#if !defined(_MSC_VER)
+#include <unistd.h> // dup, pread
+#include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY, TCP_DEFER_ACCEPT
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#endif
+#if defined(HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#include <csignal>
+#endif
+#if defined(WAYWARD_WITH_IO_URING)
+#include "wayward/util/io_uring.hpp"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace wayward {
+    // Size of receive buffers and arena chunks, which share a pool.
+    inline constexpr size_t buffer_size = 4096;
+
+    // accept() failed for this connection only, which may have gone
+    // away before it could be accepted (see accept(2)); the next one
+    // is accepted at once. Other errors, like running out of file
+    // descriptors, pause accepting (see Loop::accept_failed()).
+    inline bool accept_error_is_transient(const asio_error_code& ec) {
+        return ec == asio::error::connection_aborted
+            || ec == asio::error::interrupted
+            || ec == asio::error::would_block
+            || ec == asio::error::try_again
+            || ec == asio::error::network_down
+            || ec == asio::error::network_unreachable
+            || ec == asio::error::host_unreachable
+            || ec == asio::error::no_permission; // Refused by a firewall.
+    }
+
+    // Counters with a single writer, its event loop, need no atomic
+    // read-modify-write; they are atomic only for Server::metrics().
+    inline void increment(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // Names arrive in pieces, so a field is tagged with its ID once the
+    // parser has moved past it: at the next field, or at the end of the
+    // headers (or trailers).
+    inline void intern(HeaderField& field) {
+        field.id = header_id(field.name);
+    }
+
+    // A ConstBufferSequence over buffers owned by the client, so asio does
+    // not copy a std::vector of buffers into every write operation.
+    struct BufferRange {
+        using value_type = asio::const_buffer;
+        using const_iterator = const asio::const_buffer*;
+
+        const_iterator first;
+        const_iterator last;
+
+        const_iterator begin() const { return first; }
+        const_iterator end() const { return last; }
+    };
+
+    struct Server::ClientBase {
+        Server::Loop& loop;
+        util::IntrusiveListAnchor anchor;
+        http_parser parser;
+
+        // Requests are parsed in place. A request that spans several reads is
+        // received into the remainder of recv_buffer, so its fields stay
+        // contiguous. Only when the buffer fills up mid-request are the
+        // fields received so far copied out, into request_arena (see
+        // spill_request()), which is reset when the next request begins.
+        //
+        // recv_buffer comes from the loop's buffer pool when the socket
+        // becomes readable, and goes back as soon as no partial request
+        // refers to it, so idle connections hold no buffers.
+        char* recv_buffer = nullptr;
+        size_t recv_used = 0;
+        util::Arena request_arena;
+
+        bool in_message = false;
+        bool in_header_value = false;
+        bool in_body = false; // The headers of the current request are complete.
+        // When the last read happened, and with it the first byte of the
+        // current request. Read once per read rather than per request.
+        std::chrono::steady_clock::time_point received_at;
+        std::chrono::steady_clock::time_point request_started;
+        Request current_request;
+        // Bytes reserved for a buffered body in request_arena (see append_body()).
+        size_t body_capacity = 0;
+        // Answers a request the parser callbacks refused.
+        Status error_status = Status::BadRequest;
+        // Admission control refused the current request (see Loop::shed()).
+        // It is answered with 503, and its body is discarded.
+        bool shedding = false;
+
+        // A body consumer paused the parser. Reading stops, and whatever was
+        // received but not parsed yet waits after recv_used until
+        // resume_body().
+        bool body_paused = false;
+        size_t recv_pending = 0;
+
+        // The responder deferred the last queued response (see
+        // Request::defer()). Parsing pauses like for a body consumer, and
+        // the request and its memory stay as they are until complete(), even
+        // if the connection closes in the meantime.
+        bool deferred = false;
+
+        // Set once the connection speaks HTTP/2 (see Http2Session), which
+        // it may from the start (see received()), or after upgrading its
+        // first request (see on_message_complete()). With HTTP/2, `deferred`
+        // means that some stream is deferred.
+        std::unique_ptr<Http2Session> http2;
+        bool may_be_http2 = true;
+        bool upgrading = false;
+
+        // Set once a request has been answered with accept_websocket() (see
+        // upgrade_to_websocket()). The connection speaks WebSocket from when
+        // the 101 response has been written (see start_websocket()).
+        std::unique_ptr<WebSocketSession> websocket;
+        bool upgrade_requested = false; // By the current request.
+
+        // Index in Loop::client_slots while the connection is open.
+        static constexpr uint32_t no_slot = uint32_t(-1);
+        uint32_t slot = no_slot;
+
+        // Responses to pipelined requests are queued in request order, and
+        // everything queued while a write is in flight goes out together in
+        // the next one: the heads from the responses' arenas, and the bodies
+        // from where they are. Slots are recycled; their arenas go back to
+        // the buffer pool, and bodies up to max_retained_body keep their
+        // capacity. Reading pauses while max_queued_responses are waiting.
+        //
+        // A response with a body producer or a file is written up to its
+        // head (and a first piece); the responses queued after it wait until
+        // its body is complete (see continue_body()). So do the responses
+        // queued after a deferred one, which is not sent before complete().
+        struct Outgoing {
+            Response response;
+            std::string_view head;
+            bool head_only = false; // HEAD request
+            bool pending = false; // deferred
+            bool adopted = false; // response.arena came with complete()
+            bool closing = false; // the last response before the server stops
+            bool http10 = false; // to an HTTP/1.0 request
+            bool chunked = false; // body_producer framed in chunks
+            uint64_t body_left = 0; // of a body_producer's content_length
+            std::chrono::steady_clock::time_point request_started;
+            std::string chunk;
+            std::vector<std::shared_ptr<const std::string>> shared_pieces; // after `chunk`
+            char chunk_size[18]; // hex digits and CRLF
+            uint64_t file_offset = 0;
+            uint64_t file_left = 0;
+
+            bool continued() const {
+                return !head_only && (response.body_producer || response.file);
+            }
+
+            // Which Content-Length the head declares: the one that comes
+            // with the response only where the body is left out, or is
+            // produced; otherwise the body's own.
+            void settle_length() {
+                if (!head_only && !response.body_producer && has_body(response.status)) {
+                    response.content_length = Response::unknown_length;
+                }
+                body_left = response.body_producer ? response.content_length : 0;
+            }
+
+            // Counts a produced piece against the content_length, if there
+            // is one. Returns false if the body would not match it.
+            bool count_piece(size_t size, bool done) {
+                if (!response.body_producer || response.content_length == Response::unknown_length) {
+                    return true;
+                }
+                if (size > body_left || (done && size != body_left)) {
+                    return false;
+                }
+                body_left -= size;
+                return true;
+            }
+        };
+        static constexpr size_t max_queued_responses = 32;
+        static constexpr size_t max_retained_body = 64 * 1024;
+        std::vector<Outgoing> queued;
+        std::vector<Outgoing> in_flight;
+        size_t num_queued = 0;
+        size_t num_in_flight = 0;
+        std::vector<asio::const_buffer> write_buffers;
+        // The last in-flight response is streaming its body or file, and its
+        // producer may be waiting for resume_response().
+        bool streaming = false;
+        bool stream_waiting = false;
+
+        bool reading = false;
+        bool writing = false;
+        bool read_closed = false; // EOF, "Connection: close" or a parse error
+        bool refused = false; // read_closed by a parse error or refused request
+        bool closed = false;
+        // The last read filled the buffer, or reading was paused. The reactor
+        // is edge-triggered, so read again before waiting for readiness.
+        bool may_have_more = false;
+
+        // Closes the connection when it stalls (see update_timeout()). The
+        // header and idle deadlines run from when they were set; the others
+        // are extended whenever the connection makes progress.
+        enum class Timeout {
+            None,   // Waiting for the application.
+            Idle,   // Waiting for the next request.
+            Header, // Receiving the headers of a request.
+            Body,   // Receiving its body.
+            Write,  // Writing responses.
+            Linger, // Discarding input before closing.
+        };
+        Timeout timeout = Timeout::None;
+        util::Timer timer;
+
+        ClientBase(Loop& loop);
+        virtual ~ClientBase();
+
+        // Prepares a closed client for reuse by another connection.
+        void reset();
+
+        char* recv_begin() { return recv_buffer + recv_used; }
+        size_t recv_capacity() const { return buffer_size - recv_used; }
+        void acquire_recv_buffer();
+        void release_recv_buffer();
+        bool in_recv_buffer(const char* p) const { return recv_buffer && p >= recv_buffer && p < recv_buffer + buffer_size; }
+        void received(size_t len);
+        void received_eof();
+        void append(std::string_view& field, const char* data, size_t len);
+        void append_body(const char* data, size_t len);
+        void spill_request();
+        void resume_body(uint32_t stream);
+        void resume_parsing();
+        void complete(Response&&, uint32_t stream);
+        ConnectionHandle handle(uint32_t stream = 0);
+        bool received_preface(size_t len);
+        bool wants_http2();
+        void upgrade_to_http2(size_t parsed, size_t len);
+        bool upgrade_to_websocket(Outgoing&);
+        void start_websocket();
+        void websocket_closed();
+
+        Outgoing& queue_response();
+        void recycle(Outgoing&);
+        void record_latency(Outgoing&, std::chrono::steady_clock::time_point now);
+        void serialize(Outgoing&);
+        void flush();
+        void produce(Outgoing&);
+        void continue_body();
+        void continue_stream();
+        void resume_response(uint32_t stream);
+        void written();
+        void resume_reading();
+        void proceed();
+        void update_timeout();
+        void set_timeout(Timeout);
+        void timed_out();
+        void close_written();
+        void drain();
+        // Nothing is being written, or waiting to be.
+        bool done_writing() const { return !writing && !streaming && !deferred; }
+        virtual void close() = 0;
+        // Returns a closed client to its acceptor.
+        virtual void release() = 0;
+        // Closes with a reset, discarding unsent data, so a stalled client
+        // does not keep the kernel's socket buffers pinned.
+        virtual void drop() = 0;
+        virtual void linger() = 0;
+
+        virtual void keep_reading() = 0;
+        virtual void keep_writing() = 0;
+        // Disables Nagle's algorithm, on TCP sockets.
+        virtual void set_no_delay() = 0;
+        // Sends what it can of the in-flight file. Ends streaming once all
+        // of it has been sent; otherwise calls written() when the socket can
+        // take more.
+        virtual void send_file() = 0;
+
+        // Closing with unread input resets the connection, which can destroy
+        // the error response before the client has read it. So linger()
+        // shuts down our side and discards input until EOF, up to
+        // max_lingering_bytes.
+        static constexpr size_t max_lingering_bytes = 1024 * 1024;
+
+        // At most this much of a file goes out before other connections get
+        // a turn.
+        static constexpr size_t max_file_per_turn = 1024 * 1024;
+
+#if defined(HAVE_SYS_SENDFILE_H)
+        enum class FileProgress {
+            Sent,       // All of it.
+            Yielded,    // max_file_per_turn.
+            WouldBlock, // The socket's buffer is full.
+            Failed,     // The file shrank, or the connection failed.
+        };
+        FileProgress send_file_to(int socket);
+#endif
+
+        static int on_message_begin(http_parser*);
+        static int on_headers_complete(http_parser*);
+        static int on_message_complete(http_parser*);
+        static int on_chunk_header(http_parser*);
+        static int on_chunk_complete(http_parser*);
+
+        static int on_url(http_parser*, const char*, size_t);
+        static int on_status(http_parser*, const char*, size_t);
+        static int on_header_field(http_parser*, const char*, size_t);
+        static int on_header_value(http_parser*, const char*, size_t);
+        static int on_body(http_parser*, const char*, size_t);
+
+        static const http_parser_settings parser_settings;
+    };
+
+    // An HTTP/2 connection (see http2.cpp), which a client hands its input
+    // and output to once it speaks HTTP/2.
+    struct Server::Http2Session {
+        explicit Http2Session(ClientBase& client);
+        ~Http2Session();
+
+        void upgrade(Request& req);
+        void received(const char* data, size_t len);
+        void flush();
+        void written();
+        ClientBase::Timeout timeout() const;
+        void drain();
+        bool output_full() const;
+        void resume_body(uint32_t id);
+        void resume_response(uint32_t id);
+        void complete(uint32_t id, Response&& response);
+
+        struct Impl;
+    private:
+        std::unique_ptr<Impl> impl_;
+    };
+
+    struct Server::AcceptorBase {
+        // Closed clients are kept for reuse, along with the memory they have
+        // retained, so accepting a connection does not allocate.
+        static constexpr size_t max_pooled_clients = 1024;
+
+        Server::Loop& loop;
+        util::IntrusiveListAnchor anchor;
+        // The local address, as returned by getsockname(). Empty on Win32.
+        std::string name;
+        const bool tcp;
+        bool closed = false;
+        bool accepting = false; // An accept is in flight.
+
+        AcceptorBase(Server::Loop& loop, bool tcp) : loop(loop), tcp(tcp) {}
+        virtual ~AcceptorBase() {}
+
+        // Accepts the next connection, unless the loop has paused accepting.
+        virtual void keep_accepting() = 0;
+        // Cancels the accept in flight, for Loop::pause_accepting().
+        virtual void pause() = 0;
+        virtual void close() = 0;
+
+        // Create an acceptor in another loop listening on the same endpoint.
+        virtual AcceptorBase* clone(Server::Loop& other_loop) = 0;
+        // The same, for another socket listening on the same endpoint, which
+        // the acceptor takes ownership of.
+        virtual AcceptorBase* adopt(Server::Loop& other_loop, int fd) = 0;
+        virtual int native_handle() = 0;
+
+        // TCP_DEFER_ACCEPT (see Server::defer_accept()), where there is one.
+        void defer_accept(unsigned int seconds) {
+#if defined(TCP_DEFER_ACCEPT)
+            int timeout = int(seconds);
+            ::setsockopt(native_handle(), IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout, sizeof(timeout));
+#endif
+        }
+    };
+
+    struct ConnectionHandle::Host {};
+
+    // One event loop. Clients never leave the loop that accepted them, so
+    // nothing in here needs to be synchronized; other threads get at a
+    // client only by posting to `service` (see post_to_client()).
+    struct Server::Loop : ConnectionHandle::Host {
+        Server::Impl& server_impl;
+        asio::io_service service;
+        util::BufferPool buffer_pool{buffer_size};
+        util::IntrusiveList<ClientBase, &ClientBase::anchor> clients;
+        util::IntrusiveList<AcceptorBase, &AcceptorBase::anchor> acceptors;
+
+        // Open connections by slot, for ConnectionHandles. A slot's
+        // generation changes when its connection closes, so operations
+        // posted through stale handles find nothing, even after the client
+        // object has been reused or deleted.
+        struct ClientSlot {
+            ClientBase* client;
+            uint32_t generation;
+        };
+        std::vector<ClientSlot> client_slots;
+        std::vector<uint32_t> free_client_slots;
+
+        // Connection timeouts, in ticks of tick_ms since `started`. One timer
+        // wheel serves all of the loop's connections, driven by one asio
+        // timer, which only runs while connection timers are armed.
+        static constexpr unsigned int tick_ms = 100;
+        util::TimerWheel<ClientBase, &ClientBase::timer> timers;
+        asio::steady_timer ticker;
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        bool ticking = false;
+
+        struct alignas(64) Counters {
+            std::atomic<uint64_t> connections_accepted{0};
+            std::atomic<uint64_t> connections_closed{0};
+            std::atomic<uint64_t> requests{0};
+            std::atomic<uint64_t> parse_errors{0};
+            std::atomic<uint64_t> requests_shed{0};
+            std::atomic<uint64_t> bytes_received{0};
+            std::atomic<uint64_t> bytes_sent{0};
+        };
+        Counters counters;
+
+        // Shared by the loop's WebSocket connections with permessage-deflate,
+        // which compress every message on its own.
+        std::unique_ptr<MessageDeflate> deflate;
+
+        MessageDeflate& message_deflate() {
+            if (!deflate) {
+                deflate.reset(new MessageDeflate);
+            }
+            return *deflate;
+        }
+
+        // Set by drain(). The loop stops once its last connection has
+        // closed, or when drain_timer expires.
+        bool draining = false;
+        asio::steady_timer drain_timer;
+
+        // Admission control (see Server::max_connections()). Accepting
+        // pauses while max_clients connections are open, and when accept()
+        // fails for a lack of resources, until a connection closes or, for
+        // the latter, accept_timer expires.
+        static constexpr unsigned int accept_retry_ms = 500;
+        size_t max_clients = 0; // The loop's share of max_connections.
+        bool accepting_paused = false;
+        bool accept_failing = false; // Logged once, until an accept succeeds.
+        asio::steady_timer accept_timer;
+        // Deferred requests yet to be completed, for max_requests_in_flight.
+        size_t num_deferred_requests = 0;
+
+        // With Server::shed_load(), the probe timer waits probe_interval at
+        // a time while connections are open, and `lag` is how late it last
+        // ran: about how long whatever became ready then waited for the
+        // loop to get to it.
+        util::Codel codel;
+        std::chrono::milliseconds probe_interval{0};
+        asio::steady_timer probe_timer;
+        std::chrono::steady_clock::duration lag{0};
+        bool probing = false;
+
+        Loop(Server::Impl& impl) : server_impl(impl), ticker(service), drain_timer(service), accept_timer(service), probe_timer(service) {}
+        ~Loop();
+
+        size_t num_open_clients() const {
+            return client_slots.size() - free_client_slots.size();
+        }
+
+        void drain();
+        void stop();
+
+        void open(AcceptorBase&, ClientBase&);
+        void accept_failed(const asio_error_code&);
+        void pause_accepting();
+        void resume_accepting();
+        void keep_probing();
+        bool shed(std::chrono::steady_clock::time_point request_started);
+
+        uint64_t current_tick() const {
+            return uint64_t((std::chrono::steady_clock::now() - started) / std::chrono::milliseconds(tick_ms));
+        }
+
+        void arm(ClientBase& client, unsigned int ms) {
+            if (!ticking) {
+                // The wheel has stood still while it was empty.
+                timers.advance(current_tick(), [](ClientBase&) {});
+                ticking = true;
+                keep_ticking();
+            }
+            // The wheel lags behind the clock by up to a tick.
+            timers.schedule(client, (ms + tick_ms - 1) / tick_ms + 1);
+        }
+
+        void keep_ticking() {
+            ticker.expires_after(std::chrono::milliseconds(tick_ms));
+            ticker.async_wait([this](asio_error_code ec) {
+                if (ec) {
+                    return;
+                }
+                timers.advance(current_tick(), [](ClientBase& client) {
+                    client.timed_out();
+                });
+                if (timers.empty()) {
+                    ticking = false;
+                    return;
+                }
+                keep_ticking();
+            });
+        }
+
+        void open_slot(ClientBase& client) {
+            if (free_client_slots.empty()) {
+                client.slot = uint32_t(client_slots.size());
+                client_slots.push_back({&client, 0});
+                return;
+            }
+            client.slot = free_client_slots.back();
+            free_client_slots.pop_back();
+            client_slots[client.slot].client = &client;
+        }
+
+        void close_slot(ClientBase& client) {
+            if (client.slot == ClientBase::no_slot) {
+                return;
+            }
+            auto& entry = client_slots[client.slot];
+            entry.client = nullptr;
+            ++entry.generation;
+            free_client_slots.push_back(client.slot);
+            client.slot = ClientBase::no_slot;
+            if (accepting_paused) {
+                resume_accepting();
+            }
+            if (draining && num_open_clients() == 0) {
+                stop();
+            }
+        }
+
+        // Thread-safe: runs `fn(client)` on this loop, if the connection is
+        // still open by then.
+        template <class Function>
+        void post_to_client(uint32_t slot, uint32_t generation, Function fn) {
+            service.post([this, slot, generation, fn]() {
+                auto& entry = client_slots[slot];
+                if (entry.client && entry.generation == generation) {
+                    fn(*entry.client);
+                }
+            });
+        }
+
+#if defined(WAYWARD_WITH_IO_URING)
+        // With Server::io_uring(), the loop's ring does the socket I/O, and
+        // asio waits for its completions along with everything else.
+        // Requests carry their target, tagged with the operation in the low
+        // bits of user_data. What the loop queues is submitted at once, after
+        // the handlers that are ready have run (see queue()).
+        enum class Op : uint64_t {
+            None,
+            Accept,
+            Receive,
+            Send,
+            Poll,
+        };
+        static constexpr uint64_t op_mask = 7;
+        static constexpr unsigned int ring_entries = 1024;
+        static constexpr uint16_t ring_buffers = 1024;
+        std::unique_ptr<util::IoUring> ring;
+        std::unique_ptr<asio::posix::stream_descriptor> ring_events;
+        bool submit_posted = false;
+
+        // Closed io_uring clients, for reuse (see Acceptor::pooled_clients).
+        util::IntrusiveList<ClientBase, &ClientBase::anchor> pooled_uring_clients;
+        size_t num_pooled_uring_clients = 0;
+
+        void start_uring();
+        io_uring_sqe& queue(void* target, Op op);
+        void cancel(void* target, Op op);
+        void watch_ring();
+        void complete(const io_uring_cqe&);
+        void accept(AcceptorBase&);
+        void accepted(AcceptorBase&, const io_uring_cqe&);
+        void recycle(UringClient*);
+#endif
+    };
+
+    struct Server::Impl {
+        // The first loop exists from the start and owns the acceptors created
+        // by listen(). The rest are created by run().
+        std::vector<std::unique_ptr<Loop>> loops;
+        unsigned int num_threads = 1;
+        size_t max_body_size = Request::default_max_body_size;
+        unsigned int header_timeout_ms = 10000;
+        unsigned int body_timeout_ms = 30000;
+        unsigned int idle_timeout_ms = 60000;
+        unsigned int write_timeout_ms = 30000;
+
+        unsigned int drain_timeout_ms = 30000;
+        size_t max_connections = 0;
+        size_t max_requests_in_flight = 0;
+        unsigned int shed_target_ms = 0;
+        unsigned int shed_interval_ms = 100;
+        unsigned int accept_batch = 16;
+        bool no_delay = true;
+        unsigned int defer_accept_s = 0;
+        bool use_io_uring = false;
+        bool http2 = false;
+
+        IRequestResponder* responder = nullptr;
+
+        // Guards `loops` while run() adds to it, `stopping`, and the
+        // listening sockets while they are handed over.
+        std::mutex mutex;
+        bool stopping = false;
+        // Sockets from listen_fd() listening on an endpoint the first loop
+        // already accepts from, for the loops run() creates.
+        std::vector<int> spare_fds;
+
+#if !defined(_MSC_VER)
+        // See Server::allow_takeover(). On the first loop, and destroyed
+        // before it.
+        std::unique_ptr<asio::local::stream_protocol::acceptor> takeover;
+        std::unique_ptr<asio::local::stream_protocol::socket> successor;
+        void wait_for_successor();
+        void hand_over();
+#endif
+
+        Impl();
+        ~Impl();
+        void stop();
+    };
+}
@@ -0,0 +1,335 @@
+#include "wayward/sse.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace wayward {
+    namespace {
+        using Buffer = std::shared_ptr<const std::string>;
+
+        // The producer of one subscriber's event stream. Publishers push
+        // events from any thread; the connection takes all that are queued
+        // whenever it has written the previous ones, and otherwise waits to
+        // be resumed by the next push.
+        struct Subscriber : IBodyProducer {
+            const size_t max_queued;
+            const EventChannels::Overflow overflow;
+            const ConnectionHandle connection;
+
+            std::mutex mutex;
+            std::deque<Buffer> queue;
+            bool waiting = false;
+            bool evicted = false;
+
+            Subscriber(size_t max_queued, EventChannels::Overflow overflow, ConnectionHandle connection)
+                : max_queued(max_queued), overflow(overflow), connection(connection) {}
+
+            // Returns false if the subscriber has been evicted, by this
+            // event or before.
+            bool push(const Buffer& event, std::atomic<uint64_t>& num_evicted) {
+                bool resume;
+                bool queued;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (evicted) {
+                        return false;
+                    }
+                    if (queue.size() >= max_queued) {
+                        if (overflow == EventChannels::Overflow::Evict) {
+                            evicted = true;
+                            ++num_evicted;
+                        }
+                        else {
+                            queue.pop_front();
+                        }
+                    }
+                    queued = !evicted;
+                    if (queued) {
+                        queue.push_back(event);
+                    }
+                    resume = waiting;
+                    waiting = false;
+                }
+                if (resume) {
+                    connection.resume_response();
+                }
+                return queued;
+            }
+
+            State produce_shared(std::string&, std::vector<Buffer>& shared) override {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto& event: queue) {
+                    shared.push_back(std::move(event));
+                }
+                queue.clear();
+                if (evicted) {
+                    return Done;
+                }
+                waiting = true;
+                return Waiting;
+            }
+
+            State produce(std::string& out) override {
+                std::vector<Buffer> shared;
+                State state = produce_shared(out, shared);
+                for (auto& event: shared) {
+                    out += *event;
+                }
+                return state;
+            }
+        };
+
+        struct Topic {
+            struct Past {
+                std::string id;
+                Buffer event;
+            };
+
+            // Guards the rest. Taken after the shard's lock, if both are.
+            std::mutex mutex;
+            // Pruned of closed and evicted subscribers by publish().
+            std::vector<std::weak_ptr<Subscriber>> subscribers;
+            std::deque<Past> history;
+            // Set once the topic has been dropped from its shard; a publisher
+            // that still holds it looks it up again.
+            bool removed = false;
+
+            // Held by publish() while it pushes an event to the subscribers,
+            // outside of `mutex`, so that the events of concurrent publishers
+            // reach every subscriber in the same order.
+            std::mutex order;
+        };
+    }
+
+    struct EventChannels::Impl {
+        Options options;
+        Buffer retry; // The "retry" field, if set.
+
+        // Topics are spread over shards by name, so publishers to different
+        // topics do not wait for each other.
+        static constexpr size_t num_shards = 16;
+        struct alignas(64) Shard {
+            mutable std::mutex mutex;
+            std::map<std::string, std::shared_ptr<Topic>, std::less<>> topics;
+        };
+        Shard shards[num_shards];
+        std::atomic<uint64_t> num_evicted{0};
+
+        Shard& shard_for(std::string_view name) {
+            return shards[std::hash<std::string_view>()(name) % num_shards];
+        }
+
+        const Shard& shard_for(std::string_view name) const {
+            return shards[std::hash<std::string_view>()(name) % num_shards];
+        }
+
+        // The topic, created if `create`; otherwise null if there is none.
+        std::shared_ptr<Topic> find(std::string_view name, bool create) {
+            auto& shard = shard_for(name);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.topics.find(name);
+            if (it != shard.topics.end()) {
+                return it->second;
+            }
+            if (!create) {
+                return nullptr;
+            }
+            auto topic = std::make_shared<Topic>();
+            shard.topics.emplace(std::string(name), topic);
+            return topic;
+        }
+
+        // Drops the topic if nobody subscribes to it and it keeps no
+        // history.
+        void remove_if_unused(std::string_view name, Topic& topic) {
+            auto& shard = shard_for(name);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            std::lock_guard<std::mutex> topic_lock(topic.mutex);
+            if (topic.removed || !topic.subscribers.empty() || !topic.history.empty()) {
+                return;
+            }
+            topic.removed = true;
+            shard.topics.erase(shard.topics.find(name));
+        }
+    };
+
+    EventChannels::EventChannels() : EventChannels(Options()) {}
+
+    EventChannels::EventChannels(Options options) : impl_(new Impl) {
+        impl_->options = options;
+        if (options.retry_ms > 0) {
+            impl_->retry = std::make_shared<const std::string>("retry: " + std::to_string(options.retry_ms) + "\n\n");
+        }
+    }
+
+    EventChannels::~EventChannels() {}
+
+    void EventChannels::subscribe(Request& req, Response& res, std::string_view name) {
+        auto& options = impl_->options;
+        auto subscriber = std::make_shared<Subscriber>(options.max_queued_events, options.overflow, req.connection);
+        if (impl_->retry) {
+            subscriber->queue.push_back(impl_->retry);
+        }
+        auto last_id = req.header(HeaderId::LastEventId);
+        {
+            // The shard stays locked, so the topic cannot be dropped before
+            // the subscriber is in.
+            auto& shard = impl_->shard_for(name);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.topics.find(name);
+            if (it == shard.topics.end()) {
+                it = shard.topics.emplace(std::string(name), std::make_shared<Topic>()).first;
+            }
+            auto& topic = *it->second;
+            std::lock_guard<std::mutex> topic_lock(topic.mutex);
+            if (!last_id.empty()) {
+                auto past = topic.history.end();
+                while (past != topic.history.begin()) {
+                    --past;
+                    if (past->id == last_id) {
+                        for (++past; past != topic.history.end(); ++past) {
+                            subscriber->queue.push_back(past->event);
+                        }
+                        break;
+                    }
+                }
+            }
+            auto& subscribers = topic.subscribers;
+            if (subscribers.size() == subscribers.capacity()) {
+                // Before the vector grows, so a topic that is seldom
+                // published to does not pile up closed subscribers.
+                subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(), [](const std::weak_ptr<Subscriber>& s) {
+                    return s.expired();
+                }), subscribers.end());
+            }
+            subscribers.push_back(subscriber);
+        }
+        res.status = Status::OK;
+        res.set_header(HeaderId::ContentType, "text/event-stream");
+        res.set_header(HeaderId::CacheControl, "no-cache");
+        res.body_producer = std::move(subscriber);
+    }
+
+    size_t EventChannels::publish(std::string_view name, std::string_view data, std::string_view event, std::string_view id) {
+        std::string encoded;
+        encode_event(encoded, data, event, id);
+        auto buffer = std::make_shared<const std::string>(std::move(encoded));
+        bool keep = impl_->options.history > 0 && !id.empty();
+
+        // The subscribers are taken out under the topic's lock, and pushed
+        // to (which may wake up their connections) outside of it, so that
+        // subscribing does not wait for that.
+        std::vector<std::shared_ptr<Subscriber>> subscribers;
+        std::shared_ptr<Topic> topic;
+        std::unique_lock<std::mutex> order;
+        bool gone = false; // Some subscriber is to be pruned.
+        for (;;) {
+            topic = impl_->find(name, keep);
+            if (!topic) {
+                return 0;
+            }
+            order = std::unique_lock<std::mutex>(topic->order);
+            std::lock_guard<std::mutex> lock(topic->mutex);
+            if (topic->removed) {
+                order.unlock();
+                continue;
+            }
+            if (keep) {
+                topic->history.push_back({std::string(id), buffer});
+                if (topic->history.size() > impl_->options.history) {
+                    topic->history.pop_front();
+                }
+            }
+            subscribers.reserve(topic->subscribers.size());
+            for (auto& subscriber: topic->subscribers) {
+                if (auto locked = subscriber.lock()) {
+                    subscribers.push_back(std::move(locked));
+                }
+            }
+            gone = subscribers.size() < topic->subscribers.size();
+            break;
+        }
+
+        size_t count = 0;
+        for (auto& subscriber: subscribers) {
+            if (subscriber->push(buffer, impl_->num_evicted)) {
+                ++count;
+            }
+            else {
+                gone = true;
+            }
+        }
+        order.unlock();
+        if (gone) {
+            bool unused;
+            {
+                std::lock_guard<std::mutex> lock(topic->mutex);
+                auto& all = topic->subscribers;
+                all.erase(std::remove_if(all.begin(), all.end(), [](const std::weak_ptr<Subscriber>& s) {
+                    auto subscriber = s.lock();
+                    if (!subscriber) {
+                        return true;
+                    }
+                    std::lock_guard<std::mutex> lock(subscriber->mutex);
+                    return subscriber->evicted;
+                }), all.end());
+                unused = all.empty() && topic->history.empty();
+            }
+            if (unused) {
+                impl_->remove_if_unused(name, *topic);
+            }
+        }
+        return count;
+    }
+
+    size_t EventChannels::num_subscribers(std::string_view name) const {
+        auto& shard = impl_->shard_for(name);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.topics.find(name);
+        if (it == shard.topics.end()) {
+            return 0;
+        }
+        auto& topic = *it->second;
+        std::lock_guard<std::mutex> topic_lock(topic.mutex);
+        size_t count = 0;
+        for (auto& subscriber: topic.subscribers) {
+            count += subscriber.expired() ? 0 : 1;
+        }
+        return count;
+    }
+
+    uint64_t EventChannels::num_evicted() const {
+        return impl_->num_evicted;
+    }
+
+    void encode_event(std::string& out, std::string_view data, std::string_view event, std::string_view id) {
+        if (!id.empty()) {
+            out += "id: ";
+            out += id;
+            out += '\n';
+        }
+        if (!event.empty()) {
+            out += "event: ";
+            out += event;
+            out += '\n';
+        }
+        // Lines may end with CRLF, LF or CR.
+        size_t start = 0;
+        for (;;) {
+            size_t end = data.find_first_of("\r\n", start);
+            out += "data: ";
+            out += data.substr(start, end - start);
+            out += '\n';
+            if (end == std::string_view::npos) {
+                break;
+            }
+            start = end + (data[end] == '\r' && end + 1 < data.size() && data[end + 1] == '\n' ? 2 : 1);
+        }
+        out += '\n';
+    }
+}
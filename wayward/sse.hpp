@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <stddef.h>
+#include <string>
+#include <string_view>
+
+#include <wayward/def.hpp>
+#include <wayward/http.hpp>
+
+namespace wayward {
+    // Server-Sent Events (the text/event-stream format of the HTML standard)
+    // for many subscribers at once. A responder subscribes its connection to
+    // a topic with subscribe(), which answers with an event stream that
+    // stays open. publish() encodes an event once, into a buffer that the
+    // streams of all the topic's subscribers write from, without copying it
+    // (see IBodyProducer::produce_shared()), and releases it with the last
+    // of them.
+    //
+    // Every subscriber has a bounded queue of the events it has not been
+    // sent yet, which only fills up while its connection cannot keep up.
+    // When it is full, the subscriber is evicted, or loses its oldest
+    // events (see Overflow). All of it is thread-safe. Topics are locked
+    // on their own, and only while their subscribers are taken out, not
+    // while events are pushed to them.
+    struct WAYWARD_EXPORT EventChannels {
+        enum class Overflow {
+            // The stream ends once the queued events have been written. The
+            // client's EventSource reconnects, sending the ID of the last
+            // event it has received, and gets whatever it missed that is
+            // still in the topic's history.
+            Evict,
+            // The oldest queued event is dropped for the new one.
+            DropOldest,
+        };
+
+        struct Options {
+            size_t max_queued_events = 256;
+            Overflow overflow = Overflow::Evict;
+            // Events with an ID that each topic keeps for clients that
+            // reconnect with Last-Event-ID.
+            size_t history = 0;
+            // Sent at the start of every stream as its "retry" field: how
+            // long clients wait before reconnecting. 0 leaves it to them.
+            unsigned int retry_ms = 0;
+        };
+
+        EventChannels();
+        explicit EventChannels(Options);
+        ~EventChannels();
+
+        // Answers the request with an event stream of `topic`, replaying
+        // the events after the request's Last-Event-ID from the history.
+        // The subscription ends with the response.
+        void subscribe(Request&, Response&, std::string_view topic);
+
+        // Queues an event to every subscriber of `topic`, and returns how
+        // many there are. Events published to a topic reach each subscriber
+        // in the order of the calls. `event` and `id` must not contain line
+        // breaks.
+        size_t publish(std::string_view topic, std::string_view data, std::string_view event = std::string_view(), std::string_view id = std::string_view());
+
+        size_t num_subscribers(std::string_view topic) const;
+        // Subscribers evicted so far (see Overflow::Evict).
+        uint64_t num_evicted() const;
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
+
+    // Appends an event in the text/event-stream format, with a "data" line
+    // for every line of `data`. Exposed for testing.
+    void WAYWARD_EXPORT encode_event(std::string& out, std::string_view data, std::string_view event = std::string_view(), std::string_view id = std::string_view());
+}
@@ -0,0 +1,496 @@
+#include "wayward/static_files.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+#if !defined(_MSC_VER)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace wayward {
+    namespace {
+        using Clock = std::chrono::steady_clock;
+
+        struct MimeType {
+            std::string_view extension;
+            std::string_view type;
+        };
+
+        constexpr MimeType mime_types[] = {
+            {"css", "text/css; charset=utf-8"},
+            {"csv", "text/csv; charset=utf-8"},
+            {"gif", "image/gif"},
+            {"htm", "text/html; charset=utf-8"},
+            {"html", "text/html; charset=utf-8"},
+            {"ico", "image/x-icon"},
+            {"jpeg", "image/jpeg"},
+            {"jpg", "image/jpeg"},
+            {"js", "text/javascript; charset=utf-8"},
+            {"json", "application/json"},
+            {"mjs", "text/javascript; charset=utf-8"},
+            {"mp4", "video/mp4"},
+            {"pdf", "application/pdf"},
+            {"png", "image/png"},
+            {"svg", "image/svg+xml"},
+            {"txt", "text/plain; charset=utf-8"},
+            {"wasm", "application/wasm"},
+            {"webp", "image/webp"},
+            {"woff", "font/woff"},
+            {"woff2", "font/woff2"},
+            {"xml", "application/xml"},
+        };
+
+        std::string_view content_type(std::string_view path) {
+            auto dot = path.rfind('.');
+            if (dot != std::string_view::npos && path.find('/', dot) == std::string_view::npos) {
+                auto extension = path.substr(dot + 1);
+                for (auto& mime: mime_types) {
+                    if (iequals(mime.extension, extension)) {
+                        return mime.type;
+                    }
+                }
+            }
+            return "application/octet-stream";
+        }
+
+        int hex_value(char c) {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            return -1;
+        }
+
+        // Decodes %XX escapes. Fails on malformed escapes, NUL, backslashes,
+        // and "." or ".." segments, so the result cannot leave the root.
+        bool decode_path(std::string_view in, std::string& out) {
+            out.clear();
+            for (size_t i = 0; i < in.size(); ++i) {
+                char c = in[i];
+                if (c == '%') {
+                    if (i + 2 >= in.size()) {
+                        return false;
+                    }
+                    int high = hex_value(in[i + 1]);
+                    int low = hex_value(in[i + 2]);
+                    if (high < 0 || low < 0) {
+                        return false;
+                    }
+                    c = char(high * 16 + low);
+                    i += 2;
+                }
+                if (c == '\0' || c == '\\') {
+                    return false;
+                }
+                out += c;
+            }
+            size_t start = 0;
+            while (start <= out.size()) {
+                size_t end = std::min(out.find('/', start), out.size());
+                auto segment = std::string_view(out).substr(start, end - start);
+                if (segment == "." || segment == "..") {
+                    return false;
+                }
+                start = end + 1;
+            }
+            return true;
+        }
+
+        std::string_view trim(std::string_view str) {
+            while (!str.empty() && (str.front() == ' ' || str.front() == '\t')) {
+                str.remove_prefix(1);
+            }
+            while (!str.empty() && (str.back() == ' ' || str.back() == '\t')) {
+                str.remove_suffix(1);
+            }
+            return str;
+        }
+
+        // If-None-Match lists entity tags, which are compared weakly.
+        bool etag_matches(std::string_view list, std::string_view etag) {
+            while (!list.empty()) {
+                auto comma = list.find(',');
+                auto tag = trim(list.substr(0, comma));
+                if (tag == "*") {
+                    return true;
+                }
+                if (tag.substr(0, 2) == "W/") {
+                    tag.remove_prefix(2);
+                }
+                if (tag == etag) {
+                    return true;
+                }
+                if (comma == std::string_view::npos) {
+                    break;
+                }
+                list.remove_prefix(comma + 1);
+            }
+            return false;
+        }
+
+        bool parse_number(std::string_view digits, uint64_t& value) {
+            auto end = digits.data() + digits.size();
+            auto result = std::from_chars(digits.data(), end, value);
+            return !digits.empty() && result.ec == std::errc() && result.ptr == end;
+        }
+
+        enum class Range {
+            Full,
+            Partial,
+            Unsatisfiable,
+        };
+
+        // Only single "bytes=" ranges are served. Anything else gets the full
+        // file, as servers are free to ignore Range.
+        Range parse_range(std::string_view header, uint64_t size, uint64_t& first, uint64_t& last) {
+            constexpr std::string_view unit = "bytes=";
+            if (header.substr(0, unit.size()) != unit || header.find(',') != std::string_view::npos) {
+                return Range::Full;
+            }
+            auto spec = trim(header.substr(unit.size()));
+            auto dash = spec.find('-');
+            if (dash == std::string_view::npos) {
+                return Range::Full;
+            }
+            auto from = spec.substr(0, dash);
+            auto to = spec.substr(dash + 1);
+            if (from.empty()) {
+                // The last `suffix` bytes.
+                uint64_t suffix;
+                if (!parse_number(to, suffix)) {
+                    return Range::Full;
+                }
+                if (suffix == 0 || size == 0) {
+                    return Range::Unsatisfiable;
+                }
+                first = size - std::min(suffix, size);
+                last = size - 1;
+                return Range::Partial;
+            }
+            if (!parse_number(from, first)) {
+                return Range::Full;
+            }
+            if (!to.empty() && (!parse_number(to, last) || last < first)) {
+                return Range::Full;
+            }
+            if (first >= size) {
+                return Range::Unsatisfiable;
+            }
+            last = to.empty() ? size - 1 : std::min(last, size - 1);
+            return Range::Partial;
+        }
+
+        // A version of a file, and the header values derived from it.
+        struct FileInfo {
+            uint64_t size = 0;
+            int64_t mtime = 0;
+            uint64_t inode = 0;
+            std::string etag;
+            std::string last_modified;
+            std::string_view content_type;
+        };
+
+        // IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT", independent of
+        // the locale.
+        std::string http_date(time_t time) {
+            static const char* const days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+            static const char* const months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+            struct tm tm;
+#if defined(_MSC_VER)
+            gmtime_s(&tm, &time);
+#else
+            gmtime_r(&time, &tm);
+#endif
+            char buffer[32];
+            std::snprintf(buffer, sizeof(buffer), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+            return buffer;
+        }
+
+        bool not_modified(const Request& req, const FileInfo& info) {
+            auto none_match = req.header(HeaderId::IfNoneMatch);
+            if (!none_match.empty()) {
+                return etag_matches(none_match, info.etag);
+            }
+            auto since = req.header(HeaderId::IfModifiedSince);
+            return !since.empty() && since == info.last_modified;
+        }
+
+        // Fills in status and headers. Returns false if no body is to be
+        // sent, and otherwise the part of the file that is. Header values
+        // are copied into the response, unless `info` outlives it.
+        bool prepare(const Request& req, Response& res, const FileInfo& info, bool info_outlives, uint64_t& offset, uint64_t& length) {
+            auto add = [&](HeaderId id, std::string_view value) {
+                if (info_outlives) {
+                    res.headers.emplace_back(id, value);
+                }
+                else {
+                    res.set_header(id, value);
+                }
+            };
+            res.status = Status::OK;
+            add(HeaderId::ETag, info.etag);
+            add(HeaderId::LastModified, info.last_modified);
+            if (not_modified(req, info)) {
+                res.status = Status::NotModified;
+                return false;
+            }
+            res.headers.emplace_back(HeaderId::ContentType, info.content_type);
+            res.headers.emplace_back(HeaderId::AcceptRanges, "bytes");
+            offset = 0;
+            length = info.size;
+
+            auto range = req.header(HeaderId::Range);
+            if (range.empty() || req.method != Method::Get) {
+                return true;
+            }
+            auto if_range = req.header(HeaderId::IfRange);
+            if (!if_range.empty() && if_range != info.etag && if_range != info.last_modified) {
+                return true;
+            }
+            uint64_t first = 0, last = 0;
+            char content_range[64];
+            switch (parse_range(range, info.size, first, last)) {
+                case Range::Full:
+                    return true;
+                case Range::Unsatisfiable:
+                    res.status = Status::RangeNotSatisfiable;
+                    std::snprintf(content_range, sizeof(content_range), "bytes */%llu", (unsigned long long)info.size);
+                    res.set_header(HeaderId::ContentRange, content_range);
+                    return false;
+                case Range::Partial:
+                    res.status = Status::PartialContent;
+                    std::snprintf(content_range, sizeof(content_range), "bytes %llu-%llu/%llu",
+                        (unsigned long long)first, (unsigned long long)last, (unsigned long long)info.size);
+                    res.set_header(HeaderId::ContentRange, content_range);
+                    offset = first;
+                    length = last - first + 1;
+                    return true;
+            }
+            return true;
+        }
+
+#if !defined(_MSC_VER)
+        FileInfo file_info(const struct stat& st, std::string_view path) {
+            FileInfo info;
+            info.size = uint64_t(st.st_size);
+            info.mtime = int64_t(st.st_mtime);
+            info.inode = uint64_t(st.st_ino);
+            char etag[48];
+            std::snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (unsigned long long)info.mtime, (unsigned long long)info.size);
+            info.etag = etag;
+            info.last_modified = http_date(st.st_mtime);
+            info.content_type = content_type(path);
+            return info;
+        }
+
+        bool same_version(const FileInfo& info, const struct stat& st) {
+            return S_ISREG(st.st_mode) && info.size == uint64_t(st.st_size) && info.mtime == int64_t(st.st_mtime) && info.inode == uint64_t(st.st_ino);
+        }
+
+        bool read_file(int fd, std::string& data, uint64_t size) {
+            data.resize(size_t(size));
+            size_t done = 0;
+            while (done < data.size()) {
+                ssize_t len = ::pread(fd, &data[done], data.size() - done, off_t(done));
+                if (len < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (len <= 0) {
+                    return false;
+                }
+                done += size_t(len);
+            }
+            return true;
+        }
+#endif
+    }
+
+    struct StaticFiles::Impl {
+        std::string root;
+        size_t max_cached_file_size = 64 * 1024;
+        size_t cache_size = 16 * 1024 * 1024;
+        Clock::duration revalidate_after = std::chrono::seconds(1);
+        std::string index_file = "index.html";
+
+        // Immutable once cached, except for `checked`, which is guarded by
+        // the mutex. Responses hold on to the entry they send from.
+        struct Cached {
+            std::string path;
+            FileInfo info;
+            std::string data;
+            Clock::time_point checked;
+        };
+        using Lru = std::list<std::shared_ptr<Cached>>;
+
+        std::mutex mutex;
+        Lru lru; // Most recently used first.
+        std::unordered_map<std::string_view, Lru::iterator> index; // By Cached::path.
+        size_t cached_bytes = 0;
+
+        // Returns the cached file, if it has been checked recently enough, or
+        // is still the same after checking it again now.
+        std::shared_ptr<Cached> lookup(const std::string& path, Clock::time_point now);
+        void insert(std::shared_ptr<Cached> entry);
+        void erase(Lru::iterator it);
+    };
+
+    std::shared_ptr<StaticFiles::Impl::Cached> StaticFiles::Impl::lookup(const std::string& path, Clock::time_point now) {
+        std::shared_ptr<Cached> entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(path);
+            if (it == index.end()) {
+                return nullptr;
+            }
+            lru.splice(lru.begin(), lru, it->second);
+            entry = *it->second;
+            if (now - entry->checked < revalidate_after) {
+                return entry;
+            }
+        }
+#if !defined(_MSC_VER)
+        struct stat st;
+        bool unchanged = ::stat(path.c_str(), &st) == 0 && same_version(entry->info, st);
+#else
+        bool unchanged = false;
+#endif
+        std::lock_guard<std::mutex> lock(mutex);
+        if (unchanged) {
+            entry->checked = now;
+            return entry;
+        }
+        auto it = index.find(path);
+        if (it != index.end() && *it->second == entry) {
+            erase(it->second);
+        }
+        return nullptr;
+    }
+
+    void StaticFiles::Impl::insert(std::shared_ptr<Cached> entry) {
+        size_t size = entry->data.size();
+        if (size > cache_size) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(entry->path);
+        if (it != index.end()) {
+            erase(it->second);
+        }
+        while (cached_bytes + size > cache_size) {
+            erase(std::prev(lru.end()));
+        }
+        lru.push_front(std::move(entry));
+        index.emplace(lru.front()->path, lru.begin());
+        cached_bytes += size;
+    }
+
+    void StaticFiles::Impl::erase(Lru::iterator it) {
+        cached_bytes -= (*it)->data.size();
+        index.erase((*it)->path);
+        lru.erase(it);
+    }
+
+    StaticFiles::StaticFiles(std::string root) : impl_(std::make_shared<Impl>()) {
+#if defined(_MSC_VER)
+        throw std::runtime_error("Static files not supported on Win32.");
+#endif
+        while (root.size() > 1 && root.back() == '/') {
+            root.pop_back();
+        }
+        impl_->root = std::move(root);
+    }
+
+    StaticFiles::~StaticFiles() {}
+
+    StaticFiles& StaticFiles::max_cached_file_size(size_t bytes) {
+        impl_->max_cached_file_size = bytes;
+        return *this;
+    }
+
+    StaticFiles& StaticFiles::cache_size(size_t bytes) {
+        impl_->cache_size = bytes;
+        return *this;
+    }
+
+    StaticFiles& StaticFiles::revalidate_ms(unsigned int ms) {
+        impl_->revalidate_after = std::chrono::milliseconds(ms);
+        return *this;
+    }
+
+    StaticFiles& StaticFiles::index_file(std::string name) {
+        impl_->index_file = std::move(name);
+        return *this;
+    }
+
+    void StaticFiles::operator()(Request& req, Response& res) const {
+#if defined(_MSC_VER)
+        res.status = Status::NotImplemented;
+#else
+        auto& impl = *impl_;
+        std::string path;
+        if (!decode_path(req.param("path"), path)) {
+            res.status = Status::NotFound;
+            return;
+        }
+        if (path.empty() || path.back() == '/') {
+            path += impl.index_file;
+        }
+        path.insert(0, impl.root + '/');
+
+        uint64_t offset = 0, length = 0;
+        auto now = Clock::now();
+        if (auto entry = impl.lookup(path, now)) {
+            res.shared_owner = entry;
+            if (prepare(req, res, entry->info, true, offset, length)) {
+                res.shared_body = std::string_view(entry->data).substr(size_t(offset), size_t(length));
+            }
+            return;
+        }
+
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            res.status = errno == EACCES ? Status::Forbidden : Status::NotFound;
+            return;
+        }
+        auto file = std::make_shared<File>(fd);
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            res.status = Status::NotFound;
+            return;
+        }
+
+        if (uint64_t(st.st_size) <= impl.max_cached_file_size) {
+            auto entry = std::make_shared<Impl::Cached>();
+            entry->path = path;
+            entry->info = file_info(st, path);
+            entry->checked = now;
+            if (!read_file(fd, entry->data, entry->info.size)) {
+                res.status = Status::InternalServerError;
+                return;
+            }
+            impl.insert(entry);
+            res.shared_owner = entry;
+            if (prepare(req, res, entry->info, true, offset, length)) {
+                res.shared_body = std::string_view(entry->data).substr(size_t(offset), size_t(length));
+            }
+            return;
+        }
+
+        auto info = file_info(st, path);
+        if (prepare(req, res, info, false, offset, length)) {
+            res.file = std::move(file);
+            res.file_offset = offset;
+            res.file_length = length;
+        }
+#endif
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <wayward/http.hpp>
+
+namespace wayward {
+    // Serves the files below a root directory, as a handler for App::mount().
+    // The file path is the "path" capture of the route.
+    //
+    // Files up to max_cached_file_size are read once and kept in memory,
+    // along with their header values, in a cache of at most cache_size
+    // bytes that drops the least recently used files first. Cached files
+    // are checked for changes at most once per revalidate_ms. Larger files
+    // are sent straight from the page cache with sendfile(2).
+    //
+    // Responses carry an ETag and Last-Modified, answer If-None-Match and
+    // If-Modified-Since with 304 Not Modified, and serve single byte ranges
+    // (Range, If-Range). Paths with ".." segments are not found.
+    //
+    // Copies share the same cache, which is thread-safe.
+    struct WAYWARD_EXPORT StaticFiles {
+        explicit StaticFiles(std::string root);
+        ~StaticFiles();
+
+        StaticFiles& max_cached_file_size(size_t bytes); // Default 64 KiB.
+        StaticFiles& cache_size(size_t bytes);           // Default 16 MiB.
+        StaticFiles& revalidate_ms(unsigned int ms);     // Default 1000.
+        // Served for paths ending in '/'. Default "index.html".
+        StaticFiles& index_file(std::string name);
+
+        void operator()(Request&, Response&) const;
+
+    private:
+        struct Impl;
+        std::shared_ptr<Impl> impl_;
+    };
+}
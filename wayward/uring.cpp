@@ -0,0 +1,480 @@
+#include "wayward/server_impl.hpp"
+
+#if defined(WAYWARD_WITH_IO_URING)
+#include <climits> // IOV_MAX
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+
+namespace wayward {
+    // A connection of the io_uring backend, over either protocol. The loop's
+    // ring does all I/O on the socket.
+    //
+    // One multishot receive delivers data into the ring's buffers as it
+    // arrives. It is copied into recv_buffer, and the ring's buffer goes
+    // back right away. Data that arrives while the client is not reading
+    // waits in `backlog`; beyond max_backlog, the receive is cancelled until
+    // the backlog has been consumed.
+    struct Server::UringClient : Server::ClientBase {
+        using Op = Loop::Op;
+
+        int fd = -1;
+        // Requests that have yet to complete for the last time. The client
+        // is recycled only once there are none.
+        unsigned int num_ops = 0;
+        bool receiving = false;
+        bool cancelling = false;
+        bool received_all = false; // EOF, after the backlog
+        bool discarding = false; // see linger()
+        bool released = false;
+        bool recycling = false;
+        size_t discarded = 0;
+        std::string backlog;
+        static constexpr size_t max_backlog = 4 * buffer_size;
+        std::vector<iovec> iovecs;
+        size_t next_iovec = 0;
+        msghdr message;
+
+        explicit UringClient(Server::Loop& loop) : ClientBase(loop) {}
+
+        void start(int socket) {
+            fd = socket;
+            receiving = false;
+            cancelling = false;
+            received_all = false;
+            discarding = false;
+            released = false;
+            recycling = false;
+            discarded = 0;
+            backlog.clear();
+        }
+
+        void close() final {
+            if (closed) {
+                return;
+            }
+            closed = true;
+            increment(loop.counters.connections_closed);
+            loop.timers.cancel(*this);
+            timeout = Timeout::None;
+            if (num_ops > 0) {
+                // Requests in flight hold the socket open. The ring closes
+                // it once they are cancelled, so its number cannot be
+                // reused by an accept in between.
+                auto& cancel = loop.queue(nullptr, Op::None);
+                cancel.opcode = IORING_OP_ASYNC_CANCEL;
+                cancel.fd = fd;
+                cancel.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+                cancel.flags = IOSQE_IO_HARDLINK;
+                auto& close = loop.queue(nullptr, Op::None);
+                close.opcode = IORING_OP_CLOSE;
+                close.fd = fd;
+            }
+            else {
+                ::close(fd);
+            }
+            fd = -1;
+            websocket_closed();
+            if (!deferred) {
+                release();
+            }
+        }
+
+        void drop() final {
+            struct linger no_linger = {1, 0};
+            ::setsockopt(fd, SOL_SOCKET, SO_LINGER, &no_linger, sizeof(no_linger));
+            close();
+        }
+
+        void set_no_delay() final {
+            int enable = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        }
+
+        void release() final {
+            loop.close_slot(*this);
+            released = true;
+            recycle_when_done();
+        }
+
+        void recycle_when_done() {
+            if (!released || num_ops > 0 || recycling) {
+                return;
+            }
+            recycling = true;
+            UringClient* dead_client = this;
+            loop.service.post([dead_client]() {
+                dead_client->loop.recycle(dead_client);
+            });
+        }
+
+        void linger() final {
+            if (::shutdown(fd, SHUT_WR) != 0) {
+                close();
+                return;
+            }
+            discarding = true;
+            discarded = backlog.size();
+            backlog.clear();
+            if (received_all || discarded >= max_lingering_bytes) {
+                close();
+                return;
+            }
+            if (!receiving) {
+                receive();
+            }
+        }
+
+        void keep_reading() final {
+            reading = true;
+            if (!backlog.empty() || received_all) {
+                loop.service.post([this]() {
+                    read_backlog();
+                });
+                return;
+            }
+            if (!receiving) {
+                receive();
+            }
+        }
+
+        void read_backlog() {
+            if (closed || !reading) {
+                return;
+            }
+            reading = false;
+            if (backlog.empty()) {
+                received_eof();
+                return;
+            }
+            acquire_recv_buffer();
+            size_t len = std::min(backlog.size(), recv_capacity());
+            std::memcpy(recv_begin(), backlog.data(), len);
+            backlog.erase(0, len);
+            received_at = std::chrono::steady_clock::now();
+            received(len);
+        }
+
+        void receive() {
+            auto& sqe = loop.queue(this, Op::Receive);
+            sqe.opcode = IORING_OP_RECV;
+            sqe.fd = fd;
+            sqe.ioprio = IORING_RECV_MULTISHOT;
+            sqe.flags = IOSQE_BUFFER_SELECT;
+            sqe.buf_group = util::IoUring::buffer_group;
+            ++num_ops;
+            receiving = true;
+        }
+
+        void on_receive(const io_uring_cqe& cqe) {
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                receiving = false;
+                cancelling = false;
+                --num_ops;
+            }
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                uint16_t id = util::IoUring::buffer_id(cqe);
+                if (cqe.res > 0 && !closed) {
+                    arrived(loop.ring->buffer(id), size_t(cqe.res));
+                }
+                loop.ring->give_back(id);
+            }
+            if (closed) {
+                return;
+            }
+            if (cqe.res == 0) {
+                if (discarding) {
+                    close();
+                    return;
+                }
+                received_all = true;
+                if (reading && backlog.empty()) {
+                    reading = false;
+                    received_eof();
+                }
+                return;
+            }
+            // Out of buffers, or cancelled for backpressure: receive again
+            // when there is room.
+            if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+                if (cqe.res != -ECONNRESET) {
+                    std::cerr << "socket error: " << std::strerror(-cqe.res) << "\n";
+                }
+                close();
+                return;
+            }
+            if (!receiving && (discarding || (reading && backlog.empty()))) {
+                receive();
+            }
+        }
+
+        void arrived(const char* data, size_t len) {
+            increment(loop.counters.bytes_received, len);
+            if (discarding) {
+                discarded += len;
+                if (discarded >= max_lingering_bytes) {
+                    close();
+                }
+                return;
+            }
+            if (reading && backlog.empty()) {
+                reading = false;
+                acquire_recv_buffer();
+                size_t direct = std::min(len, recv_capacity());
+                std::memcpy(recv_begin(), data, direct);
+                backlog.append(data + direct, len - direct);
+                received_at = std::chrono::steady_clock::now();
+                received(direct);
+            }
+            else {
+                backlog.append(data, len);
+            }
+            if (backlog.size() > max_backlog && receiving && !cancelling && !closed) {
+                cancelling = true;
+                loop.cancel(this, Op::Receive);
+            }
+        }
+
+        void keep_writing() final {
+            writing = true;
+            iovecs.clear();
+            for (auto& buffer: write_buffers) {
+                iovecs.push_back({const_cast<void*>(buffer.data()), buffer.size()});
+            }
+            next_iovec = 0;
+            send();
+        }
+
+        void send() {
+            std::memset(&message, 0, sizeof(message));
+            message.msg_iov = iovecs.data() + next_iovec;
+            message.msg_iovlen = std::min<size_t>(iovecs.size() - next_iovec, IOV_MAX);
+            auto& sqe = loop.queue(this, Op::Send);
+            sqe.opcode = IORING_OP_SENDMSG;
+            sqe.fd = fd;
+            sqe.addr = reinterpret_cast<uint64_t>(&message);
+            sqe.len = 1;
+            sqe.msg_flags = MSG_NOSIGNAL;
+            ++num_ops;
+        }
+
+        void on_send(const io_uring_cqe& cqe) {
+            --num_ops;
+            if (cqe.res > 0) {
+                increment(loop.counters.bytes_sent, uint64_t(cqe.res));
+            }
+            if (closed) {
+                return;
+            }
+            if (cqe.res <= 0) {
+                if (cqe.res != -EPIPE && cqe.res != -ECONNRESET && cqe.res != 0) {
+                    std::cerr << "socket error while writing: " << std::strerror(-cqe.res) << "\n";
+                }
+                close();
+                return;
+            }
+            size_t len = size_t(cqe.res);
+            while (next_iovec < iovecs.size() && len >= iovecs[next_iovec].iov_len) {
+                len -= iovecs[next_iovec].iov_len;
+                ++next_iovec;
+            }
+            if (next_iovec < iovecs.size()) {
+                auto& partial = iovecs[next_iovec];
+                partial.iov_base = static_cast<char*>(partial.iov_base) + len;
+                partial.iov_len -= len;
+                send();
+                return;
+            }
+            written();
+        }
+
+        void send_file() final {
+            switch (send_file_to(fd)) {
+                case FileProgress::Sent:
+                    streaming = false;
+                    return;
+                case FileProgress::Yielded:
+                    writing = true;
+                    loop.service.post([this]() {
+                        if (!closed) {
+                            written();
+                        }
+                    });
+                    return;
+                case FileProgress::WouldBlock: {
+                    writing = true;
+                    auto& sqe = loop.queue(this, Op::Poll);
+                    sqe.opcode = IORING_OP_POLL_ADD;
+                    sqe.fd = fd;
+                    sqe.poll32_events = POLLOUT;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                    sqe.poll32_events = (sqe.poll32_events << 16) | (sqe.poll32_events >> 16);
+#endif
+                    ++num_ops;
+                    return;
+                }
+                case FileProgress::Failed:
+                    close();
+                    return;
+            }
+        }
+
+        void on_poll(const io_uring_cqe& cqe) {
+            --num_ops;
+            if (closed) {
+                return;
+            }
+            if (cqe.res < 0) {
+                close();
+                return;
+            }
+            written();
+        }
+    };
+
+    // Uses io_uring if the kernel is recent enough (Linux 6.0 added
+    // multishot receives) and lets this process set one up.
+    void Server::Loop::start_uring() {
+        utsname name;
+        int major = 0;
+        if (::uname(&name) == 0) {
+            major = std::atoi(name.release);
+        }
+        if (major < 6) {
+            throw std::runtime_error("Linux 6.0 or later required");
+        }
+        ring.reset(new util::IoUring(ring_entries, ring_buffers, buffer_size));
+        int fd = ::dup(ring->fd());
+        if (fd < 0) {
+            throw std::system_error(errno, std::system_category(), "dup()");
+        }
+        ring_events.reset(new asio::posix::stream_descriptor(service, fd));
+        watch_ring();
+    }
+
+    io_uring_sqe& Server::Loop::queue(void* target, Op op) {
+        auto& sqe = ring->next_sqe();
+        sqe.user_data = reinterpret_cast<uint64_t>(target) | uint64_t(op);
+        if (!submit_posted) {
+            submit_posted = true;
+            service.post([this]() {
+                submit_posted = false;
+                ring->submit();
+            });
+        }
+        return sqe;
+    }
+
+    void Server::Loop::cancel(void* target, Op op) {
+        auto& sqe = queue(nullptr, Op::None);
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.addr = reinterpret_cast<uint64_t>(target) | uint64_t(op);
+    }
+
+    // The ring's descriptor is readable while completions are waiting. The
+    // reactor is edge-triggered, so check again after waiting anew.
+    void Server::Loop::watch_ring() {
+        ring_events->async_wait(asio::posix::stream_descriptor::wait_read, [this](asio_error_code ec) {
+            if (ec) {
+                return;
+            }
+            auto reap = [this]() {
+                ring->consume([this](const io_uring_cqe& cqe) {
+                    complete(cqe);
+                });
+            };
+            reap();
+            watch_ring();
+            if (ring->has_completions()) {
+                service.post(reap);
+            }
+        });
+    }
+
+    void Server::Loop::complete(const io_uring_cqe& cqe) {
+        void* target = reinterpret_cast<void*>(cqe.user_data & ~op_mask);
+        switch (Op(cqe.user_data & op_mask)) {
+            case Op::None:
+                return;
+            case Op::Accept:
+                accepted(*static_cast<AcceptorBase*>(target), cqe);
+                return;
+            case Op::Receive:
+            case Op::Send:
+            case Op::Poll:
+                break;
+        }
+        auto& client = *static_cast<UringClient*>(target);
+        switch (Op(cqe.user_data & op_mask)) {
+            case Op::Receive: client.on_receive(cqe); break;
+            case Op::Send:    client.on_send(cqe); break;
+            default:          client.on_poll(cqe); break;
+        }
+        if (client.closed) {
+            client.recycle_when_done();
+        }
+    }
+
+    void Server::Loop::accept(AcceptorBase& acceptor) {
+        auto& sqe = queue(&acceptor, Op::Accept);
+        sqe.opcode = IORING_OP_ACCEPT;
+        sqe.fd = acceptor.native_handle();
+        sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe.accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+
+    void Server::Loop::accepted(AcceptorBase& acceptor, const io_uring_cqe& cqe) {
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        if (!more) {
+            acceptor.accepting = false;
+        }
+        if (acceptor.closed) {
+            if (cqe.res >= 0) {
+                ::close(cqe.res);
+            }
+            return;
+        }
+        if (cqe.res == -ECANCELED) {
+            // Paused, and maybe resumed since.
+            acceptor.keep_accepting();
+            return;
+        }
+        if (cqe.res < 0) {
+            asio_error_code ec(-cqe.res, asio::error::get_system_category());
+            if (!accept_error_is_transient(ec)) {
+                accept_failed(ec);
+            }
+            else if (!more) {
+                acceptor.keep_accepting();
+            }
+            return;
+        }
+        UringClient* client;
+        if (pooled_uring_clients.empty()) {
+            client = new UringClient(*this);
+        }
+        else {
+            client = static_cast<UringClient*>(&*pooled_uring_clients.begin());
+            pooled_uring_clients.unlink(client);
+            --num_pooled_uring_clients;
+        }
+        clients.link_front(client);
+        client->start(cqe.res);
+        open(acceptor, *client);
+        if (!more) {
+            acceptor.keep_accepting();
+        }
+    }
+
+    void Server::Loop::recycle(UringClient* client) {
+        if (num_pooled_uring_clients == AcceptorBase::max_pooled_clients) {
+            delete client;
+            return;
+        }
+        clients.unlink(client);
+        client->reset();
+        pooled_uring_clients.link_front(client);
+        ++num_pooled_uring_clients;
+    }
+}
+#endif
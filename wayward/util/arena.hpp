@@ -0,0 +1,195 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint> // uintptr_t
+#include <cstring> // std::memcpy
+#include <stddef.h>
+#include <new> // operator new
+#include <string_view>
+#include <utility> // std::move
+
+#include <wayward/util/buffer_pool.hpp>
+
+namespace wayward {
+namespace util {
+
+    // Bump allocator for memory that lives for one request/response cycle.
+    //
+    // Allocations are never freed individually. reset() rewinds all of them
+    // at once, and keeps at most `max_retained` bytes of chunks for the next
+    // cycle, so one huge request does not keep its memory pinned. The first
+    // chunk is allocated lazily, so an unused Arena costs nothing.
+    //
+    // An Arena created with a BufferPool takes its regular chunks from the
+    // pool, so release() and reallocation are cheap.
+    struct Arena {
+        static constexpr size_t default_chunk_size = 4096;
+        static constexpr size_t default_max_retained = 64 * 1024;
+
+        explicit Arena(size_t chunk_size = default_chunk_size, size_t max_retained = default_max_retained)
+            : chunk_size_(chunk_size), max_retained_(max_retained) {}
+
+        explicit Arena(BufferPool& pool, size_t max_retained = default_max_retained)
+            : pool_(&pool), chunk_size_(pool.block_size() - sizeof(Chunk)), max_retained_(max_retained) {}
+
+        ~Arena() {
+            free_chunks(first_);
+        }
+
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        Arena(Arena&& other) noexcept {
+            *this = std::move(other);
+        }
+
+        Arena& operator=(Arena&& other) noexcept {
+            if (this != &other) {
+                free_chunks(first_);
+                first_ = other.first_;
+                current_ = other.current_;
+                ptr_ = other.ptr_;
+                end_ = other.end_;
+                reserved_ = other.reserved_;
+                pool_ = other.pool_;
+                chunk_size_ = other.chunk_size_;
+                max_retained_ = other.max_retained_;
+                other.first_ = other.current_ = nullptr;
+                other.ptr_ = other.end_ = nullptr;
+                other.reserved_ = 0;
+            }
+            return *this;
+        }
+
+        void* allocate(size_t size, size_t align = alignof(max_align_t)) {
+            assert(align != 0 && (align & (align - 1)) == 0);
+            char* p = align_up(ptr_, align);
+            if (p == nullptr || p + size > end_) {
+                p = align_up(next_chunk(size + align - 1), align);
+            }
+            ptr_ = p + size;
+            return p;
+        }
+
+        char* allocate_chars(size_t size) {
+            return static_cast<char*>(allocate(size, 1));
+        }
+
+        std::string_view copy(std::string_view str) {
+            if (str.empty()) {
+                return std::string_view();
+            }
+            char* p = allocate_chars(str.size());
+            std::memcpy(p, str.data(), str.size());
+            return std::string_view(p, str.size());
+        }
+
+        // Invalidates everything allocated from the arena.
+        void reset() {
+            if (first_ == nullptr) {
+                return;
+            }
+            if (first_->next != nullptr || first_->size > max_retained_) {
+                trim();
+                if (first_ == nullptr) {
+                    return;
+                }
+            }
+            current_ = first_;
+            ptr_ = first_->data();
+            end_ = ptr_ + first_->size;
+        }
+
+        // Invalidates everything allocated from the arena, and frees all of
+        // its chunks.
+        void release() {
+            free_chunks(first_);
+            first_ = current_ = nullptr;
+            ptr_ = end_ = nullptr;
+            reserved_ = 0;
+        }
+
+        // Bytes held in chunks, used or not.
+        size_t bytes_reserved() const {
+            return reserved_;
+        }
+
+    private:
+        struct Chunk {
+            Chunk* next;
+            size_t size;
+
+            char* data() {
+                return reinterpret_cast<char*>(this + 1);
+            }
+        };
+
+        Chunk* first_ = nullptr;
+        Chunk* current_ = nullptr;
+        char* ptr_ = nullptr;
+        char* end_ = nullptr;
+        size_t reserved_ = 0;
+        BufferPool* pool_ = nullptr;
+        size_t chunk_size_;
+        size_t max_retained_;
+
+        static char* align_up(char* p, size_t align) {
+            return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + align - 1) & ~(uintptr_t(align) - 1));
+        }
+
+        // Moves to the next retained chunk if it is big enough, or links in a
+        // new one after the current chunk.
+        char* next_chunk(size_t min_size) {
+            Chunk* next = current_ ? current_->next : first_;
+            if (next == nullptr || next->size < min_size) {
+                size_t size = min_size > chunk_size_ ? min_size : chunk_size_;
+                void* memory = (pool_ && size == chunk_size_) ? pool_->acquire() : ::operator new(sizeof(Chunk) + size);
+                Chunk* chunk = static_cast<Chunk*>(memory);
+                chunk->size = size;
+                chunk->next = next;
+                if (current_) {
+                    current_->next = chunk;
+                }
+                else {
+                    first_ = chunk;
+                }
+                reserved_ += size;
+                next = chunk;
+            }
+            current_ = next;
+            ptr_ = next->data();
+            end_ = ptr_ + next->size;
+            return ptr_;
+        }
+
+        // Frees chunks beyond the first `max_retained_` bytes.
+        void trim() {
+            Chunk** link = &first_;
+            size_t retained = 0;
+            while (*link != nullptr && retained + (*link)->size <= max_retained_) {
+                retained += (*link)->size;
+                link = &(*link)->next;
+            }
+            free_chunks(*link);
+            *link = nullptr;
+            reserved_ = retained;
+            current_ = nullptr;
+            ptr_ = end_ = nullptr;
+        }
+
+        void free_chunks(Chunk* chunk) {
+            while (chunk != nullptr) {
+                Chunk* next = chunk->next;
+                if (pool_ && chunk->size == chunk_size_) {
+                    pool_->release(chunk);
+                }
+                else {
+                    ::operator delete(chunk);
+                }
+                chunk = next;
+            }
+        }
+    };
+
+} // namespace util
+} // namespace wayward
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cassert>
+#include <stddef.h>
+#include <new> // operator new
+
+namespace wayward {
+namespace util {
+
+    // Free list of equally sized memory blocks. Not thread-safe: every event
+    // loop has its own, shared by all of its connections. At most `max_free`
+    // released blocks are kept; the rest go back to the heap.
+    struct BufferPool {
+        explicit BufferPool(size_t block_size, size_t max_free = 1024)
+            : block_size_(block_size < sizeof(Block) ? sizeof(Block) : block_size), max_free_(max_free) {}
+
+        ~BufferPool() {
+            while (free_ != nullptr) {
+                Block* next = free_->next;
+                ::operator delete(free_);
+                free_ = next;
+            }
+        }
+
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+
+        void* acquire() {
+            ++num_acquired_;
+            if (free_ == nullptr) {
+                return ::operator new(block_size_);
+            }
+            Block* block = free_;
+            free_ = block->next;
+            --num_free_;
+            return block;
+        }
+
+        void release(void* ptr) {
+            assert(num_acquired_ > 0);
+            --num_acquired_;
+            if (num_free_ == max_free_) {
+                ::operator delete(ptr);
+                return;
+            }
+            Block* block = static_cast<Block*>(ptr);
+            block->next = free_;
+            free_ = block;
+            ++num_free_;
+        }
+
+        size_t block_size() const {
+            return block_size_;
+        }
+
+        // Blocks currently handed out.
+        size_t num_acquired() const {
+            return num_acquired_;
+        }
+
+        // Blocks kept for reuse.
+        size_t num_free() const {
+            return num_free_;
+        }
+
+    private:
+        struct Block {
+            Block* next;
+        };
+
+        Block* free_ = nullptr;
+        size_t num_free_ = 0;
+        size_t num_acquired_ = 0;
+        size_t block_size_;
+        size_t max_free_;
+    };
+
+} // namespace util
+} // namespace wayward
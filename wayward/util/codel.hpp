@@ -0,0 +1,46 @@
+#pragma once
+
+#include <chrono>
+
+namespace wayward {
+namespace util {
+
+    // Load shedding after CoDel (Nichols and Jacobson, "Controlling Queue
+    // Delay"): a queue whose delay stays above `target` for a whole
+    // `interval`, even for the requests that waited least, is overloaded
+    // rather than just busy. Until an interval in which some request waited
+    // less than `target`, requests that have waited more than twice as long
+    // are shed, so that those admitted still wait about `target`. A busy
+    // queue that drains now and then sheds nothing.
+    //
+    // Not thread-safe, like the event loop that owns it.
+    struct Codel {
+        using Clock = std::chrono::steady_clock;
+
+        Codel() = default;
+        Codel(Clock::duration target, Clock::duration interval) : target_(target), interval_(interval) {}
+
+        // Records that a request has waited `delay` by `now`, and returns
+        // whether to shed it.
+        bool overloaded(Clock::time_point now, Clock::duration delay) {
+            if (now >= interval_end_) {
+                // An interval without requests ends any overload.
+                overloaded_ = now < interval_end_ + interval_ && min_delay_ > target_;
+                min_delay_ = delay;
+                interval_end_ = now + interval_;
+            }
+            else if (delay < min_delay_) {
+                min_delay_ = delay;
+            }
+            return overloaded_ && delay > 2 * target_;
+        }
+
+    private:
+        Clock::duration target_{};
+        Clock::duration interval_{};
+        Clock::time_point interval_end_{};
+        Clock::duration min_delay_{};
+        bool overloaded_ = false;
+    };
+}
+}
@@ -0,0 +1,277 @@
+#pragma once
+
+// Linux only (see WAYWARD_IO_URING in CMakeLists.txt).
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stddef.h>
+#include <stdint.h>
+#include <system_error>
+
+namespace wayward {
+namespace util {
+
+    // An io_uring instance, driven through the system calls themselves: a
+    // submission queue the kernel takes requests from, and a completion
+    // queue it posts their results to, both mapped into this process. Not
+    // thread-safe: every event loop has its own.
+    //
+    // Also provides receive buffers, which the kernel picks from for
+    // requests flagged IOSQE_BUFFER_SELECT with buffer_group, and which go
+    // back to it with give_back() once consumed.
+    struct IoUring {
+        static constexpr uint16_t buffer_group = 0;
+
+        // `num_buffers` must be a power of 2.
+        IoUring(unsigned int entries, uint16_t num_buffers, size_t buffer_size)
+            : num_buffers_(num_buffers), buffer_size_(buffer_size)
+        {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            // Multishot requests post many completions per submission.
+            params.flags = IORING_SETUP_CLAMP | IORING_SETUP_CQSIZE;
+            params.cq_entries = entries * 4;
+            fd_ = int(::syscall(__NR_io_uring_setup, entries, &params));
+            if (fd_ < 0) {
+                throw std::system_error(errno, std::system_category(), "io_uring_setup()");
+            }
+            if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+                destroy();
+                throw std::system_error(ENOSYS, std::system_category(), "io_uring_setup()");
+            }
+            size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+            size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            rings_size_ = sq_size > cq_size ? sq_size : cq_size;
+            rings_ = map(rings_size_, IORING_OFF_SQ_RING);
+            sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+            sqes_ = static_cast<io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+
+            char* rings = static_cast<char*>(rings_);
+            sq_head_ = reinterpret_cast<unsigned int*>(rings + params.sq_off.head);
+            sq_tail_ = reinterpret_cast<unsigned int*>(rings + params.sq_off.tail);
+            sq_flags_ = reinterpret_cast<unsigned int*>(rings + params.sq_off.flags);
+            sq_mask_ = *reinterpret_cast<unsigned int*>(rings + params.sq_off.ring_mask);
+            sq_entries_ = params.sq_entries;
+            unsigned int* sq_array = reinterpret_cast<unsigned int*>(rings + params.sq_off.array);
+            for (unsigned int i = 0; i < sq_entries_; ++i) {
+                sq_array[i] = i;
+            }
+            cq_head_ = reinterpret_cast<unsigned int*>(rings + params.cq_off.head);
+            cq_tail_ = reinterpret_cast<unsigned int*>(rings + params.cq_off.tail);
+            cq_mask_ = *reinterpret_cast<unsigned int*>(rings + params.cq_off.ring_mask);
+            cqes_ = reinterpret_cast<io_uring_cqe*>(rings + params.cq_off.cqes);
+            sq_local_tail_ = *sq_tail_;
+
+            register_buffers();
+        }
+
+        ~IoUring() {
+            // Nothing may land in the buffers once they are freed.
+            try {
+                io_uring_sqe& sqe = next_sqe();
+                sqe.opcode = IORING_OP_ASYNC_CANCEL;
+                sqe.fd = -1;
+                sqe.cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+                submit();
+            }
+            catch (std::system_error&) {
+            }
+            destroy();
+        }
+
+        IoUring(const IoUring&) = delete;
+        IoUring& operator=(const IoUring&) = delete;
+
+        int fd() const {
+            return fd_;
+        }
+
+        // A cleared entry to fill in. Submits what is queued if the queue
+        // is full.
+        io_uring_sqe& next_sqe() {
+            if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+                submit();
+                if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+                    throw std::system_error(EBUSY, std::system_category(), "io_uring_enter()");
+                }
+            }
+            io_uring_sqe& sqe = sqes_[sq_local_tail_ & sq_mask_];
+            std::memset(&sqe, 0, sizeof(sqe));
+            ++sq_local_tail_;
+            return sqe;
+        }
+
+        // Hands what has been queued since the last call to the kernel, in
+        // one system call. Entries it could not take yet stay queued.
+        void submit() {
+            unsigned int to_submit = sq_local_tail_ - sq_submitted_;
+            if (to_submit == 0) {
+                return;
+            }
+            __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+            int submitted = enter(to_submit, 0, 0);
+            if (submitted > 0) {
+                sq_submitted_ += unsigned(submitted);
+            }
+        }
+
+        bool has_completions() const {
+            return *cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) || overflowed();
+        }
+
+        // Calls fn(const io_uring_cqe&) for every completion posted so far.
+        // fn may queue more requests.
+        template <class Function>
+        size_t consume(Function fn) {
+            size_t count = 0;
+            for (;;) {
+                unsigned int head = *cq_head_;
+                if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+                    if (!overflowed()) {
+                        return count;
+                    }
+                    // Completions that did not fit wait in the kernel.
+                    enter(0, 0, IORING_ENTER_GETEVENTS);
+                    continue;
+                }
+                io_uring_cqe cqe = cqes_[head & cq_mask_];
+                __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+                fn(cqe);
+                ++count;
+            }
+        }
+
+        // The provided buffer a completion with IORING_CQE_F_BUFFER used.
+        static uint16_t buffer_id(const io_uring_cqe& cqe) {
+            return uint16_t(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+
+        char* buffer(uint16_t id) {
+            return buffers_ + size_t(id) * buffer_size_;
+        }
+
+        void give_back(uint16_t id) {
+            // Not buf_ring_->bufs: in C++, the empty struct the header puts
+            // before it takes up space. The entries start with the ring, and
+            // the first one's reserved field is the tail.
+            io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(buf_ring_)[buf_tail_ & (num_buffers_ - 1)];
+            buf.addr = reinterpret_cast<uint64_t>(buffer(id));
+            buf.len = uint32_t(buffer_size_);
+            buf.bid = id;
+            ++buf_tail_;
+            __atomic_store_n(&buf_ring_->tail, buf_tail_, __ATOMIC_RELEASE);
+        }
+
+    private:
+        int fd_ = -1;
+        void* rings_ = MAP_FAILED;
+        size_t rings_size_ = 0;
+        io_uring_sqe* sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+        size_t sqes_size_ = 0;
+
+        unsigned int* sq_head_ = nullptr;
+        unsigned int* sq_tail_ = nullptr;
+        unsigned int* sq_flags_ = nullptr;
+        unsigned int sq_mask_ = 0;
+        unsigned int sq_entries_ = 0;
+        unsigned int sq_local_tail_ = 0; // Queued, including not yet submitted.
+        unsigned int sq_submitted_ = 0;
+
+        unsigned int* cq_head_ = nullptr;
+        unsigned int* cq_tail_ = nullptr;
+        unsigned int cq_mask_ = 0;
+        io_uring_cqe* cqes_ = nullptr;
+
+        uint16_t num_buffers_;
+        size_t buffer_size_;
+        io_uring_buf_ring* buf_ring_ = static_cast<io_uring_buf_ring*>(MAP_FAILED);
+        size_t buf_ring_size_ = 0;
+        uint16_t buf_tail_ = 0;
+        char* buffers_ = nullptr;
+
+        void* map(size_t size, off_t offset) {
+            void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+            if (p == MAP_FAILED) {
+                int error = errno;
+                destroy();
+                throw std::system_error(error, std::system_category(), "mmap()");
+            }
+            return p;
+        }
+
+        void register_buffers() {
+            buf_ring_size_ = num_buffers_ * sizeof(io_uring_buf);
+            void* ring = ::mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ring == MAP_FAILED) {
+                int error = errno;
+                destroy();
+                throw std::system_error(error, std::system_category(), "mmap()");
+            }
+            buf_ring_ = static_cast<io_uring_buf_ring*>(ring);
+            buffers_ = new char[num_buffers_ * buffer_size_];
+
+            io_uring_buf_reg reg;
+            std::memset(&reg, 0, sizeof(reg));
+            reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+            reg.ring_entries = num_buffers_;
+            reg.bgid = buffer_group;
+            if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+                int error = errno;
+                destroy();
+                throw std::system_error(error, std::system_category(), "IORING_REGISTER_PBUF_RING");
+            }
+            for (uint16_t id = 0; id < num_buffers_; ++id) {
+                give_back(id);
+            }
+        }
+
+        bool overflowed() const {
+            return __atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW;
+        }
+
+        int enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+            for (;;) {
+                int result = int(::syscall(__NR_io_uring_enter, fd_, to_submit, min_complete, flags, nullptr, 0));
+                if (result >= 0) {
+                    return result;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                // The completion queue is full: consume, then retry.
+                if (errno == EBUSY || errno == EAGAIN) {
+                    return 0;
+                }
+                throw std::system_error(errno, std::system_category(), "io_uring_enter()");
+            }
+        }
+
+        void destroy() {
+            // Closing the ring cancels what is still in flight.
+            if (fd_ >= 0) {
+                ::close(fd_);
+                fd_ = -1;
+            }
+            if (sqes_ != MAP_FAILED) {
+                ::munmap(sqes_, sqes_size_);
+                sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+            }
+            if (rings_ != MAP_FAILED) {
+                ::munmap(rings_, rings_size_);
+                rings_ = MAP_FAILED;
+            }
+            if (buf_ring_ != MAP_FAILED) {
+                ::munmap(buf_ring_, buf_ring_size_);
+                buf_ring_ = static_cast<io_uring_buf_ring*>(MAP_FAILED);
+            }
+            delete[] buffers_;
+            buffers_ = nullptr;
+        }
+    };
+
+}
+}
@@ -14,12 +14,19 @@ namespace util {
         }
 
         void unlink() {
+            if (next == nullptr) {
+                return;
+            }
             next->prev = prev;
             prev->next = next;
             next = nullptr;
             prev = nullptr;
         }
 
+        bool linked() const {
+            return next != nullptr;
+        }
+
     private:
         template <class T, IntrusiveListAnchor T::*> friend struct IntrusiveList;
         IntrusiveListAnchor* next = nullptr;
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+#include <stddef.h>
+#include <vector>
+
+#include <wayward/util/linklist.hpp>
+
+namespace wayward {
+namespace util {
+
+    // An entry in a TimerWheel, embedded in the object it times.
+    struct Timer {
+        bool armed() const {
+            return anchor_.linked();
+        }
+
+        uint64_t expiry() const {
+            return expiry_;
+        }
+
+    private:
+        template <class T, Timer T::*> friend struct TimerWheel;
+        IntrusiveListAnchor anchor_;
+        uint64_t expiry_ = 0;
+    };
+
+    // Hashed timing wheel: timers expire at a tick, and are kept in the slot
+    // for their tick modulo the number of slots, so arming, re-arming and
+    // cancelling are O(1), and advancing the wheel by a tick only visits one
+    // slot. Timers further out than one turn of the wheel stay in their slot
+    // for more turns.
+    //
+    // Ticks are whatever unit the owner advances the wheel by. Not
+    // thread-safe, like the event loop that owns it.
+    template <class T, Timer T::*Member>
+    struct TimerWheel {
+        explicit TimerWheel(size_t num_slots = 1024) : slots_(num_slots) {}
+
+        TimerWheel(const TimerWheel&) = delete;
+        TimerWheel& operator=(const TimerWheel&) = delete;
+
+        uint64_t now() const {
+            return now_;
+        }
+
+        size_t size() const {
+            return size_;
+        }
+
+        bool empty() const {
+            return size_ == 0;
+        }
+
+        // (Re-)arms the timer to expire `ticks` from now, at least one.
+        void schedule(T& object, uint64_t ticks) {
+            Timer& timer = object.*Member;
+            cancel(object);
+            timer.expiry_ = now_ + (ticks > 0 ? ticks : 1);
+            slots_[timer.expiry_ % slots_.size()].link_back(&timer);
+            ++size_;
+        }
+
+        void cancel(T& object) {
+            Timer& timer = object.*Member;
+            if (timer.armed()) {
+                timer.anchor_.unlink();
+                --size_;
+            }
+        }
+
+        // Moves the wheel forward to `now`, calling `expired(T&)` for every
+        // timer that expires on the way, after cancelling it. Callbacks may
+        // arm and cancel any timer.
+        template <class Function>
+        void advance(uint64_t now, Function expired) {
+            if (now <= now_) {
+                return;
+            }
+            if (empty()) {
+                now_ = now;
+                return;
+            }
+            // Visiting every slot once finds all timers due by now.
+            uint64_t ticks = now - now_;
+            uint64_t first = ticks < slots_.size() ? now_ + 1 : now - slots_.size() + 1;
+            now_ = now;
+            for (uint64_t tick = first; tick <= now; ++tick) {
+                auto& slot = slots_[tick % slots_.size()];
+                for (auto it = slot.begin(); it != slot.end();) {
+                    Timer& timer = *it++;
+                    if (timer.expiry_ <= now) {
+                        timer.anchor_.unlink();
+                        due_.link_back(&timer);
+                    }
+                }
+            }
+            // Callbacks may cancel due timers that have not fired yet.
+            while (!due_.empty()) {
+                Timer& timer = *due_.begin();
+                timer.anchor_.unlink();
+                --size_;
+                expired(object_for(timer));
+            }
+        }
+
+    private:
+        using List = IntrusiveList<Timer, &Timer::anchor_>;
+        std::vector<List> slots_;
+        List due_;
+        uint64_t now_ = 0;
+        size_t size_ = 0;
+
+        static T& object_for(Timer& timer) {
+            char* base = reinterpret_cast<char*>(&timer) - offset_of_member(Member);
+            return *reinterpret_cast<T*>(base);
+        }
+    };
+
+} // namespace util
+} // namespace wayward
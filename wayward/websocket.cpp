@@ -0,0 +1,454 @@
+#include "wayward/websocket.hpp"
+#include "config.h"
+
+#if defined(WAYWARD_WITH_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <new> // std::bad_alloc
+
+namespace wayward {
+    namespace {
+        // SHA-1 (RFC 3174), which the handshake needs for nothing but
+        // Sec-WebSocket-Accept.
+        struct Sha1 {
+            uint32_t state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+            unsigned char block[64];
+            size_t block_used = 0;
+            uint64_t length = 0;
+
+            static uint32_t rotate(uint32_t x, int n) {
+                return x << n | x >> (32 - n);
+            }
+
+            void update(std::string_view data) {
+                for (char c: data) {
+                    block[block_used++] = static_cast<unsigned char>(c);
+                    if (block_used == 64) {
+                        process();
+                        block_used = 0;
+                    }
+                }
+                length += data.size();
+            }
+
+            void finish(unsigned char digest[20]) {
+                uint64_t bits = length * 8;
+                block[block_used++] = 0x80;
+                if (block_used > 56) {
+                    std::memset(block + block_used, 0, 64 - block_used);
+                    process();
+                    block_used = 0;
+                }
+                std::memset(block + block_used, 0, 56 - block_used);
+                for (int i = 0; i < 8; ++i) {
+                    block[56 + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+                }
+                process();
+                for (int i = 0; i < 20; ++i) {
+                    digest[i] = static_cast<unsigned char>(state[i / 4] >> (24 - 8 * (i % 4)));
+                }
+            }
+
+            void process() {
+                uint32_t w[80];
+                for (int i = 0; i < 16; ++i) {
+                    w[i] = uint32_t(block[4 * i]) << 24 | uint32_t(block[4 * i + 1]) << 16 | uint32_t(block[4 * i + 2]) << 8 | block[4 * i + 3];
+                }
+                for (int i = 16; i < 80; ++i) {
+                    w[i] = rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+                }
+                uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+                for (int i = 0; i < 80; ++i) {
+                    uint32_t f, k;
+                    if (i < 20) {
+                        f = (b & c) | (~b & d);
+                        k = 0x5a827999;
+                    }
+                    else if (i < 40) {
+                        f = b ^ c ^ d;
+                        k = 0x6ed9eba1;
+                    }
+                    else if (i < 60) {
+                        f = (b & c) | (b & d) | (c & d);
+                        k = 0x8f1bbcdc;
+                    }
+                    else {
+                        f = b ^ c ^ d;
+                        k = 0xca62c1d6;
+                    }
+                    uint32_t temp = rotate(a, 5) + f + e + k + w[i];
+                    e = d;
+                    d = c;
+                    c = rotate(b, 30);
+                    b = a;
+                    a = temp;
+                }
+                state[0] += a;
+                state[1] += b;
+                state[2] += c;
+                state[3] += d;
+                state[4] += e;
+            }
+        };
+
+        void encode_base64(const unsigned char* data, size_t len, std::string& out) {
+            static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            size_t i = 0;
+            for (; i + 3 <= len; i += 3) {
+                uint32_t bits = uint32_t(data[i]) << 16 | uint32_t(data[i + 1]) << 8 | data[i + 2];
+                out.push_back(alphabet[bits >> 18]);
+                out.push_back(alphabet[(bits >> 12) & 63]);
+                out.push_back(alphabet[(bits >> 6) & 63]);
+                out.push_back(alphabet[bits & 63]);
+            }
+            if (i + 1 == len) {
+                uint32_t bits = uint32_t(data[i]) << 16;
+                out.push_back(alphabet[bits >> 18]);
+                out.push_back(alphabet[(bits >> 12) & 63]);
+                out.append("==");
+            }
+            else if (i + 2 == len) {
+                uint32_t bits = uint32_t(data[i]) << 16 | uint32_t(data[i + 1]) << 8;
+                out.push_back(alphabet[bits >> 18]);
+                out.push_back(alphabet[(bits >> 12) & 63]);
+                out.push_back(alphabet[(bits >> 6) & 63]);
+                out.push_back('=');
+            }
+        }
+
+        // A nonce of 16 bytes, base64-encoded: 22 characters and "==".
+        bool valid_key(std::string_view key) {
+            if (key.size() != 24 || key.substr(22) != "==") {
+                return false;
+            }
+            for (char c: key.substr(0, 22)) {
+                if (!((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '+' || c == '/')) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        std::string_view trim(std::string_view s) {
+            while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+                s.remove_prefix(1);
+            }
+            while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+                s.remove_suffix(1);
+            }
+            return s;
+        }
+
+        // Whether one offer from Sec-WebSocket-Extensions is permessage-deflate
+        // with parameters that allow our terms (RFC 7692, section 7.1): no
+        // context takeover on either side, and the default window, which the
+        // loop's compressor uses for every connection.
+        bool acceptable_deflate(std::string_view offer) {
+            size_t semicolon = offer.find(';');
+            if (!iequals(trim(offer.substr(0, semicolon)), "permessage-deflate")) {
+                return false;
+            }
+            while (semicolon != std::string_view::npos) {
+                offer.remove_prefix(semicolon + 1);
+                semicolon = offer.find(';');
+                auto param = trim(offer.substr(0, semicolon));
+                size_t equals = param.find('=');
+                auto name = trim(param.substr(0, equals));
+                auto value = equals == std::string_view::npos ? std::string_view() : trim(param.substr(equals + 1));
+                if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+                    value = value.substr(1, value.size() - 2);
+                }
+                if (iequals(name, "server_no_context_takeover") || iequals(name, "client_no_context_takeover")) {
+                    if (!value.empty()) {
+                        return false;
+                    }
+                }
+                else if (iequals(name, "client_max_window_bits")) {
+                    // The client may use a smaller window than it is allowed.
+                    continue;
+                }
+                else if (!(iequals(name, "server_max_window_bits") && value == "15")) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool offers_deflate(const Request& req) {
+            for (auto& field: req.headers) {
+                if (field.id != HeaderId::SecWebSocketExtensions) {
+                    continue;
+                }
+                // Offers are separated by commas, which parameter values
+                // cannot contain.
+                auto list = field.value;
+                while (!list.empty()) {
+                    size_t comma = list.find(',');
+                    if (acceptable_deflate(list.substr(0, comma))) {
+                        return true;
+                    }
+                    list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+                }
+            }
+            return false;
+        }
+    }
+
+    bool accept_websocket(Request& req, Response& res, std::shared_ptr<IWebSocketHandler> handler, bool deflate) {
+        auto key = req.header(HeaderId::SecWebSocketKey);
+        if (req.method != Method::Get || !has_token(req.header(HeaderId::Connection), "upgrade") || !has_token(req.header(HeaderId::Upgrade), "websocket") || !valid_key(key)) {
+            res.status = Status::BadRequest;
+            return false;
+        }
+        if (req.header(HeaderId::SecWebSocketVersion) != "13") {
+            res.status = Status::UpgradeRequired;
+            res.set_header(HeaderId::SecWebSocketVersion, "13");
+            return false;
+        }
+        res.status = Status::SwitchingProtocols;
+        res.set_header(HeaderId::Upgrade, "websocket");
+        res.set_header(HeaderId::Connection, "Upgrade");
+        res.set_header(HeaderId::SecWebSocketAccept, websocket_accept_key(key));
+        if (deflate && MessageDeflate::available() && offers_deflate(req)) {
+            res.set_header(HeaderId::SecWebSocketExtensions, "permessage-deflate; server_no_context_takeover; client_no_context_takeover");
+        }
+        res.websocket = std::move(handler);
+        return true;
+    }
+
+    std::string websocket_accept_key(std::string_view key) {
+        Sha1 sha1;
+        sha1.update(key);
+        sha1.update("258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+        unsigned char digest[20];
+        sha1.finish(digest);
+        std::string accept;
+        encode_base64(digest, sizeof(digest), accept);
+        return accept;
+    }
+
+    // Clients mask every byte they send, so large messages are unmasked 64
+    // bytes per iteration where SSE2 is available, and 8 otherwise.
+    void websocket_mask(char* data, size_t len, const unsigned char key[4], uint64_t offset) {
+        unsigned char rotated[8];
+        for (int i = 0; i < 8; ++i) {
+            rotated[i] = key[(offset + i) % 4];
+        }
+        size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+        if (len >= 16) {
+            int32_t word;
+            std::memcpy(&word, rotated, 4);
+            const __m128i mask = _mm_set1_epi32(word);
+            for (; i + 64 <= len; i += 64) {
+                auto p = reinterpret_cast<__m128i*>(data + i);
+                __m128i a = _mm_loadu_si128(p);
+                __m128i b = _mm_loadu_si128(p + 1);
+                __m128i c = _mm_loadu_si128(p + 2);
+                __m128i d = _mm_loadu_si128(p + 3);
+                _mm_storeu_si128(p, _mm_xor_si128(a, mask));
+                _mm_storeu_si128(p + 1, _mm_xor_si128(b, mask));
+                _mm_storeu_si128(p + 2, _mm_xor_si128(c, mask));
+                _mm_storeu_si128(p + 3, _mm_xor_si128(d, mask));
+            }
+            for (; i + 16 <= len; i += 16) {
+                auto p = reinterpret_cast<__m128i*>(data + i);
+                _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), mask));
+            }
+        }
+#endif
+        uint64_t mask;
+        std::memcpy(&mask, rotated, 8);
+        for (; i + 8 <= len; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, data + i, 8);
+            word ^= mask;
+            std::memcpy(data + i, &word, 8);
+        }
+        // `i` is a multiple of 4 here.
+        for (; i < len; ++i) {
+            data[i] ^= static_cast<char>(rotated[i % 4]);
+        }
+    }
+
+    // Rejects overlong forms, surrogates and code points above U+10FFFF
+    // (RFC 3629, section 4), skipping over ASCII 8 bytes at a time.
+    bool valid_utf8(std::string_view text) {
+        auto s = reinterpret_cast<const unsigned char*>(text.data());
+        size_t len = text.size();
+        size_t i = 0;
+        while (i < len) {
+            if (i + 8 <= len) {
+                uint64_t word;
+                std::memcpy(&word, s + i, 8);
+                if ((word & 0x8080808080808080ull) == 0) {
+                    i += 8;
+                    continue;
+                }
+            }
+            unsigned char c = s[i];
+            if (c < 0x80) {
+                ++i;
+                continue;
+            }
+            size_t n;
+            unsigned char low = 0x80, high = 0xbf; // Bounds of the second byte.
+            if (c >= 0xc2 && c <= 0xdf) {
+                n = 1;
+            }
+            else if (c >= 0xe0 && c <= 0xef) {
+                n = 2;
+                if (c == 0xe0) low = 0xa0;
+                if (c == 0xed) high = 0x9f;
+            }
+            else if (c >= 0xf0 && c <= 0xf4) {
+                n = 3;
+                if (c == 0xf0) low = 0x90;
+                if (c == 0xf4) high = 0x8f;
+            }
+            else {
+                return false;
+            }
+            if (len - i <= n || s[i + 1] < low || s[i + 1] > high) {
+                return false;
+            }
+            for (size_t j = 2; j <= n; ++j) {
+                if ((s[i + j] & 0xc0) != 0x80) {
+                    return false;
+                }
+            }
+            i += n + 1;
+        }
+        return true;
+    }
+
+#if defined(WAYWARD_WITH_ZLIB)
+    struct MessageDeflate::Impl {
+        z_stream deflater{};
+        z_stream inflater{};
+        bool deflater_ready = false;
+        bool inflater_ready = false;
+
+        ~Impl() {
+            if (deflater_ready) {
+                deflateEnd(&deflater);
+            }
+            if (inflater_ready) {
+                inflateEnd(&inflater);
+            }
+        }
+    };
+
+    MessageDeflate::MessageDeflate() : impl_(new Impl) {}
+    MessageDeflate::~MessageDeflate() {}
+
+    bool MessageDeflate::available() {
+        return true;
+    }
+
+    // RFC 7692, section 7.2.1: raw deflate, flushed to a byte boundary with
+    // an empty stored block, whose last four bytes are left off.
+    void MessageDeflate::compress(std::string_view message, std::string& out) {
+        auto& z = impl_->deflater;
+        if (!impl_->deflater_ready) {
+            if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                throw std::bad_alloc();
+            }
+            impl_->deflater_ready = true;
+        }
+        else {
+            deflateReset(&z);
+        }
+        z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(message.data()));
+        z.avail_in = uInt(message.size());
+        size_t start = out.size();
+        do {
+            size_t used = out.size();
+            size_t room = std::max<size_t>(deflateBound(&z, z.avail_in) + 16, 256);
+            out.resize(used + room);
+            z.next_out = reinterpret_cast<Bytef*>(&out[used]);
+            z.avail_out = uInt(room);
+            deflate(&z, Z_SYNC_FLUSH);
+            out.resize(used + room - z.avail_out);
+        } while (z.avail_in > 0 || z.avail_out == 0);
+        assert(out.size() >= start + 4);
+        out.resize(out.size() - 4);
+    }
+
+    bool MessageDeflate::decompress(std::string_view payload, size_t max_size, std::string& out) {
+        static const unsigned char tail[4] = {0x00, 0x00, 0xff, 0xff};
+        auto& z = impl_->inflater;
+        if (!impl_->inflater_ready) {
+            if (inflateInit2(&z, -15) != Z_OK) {
+                throw std::bad_alloc();
+            }
+            impl_->inflater_ready = true;
+        }
+        else {
+            inflateReset(&z);
+        }
+        size_t start = out.size();
+        for (int part = 0; part < 2; ++part) {
+            if (part == 0) {
+                z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(payload.data()));
+                z.avail_in = uInt(payload.size());
+            }
+            else {
+                z.next_in = const_cast<Bytef*>(tail);
+                z.avail_in = sizeof(tail);
+            }
+            do {
+                size_t used = out.size();
+                size_t room = std::max<size_t>(size_t(z.avail_in) * 4, 4096);
+                if (used - start + room > max_size + 1) {
+                    room = max_size + 1 - (used - start);
+                }
+                out.resize(used + room);
+                z.next_out = reinterpret_cast<Bytef*>(&out[used]);
+                z.avail_out = uInt(room);
+                int result = inflate(&z, Z_SYNC_FLUSH);
+                out.resize(used + room - z.avail_out);
+                if (out.size() - start > max_size) {
+                    return false;
+                }
+                if (result == Z_STREAM_END) {
+                    // A final block ends the message; nothing may follow it
+                    // but the tail.
+                    return part == 1 || z.avail_in == 0;
+                }
+                if (result == Z_BUF_ERROR) {
+                    break; // All input consumed.
+                }
+                if (result != Z_OK) {
+                    return false;
+                }
+            } while (z.avail_in > 0 || z.avail_out == 0);
+        }
+        return true;
+    }
+#else
+    struct MessageDeflate::Impl {};
+
+    MessageDeflate::MessageDeflate() {}
+    MessageDeflate::~MessageDeflate() {}
+
+    bool MessageDeflate::available() {
+        return false;
+    }
+
+    void MessageDeflate::compress(std::string_view, std::string&) {
+        assert(false);
+    }
+
+    bool MessageDeflate::decompress(std::string_view, size_t, std::string&) {
+        return false;
+    }
+#endif
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <stddef.h>
+#include <string>
+#include <string_view>
+
+#include <wayward/def.hpp>
+#include <wayward/http.hpp>
+
+namespace wayward {
+    // WebSocket (RFC 6455). The responder to a GET request asking to upgrade
+    // accepts it with accept_websocket(), which answers 101 Switching
+    // Protocols and names the handler of the connection's messages. Once the
+    // response has been written, the connection speaks WebSocket instead of
+    // HTTP, on the same event loop: frames are parsed as they arrive, and
+    // every complete message goes to the handler. Messages are sent through
+    // the connection's WebSocket handle, from any thread.
+
+    struct WebSocket;
+
+    // Called on the connection's event loop, one call at a time.
+    struct IWebSocketHandler {
+        virtual ~IWebSocketHandler() {}
+
+        // The handshake has been written. The handle may be kept, and used
+        // from any thread, to send messages until the connection closes.
+        virtual void opened(const WebSocket&) {}
+        // A complete message, reassembled from its fragments and inflated.
+        // Text messages are valid UTF-8. `data` is only valid during the call.
+        virtual void message(const WebSocket&, std::string_view data, bool binary) = 0;
+        // The connection has closed, with the status code of the peer's
+        // Close frame, or of our own, or 1006 (Abnormal Closure) if it went
+        // away without one.
+        virtual void closed(uint16_t code) {}
+    };
+
+    // Refers to an open WebSocket connection. Handles can be copied to, and
+    // used from, any thread, but must not outlive the Server. Once the
+    // connection has closed, operations on its handles do nothing.
+    struct WAYWARD_EXPORT WebSocket {
+        // Status codes of Close frames (RFC 6455, section 7.4.1).
+        enum Code : uint16_t {
+            NormalClosure = 1000,
+            GoingAway = 1001,
+            ProtocolError = 1002,
+            UnsupportedData = 1003,
+            NoStatus = 1005,
+            AbnormalClosure = 1006,
+            InvalidPayload = 1007,
+            PolicyViolation = 1008,
+            MessageTooBig = 1009,
+            InternalError = 1011,
+        };
+
+        WebSocket() = default;
+
+        // Queues a message, as one frame, compressed if permessage-deflate
+        // was negotiated and that makes it smaller. Messages from one thread
+        // go out in order. A connection whose peer falls more than
+        // max_queued_bytes behind is dropped.
+        void send(std::string message, bool binary = false) const;
+        // Starts the closing handshake: nothing is sent after the Close
+        // frame, and the connection closes once the peer has answered it.
+        void close(uint16_t code = NormalClosure, std::string reason = std::string()) const;
+
+        static constexpr size_t max_queued_bytes = 16 * 1024 * 1024;
+
+        explicit operator bool() const {
+            return bool(connection_);
+        }
+
+    private:
+        friend struct Server;
+        explicit WebSocket(ConnectionHandle connection) : connection_(connection) {}
+
+        ConnectionHandle connection_;
+    };
+
+    // Answers a WebSocket handshake with 101 Switching Protocols, handing the
+    // connection to `handler` once the response has been written. Returns
+    // false, with the response set to 400 Bad Request (or 426 Upgrade
+    // Required, for other protocol versions), if the request is not a valid
+    // handshake. The responder may add headers afterwards, e.g. the
+    // Sec-WebSocket-Protocol it picks.
+    //
+    // With `deflate`, permessage-deflate (RFC 7692) is negotiated if the
+    // client offers it, and the server is built with zlib. Every message is
+    // compressed on its own (no context takeover), so compression costs no
+    // memory per connection, only a compressor per event loop.
+    bool WAYWARD_EXPORT accept_websocket(Request&, Response&, std::shared_ptr<IWebSocketHandler> handler, bool deflate = false);
+
+    // The rest is the codec the server uses, exposed for testing.
+
+    // The value of Sec-WebSocket-Accept for a Sec-WebSocket-Key.
+    std::string WAYWARD_EXPORT websocket_accept_key(std::string_view key);
+
+    // XORs `len` bytes with the masking key, `offset` bytes into the payload
+    // they belong to. Unmasking and masking are the same.
+    void WAYWARD_EXPORT websocket_mask(char* data, size_t len, const unsigned char key[4], uint64_t offset = 0);
+
+    bool WAYWARD_EXPORT valid_utf8(std::string_view);
+
+    // Compresses and decompresses the payloads of permessage-deflate
+    // messages without context takeover, resetting its zlib streams between
+    // messages. Not thread-safe. Without zlib, available() is false, and
+    // nothing else may be called.
+    struct WAYWARD_EXPORT MessageDeflate {
+        MessageDeflate();
+        ~MessageDeflate();
+
+        static bool available();
+
+        // Appends the compressed message to `out`, without the empty block
+        // at the end that the peer appends again.
+        void compress(std::string_view message, std::string& out);
+        // Appends the decompressed message to `out`. Returns false if the
+        // payload is corrupt, or inflates to more than `max_size` bytes.
+        bool decompress(std::string_view payload, size_t max_size, std::string& out);
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
+}
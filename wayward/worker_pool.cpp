@@ -0,0 +1,93 @@
+#include "wayward/worker_pool.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace wayward {
+    struct WorkerPool::Impl {
+        size_t max_queued;
+        mutable std::mutex mutex;
+        std::condition_variable wakeup;
+        std::deque<std::function<void()>> jobs;
+        bool stopping = false;
+        std::vector<std::thread> threads;
+
+        void work() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                wakeup.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (jobs.empty()) {
+                    return;
+                }
+                auto job = std::move(jobs.front());
+                jobs.pop_front();
+                lock.unlock();
+                job();
+                lock.lock();
+            }
+        }
+    };
+
+    WorkerPool::WorkerPool(unsigned int num_threads, size_t max_queued) : impl_(new Impl) {
+        impl_->max_queued = max_queued;
+        if (num_threads == 0) {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        impl_->threads.reserve(num_threads);
+        for (unsigned int i = 0; i < num_threads; ++i) {
+            impl_->threads.emplace_back([impl = impl_.get()]() {
+                impl->work();
+            });
+        }
+    }
+
+    WorkerPool::~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(impl_->mutex);
+            impl_->stopping = true;
+        }
+        impl_->wakeup.notify_all();
+        for (auto& thread: impl_->threads) {
+            thread.join();
+        }
+    }
+
+    bool WorkerPool::try_post(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(impl_->mutex);
+            if (impl_->stopping || impl_->jobs.size() >= impl_->max_queued) {
+                return false;
+            }
+            impl_->jobs.push_back(std::move(job));
+        }
+        impl_->wakeup.notify_one();
+        return true;
+    }
+
+    size_t WorkerPool::num_queued() const {
+        std::lock_guard<std::mutex> lock(impl_->mutex);
+        return impl_->jobs.size();
+    }
+
+    std::function<void(Request&, Response&)> offload(WorkerPool& workers, std::function<void(Request&, Response&)> handler) {
+        auto shared_handler = std::make_shared<std::function<void(Request&, Response&)>>(std::move(handler));
+        return [&workers, shared_handler](Request& req, Response& res) {
+            auto connection = req.defer();
+            Request* deferred_req = &req;
+            bool queued = workers.try_post([deferred_req, shared_handler, connection]() {
+                Response response;
+                (*shared_handler)(*deferred_req, response);
+                connection.complete(std::move(response));
+            });
+            if (!queued) {
+                req.deferred = false;
+                res.status = Status::ServiceUnavailable;
+                res.set_header(HeaderId::RetryAfter, "1");
+            }
+        };
+    }
+}
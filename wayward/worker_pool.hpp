@@ -0,0 +1,37 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+
+#include <wayward/http.hpp>
+
+namespace wayward {
+    // A fixed number of threads running jobs from a bounded queue, for work
+    // that would hold up an event loop (see offload()).
+    struct WAYWARD_EXPORT WorkerPool {
+        static constexpr size_t default_max_queued = 1024;
+
+        explicit WorkerPool(unsigned int num_threads, size_t max_queued = default_max_queued);
+        // Runs the jobs still queued, then joins the threads.
+        ~WorkerPool();
+
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        // Queues `job`, unless max_queued jobs are waiting already.
+        bool try_post(std::function<void()> job);
+
+        size_t num_queued() const;
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
+
+    // Wraps `handler` to run on `workers` instead of the event loop, with a
+    // deferred response (see Request::defer()). While the pool's queue is
+    // full, requests are answered with 503 Service Unavailable right away,
+    // so a saturated pool does not slow down the routes that stay on the
+    // event loop. The pool must outlive the Server.
+    std::function<void(Request&, Response&)> WAYWARD_EXPORT offload(WorkerPool& workers, std::function<void(Request&, Response&)> handler);
+}